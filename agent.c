@@ -0,0 +1,606 @@
+#define _GNU_SOURCE // accept4, SO_PEERCRED
+#include "agent.h"
+#include "crypto.h"
+#include "stats.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+// a resident process that hashes the password once and then encrypts,
+// decrypts and verifies files for other processes of the same user, so a
+// script that handles one file per process does not pay for argon2 each
+// time. the agent derives a master key under a salt of its own and writes
+// CRYPTO_KEY_MASTER files, whose keys come from the master key alone. files
+// under another master salt cost one argon2 run per salt (the keys are
+// cached), password mode files one run each. the password and the keys
+// live in sodium_malloc memory, locked and between guard pages, and are
+// wiped when the agent stops, which it does after idle_seconds without a
+// request.
+// a request is one message on a SOCK_SEQPACKET unix socket with the files
+// attached as descriptors (SCM_RIGHTS): the client opens them with its own
+// permissions and no file data crosses the socket. each connection is
+// served by its own thread, so requests run concurrently
+
+#define AGENT_MAGIC 0x47414346 // "FCAG"
+#define AGENT_MAX_CLIENTS 16
+#define AGENT_KEYS 8 // master keys kept, the agent's own in slot 0
+#define AGENT_PASSWORD_MAX 1024
+
+// the names only label the descriptors in stats and the manifest, empty
+// for stdin and stdout
+typedef struct AgentRequest {
+  uint32_t magic;
+  uint32_t op; // AGENT_OP_*
+  char src[PATH_MAX];
+  char dest[PATH_MAX];
+} AgentRequest;
+
+typedef struct AgentReply {
+  uint32_t magic;
+  int32_t result; // CRYPTO_* code
+} AgentReply;
+
+typedef struct AgentKey {
+  int used;
+  long long last_used_ns;
+  unsigned char salt[crypto_pwhash_SALTBYTES];
+  unsigned char key[CRYPTO_MASTER_KEY_BYTES];
+} AgentKey;
+
+static AgentKey *agent_keys; // sodium_malloc'ed, AGENT_KEYS of them
+static const char *agent_password;
+static char agent_socket_path[PATH_MAX];
+static int agent_listen_fd = -1;
+static int agent_io_policy;
+static int agent_no_digest;
+static pthread_mutex_t agent_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t agent_cond = PTHREAD_COND_INITIALIZER;
+// one argon2 run at a time: each takes 256 MiB, and a burst of requests for
+// a new salt waits for the first one instead of repeating it
+static pthread_mutex_t agent_kdf_lock = PTHREAD_MUTEX_INITIALIZER;
+static int agent_conns[AGENT_MAX_CLIENTS]; // -1 for a free slot
+static int agent_clients;
+static int agent_busy; // requests being run
+static atomic_llong agent_last_request_ns;
+static atomic_int agent_stop;
+
+// reads a line from the terminal with echo off, or from stdin when there is
+// no terminal (a script piping the password in). stdio does not buffer it,
+// so the only copy is the sodium_malloc'ed one returned; free it with
+// agent_free_password
+char *agent_read_password(const char *prompt) {
+  FILE *tty = fopen("/dev/tty", "r+");
+  FILE *in = tty ? tty : stdin;
+  setvbuf(in, NULL, _IONBF, 0);
+  struct termios saved;
+  int echo_off = 0;
+  if (tty) {
+    fputs(prompt, tty);
+    fflush(tty);
+    if (tcgetattr(fileno(tty), &saved) == 0) {
+      struct termios quiet = saved;
+      quiet.c_lflag &= ~(tcflag_t)ECHO;
+      echo_off = tcsetattr(fileno(tty), TCSAFLUSH, &quiet) == 0;
+    }
+  }
+  char *password = sodium_malloc(AGENT_PASSWORD_MAX);
+  if (password && !fgets(password, AGENT_PASSWORD_MAX, in)) {
+    sodium_free(password);
+    password = NULL;
+  }
+  if (echo_off) {
+    tcsetattr(fileno(tty), TCSAFLUSH, &saved);
+    fputc('\n', tty);
+  }
+  if (tty) {
+    fclose(tty);
+  }
+  if (password) {
+    password[strcspn(password, "\r\n")] = '\0';
+  }
+  return password;
+}
+
+void agent_free_password(char *password) {
+  if (password) {
+    sodium_free(password); // sodium_free zeroes the buffer first
+  }
+}
+
+// copies the cached key for 'salt' into 'key', 0 if there is none
+static int agent_copy_key(const unsigned char *salt, unsigned char *key) {
+  int found = 0;
+  pthread_mutex_lock(&agent_lock);
+  for (int i = 0; i < AGENT_KEYS && !found; i++) {
+    AgentKey *entry = &agent_keys[i];
+    if (entry->used &&
+        sodium_memcmp(entry->salt, salt, sizeof(entry->salt)) == 0) {
+      entry->last_used_ns = stats_now_ns();
+      memcpy(key, entry->key, sizeof(entry->key));
+      found = 1;
+    }
+  }
+  pthread_mutex_unlock(&agent_lock);
+  return found;
+}
+
+// caches a key in a free slot, or in place of the least recently used one.
+// slot 0 holds the agent's own key and is never replaced
+static void agent_cache_key(const unsigned char *salt,
+                            const unsigned char *key) {
+  pthread_mutex_lock(&agent_lock);
+  AgentKey *slot = &agent_keys[1];
+  for (int i = 1; i < AGENT_KEYS; i++) {
+    if (!agent_keys[i].used) {
+      slot = &agent_keys[i];
+      break;
+    }
+    if (agent_keys[i].last_used_ns < slot->last_used_ns) {
+      slot = &agent_keys[i];
+    }
+  }
+  sodium_memzero(slot, sizeof(*slot));
+  slot->used = 1;
+  slot->last_used_ns = stats_now_ns();
+  memcpy(slot->salt, salt, sizeof(slot->salt));
+  memcpy(slot->key, key, sizeof(slot->key));
+  pthread_mutex_unlock(&agent_lock);
+}
+
+// the master key for 'salt', from the cache or hashed from the password
+static int agent_master_key(const unsigned char *salt, unsigned char *key) {
+  if (agent_copy_key(salt, key)) {
+    return AGENT_SUCCESS;
+  }
+  int status = AGENT_SUCCESS;
+  pthread_mutex_lock(&agent_kdf_lock);
+  if (!agent_copy_key(salt, key)) {
+    if (crypto_derive_key(key, CRYPTO_MASTER_KEY_BYTES, agent_password,
+                          salt) == 0) {
+      agent_cache_key(salt, key);
+    } else {
+      status = AGENT_ERROR;
+    }
+  }
+  pthread_mutex_unlock(&agent_kdf_lock);
+  return status;
+}
+
+static const char *agent_label(const char *name) {
+  return name[0] ? name : NULL;
+}
+
+static int agent_run_request(const AgentRequest *request, const int *fds,
+                             int num_fds) {
+  if (request->op == AGENT_OP_STOP) {
+    atomic_store(&agent_stop, 1);
+    return CRYPTO_SUCCESS;
+  }
+  int wanted = request->op == AGENT_OP_VERIFY ? 1 : 2;
+  if ((request->op != AGENT_OP_ENCRYPT && request->op != AGENT_OP_DECRYPT &&
+       request->op != AGENT_OP_VERIFY) ||
+      num_fds != wanted) {
+    return CRYPTO_ERROR_FILE;
+  }
+
+  unsigned char *master = sodium_malloc(CRYPTO_MASTER_KEY_BYTES);
+  if (!master) {
+    return CRYPTO_ERROR_MEM;
+  }
+  unsigned char salt[crypto_pwhash_SALTBYTES];
+  // password mode files and salts the cache could not take still run
+  // argon2 inside the decryption, under the same lock
+  CryptoOptions opts = {.io_policy = agent_io_policy,
+                        .checkpoint_bytes = -1,
+                        .no_digest = agent_no_digest,
+                        .kdf_lock = &agent_kdf_lock};
+  int result;
+  if (request->op == AGENT_OP_ENCRYPT) {
+    pthread_mutex_lock(&agent_lock);
+    memcpy(salt, agent_keys[0].salt, sizeof(salt));
+    memcpy(master, agent_keys[0].key, CRYPTO_MASTER_KEY_BYTES);
+    pthread_mutex_unlock(&agent_lock);
+    opts.master_key = master;
+    opts.master_salt = salt;
+    result = crypto_encrypt_fd(fds[0], fds[1], agent_label(request->src),
+                               agent_label(request->dest), NULL, &opts);
+  } else {
+    if (crypto_master_salt(fds[0], salt) == CRYPTO_SUCCESS &&
+        agent_master_key(salt, master) == AGENT_SUCCESS) {
+      opts.master_key = master;
+      opts.master_salt = salt;
+    }
+    // a verification decrypts into nothing and leaves the plaintext out of
+    // the manifest; the digest in the file is still checked
+    int verify = request->op == AGENT_OP_VERIFY;
+    int dest_fd = verify ? open("/dev/null", O_WRONLY | O_CLOEXEC) : fds[1];
+    const char *dest = verify ? NULL : agent_label(request->dest);
+    result = dest_fd < 0 ? CRYPTO_ERROR_FILE
+                         : crypto_decrypt_fd(fds[0], dest_fd,
+                                             agent_label(request->src), dest,
+                                             agent_password, &opts);
+    if (verify && dest_fd >= 0) {
+      close(dest_fd);
+    }
+  }
+  sodium_free(master);
+  return result;
+}
+
+// receives one request and up to two descriptors. returns 0 once the client
+// hangs up or sends something malformed
+static int agent_recv(int conn, AgentRequest *request, int *fds,
+                      int *num_fds) {
+  union {
+    struct cmsghdr align;
+    char buf[CMSG_SPACE(2 * sizeof(int))];
+  } control;
+  struct iovec iov = {.iov_base = request, .iov_len = sizeof(*request)};
+  struct msghdr msg = {.msg_iov = &iov,
+                       .msg_iovlen = 1,
+                       .msg_control = control.buf,
+                       .msg_controllen = sizeof(control.buf)};
+  ssize_t got = recvmsg(conn, &msg, MSG_CMSG_CLOEXEC);
+  *num_fds = 0;
+  for (struct cmsghdr *cmsg = got >= 0 ? CMSG_FIRSTHDR(&msg) : NULL; cmsg;
+       cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+    if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+      continue;
+    }
+    int n = (int)((cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+    if (n > 2 - *num_fds) {
+      n = 2 - *num_fds;
+    }
+    memcpy(fds + *num_fds, CMSG_DATA(cmsg), n * sizeof(int));
+    *num_fds += n;
+  }
+  if (got != (ssize_t)sizeof(*request) ||
+      (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) ||
+      request->magic != AGENT_MAGIC) {
+    for (int i = 0; i < *num_fds; i++) {
+      close(fds[i]);
+    }
+    return 0;
+  }
+  request->src[sizeof(request->src) - 1] = '\0';
+  request->dest[sizeof(request->dest) - 1] = '\0';
+  return 1;
+}
+
+static void *agent_client_thread(void *arg) {
+  int slot = (int)(intptr_t)arg;
+  int conn = agent_conns[slot];
+  AgentRequest request;
+  int fds[2];
+  int num_fds;
+  while (agent_recv(conn, &request, fds, &num_fds)) {
+    pthread_mutex_lock(&agent_lock);
+    agent_busy++;
+    pthread_mutex_unlock(&agent_lock);
+
+    AgentReply reply = {.magic = AGENT_MAGIC};
+    reply.result = agent_run_request(&request, fds, num_fds);
+    for (int i = 0; i < num_fds; i++) {
+      close(fds[i]);
+    }
+
+    pthread_mutex_lock(&agent_lock);
+    agent_busy--;
+    atomic_store(&agent_last_request_ns, stats_now_ns());
+    pthread_mutex_unlock(&agent_lock);
+    if (send(conn, &reply, sizeof(reply), MSG_NOSIGNAL) !=
+        (ssize_t)sizeof(reply)) {
+      break;
+    }
+  }
+
+  pthread_mutex_lock(&agent_lock);
+  close(conn);
+  agent_conns[slot] = -1;
+  agent_clients--;
+  pthread_cond_broadcast(&agent_cond);
+  pthread_mutex_unlock(&agent_lock);
+  return NULL;
+}
+
+// only processes of the agent's own user are served
+static void agent_accept() {
+  int conn = accept4(agent_listen_fd, NULL, NULL, SOCK_CLOEXEC);
+  if (conn < 0) {
+    return;
+  }
+  struct ucred cred;
+  socklen_t len = sizeof(cred);
+  if (getsockopt(conn, SOL_SOCKET, SO_PEERCRED, &cred, &len) != 0 ||
+      cred.uid != getuid()) {
+    close(conn);
+    return;
+  }
+
+  pthread_mutex_lock(&agent_lock);
+  int slot = 0;
+  while (agent_conns[slot] >= 0) {
+    slot++; // the caller made sure a slot is free
+  }
+  agent_conns[slot] = conn;
+  agent_clients++;
+  pthread_mutex_unlock(&agent_lock);
+
+  pthread_t thread;
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  if (pthread_create(&thread, &attr, agent_client_thread,
+                     (void *)(intptr_t)slot) != 0) {
+    pthread_mutex_lock(&agent_lock);
+    close(conn);
+    agent_conns[slot] = -1;
+    agent_clients--;
+    pthread_mutex_unlock(&agent_lock);
+  }
+  pthread_attr_destroy(&attr);
+}
+
+static void agent_on_signal(int sig) {
+  (void)sig;
+  atomic_store(&agent_stop, 1);
+}
+
+// a socket another agent still answers on is left alone; one left behind by
+// an agent that died is replaced. anything that is not a socket is refused
+static int agent_listen(const char *socket_path) {
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+  if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+    return -1;
+  }
+  strcpy(addr.sun_path, socket_path);
+  struct stat st;
+  if (lstat(socket_path, &st) == 0) {
+    int probe = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    int alive = probe >= 0 && connect(probe, (struct sockaddr *)&addr,
+                                      sizeof(addr)) == 0;
+    if (probe >= 0) {
+      close(probe);
+    }
+    if (!S_ISSOCK(st.st_mode) || alive || unlink(socket_path) != 0) {
+      return -1;
+    }
+  }
+
+  int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    return -1;
+  }
+  mode_t old_mask = umask(077); // the socket is the user's alone
+  int ok = bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0 &&
+           listen(fd, AGENT_MAX_CLIENTS) == 0;
+  umask(old_mask);
+  if (!ok) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+static void agent_wipe() {
+  if (agent_keys) {
+    sodium_free(agent_keys);
+    agent_keys = NULL;
+  }
+  agent_password = NULL;
+}
+
+// derives the agent's own master key, the one argon2 run it always makes,
+// and starts listening. 'password' must stay valid until agent_serve returns
+int agent_start(const char *socket_path, const char *password, int io_policy,
+                int no_digest) {
+  if (strlen(socket_path) >= sizeof(agent_socket_path)) {
+    return AGENT_ERROR;
+  }
+  // no core dumps or ptrace by other processes of the user: either would
+  // read the keys
+  prctl(PR_SET_DUMPABLE, 0, 0, 0, 0);
+  agent_keys = sodium_malloc(AGENT_KEYS * sizeof(AgentKey));
+  if (!agent_keys) {
+    return AGENT_ERROR;
+  }
+  memset(agent_keys, 0, AGENT_KEYS * sizeof(AgentKey));
+  agent_password = password;
+  agent_io_policy = io_policy;
+  agent_no_digest = no_digest;
+
+  AgentKey *own = &agent_keys[0];
+  randombytes_buf(own->salt, sizeof(own->salt));
+  if (crypto_derive_key(own->key, sizeof(own->key), password, own->salt) !=
+      0) {
+    agent_wipe();
+    return AGENT_ERROR;
+  }
+  own->used = 1;
+
+  agent_listen_fd = agent_listen(socket_path);
+  if (agent_listen_fd < 0) {
+    agent_wipe();
+    return AGENT_ERROR;
+  }
+  strcpy(agent_socket_path, socket_path);
+  for (int i = 0; i < AGENT_MAX_CLIENTS; i++) {
+    agent_conns[i] = -1;
+  }
+  return AGENT_SUCCESS;
+}
+
+// serves requests until SIGINT, SIGTERM, a stop request or 'idle_seconds'
+// (0 for never) without one, then waits for the requests being run and
+// wipes the keys
+int agent_serve(int idle_seconds) {
+  struct sigaction action = {.sa_handler = agent_on_signal};
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGINT, &action, NULL);
+  sigaction(SIGTERM, &action, NULL);
+  signal(SIGPIPE, SIG_IGN); // an output pipe closing early is an error, not
+                            // the end of the agent
+  atomic_store(&agent_stop, 0);
+  atomic_store(&agent_last_request_ns, stats_now_ns());
+
+  while (!atomic_load(&agent_stop)) {
+    pthread_mutex_lock(&agent_lock);
+    int full = agent_clients >= AGENT_MAX_CLIENTS;
+    int idle = idle_seconds > 0 && agent_busy == 0 &&
+               stats_now_ns() - atomic_load(&agent_last_request_ns) >
+                   idle_seconds * 1000000000LL;
+    if (full) {
+      struct timespec until;
+      clock_gettime(CLOCK_REALTIME, &until);
+      until.tv_sec++;
+      pthread_cond_timedwait(&agent_cond, &agent_lock, &until);
+    }
+    pthread_mutex_unlock(&agent_lock);
+    if (idle) {
+      break;
+    }
+    if (full) {
+      continue;
+    }
+    struct pollfd pfd = {.fd = agent_listen_fd, .events = POLLIN};
+    if (poll(&pfd, 1, 1000) > 0) {
+      agent_accept();
+    }
+  }
+
+  close(agent_listen_fd);
+  agent_listen_fd = -1;
+  unlink(agent_socket_path);
+  // idle connections hang up; requests in progress run to the end
+  pthread_mutex_lock(&agent_lock);
+  for (int i = 0; i < AGENT_MAX_CLIENTS; i++) {
+    if (agent_conns[i] >= 0) {
+      shutdown(agent_conns[i], SHUT_RD);
+    }
+  }
+  while (agent_clients > 0) {
+    pthread_cond_wait(&agent_cond, &agent_lock);
+  }
+  pthread_mutex_unlock(&agent_lock);
+  agent_wipe();
+  return AGENT_SUCCESS;
+}
+
+static int agent_connect(const char *socket_path) {
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+  if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+    return -1;
+  }
+  strcpy(addr.sun_path, socket_path);
+  int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  if (fd >= 0 &&
+      connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+    close(fd);
+    fd = -1;
+  }
+  return fd;
+}
+
+// the absolute path when there is one, the agent having its own cwd
+static void agent_name(const char *path, char *out) {
+  if (strcmp(path, "-") == 0) {
+    out[0] = '\0';
+  } else if (!realpath(path, out)) {
+    snprintf(out, PATH_MAX, "%s", path);
+  }
+}
+
+// opens the files of a request in this process, with its permissions, and
+// has the agent at 'socket_path' run it on the descriptors. '*result' gets
+// the CRYPTO_* code of the operation. "-" stands for stdin or stdout. a
+// failed operation leaves no output file behind
+int agent_request(const char *socket_path, int op, const char *src,
+                  const char *dest, int *result) {
+  int conn = agent_connect(socket_path);
+  if (conn < 0) {
+    return AGENT_ERROR_CONNECT;
+  }
+  AgentRequest *request = calloc(1, sizeof(*request));
+  if (!request) {
+    close(conn);
+    return AGENT_ERROR;
+  }
+  request->magic = AGENT_MAGIC;
+  request->op = (uint32_t)op;
+
+  int fds[2] = {-1, -1};
+  int num_fds = 0;
+  int created = 0;
+  int status = AGENT_SUCCESS;
+  if (op != AGENT_OP_STOP) {
+    fds[0] = strcmp(src, "-") == 0 ? STDIN_FILENO
+                                   : open(src, O_RDONLY | O_CLOEXEC);
+    num_fds = 1;
+    agent_name(src, request->src);
+  }
+  if (fds[0] >= 0 && (op == AGENT_OP_ENCRYPT || op == AGENT_OP_DECRYPT)) {
+    created = strcmp(dest, "-") != 0;
+    fds[1] = created ? open(dest, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                            0644)
+                     : STDOUT_FILENO;
+    num_fds = 2;
+    agent_name(dest, request->dest);
+  }
+  if ((num_fds > 0 && fds[0] < 0) || (num_fds > 1 && fds[1] < 0)) {
+    status = AGENT_ERROR_FILE;
+  }
+
+  if (status == AGENT_SUCCESS) {
+    union {
+      struct cmsghdr align;
+      char buf[CMSG_SPACE(2 * sizeof(int))];
+    } control;
+    struct iovec iov = {.iov_base = request, .iov_len = sizeof(*request)};
+    struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1};
+    if (num_fds > 0) {
+      msg.msg_control = control.buf;
+      msg.msg_controllen = CMSG_SPACE(num_fds * sizeof(int));
+      struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+      cmsg->cmsg_level = SOL_SOCKET;
+      cmsg->cmsg_type = SCM_RIGHTS;
+      cmsg->cmsg_len = CMSG_LEN(num_fds * sizeof(int));
+      memcpy(CMSG_DATA(cmsg), fds, num_fds * sizeof(int));
+    }
+    AgentReply reply;
+    if (sendmsg(conn, &msg, MSG_NOSIGNAL) != (ssize_t)sizeof(*request) ||
+        recv(conn, &reply, sizeof(reply), 0) != (ssize_t)sizeof(reply) ||
+        reply.magic != AGENT_MAGIC) {
+      status = AGENT_ERROR; // the agent went away mid-request
+    } else {
+      *result = reply.result;
+    }
+  }
+
+  for (int i = 0; i < num_fds; i++) {
+    if (fds[i] > STDOUT_FILENO) {
+      close(fds[i]);
+    }
+  }
+  if (created && fds[1] >= 0 &&
+      (status != AGENT_SUCCESS || *result != CRYPTO_SUCCESS)) {
+    unlink(dest);
+  }
+  free(request);
+  close(conn);
+  return status;
+}
@@ -0,0 +1,25 @@
+#ifndef AGENT_H
+#define AGENT_H
+
+#define AGENT_SUCCESS 1
+#define AGENT_ERROR -1
+#define AGENT_ERROR_CONNECT -2 // nothing listens on the socket
+#define AGENT_ERROR_FILE -3    // a file of the request cannot be opened
+
+// values of a request's op
+#define AGENT_OP_ENCRYPT 1
+#define AGENT_OP_DECRYPT 2
+#define AGENT_OP_VERIFY 3 // decrypts, discarding the plaintext
+#define AGENT_OP_STOP 4   // wipes the keys and exits
+
+#define AGENT_DEFAULT_IDLE_SECONDS 900
+
+char *agent_read_password(const char *prompt);
+void agent_free_password(char *password);
+int agent_start(const char *socket_path, const char *password, int io_policy,
+                int no_digest);
+int agent_serve(int idle_seconds);
+int agent_request(const char *socket_path, int op, const char *src,
+                  const char *dest, int *result);
+
+#endif
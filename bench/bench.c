@@ -0,0 +1,488 @@
+#define _GNU_SOURCE // nftw
+#include "../crypto.h"
+#include "../crypto_io.h"
+#include "../file_tree.h"
+#include "../stats.h"
+#include "../tui.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// benchmarks for the crypto engine and the file tree. every case runs a
+// number of timed iterations and prints one csv row (or json line) with
+// latency percentiles, so runs on the same machine can be compared.
+// all files are created under a scratch directory that is removed at exit
+
+#define BENCH_PASSWORD "benchmark password"
+#define BENCH_MAX_SAMPLES 4096
+#define BENCH_FILES_PER_DIR 1000
+
+#define BENCH_FORMAT_CSV 0
+#define BENCH_FORMAT_JSON 1
+
+typedef struct BenchResult {
+  const char *name;
+  char param[64];
+  int iterations;
+  double samples[BENCH_MAX_SAMPLES]; // nanoseconds
+  long long bytes; // payload per iteration, 0 when throughput is meaningless
+} BenchResult;
+
+static int bench_format = BENCH_FORMAT_CSV;
+static int bench_iterations = 5;
+static int bench_quick;
+static const char *bench_only;
+static int bench_io_policy = CRYPTO_IO_CACHED;
+static const char *bench_io_name = "cached";
+static char bench_dir[MAX_PATH_LENGTH];
+
+static int bench_compare(const void *a, const void *b) {
+  double x = *(const double *)a;
+  double y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+// nearest-rank percentile of the sorted samples
+static double bench_percentile(const BenchResult *result, double p) {
+  int rank = (int)(p / 100.0 * result->iterations + 0.5);
+  if (rank < 1) {
+    rank = 1;
+  }
+  if (rank > result->iterations) {
+    rank = result->iterations;
+  }
+  return result->samples[rank - 1];
+}
+
+static void bench_report(BenchResult *result) {
+  if (result->iterations == 0) {
+    return;
+  }
+  qsort(result->samples, result->iterations, sizeof(double), bench_compare);
+  double sum = 0;
+  for (int i = 0; i < result->iterations; i++) {
+    sum += result->samples[i];
+  }
+  double mean = sum / result->iterations;
+  double p50 = bench_percentile(result, 50);
+  double mb_per_s = result->bytes > 0 ? result->bytes / (p50 / 1e9) / 1e6 : 0;
+
+  if (bench_format == BENCH_FORMAT_JSON) {
+    printf("{\"bench\":\"%s\",\"param\":\"%s\",\"iterations\":%d,"
+           "\"min_us\":%.3f,\"p50_us\":%.3f,\"p90_us\":%.3f,\"p99_us\":%.3f,"
+           "\"max_us\":%.3f,\"mean_us\":%.3f,\"mb_per_s\":%.3f}\n",
+           result->name, result->param, result->iterations,
+           result->samples[0] / 1e3, p50 / 1e3,
+           bench_percentile(result, 90) / 1e3,
+           bench_percentile(result, 99) / 1e3,
+           result->samples[result->iterations - 1] / 1e3, mean / 1e3,
+           mb_per_s);
+  } else {
+    printf("%s,%s,%d,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f\n", result->name,
+           result->param, result->iterations, result->samples[0] / 1e3,
+           p50 / 1e3, bench_percentile(result, 90) / 1e3,
+           bench_percentile(result, 99) / 1e3,
+           result->samples[result->iterations - 1] / 1e3, mean / 1e3,
+           mb_per_s);
+  }
+  fflush(stdout);
+}
+
+static int bench_selected(const char *name) {
+  return !bench_only || strcmp(bench_only, name) == 0;
+}
+
+static int bench_write_random_file(const char *path, long long size) {
+  FILE *file = fopen(path, "wb");
+  if (!file) {
+    return 0;
+  }
+  unsigned char buffer[65536];
+  while (size > 0) {
+    size_t len = size < (long long)sizeof(buffer) ? (size_t)size
+                                                  : sizeof(buffer);
+    randombytes_buf(buffer, len);
+    if (fwrite(buffer, 1, len, file) != len) {
+      fclose(file);
+      return 0;
+    }
+    size -= len;
+  }
+  return fclose(file) == 0;
+}
+
+static void bench_kdf() {
+  BenchResult result = {.name = "kdf", .iterations = 0};
+  snprintf(result.param, sizeof(result.param), "moderate");
+  unsigned char key[crypto_secretstream_xchacha20poly1305_KEYBYTES];
+  unsigned char salt[crypto_pwhash_SALTBYTES];
+  for (int i = 0; i < bench_iterations; i++) {
+    randombytes_buf(salt, sizeof(salt));
+    long long start = stats_now_ns();
+    crypto_derive_key(key, sizeof(key), BENCH_PASSWORD, salt);
+    result.samples[result.iterations++] = stats_now_ns() - start;
+  }
+  sodium_memzero(key, sizeof(key));
+  bench_report(&result);
+}
+
+// raw secretstream push over a buffer, for chunk sizes other than the one
+// compiled into the file format
+static void bench_aead() {
+  static const int chunk_sizes[] = {1024, 4096, 16384, 65536, 262144, 1048576};
+  const long long total = bench_quick ? 16LL << 20 : 64LL << 20;
+  unsigned char key[crypto_secretstream_xchacha20poly1305_KEYBYTES];
+  crypto_secretstream_xchacha20poly1305_keygen(key);
+
+  for (size_t c = 0; c < sizeof(chunk_sizes) / sizeof(chunk_sizes[0]); c++) {
+    int chunk_size = chunk_sizes[c];
+    unsigned char *input = (unsigned char *)malloc(chunk_size);
+    unsigned char *output = (unsigned char *)malloc(
+        chunk_size + crypto_secretstream_xchacha20poly1305_ABYTES);
+    if (!input || !output) {
+      free(input);
+      free(output);
+      continue;
+    }
+    randombytes_buf(input, chunk_size);
+
+    BenchResult result = {.name = "aead_push", .bytes = total};
+    snprintf(result.param, sizeof(result.param), "chunk=%d", chunk_size);
+    for (int i = 0; i < bench_iterations; i++) {
+      crypto_secretstream_xchacha20poly1305_state state;
+      unsigned char header[crypto_secretstream_xchacha20poly1305_HEADERBYTES];
+      unsigned long long out_len;
+      long long start = stats_now_ns();
+      crypto_secretstream_xchacha20poly1305_init_push(&state, header, key);
+      for (long long done = 0; done < total; done += chunk_size) {
+        crypto_secretstream_xchacha20poly1305_push(&state, output, &out_len,
+                                                   input, chunk_size, NULL, 0,
+                                                   0);
+      }
+      result.samples[result.iterations++] = stats_now_ns() - start;
+    }
+    bench_report(&result);
+    free(input);
+    free(output);
+  }
+  sodium_memzero(key, sizeof(key));
+}
+
+// end to end file encryption and decryption. the kdf is timed separately
+// by the crypto engine, so besides the full operation the stream part is
+// reported on its own
+static void bench_file_crypto() {
+  static const long long sizes[] = {4096, 1 << 20, 16 << 20, 256 << 20};
+  int num_sizes = bench_quick ? 3 : 4;
+  char plain[MAX_PATH_LENGTH], enc[MAX_PATH_LENGTH], dec[MAX_PATH_LENGTH];
+  file_tree_join_path(plain, bench_dir, "plain");
+  file_tree_join_path(enc, bench_dir, "plain.enc");
+  file_tree_join_path(dec, bench_dir, "plain.dec");
+
+  for (int s = 0; s < num_sizes; s++) {
+    if (!bench_write_random_file(plain, sizes[s])) {
+      fprintf(stderr, "bench: cannot write %s: %s\n", plain, strerror(errno));
+      return;
+    }
+    BenchResult results[4] = {{.name = "encrypt"},
+                              {.name = "encrypt_stream"},
+                              {.name = "decrypt"},
+                              {.name = "decrypt_stream"}};
+    for (int r = 0; r < 4; r++) {
+      snprintf(results[r].param, sizeof(results[r].param), "size=%lld io=%s",
+               sizes[s], bench_io_name);
+      results[r].bytes = sizes[s];
+    }
+    for (int i = 0; i < bench_iterations; i++) {
+      StatsCrypto stats;
+      CryptoOptions opts = {.stats = &stats, .io_policy = bench_io_policy};
+      int status = crypto_encrypt_file_ex(plain, enc, BENCH_PASSWORD, &opts);
+      results[0].samples[i] = stats.total_ns;
+      results[1].samples[i] = stats.total_ns - stats.kdf_ns;
+      if (status == CRYPTO_SUCCESS) {
+        status = crypto_decrypt_file_ex(enc, dec, BENCH_PASSWORD, &opts);
+      }
+      if (status != CRYPTO_SUCCESS) {
+        // a failed run is no sample, and the rest would fail the same way
+        fprintf(stderr, "bench: %s: crypto error %d\n", plain, status);
+        unlink(plain);
+        unlink(enc);
+        unlink(dec);
+        return;
+      }
+      results[2].samples[i] = stats.total_ns;
+      results[3].samples[i] = stats.total_ns - stats.kdf_ns;
+    }
+    for (int r = 0; r < 4; r++) {
+      results[r].iterations = bench_iterations;
+      bench_report(&results[r]);
+    }
+  }
+  unlink(plain);
+  unlink(enc);
+  unlink(dec);
+}
+
+// encrypts a batch of 1 KiB files back to back and reports the time per file;
+// ops/sec is 1e6 / p50_us
+static void bench_small_files() {
+  const int num_files = bench_quick ? 4 : 16;
+  char path[MAX_PATH_LENGTH], enc[MAX_PATH_LENGTH + sizeof(".enc")];
+  BenchResult result = {.name = "small_file_encrypt", .bytes = 1024};
+  snprintf(result.param, sizeof(result.param), "files=%d", num_files);
+  for (int i = 0; i < num_files && i < BENCH_MAX_SAMPLES; i++) {
+    char name[32];
+    snprintf(name, sizeof(name), "small%d", i);
+    file_tree_join_path(path, bench_dir, name);
+    snprintf(enc, sizeof(enc), "%s.enc", path);
+    if (!bench_write_random_file(path, 1024)) {
+      break;
+    }
+    long long start = stats_now_ns();
+    int status = crypto_encrypt_file(path, enc, BENCH_PASSWORD);
+    long long elapsed = stats_now_ns() - start;
+    unlink(path);
+    unlink(enc);
+    if (status != CRYPTO_SUCCESS) {
+      fprintf(stderr, "bench: %s: crypto error %d\n", path, status);
+      return;
+    }
+    result.samples[result.iterations++] = elapsed;
+  }
+  bench_report(&result);
+}
+
+// lays out 'num_files' empty files in directories of BENCH_FILES_PER_DIR
+static int bench_make_tree(const char *root, int num_files) {
+  if (mkdir(root, 0700) != 0 && errno != EEXIST) {
+    return 0;
+  }
+  char dir[MAX_PATH_LENGTH], path[MAX_PATH_LENGTH], name[32];
+  for (int i = 0; i < num_files; i++) {
+    snprintf(name, sizeof(name), "d%05d", i / BENCH_FILES_PER_DIR);
+    file_tree_join_path(dir, root, name);
+    if (i % BENCH_FILES_PER_DIR == 0 && mkdir(dir, 0700) != 0 &&
+        errno != EEXIST) {
+      return 0;
+    }
+    snprintf(name, sizeof(name), "file%07d.txt", i);
+    file_tree_join_path(path, dir, name);
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0) {
+      return 0;
+    }
+    close(fd);
+  }
+  return 1;
+}
+
+// draws the browser at evenly spread scroll offsets with curses writing to
+// /dev/null, so the time covers row lookup and formatting, not a terminal
+static void bench_redraw(FileNode *root, int num_files) {
+  if (!getenv("TERM")) {
+    setenv("TERM", "xterm", 0);
+  }
+  fflush(stdout);
+  int saved_stdout = dup(STDOUT_FILENO);
+  int null_fd = open("/dev/null", O_WRONLY);
+  if (saved_stdout < 0 || null_fd < 0) {
+    return;
+  }
+  dup2(null_fd, STDOUT_FILENO);
+  close(null_fd);
+
+  BenchResult result = {.name = "browser_redraw"};
+  snprintf(result.param, sizeof(result.param), "entries=%d", num_files);
+  tui_init();
+  int total = file_tree_count_nodes(root);
+  int samples = bench_iterations * 20;
+  if (samples > BENCH_MAX_SAMPLES) {
+    samples = BENCH_MAX_SAMPLES;
+  }
+  for (int i = 0; i < samples; i++) {
+    int offset = (int)((long long)total * i / samples);
+    long long start = stats_now_ns();
+    tui_draw_file_browser(root, offset, offset);
+    result.samples[result.iterations++] = stats_now_ns() - start;
+  }
+  tui_cleanup();
+
+  fflush(stdout);
+  dup2(saved_stdout, STDOUT_FILENO);
+  close(saved_stdout);
+  bench_report(&result);
+}
+
+static void bench_tree(const char *sizes_arg) {
+  char sizes[128];
+  snprintf(sizes, sizeof(sizes), "%s", sizes_arg);
+  for (char *token = strtok(sizes, ","); token; token = strtok(NULL, ",")) {
+    int num_files = atoi(token);
+    if (num_files <= 0) {
+      continue;
+    }
+    char root[MAX_PATH_LENGTH], name[32];
+    snprintf(name, sizeof(name), "tree%d", num_files);
+    file_tree_join_path(root, bench_dir, name);
+    if (!bench_make_tree(root, num_files)) {
+      fprintf(stderr, "bench: cannot create %s: %s\n", root, strerror(errno));
+      return;
+    }
+
+    BenchResult result = {.name = "tree_scan"};
+    snprintf(result.param, sizeof(result.param), "entries=%d", num_files);
+    FileNode *last = NULL;
+    for (int i = 0; i < bench_iterations; i++) {
+      long long start = stats_now_ns();
+      FileNode *tree = file_tree_create(root, 0);
+      result.samples[result.iterations++] = stats_now_ns() - start;
+      file_tree_destroy(last);
+      last = tree;
+    }
+    bench_report(&result);
+    if (last && bench_selected("redraw")) {
+      bench_redraw(last, num_files);
+    }
+    file_tree_destroy(last);
+  }
+}
+
+static int bench_remove_entry(const char *path, const struct stat *st,
+                              int type, struct FTW *ftw) {
+  (void)st;
+  (void)type;
+  (void)ftw;
+  return remove(path) == 0 ? 0 : -1;
+}
+
+// removes the scratch tree bottom up, never following a symlink out of it
+static void bench_remove_dir(const char *path) {
+  if (nftw(path, bench_remove_entry, 16, FTW_DEPTH | FTW_PHYS) != 0) {
+    fprintf(stderr, "bench: failed to remove %s: %s\n", path,
+            strerror(errno));
+  }
+}
+
+static void bench_usage(const char *prog_name) {
+  printf("Usage: %s [options]\n\n", prog_name);
+  printf("Options:\n");
+  printf("  -f, --format csv|json  Output format (default csv).\n");
+  printf("  -n, --iterations N     Timed iterations per case (default 5).\n");
+  printf("  -q, --quick            Smaller inputs, for a fast smoke run.\n");
+  printf("  -o, --only NAME        Run one group: kdf, aead, file, small, "
+         "tree,\n");
+  printf("                         redraw (implies tree).\n");
+  printf("  -t, --tree-sizes LIST  Comma-separated synthetic tree sizes "
+         "(default\n");
+  printf("                         10000,100000,1000000).\n");
+  printf("  -d, --dir DIR          Scratch directory parent (default "
+         "/tmp).\n");
+  printf("  -i, --io-policy MODE   cached, stream or direct, for the file "
+         "group\n");
+  printf("                         (default cached).\n");
+}
+
+int main(int argc, char **argv) {
+  const char *tree_sizes = "10000,100000,1000000";
+  const char *scratch_parent = "/tmp";
+
+  struct option long_options[] = {
+      {"format", required_argument, 0, 'f'},
+      {"iterations", required_argument, 0, 'n'},
+      {"quick", no_argument, 0, 'q'},
+      {"only", required_argument, 0, 'o'},
+      {"tree-sizes", required_argument, 0, 't'},
+      {"dir", required_argument, 0, 'd'},
+      {"io-policy", required_argument, 0, 'i'},
+      {"help", no_argument, 0, 'h'},
+      {0, 0, 0, 0}};
+  int opt_char;
+  while ((opt_char = getopt_long(argc, argv, "f:n:qo:t:d:i:h", long_options,
+                                 NULL)) != -1) {
+    switch (opt_char) {
+    case 'f':
+      bench_format =
+          strcmp(optarg, "json") == 0 ? BENCH_FORMAT_JSON : BENCH_FORMAT_CSV;
+      break;
+    case 'n':
+      bench_iterations = atoi(optarg);
+      break;
+    case 'q':
+      bench_quick = 1;
+      tree_sizes = "10000";
+      break;
+    case 'o':
+      bench_only = optarg;
+      break;
+    case 't':
+      tree_sizes = optarg;
+      break;
+    case 'd':
+      scratch_parent = optarg;
+      break;
+    case 'i':
+      bench_io_name = optarg;
+      if (strcmp(optarg, "cached") == 0) {
+        bench_io_policy = CRYPTO_IO_CACHED;
+      } else if (strcmp(optarg, "stream") == 0) {
+        bench_io_policy = CRYPTO_IO_STREAM;
+      } else if (strcmp(optarg, "direct") == 0) {
+        bench_io_policy = CRYPTO_IO_DIRECT;
+      } else {
+        bench_usage(argv[0]);
+        return 1;
+      }
+      break;
+    default:
+      bench_usage(argv[0]);
+      return opt_char == 'h' ? 0 : 1;
+    }
+  }
+  if (bench_iterations < 1) {
+    bench_iterations = 1;
+  }
+  if (bench_iterations > BENCH_MAX_SAMPLES) {
+    bench_iterations = BENCH_MAX_SAMPLES;
+  }
+
+  if (sodium_init() < 0) {
+    fprintf(stderr, "Failed to initialise libsodium\n");
+    return 1;
+  }
+  snprintf(bench_dir, sizeof(bench_dir), "%s/filecryption-bench.XXXXXX",
+           scratch_parent);
+  if (!mkdtemp(bench_dir)) {
+    fprintf(stderr, "bench: cannot create scratch directory: %s\n",
+            strerror(errno));
+    return 1;
+  }
+
+  if (bench_format == BENCH_FORMAT_CSV) {
+    printf("bench,param,iterations,min_us,p50_us,p90_us,p99_us,max_us,"
+           "mean_us,mb_per_s\n");
+  }
+  if (bench_selected("kdf")) {
+    bench_kdf();
+  }
+  if (bench_selected("aead")) {
+    bench_aead();
+  }
+  if (bench_selected("file")) {
+    bench_file_crypto();
+  }
+  if (bench_selected("small")) {
+    bench_small_files();
+  }
+  if (bench_selected("tree") || bench_selected("redraw")) {
+    bench_tree(tree_sizes);
+  }
+
+  bench_remove_dir(bench_dir);
+  return 0;
+}
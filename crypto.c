@@ -1,11 +1,80 @@
 #include "crypto.h"
+#include "crypto_io.h"
+#include "manifest.h"
+#include "stats.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <linux/fs.h> // FICLONE
+#endif
 
 #define CHUNK_SIZE 4096
+
+// files start with a cleartext preamble: the magic, the format version and
+// how the key is obtained, followed by what the key is derived from and then
+// the stream header. for CRYPTO_KEY_PASSWORD that is the salt of the
+// password; for CRYPTO_KEY_MASTER the salt of the master key (itself derived
+// from the password) and a random nonce, the file key being the nonce
+// hashed with the master key, so a holder of the master key (see agent.c)
+// needs no password hashing per file. for CRYPTO_KEY_RECIPIENT it is the
+// number of recipients and a random file key sealed (crypto_box_seal) to
+// each of their X25519 public keys: encrypting takes no password at all,
+// decrypting the secret key of any one of them. the stream is a sequence of
+// records, each a little-endian u32 ciphertext length and one message whose
+// first plaintext byte is the record type:
+//   DATA  up to CHUNK_SIZE bytes at the current output offset
+//   HOLE  u64 count of zero bytes that are not stored
+//   CHECKPOINT  u64 plaintext offset and u64 count of records before it,
+//               written every CRYPTO_CHECKPOINT_BYTES of input
+//   END   u64 plaintext size and, unless the file was written without one,
+//         the BLAKE2b-512 digest of the plaintext (holes hashed as zeros,
+//         so it matches b2sum); the only record tagged FINAL
+// version 1 files have no preamble and a stream of fixed size chunks; they
+// are still decrypted
+#define CRYPTO_MAGIC "FCRYPT"
+#define CRYPTO_MAGIC_LEN 6
+#define CRYPTO_PREAMBLE_LEN (CRYPTO_MAGIC_LEN + 2)
+#define CRYPTO_FILE_NONCE_BYTES 16
+#define CRYPTO_SEALED_KEY_BYTES                                                \
+  (crypto_box_SEALBYTES + crypto_secretstream_xchacha20poly1305_KEYBYTES)
+#define CRYPTO_HEAD_MAX                                                        \
+  (CRYPTO_PREAMBLE_LEN + 1 + CRYPTO_MAX_RECIPIENTS * CRYPTO_SEALED_KEY_BYTES + \
+   crypto_secretstream_xchacha20poly1305_HEADERBYTES)
+#define CRYPTO_VERSION 2
+#define CRYPTO_KEY_PASSWORD 0
+#define CRYPTO_KEY_MASTER 1
+#define CRYPTO_KEY_RECIPIENT 2
+
+// first words of the key files written by crypto_keygen
+#define CRYPTO_PUBLIC_KEY_TAG "filecryption-public-key"
+#define CRYPTO_SECRET_KEY_TAG "filecryption-secret-key"
+
+#define CRYPTO_RECORD_DATA 1
+#define CRYPTO_RECORD_HOLE 2
+#define CRYPTO_RECORD_END 3
+#define CRYPTO_RECORD_CHECKPOINT 4
+#define CRYPTO_RECORD_MAX (1 + CHUNK_SIZE)
+#define CRYPTO_RECORD_CIPHER_MAX                                               \
+  (CRYPTO_RECORD_MAX + crypto_secretstream_xchacha20poly1305_ABYTES)
+
+// progress is published once per this many chunks (256 KiB)
+#define CRYPTO_PROGRESS_CHUNKS 64
 #define AAD_STRING (const unsigned char *)"ZmlsZWNyeXB0aW9u"
 #define AAD_STRING_LEN 16
 
+#define CRYPTO_OP_ENCRYPT 1
+#define CRYPTO_OP_DECRYPT 2
+#define CRYPTO_CHECKPOINT_SUFFIX ".ckpt"
+#define CRYPTO_CHECKPOINT_CONTEXT "FCRYPTCK" // crypto_kdf context, 8 bytes
+
 int crypto_derive_key(unsigned char *key, size_t key_len, const char *password,
                       const unsigned char *salt) {
   return crypto_pwhash(key, key_len, password, strlen(password), salt,
@@ -14,143 +83,2381 @@ int crypto_derive_key(unsigned char *key, size_t key_len, const char *password,
                        crypto_pwhash_ALG_DEFAULT);
 }
 
+// bytes between the preamble and the stream header of 'head', 0 for an
+// unknown mode. recipient heads need their first byte past the preamble
+static size_t crypto_key_material_len(const unsigned char *head) {
+  int recipients = head[CRYPTO_PREAMBLE_LEN];
+  switch (head[CRYPTO_MAGIC_LEN + 1]) {
+  case CRYPTO_KEY_PASSWORD:
+    return crypto_pwhash_SALTBYTES;
+  case CRYPTO_KEY_MASTER:
+    return crypto_pwhash_SALTBYTES + CRYPTO_FILE_NONCE_BYTES;
+  case CRYPTO_KEY_RECIPIENT:
+    return recipients > 0 && recipients <= CRYPTO_MAX_RECIPIENTS
+               ? 1 + (size_t)recipients * CRYPTO_SEALED_KEY_BYTES
+               : 0;
+  default:
+    return 0;
+  }
+}
+
+// copies the master key salt of the encrypted file open as 'fd' into 'salt'.
+// CRYPTO_ERROR_DEC if the file is not under a master key. the file offset
+// is left alone
+int crypto_master_salt(int fd, unsigned char *salt) {
+  unsigned char head[CRYPTO_PREAMBLE_LEN + crypto_pwhash_SALTBYTES];
+  if (pread(fd, head, sizeof(head), 0) != (ssize_t)sizeof(head)) {
+    return CRYPTO_ERROR_DEC;
+  }
+  if (memcmp(head, CRYPTO_MAGIC, CRYPTO_MAGIC_LEN) != 0 ||
+      head[CRYPTO_MAGIC_LEN] != CRYPTO_VERSION ||
+      head[CRYPTO_MAGIC_LEN + 1] != CRYPTO_KEY_MASTER) {
+    return CRYPTO_ERROR_DEC;
+  }
+  memcpy(salt, head + CRYPTO_PREAMBLE_LEN, crypto_pwhash_SALTBYTES);
+  return CRYPTO_SUCCESS;
+}
+
+// checks, without a password, that 'path' is laid out like a file written by
+// crypto_encrypt_file. version 2 files need the preamble and room for at
+// least the END record; version 1 files a salt, a stream header, then full
+// chunks and a final chunk
+int crypto_probe_file(const char *path) {
+  FILE *file = fopen(path, "rb");
+  if (!file) {
+    return CRYPTO_ERROR_FILE;
+  }
+
+  unsigned char header[crypto_pwhash_SALTBYTES +
+                       crypto_secretstream_xchacha20poly1305_HEADERBYTES];
+  if (fread(header, 1, sizeof(header), file) != sizeof(header) ||
+      fseek(file, 0, SEEK_END) != 0) {
+    fclose(file);
+    return CRYPTO_ERROR_DEC; // incomplete salt or header
+  }
+  long size = ftell(file);
+  fclose(file);
+  if (size < 0) {
+    return CRYPTO_ERROR_FILE;
+  }
+
+  const long abytes = crypto_secretstream_xchacha20poly1305_ABYTES;
+  if (memcmp(header, CRYPTO_MAGIC, CRYPTO_MAGIC_LEN) == 0) {
+    const size_t material = crypto_key_material_len(header);
+    const long min_size = CRYPTO_PREAMBLE_LEN + (long)material +
+                          crypto_secretstream_xchacha20poly1305_HEADERBYTES +
+                          4 + 1 + 8 + abytes;
+    if (header[CRYPTO_MAGIC_LEN] != CRYPTO_VERSION || material == 0 ||
+        size < min_size) {
+      // unknown version or key mode, or no room for the stream
+      return CRYPTO_ERROR_DEC;
+    }
+    return CRYPTO_SUCCESS;
+  }
+  const long stream_size = size - (long)sizeof(header);
+  const long last_chunk_size = stream_size % (CHUNK_SIZE + abytes);
+  // the final chunk is never full: a plaintext that fills its last chunk is
+  // followed by an empty final one. so a file cut at a chunk boundary has
+  // lost it
+  if (stream_size < abytes || last_chunk_size < abytes) {
+    return CRYPTO_ERROR_DEC; // truncated chunk
+  }
+  return CRYPTO_SUCCESS;
+}
+
+static int crypto_cancelled(const CryptoOptions *opts) {
+  return opts && opts->cancel &&
+         atomic_load_explicit(opts->cancel, memory_order_relaxed);
+}
+
+static long long crypto_now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void crypto_progress_begin(const CryptoOptions *opts, long long total) {
+  if (!opts || !opts->progress) {
+    return;
+  }
+  CryptoProgress *progress = opts->progress;
+  long long now = crypto_now_ns();
+  atomic_store_explicit(&progress->bytes_total, total, memory_order_relaxed);
+  atomic_store_explicit(&progress->bytes_done, 0, memory_order_relaxed);
+  atomic_store_explicit(&progress->started_ns, now, memory_order_relaxed);
+  atomic_store_explicit(&progress->updated_ns, now, memory_order_relaxed);
+  atomic_store(&progress->phase, CRYPTO_PHASE_KDF);
+}
+
+static void crypto_progress_update(const CryptoOptions *opts, int phase,
+                                   long long bytes_done) {
+  if (!opts || !opts->progress) {
+    return;
+  }
+  CryptoProgress *progress = opts->progress;
+  long long now = crypto_now_ns();
+  if (atomic_load_explicit(&progress->phase, memory_order_relaxed) != phase &&
+      phase == CRYPTO_PHASE_STREAM) {
+    // throughput is measured over the stream only, not the key derivation
+    atomic_store_explicit(&progress->started_ns, now, memory_order_relaxed);
+  }
+  atomic_store_explicit(&progress->bytes_done, bytes_done,
+                        memory_order_relaxed);
+  atomic_store_explicit(&progress->updated_ns, now, memory_order_relaxed);
+  atomic_store(&progress->phase, phase);
+}
+
+// derives the stream throughput (bytes per second), the time left and how
+// long the operation has gone without publishing anything. a long idle time
+// with a low rate means a stalled device rather than a slow one
+void crypto_progress_estimate(CryptoProgress *progress, double *rate,
+                              long long *eta_ms, long long *idle_ms) {
+  long long now = crypto_now_ns();
+  int phase = atomic_load(&progress->phase);
+  long long done = atomic_load_explicit(&progress->bytes_done,
+                                        memory_order_relaxed);
+  long long total = atomic_load_explicit(&progress->bytes_total,
+                                         memory_order_relaxed);
+  long long started = atomic_load_explicit(&progress->started_ns,
+                                           memory_order_relaxed);
+  long long updated = atomic_load_explicit(&progress->updated_ns,
+                                           memory_order_relaxed);
+
+  *rate = 0;
+  *eta_ms = -1;
+  *idle_ms = updated > 0 && now > updated ? (now - updated) / 1000000 : 0;
+  if (phase < CRYPTO_PHASE_STREAM || updated <= started) {
+    return;
+  }
+  *rate = (double)done * 1e9 / (double)(updated - started);
+  if (*rate > 0 && total >= done) {
+    *eta_ms = (long long)((double)(total - done) * 1000.0 / *rate);
+  }
+}
+
 int crypto_encrypt_file(const char *src, const char *dest,
                         const char *password) {
-  FILE *src_file = fopen(src, "rb");
-  if (!src_file) {
-    return CRYPTO_ERROR_FILE; // error opening source file for encryption
+  return crypto_encrypt_file_ex(src, dest, password, NULL);
+}
+
+// the two ends of an operation: paths, or descriptors the caller keeps open,
+// the paths then only naming them in stats and the manifest
+typedef struct CryptoFiles {
+  const char *src;
+  const char *dest;
+  int src_fd; // -1 to open 'src'
+  int dest_fd;
+  int in_place; // 'src' is converted into itself, 'dest' is unused
+} CryptoFiles;
+
+struct CryptoJournal;
+
+// state shared by the stream loops below. 'stats' is non-NULL only when
+// stats are enabled; otherwise the loops do not even read the clock
+typedef struct CryptoStream {
+  crypto_secretstream_xchacha20poly1305_state state;
+  CryptoReader reader;
+  CryptoWriter writer;
+  const CryptoOptions *opts;
+  StatsCrypto *stats;
+  int op; // CRYPTO_OP_*
+  int io_policy;
+  long long records; // records pushed or pulled so far
+  // preamble, key material and stream header of the encrypted file. version
+  // 1 files leave the preamble out, their head starts at the key material
+  unsigned char head[CRYPTO_HEAD_MAX];
+  size_t head_len;
+  int key_mode; // CRYPTO_KEY_*
+  // the key just sealed to the recipients of a new recipient file
+  unsigned char file_key[crypto_secretstream_xchacha20poly1305_KEYBYTES];
+  int file_key_set;
+  // checkpoints are off when 'checkpoint_path' is empty
+  char checkpoint_path[PATH_MAX];
+  unsigned char checkpoint_key[crypto_kdf_KEYBYTES];
+  long long checkpoint_every; // plaintext bytes between checkpoints
+  long long checkpoint_last;  // plaintext offset of the last one
+  long long src_size;         // identify the source a checkpoint belongs to
+  long long src_mtime_ns;
+  // digests taken in the same pass: of the plaintext, stored in the END
+  // record and checked on decryption, and of the encrypted file, which is
+  // only wanted for the manifest
+  int hash_plain;
+  int hash_cipher;
+  crypto_generichash_state plain_hash;
+  crypto_generichash_state cipher_hash;
+  int plain_final; // plain_digest holds the finished digest
+  unsigned char plain_digest[CRYPTO_DIGEST_BYTES];
+  const char *src;
+  const char *dest;
+  int dest_fd;
+  struct CryptoJournal *journal; // set for conversions in place
+} CryptoStream;
+
+static void crypto_store_le(unsigned char *out, unsigned long long value,
+                            int len) {
+  for (int i = 0; i < len; i++) {
+    out[i] = (unsigned char)(value >> (8 * i));
   }
+}
 
-  FILE *dest_file = fopen(dest, "wb");
-  if (!dest_file) {
-    fclose(src_file);
-    return CRYPTO_ERROR_FILE; // error opening destination file for encryption
+static unsigned long long crypto_load_le(const unsigned char *in, int len) {
+  unsigned long long value = 0;
+  for (int i = len - 1; i >= 0; i--) {
+    value = (value << 8) | in[i];
   }
+  return value;
+}
 
-  unsigned char salt[crypto_pwhash_SALTBYTES];
-  randombytes_buf(salt, sizeof(salt));
+static int crypto_sidecar_path(const char *path, const char *suffix,
+                               char *out, size_t len) {
+  int written = snprintf(out, len, "%s%s", path, suffix);
+  return written > 0 && (size_t)written < len;
+}
 
-  unsigned char key[crypto_secretstream_xchacha20poly1305_KEYBYTES];
-  if (crypto_derive_key(key, sizeof(key), password, salt) != 0) {
-    fclose(dest_file);
-    fclose(src_file);
-    return CRYPTO_ERROR_ENC; // unable to derive key
+static int crypto_checkpoint_path(const char *dest, char *out, size_t len) {
+  return crypto_sidecar_path(dest, CRYPTO_CHECKPOINT_SUFFIX, out, len);
+}
+
+int crypto_checkpoint_exists(const char *dest) {
+  char path[PATH_MAX];
+  return crypto_checkpoint_path(dest, path, sizeof(path)) &&
+         access(path, F_OK) == 0;
+}
+
+// removes a partial output together with its checkpoint
+void crypto_remove_output(const char *dest) {
+  char path[PATH_MAX];
+  unlink(dest);
+  if (crypto_checkpoint_path(dest, path, sizeof(path))) {
+    unlink(path);
   }
+}
 
-  fwrite(salt, 1, sizeof(salt), dest_file);
+static void crypto_hash_zeros(crypto_generichash_state *state, long long len) {
+  static unsigned char zeros[1 << 16];
+  while (len > 0) {
+    size_t n = len < (long long)sizeof(zeros) ? (size_t)len : sizeof(zeros);
+    crypto_generichash_update(state, zeros, n);
+    len -= (long long)n;
+  }
+}
 
-  crypto_secretstream_xchacha20poly1305_state state;
-  unsigned char header[crypto_secretstream_xchacha20poly1305_HEADERBYTES];
-  crypto_secretstream_xchacha20poly1305_init_push(&state, header, key);
-  fwrite(header, 1, sizeof(header), dest_file);
+static void crypto_finish_plain_digest(CryptoStream *s) {
+  if (s->hash_plain && !s->plain_final) {
+    crypto_generichash_final(&s->plain_hash, s->plain_digest,
+                             sizeof(s->plain_digest));
+    s->plain_final = 1;
+  }
+}
 
-  unsigned char input_buffer[CHUNK_SIZE];
-  unsigned char
-      output_buffer[CHUNK_SIZE + crypto_secretstream_xchacha20poly1305_ABYTES];
-  unsigned long long encrypted_chunk_len;
-  size_t bytes_read;
-  int eof;
-  unsigned char tag; // tag to mark the chunks
-  do {
-    bytes_read = fread(input_buffer, 1, sizeof(input_buffer), src_file);
-    eof = feof(src_file);
+static void crypto_stream_init(CryptoStream *s, int op,
+                               const CryptoFiles *files,
+                               const CryptoOptions *opts, StatsCrypto *stats) {
+  memset(s, 0, sizeof(*s));
+  s->reader.fd = -1;
+  s->writer.fd = -1;
+  s->op = op;
+  s->opts = opts;
+  s->stats = stats;
+  s->io_policy = opts ? opts->io_policy : CRYPTO_IO_CACHED;
+  s->src = files->src;
+  s->dest = files->dest;
+  s->dest_fd = files->dest_fd;
+  s->hash_plain = !(opts && opts->no_digest);
+  s->hash_cipher = manifest_enabled();
+  crypto_generichash_init(&s->plain_hash, NULL, 0, CRYPTO_DIGEST_BYTES);
+  crypto_generichash_init(&s->cipher_hash, NULL, 0, CRYPTO_DIGEST_BYTES);
+}
 
-    tag = eof ? crypto_secretstream_xchacha20poly1305_TAG_FINAL : 0;
+// opens the source; the destination is opened by the caller once it knows
+// whether the operation starts over or resumes
+static int crypto_stream_open(CryptoStream *s, int op,
+                              const CryptoFiles *files,
+                              const CryptoOptions *opts, StatsCrypto *stats) {
+  crypto_stream_init(s, op, files, opts, stats);
+  int status =
+      files->src_fd >= 0
+          ? crypto_reader_open_fd(&s->reader, files->src_fd, s->io_policy)
+          : crypto_reader_open(&s->reader, files->src, s->io_policy);
+  if (status != CRYPTO_SUCCESS) {
+    return status; // error opening the source file
+  }
+  if (stats) {
+    s->reader.calls = &stats->read_calls;
+  }
 
-    crypto_secretstream_xchacha20poly1305_push(
-        &state, output_buffer, &encrypted_chunk_len, input_buffer, bytes_read,
-        AAD_STRING, AAD_STRING_LEN, tag);
+  struct stat st;
+  if (fstat(s->reader.fd, &st) == 0) {
+    s->src_size = st.st_size;
+    s->src_mtime_ns = st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+  }
+  s->checkpoint_every = opts && opts->checkpoint_bytes != 0
+                            ? opts->checkpoint_bytes
+                            : CRYPTO_CHECKPOINT_BYTES;
+  // a descriptor has no path to keep a checkpoint next to
+  if (s->checkpoint_every < 0 || s->dest_fd >= 0 ||
+      !crypto_checkpoint_path(s->dest, s->checkpoint_path,
+                              sizeof(s->checkpoint_path))) {
+    s->checkpoint_every = 0;
+    s->checkpoint_path[0] = '\0';
+  }
 
-    fwrite(output_buffer, 1, (size_t)encrypted_chunk_len, dest_file);
-  } while (!eof);
+  crypto_progress_begin(opts, s->src_size);
+  return CRYPTO_SUCCESS;
+}
 
-  fclose(src_file);
-  fclose(dest_file);
+static int crypto_stream_open_dest(CryptoStream *s, long long offset) {
+  int status =
+      s->dest_fd >= 0
+          ? crypto_writer_open_fd(&s->writer, s->dest_fd, s->io_policy)
+          : crypto_writer_open_at(&s->writer, s->dest, s->io_policy, offset);
+  if (status == CRYPTO_SUCCESS && s->stats) {
+    s->writer.calls = &s->stats->write_calls;
+  }
+  return status;
+}
 
-  sodium_memzero(key, sizeof(key));
+// both digests of a finished operation go to the manifest
+static void crypto_stream_record_digests(CryptoStream *s) {
+  unsigned char cipher_digest[CRYPTO_DIGEST_BYTES];
+  crypto_finish_plain_digest(s);
+  crypto_generichash_final(&s->cipher_hash, cipher_digest,
+                           sizeof(cipher_digest));
+  const char *plain_path = s->op == CRYPTO_OP_ENCRYPT ? s->src : s->dest;
+  const char *cipher_path = s->op == CRYPTO_OP_ENCRYPT ? s->dest : s->src;
+  if (s->hash_plain && plain_path) {
+    manifest_record(plain_path, s->plain_digest, sizeof(s->plain_digest));
+  }
+  if (cipher_path) {
+    manifest_record(cipher_path, cipher_digest, sizeof(cipher_digest));
+  }
+}
+
+// wipes the stream state and closes both files. 'error' is what a failed
+// final flush is reported as. the checkpoint goes once the output is whole
+static int crypto_stream_close(CryptoStream *s, int status, int error,
+                               long long done) {
+  // v2 finishes the digest at the END record, v1 has none and finishes here,
+  // before the state is wiped
+  crypto_finish_plain_digest(s);
+  sodium_memzero(&s->state, sizeof(s->state));
+  sodium_memzero(&s->plain_hash, sizeof(s->plain_hash));
+  sodium_memzero(s->checkpoint_key, sizeof(s->checkpoint_key));
+  sodium_memzero(s->file_key, sizeof(s->file_key));
+  crypto_progress_update(s->opts, CRYPTO_PHASE_FINALIZE, done);
+  crypto_reader_close(&s->reader);
+  if (crypto_writer_close(&s->writer) != CRYPTO_SUCCESS &&
+      status == CRYPTO_SUCCESS) {
+    status = error; // the final flush failed
+  }
+  if (status == CRYPTO_SUCCESS) {
+    if (s->checkpoint_path[0]) {
+      unlink(s->checkpoint_path);
+    }
+    if (s->hash_plain && s->opts && s->opts->digest) {
+      crypto_finish_plain_digest(s);
+      memcpy(s->opts->digest, s->plain_digest, sizeof(s->plain_digest));
+    }
+    if (s->hash_cipher) {
+      crypto_stream_record_digests(s);
+    }
+    crypto_progress_update(s->opts, CRYPTO_PHASE_DONE, done);
+  }
+  return status;
+}
+
+// the file key of a recipient file: the one just sealed when encrypting,
+// otherwise whichever sealed copy opens with the secret key in the options
+static int crypto_recipient_key(CryptoStream *s, unsigned char *key) {
+  const CryptoOptions *opts = s->opts;
+  if (s->file_key_set) {
+    memcpy(key, s->file_key, sizeof(s->file_key));
+    return 0;
+  }
+  if (!opts || !opts->secret_key) {
+    return -1;
+  }
+  unsigned char public_key[crypto_box_PUBLICKEYBYTES];
+  crypto_scalarmult_base(public_key, opts->secret_key);
+  const unsigned char *sealed = s->head + CRYPTO_PREAMBLE_LEN + 1;
+  int recipients = s->head[CRYPTO_PREAMBLE_LEN];
+  for (int i = 0; i < recipients; i++) {
+    if (crypto_box_seal_open(key, sealed + i * CRYPTO_SEALED_KEY_BYTES,
+                             CRYPTO_SEALED_KEY_BYTES, public_key,
+                             opts->secret_key) == 0) {
+      return 0;
+    }
+  }
+  return -1; // not one of the recipients
+}
+
+// crypto_derive_key under the options' kdf_lock, when they have one
+static int crypto_stream_pwhash(const CryptoOptions *opts, unsigned char *key,
+                                size_t key_len, const char *password,
+                                const unsigned char *salt) {
+  pthread_mutex_t *lock = opts ? opts->kdf_lock : NULL;
+  if (lock) {
+    pthread_mutex_lock(lock);
+  }
+  int status = crypto_derive_key(key, key_len, password, salt);
+  if (lock) {
+    pthread_mutex_unlock(lock);
+  }
+  return status;
+}
+
+// derives the stream key from the key material in s->head, and the
+// checkpoint key from the stream key. a master key given in the options
+// stands in for the password when its salt is the one in the head
+static int crypto_stream_derive_key(CryptoStream *s, unsigned char *key,
+                                    const char *password) {
+  const unsigned char *salt = s->head + CRYPTO_PREAMBLE_LEN;
+  const CryptoOptions *opts = s->opts;
+  long long kdf_start = s->stats ? stats_now_ns() : 0;
+  int kdf_status = -1;
+  if (s->key_mode == CRYPTO_KEY_MASTER) {
+    unsigned char master[CRYPTO_MASTER_KEY_BYTES];
+    if (opts && opts->master_key &&
+        sodium_memcmp(opts->master_salt, salt, crypto_pwhash_SALTBYTES) == 0) {
+      memcpy(master, opts->master_key, sizeof(master));
+      kdf_status = 0;
+    } else if (password) {
+      kdf_status =
+          crypto_stream_pwhash(opts, master, sizeof(master), password, salt);
+    }
+    if (kdf_status == 0) {
+      crypto_generichash(key, crypto_secretstream_xchacha20poly1305_KEYBYTES,
+                         salt + crypto_pwhash_SALTBYTES,
+                         CRYPTO_FILE_NONCE_BYTES, master, sizeof(master));
+    }
+    sodium_memzero(master, sizeof(master));
+  } else if (s->key_mode == CRYPTO_KEY_RECIPIENT) {
+    kdf_status = crypto_recipient_key(s, key);
+  } else if (password) {
+    kdf_status = crypto_stream_pwhash(
+        opts, key, crypto_secretstream_xchacha20poly1305_KEYBYTES, password,
+        salt);
+  }
+  if (s->stats) {
+    s->stats->kdf_ns = stats_now_ns() - kdf_start;
+  }
+  if (kdf_status == 0 && s->checkpoint_path[0]) {
+    crypto_kdf_derive_from_key(s->checkpoint_key, sizeof(s->checkpoint_key),
+                               1, CRYPTO_CHECKPOINT_CONTEXT, key);
+  }
+  return kdf_status;
+}
+
+// encrypts 'record' (type byte included) as one message and writes it with
+// its length in front
+static int crypto_push_record(CryptoStream *s, const unsigned char *record,
+                              size_t len, unsigned char tag) {
+  unsigned char frame[4 + CRYPTO_RECORD_CIPHER_MAX];
+  unsigned long long cipher_len;
+  long long aead_start = s->stats ? stats_now_ns() : 0;
+  crypto_secretstream_xchacha20poly1305_push(&s->state, frame + 4,
+                                             &cipher_len, record, len,
+                                             AAD_STRING, AAD_STRING_LEN, tag);
+  if (s->stats) {
+    s->stats->aead_ns += stats_now_ns() - aead_start;
+  }
+  crypto_store_le(frame, cipher_len, 4);
+  if (crypto_writer_write(&s->writer, frame, 4 + (size_t)cipher_len) !=
+      CRYPTO_SUCCESS) {
+    return CRYPTO_ERROR_ENC; // unable to write the output
+  }
+  if (s->hash_cipher) {
+    crypto_generichash_update(&s->cipher_hash, frame, 4 + cipher_len);
+  }
+  s->records++;
+  if (s->stats) {
+    s->stats->bytes_written += 4 + cipher_len;
+    s->stats->chunks++;
+  }
   return CRYPTO_SUCCESS;
 }
 
-int crypto_decrypt_file(const char *src, const char *dest,
-                        const char *password) {
-  FILE *src_file = fopen(src, "rb");
-  if (!src_file) {
-    return CRYPTO_ERROR_FILE; // error opening source file for decryption
+// reads one length-prefixed message from 'reader' and decrypts it into
+// 'record'
+static int crypto_pull_record(CryptoStream *s, CryptoReader *reader,
+                              unsigned char *record, size_t *len,
+                              unsigned char *tag) {
+  unsigned char frame[CRYPTO_RECORD_CIPHER_MAX];
+  unsigned char prefix[4];
+  if (crypto_reader_read(reader, prefix, sizeof(prefix)) != sizeof(prefix)) {
+    return CRYPTO_ERROR_DEC; // end of file before the end of the stream
+  }
+  size_t cipher_len = (size_t)crypto_load_le(prefix, 4);
+  if (cipher_len < 1 + crypto_secretstream_xchacha20poly1305_ABYTES ||
+      cipher_len > sizeof(frame) ||
+      crypto_reader_read(reader, frame, cipher_len) != cipher_len) {
+    return CRYPTO_ERROR_DEC; // corrupted length or truncated record
+  }
+  if (s->hash_cipher) {
+    crypto_generichash_update(&s->cipher_hash, prefix, sizeof(prefix));
+    crypto_generichash_update(&s->cipher_hash, frame, cipher_len);
   }
 
-  FILE *dest_file = fopen(dest, "wb");
-  if (!dest_file) {
-    fclose(src_file);
-    return CRYPTO_ERROR_FILE; // error opening destination file for decryption
+  unsigned long long record_len;
+  long long aead_start = s->stats ? stats_now_ns() : 0;
+  int pull_status = crypto_secretstream_xchacha20poly1305_pull(
+      &s->state, record, &record_len, tag, frame, cipher_len, AAD_STRING,
+      AAD_STRING_LEN);
+  if (s->stats) {
+    s->stats->aead_ns += stats_now_ns() - aead_start;
+    s->stats->bytes_read += sizeof(prefix) + cipher_len;
+    s->stats->chunks++;
+  }
+  if (pull_status != 0 || record_len == 0) {
+    return CRYPTO_ERROR_DEC; // corrupted record
   }
+  s->records++;
+  *len = (size_t)record_len;
+  return CRYPTO_SUCCESS;
+}
+
+// a checkpoint file holds what it takes to continue the stream after a
+// CHECKPOINT record: where that record starts in the encrypted file, the
+// plaintext offset it names, the record count, the state of the stream and
+// of both digests just before it and the size and mtime of the source, and
+// which digests are being taken. it is sealed with a key
+// derived from the stream key, with the head of the encrypted file as
+// associated data, so it only opens for the same password and file. the
+// state is stored raw and so only resumes on a build of the same libsodium
+#define CRYPTO_CHECKPOINT_MAGIC "FCCKPT"
+#define CRYPTO_CHECKPOINT_VERSION 2
+#define CRYPTO_CHECKPOINT_PREFIX_LEN (CRYPTO_MAGIC_LEN + 2)
+#define CRYPTO_CHECKPOINT_BODY_LEN                                             \
+  (6 * 8 + sizeof(crypto_secretstream_xchacha20poly1305_state) +               \
+   2 * sizeof(crypto_generichash_state))
+#define CRYPTO_CHECKPOINT_FILE_LEN                                             \
+  (CRYPTO_CHECKPOINT_PREFIX_LEN +                                              \
+   crypto_aead_xchacha20poly1305_ietf_NPUBBYTES + CRYPTO_CHECKPOINT_BODY_LEN + \
+   crypto_aead_xchacha20poly1305_ietf_ABYTES)
+
+// the stream as it was just before a record, for checkpoints
+typedef struct CryptoMark {
+  crypto_secretstream_xchacha20poly1305_state state;
+  crypto_generichash_state cipher_hash;
+  long long record_offset;
+  long long records;
+} CryptoMark;
+
+static void crypto_stream_mark(CryptoStream *s, CryptoMark *mark,
+                               long long record_offset) {
+  mark->state = s->state;
+  if (s->hash_cipher) {
+    mark->cipher_hash = s->cipher_hash;
+  }
+  mark->record_offset = record_offset;
+  mark->records = s->records;
+}
+
+// returns the length of the associated data
+static size_t crypto_checkpoint_ad(CryptoStream *s,
+                                   const unsigned char *prefix,
+                                   unsigned char *ad) {
+  memcpy(ad, prefix, CRYPTO_CHECKPOINT_PREFIX_LEN);
+  memcpy(ad + CRYPTO_CHECKPOINT_PREFIX_LEN, s->head, s->head_len);
+  return CRYPTO_CHECKPOINT_PREFIX_LEN + s->head_len;
+}
+
+// replaces the checkpoint file atomically. a checkpoint that cannot be
+// saved only costs the ability to resume from it, so errors are not fatal
+static void crypto_checkpoint_save(CryptoStream *s, const CryptoMark *mark,
+                                   long long plain_pos) {
+  unsigned char body[CRYPTO_CHECKPOINT_BODY_LEN];
+  unsigned char *p = body;
+  crypto_store_le(p, (unsigned long long)mark->record_offset, 8);
+  crypto_store_le(p + 8, (unsigned long long)plain_pos, 8);
+  crypto_store_le(p + 16, (unsigned long long)mark->records, 8);
+  crypto_store_le(p + 24, (unsigned long long)s->src_size, 8);
+  crypto_store_le(p + 32, (unsigned long long)s->src_mtime_ns, 8);
+  crypto_store_le(p + 40, (s->hash_plain ? 1 : 0) | (s->hash_cipher ? 2 : 0),
+                  8);
+  p += 48;
+  memcpy(p, &mark->state, sizeof(mark->state));
+  p += sizeof(mark->state);
+  memcpy(p, &s->plain_hash, sizeof(s->plain_hash));
+  p += sizeof(s->plain_hash);
+  if (s->hash_cipher) {
+    memcpy(p, &mark->cipher_hash, sizeof(mark->cipher_hash));
+  } else {
+    memset(p, 0, sizeof(mark->cipher_hash));
+  }
+
+  unsigned char file[CRYPTO_CHECKPOINT_FILE_LEN];
+  memcpy(file, CRYPTO_CHECKPOINT_MAGIC, CRYPTO_MAGIC_LEN);
+  file[CRYPTO_MAGIC_LEN] = CRYPTO_CHECKPOINT_VERSION;
+  file[CRYPTO_MAGIC_LEN + 1] = (unsigned char)s->op;
+  unsigned char *nonce = file + CRYPTO_CHECKPOINT_PREFIX_LEN;
+  randombytes_buf(nonce, crypto_aead_xchacha20poly1305_ietf_NPUBBYTES);
+  unsigned char ad[CRYPTO_CHECKPOINT_PREFIX_LEN + CRYPTO_HEAD_MAX];
+  size_t ad_len = crypto_checkpoint_ad(s, file, ad);
+  crypto_aead_xchacha20poly1305_ietf_encrypt(
+      nonce + crypto_aead_xchacha20poly1305_ietf_NPUBBYTES, NULL, body,
+      sizeof(body), ad, ad_len, NULL, nonce, s->checkpoint_key);
+  sodium_memzero(body, sizeof(body));
+
+  char tmp_path[PATH_MAX + 8];
+  snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", s->checkpoint_path);
+  int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+  if (fd < 0) {
+    return;
+  }
+  int ok = write(fd, file, sizeof(file)) == (ssize_t)sizeof(file) &&
+           fsync(fd) == 0;
+  if (close(fd) != 0 || !ok || rename(tmp_path, s->checkpoint_path) != 0) {
+    unlink(tmp_path);
+  }
+}
+
+// opens the checkpoint file, restores s->state and s->records from it and
+// checks that the source is the one it was written for
+static int crypto_checkpoint_load(CryptoStream *s, long long *record_offset,
+                                  long long *plain_pos) {
+  unsigned char file[CRYPTO_CHECKPOINT_FILE_LEN];
+  FILE *checkpoint = fopen(s->checkpoint_path, "rb");
+  if (!checkpoint) {
+    return CRYPTO_ERROR_RESUME; // nothing to resume from
+  }
+  size_t got = fread(file, 1, sizeof(file), checkpoint);
+  fclose(checkpoint);
+  if (got != sizeof(file) ||
+      memcmp(file, CRYPTO_CHECKPOINT_MAGIC, CRYPTO_MAGIC_LEN) != 0 ||
+      file[CRYPTO_MAGIC_LEN] != CRYPTO_CHECKPOINT_VERSION ||
+      file[CRYPTO_MAGIC_LEN + 1] != s->op) {
+    return CRYPTO_ERROR_RESUME;
+  }
+
+  unsigned char body[CRYPTO_CHECKPOINT_BODY_LEN];
+  const unsigned char *nonce = file + CRYPTO_CHECKPOINT_PREFIX_LEN;
+  unsigned char ad[CRYPTO_CHECKPOINT_PREFIX_LEN + CRYPTO_HEAD_MAX];
+  size_t ad_len = crypto_checkpoint_ad(s, file, ad);
+  if (crypto_aead_xchacha20poly1305_ietf_decrypt(
+          body, NULL, NULL,
+          nonce + crypto_aead_xchacha20poly1305_ietf_NPUBBYTES,
+          sizeof(file) - CRYPTO_CHECKPOINT_PREFIX_LEN -
+              crypto_aead_xchacha20poly1305_ietf_NPUBBYTES,
+          ad, ad_len, nonce, s->checkpoint_key) != 0) {
+    return CRYPTO_ERROR_RESUME; // another password or another file
+  }
+
+  int status = CRYPTO_SUCCESS;
+  if ((long long)crypto_load_le(body + 24, 8) != s->src_size ||
+      (long long)crypto_load_le(body + 32, 8) != s->src_mtime_ns) {
+    status = CRYPTO_ERROR_RESUME; // the source changed since
+  } else {
+    *record_offset = (long long)crypto_load_le(body, 8);
+    *plain_pos = (long long)crypto_load_le(body + 8, 8);
+    s->records = (long long)crypto_load_le(body + 16, 8);
+    // carry on with the digests the interrupted run was taking
+    unsigned long long digests = crypto_load_le(body + 40, 8);
+    s->hash_plain = (digests & 1) != 0;
+    s->hash_cipher = (digests & 2) != 0;
+    const unsigned char *p = body + 48;
+    memcpy(&s->state, p, sizeof(s->state));
+    p += sizeof(s->state);
+    memcpy(&s->plain_hash, p, sizeof(s->plain_hash));
+    p += sizeof(s->plain_hash);
+    memcpy(&s->cipher_hash, p, sizeof(s->cipher_hash));
+  }
+  sodium_memzero(body, sizeof(body));
+  return status;
+}
 
-  unsigned char salt[crypto_pwhash_SALTBYTES];
-  if (fread(salt, 1, sizeof(salt), src_file) != sizeof(salt)) {
-    fclose(src_file);
-    fclose(dest_file);
-    return CRYPTO_ERROR_DEC; // incomplete salt
+// checks a CHECKPOINT record: it must name the current plaintext offset and
+// the number of records before it
+static int crypto_checkpoint_matches(const unsigned char *record, size_t len,
+                                     long long pos, long long records) {
+  return len == 1 + 16 && record[0] == CRYPTO_RECORD_CHECKPOINT &&
+         (long long)crypto_load_le(record + 1, 8) == pos &&
+         (long long)crypto_load_le(record + 9, 8) == records;
+}
+
+// reads what follows the version 2 preamble in s->head, up to and
+// including the stream header
+static int crypto_read_head(CryptoStream *s, CryptoReader *reader) {
+  unsigned char *rest_at = s->head + CRYPTO_PREAMBLE_LEN;
+  s->key_mode = s->head[CRYPTO_MAGIC_LEN + 1];
+  if (s->key_mode == CRYPTO_KEY_RECIPIENT) {
+    if (crypto_reader_read(reader, rest_at, 1) != 1) {
+      return CRYPTO_ERROR_DEC;
+    }
+    rest_at++; // the recipient count, which the length depends on
   }
+  size_t material = crypto_key_material_len(s->head);
+  if (s->head[CRYPTO_MAGIC_LEN] != CRYPTO_VERSION || material == 0) {
+    return CRYPTO_ERROR_DEC; // unknown version or key mode
+  }
+  s->head_len = CRYPTO_PREAMBLE_LEN + material +
+                crypto_secretstream_xchacha20poly1305_HEADERBYTES;
+  size_t rest = (size_t)(s->head + s->head_len - rest_at);
+  if (crypto_reader_read(reader, rest_at, rest) != rest) {
+    return CRYPTO_ERROR_DEC; // incomplete head
+  }
+  return CRYPTO_SUCCESS;
+}
 
+// reads the head of the encrypted file 'enc', derives the keys, then
+// restores the stream from the checkpoint file and pulls the CHECKPOINT
+// record it points at. that record decrypting with the restored state, and
+// naming the same position, proves the output up to it is the one the
+// checkpoint was written for. 'enc' is left just after the record
+static int crypto_stream_resume(CryptoStream *s, CryptoReader *enc,
+                                const char *password, long long *plain_pos) {
+  if (!s->checkpoint_path[0] ||
+      crypto_reader_read(enc, s->head, CRYPTO_PREAMBLE_LEN) !=
+          CRYPTO_PREAMBLE_LEN ||
+      memcmp(s->head, CRYPTO_MAGIC, CRYPTO_MAGIC_LEN) != 0 ||
+      crypto_read_head(s, enc) != CRYPTO_SUCCESS) {
+    return CRYPTO_ERROR_RESUME;
+  }
   unsigned char key[crypto_secretstream_xchacha20poly1305_KEYBYTES];
-  if (crypto_derive_key(key, sizeof(key), password, salt) != 0) {
-    fclose(dest_file);
-    fclose(src_file);
-    return CRYPTO_ERROR_DEC; // unable to derive key
+  int kdf_status = crypto_stream_derive_key(s, key, password);
+  sodium_memzero(key, sizeof(key));
+  if (kdf_status != 0) {
+    return CRYPTO_ERROR_RESUME;
+  }
+
+  long long record_offset;
+  int status = crypto_checkpoint_load(s, &record_offset, plain_pos);
+  if (status != CRYPTO_SUCCESS) {
+    return status;
+  }
+  unsigned char record[CRYPTO_RECORD_MAX];
+  size_t len;
+  unsigned char tag;
+  long long records = s->records;
+  if (crypto_reader_seek(enc, record_offset) != CRYPTO_SUCCESS ||
+      crypto_pull_record(s, enc, record, &len, &tag) != CRYPTO_SUCCESS ||
+      !crypto_checkpoint_matches(record, len, *plain_pos, records)) {
+    status = CRYPTO_ERROR_RESUME;
   }
+  sodium_memzero(record, sizeof(record));
+  s->checkpoint_last = *plain_pos;
+  return status;
+}
 
-  unsigned char header[crypto_secretstream_xchacha20poly1305_HEADERBYTES];
-  if (fread(header, 1, sizeof(header), src_file) != sizeof(header)) {
-    fclose(src_file);
-    fclose(dest_file);
-    return CRYPTO_ERROR_DEC; // incomplete header
+static int crypto_push_hole(CryptoStream *s, long long len) {
+  unsigned char record[1 + 8];
+  record[0] = CRYPTO_RECORD_HOLE;
+  crypto_store_le(record + 1, (unsigned long long)len, 8);
+  return crypto_push_record(s, record, sizeof(record), 0);
+}
+
+// writes a CHECKPOINT record, waits for the output to reach the disk and
+// only then records the checkpoint, so it never points past durable data
+static int crypto_push_checkpoint(CryptoStream *s, long long pos) {
+  CryptoMark mark;
+  crypto_stream_mark(s, &mark, crypto_writer_tell(&s->writer));
+  unsigned char record[1 + 16];
+  record[0] = CRYPTO_RECORD_CHECKPOINT;
+  crypto_store_le(record + 1, (unsigned long long)pos, 8);
+  crypto_store_le(record + 9, (unsigned long long)mark.records, 8);
+  int status = crypto_push_record(s, record, sizeof(record), 0);
+  if (status == CRYPTO_SUCCESS &&
+      crypto_writer_sync(&s->writer) != CRYPTO_SUCCESS) {
+    status = CRYPTO_ERROR_ENC;
+  }
+  if (status == CRYPTO_SUCCESS) {
+    crypto_checkpoint_save(s, &mark, pos);
   }
+  sodium_memzero(&mark, sizeof(mark));
+  s->checkpoint_last = pos;
+  return status;
+}
+
+// conversions in place overwrite the file they read. encryption first moves
+// the plaintext further into the file, by more than the whole stream can
+// grow, then writes the stream from the start of the file, always behind
+// what is left to read. decryption writes the plaintext over the ciphertext
+// it has read; only a hole can outrun it, and the ciphertext left is then
+// moved out of its way the same way. the journal next to the file says where
+// to resume: each commit makes the output durable and saves the stream state
+// together with whatever input the writes up to the next commit, a window
+// ahead, may land on. a crash then resumes from the last commit. the window
+// bounds both the space the conversion takes beyond the file and the journal
+#define CRYPTO_JOURNAL_SUFFIX ".journal"
+#define CRYPTO_SNAPSHOT_SUFFIX ".snapshot"
+#define CRYPTO_JOURNAL_MAGIC "FCJRNL"
+#define CRYPTO_JOURNAL_VERSION 2
+#define CRYPTO_JOURNAL_FIELDS 13
+#define CRYPTO_JOURNAL_FIXED_LEN                                               \
+  (CRYPTO_JOURNAL_FIELDS * 8 +                                                 \
+   sizeof(crypto_secretstream_xchacha20poly1305_state) +                       \
+   sizeof(crypto_generichash_state))
+#define CRYPTO_JOURNAL_WINDOW_MIN (64LL << 10)
+#define CRYPTO_JOURNAL_WINDOW_MAX (16LL << 20)
 
+// values of CryptoJournal.phase
+#define CRYPTO_JOURNAL_SHIFT 1  // moving [shift_from, shift_end) by the delta
+#define CRYPTO_JOURNAL_STREAM 2 // converting from the resume point
+#define CRYPTO_JOURNAL_FINISH 3 // the stream is whole, cut at final_size
+
+typedef struct CryptoJournal {
+  char path[PATH_MAX];
+  int fd; // the file converted, for shifts and the input a commit saves
+  unsigned char key[crypto_aead_xchacha20poly1305_ietf_KEYBYTES];
+  int phase;
+  long long window;
+  long long limit; // writes stay before this until the next commit
+  // the resume point: the stream just before the record or chunk read at
+  // 'reader_offset', whose plaintext starts at 'pos', with the output
+  // durable up to 'writer_offset'. offsets are in the file; for encryption
+  // the plaintext starts at 'base', where it was moved to
   crypto_secretstream_xchacha20poly1305_state state;
-  if (crypto_secretstream_xchacha20poly1305_init_pull(&state, header, key) !=
-      0) {
-    fclose(src_file);
-    fclose(dest_file);
-    return CRYPTO_ERROR_DEC; // corrupted header
+  crypto_generichash_state plain_hash;
+  long long records;
+  long long base;
+  long long reader_offset;
+  long long pos;
+  long long writer_offset;
+  long long shift_from;
+  long long shift_end; // [shift_from, shift_end) is still to move
+  long long shift_delta;
+  long long final_size;
+  unsigned char *saved; // input from 'reader_offset' on, 'window' bytes
+  long long saved_len;
+} CryptoJournal;
+
+static int crypto_pread_all(int fd, unsigned char *data, long long len,
+                            long long offset) {
+  while (len > 0) {
+    ssize_t got = pread(fd, data, (size_t)len, offset);
+    if (got < 0 && errno == EINTR) {
+      continue;
+    }
+    if (got <= 0) {
+      return 0;
+    }
+    data += got;
+    len -= got;
+    offset += got;
+  }
+  return 1;
+}
+
+static int crypto_pwrite_all(int fd, const unsigned char *data, long long len,
+                             long long offset) {
+  while (len > 0) {
+    ssize_t put = pwrite(fd, data, (size_t)len, offset);
+    if (put < 0 && errno == EINTR) {
+      continue;
+    }
+    if (put <= 0) {
+      return 0;
+    }
+    data += put;
+    len -= put;
+    offset += put;
+  }
+  return 1;
+}
+
+static void crypto_journal_key(CryptoJournal *j, const unsigned char *key) {
+  crypto_kdf_derive_from_key(j->key, sizeof(j->key), 2,
+                             CRYPTO_CHECKPOINT_CONTEXT, key);
+}
+
+// the journal starts with the magic, its version, the operation and the
+// head of the encrypted file in the clear, so resuming can derive the key;
+// they are the associated data of the sealed rest. returns their length
+static size_t crypto_journal_prefix(CryptoStream *s, unsigned char *out) {
+  memcpy(out, CRYPTO_JOURNAL_MAGIC, CRYPTO_MAGIC_LEN);
+  out[CRYPTO_MAGIC_LEN] = CRYPTO_JOURNAL_VERSION;
+  out[CRYPTO_MAGIC_LEN + 1] = (unsigned char)s->op;
+  crypto_store_le(out + CRYPTO_CHECKPOINT_PREFIX_LEN, s->head_len, 2);
+  memcpy(out + CRYPTO_CHECKPOINT_PREFIX_LEN + 2, s->head, s->head_len);
+  return CRYPTO_CHECKPOINT_PREFIX_LEN + 2 + s->head_len;
+}
+
+// replaces the journal atomically. unlike a checkpoint, the conversion
+// cannot go on without it
+static int crypto_journal_save(CryptoStream *s) {
+  CryptoJournal *j = s->journal;
+  size_t body_len = CRYPTO_JOURNAL_FIXED_LEN + (size_t)j->saved_len;
+  size_t file_len = CRYPTO_CHECKPOINT_PREFIX_LEN + 2 + CRYPTO_HEAD_MAX +
+                    crypto_aead_xchacha20poly1305_ietf_NPUBBYTES + body_len +
+                    crypto_aead_xchacha20poly1305_ietf_ABYTES;
+  unsigned char *body = malloc(body_len);
+  unsigned char *file = malloc(file_len);
+  int status = s->op == CRYPTO_OP_ENCRYPT ? CRYPTO_ERROR_ENC : CRYPTO_ERROR_DEC;
+  if (body && file) {
+    const long long fields[CRYPTO_JOURNAL_FIELDS] = {
+        j->phase,      j->window,        j->base,        j->reader_offset,
+        j->pos,        j->writer_offset, j->records,     j->shift_from,
+        j->shift_end,  j->shift_delta,   j->final_size,  j->saved_len,
+        s->hash_plain};
+    for (int i = 0; i < CRYPTO_JOURNAL_FIELDS; i++) {
+      crypto_store_le(body + 8 * i, (unsigned long long)fields[i], 8);
+    }
+    unsigned char *p = body + CRYPTO_JOURNAL_FIELDS * 8;
+    memcpy(p, &j->state, sizeof(j->state));
+    p += sizeof(j->state);
+    memcpy(p, &j->plain_hash, sizeof(j->plain_hash));
+    p += sizeof(j->plain_hash);
+    memcpy(p, j->saved, (size_t)j->saved_len);
+
+    size_t ad_len = crypto_journal_prefix(s, file);
+    unsigned char *nonce = file + ad_len;
+    randombytes_buf(nonce, crypto_aead_xchacha20poly1305_ietf_NPUBBYTES);
+    unsigned long long cipher_len;
+    crypto_aead_xchacha20poly1305_ietf_encrypt(
+        nonce + crypto_aead_xchacha20poly1305_ietf_NPUBBYTES, &cipher_len,
+        body, body_len, file, ad_len, NULL, nonce, j->key);
+    file_len = ad_len + crypto_aead_xchacha20poly1305_ietf_NPUBBYTES +
+               (size_t)cipher_len;
+
+    char tmp_path[PATH_MAX + 8];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", j->path);
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd >= 0) {
+      int ok = crypto_pwrite_all(fd, file, (long long)file_len, 0) &&
+               fsync(fd) == 0;
+      if (close(fd) == 0 && ok && rename(tmp_path, j->path) == 0) {
+        status = CRYPTO_SUCCESS;
+      } else {
+        unlink(tmp_path);
+      }
+    }
+  }
+  if (body) {
+    sodium_memzero(body, body_len);
+  }
+  free(body);
+  free(file);
+  return status;
+}
+
+// reads the journal: the head goes to s->head, the key is derived from it
+// and the rest is unsealed into the journal
+static int crypto_journal_load(CryptoStream *s, const char *password) {
+  CryptoJournal *j = s->journal;
+  const size_t ad_max = CRYPTO_CHECKPOINT_PREFIX_LEN + 2 + CRYPTO_HEAD_MAX;
+  const size_t seal_len = crypto_aead_xchacha20poly1305_ietf_NPUBBYTES +
+                          crypto_aead_xchacha20poly1305_ietf_ABYTES;
+  int fd = open(j->path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return CRYPTO_ERROR_RESUME; // nothing to resume
+  }
+  struct stat st;
+  unsigned char *file = NULL;
+  size_t file_len = 0;
+  if (fstat(fd, &st) == 0 &&
+      st.st_size <= (off_t)(ad_max + seal_len + CRYPTO_JOURNAL_FIXED_LEN +
+                            CRYPTO_JOURNAL_WINDOW_MAX)) {
+    file_len = (size_t)st.st_size;
+    file = malloc(file_len ? file_len : 1);
+  }
+  int ok = file && crypto_pread_all(fd, file, (long long)file_len, 0);
+  close(fd);
+  size_t head_len =
+      ok && file_len > CRYPTO_CHECKPOINT_PREFIX_LEN + 2
+          ? (size_t)crypto_load_le(file + CRYPTO_CHECKPOINT_PREFIX_LEN, 2)
+          : 0;
+  size_t ad_len = CRYPTO_CHECKPOINT_PREFIX_LEN + 2 + head_len;
+  if (!ok || head_len < CRYPTO_PREAMBLE_LEN || head_len > CRYPTO_HEAD_MAX ||
+      file_len < ad_len + seal_len + CRYPTO_JOURNAL_FIXED_LEN ||
+      memcmp(file, CRYPTO_JOURNAL_MAGIC, CRYPTO_MAGIC_LEN) != 0 ||
+      file[CRYPTO_MAGIC_LEN] != CRYPTO_JOURNAL_VERSION ||
+      file[CRYPTO_MAGIC_LEN + 1] != s->op) {
+    free(file);
+    return CRYPTO_ERROR_RESUME;
+  }
+
+  memcpy(s->head, file + ad_len - head_len, head_len);
+  s->head_len = head_len;
+  s->key_mode = s->head[CRYPTO_MAGIC_LEN + 1];
+  size_t material = crypto_key_material_len(s->head);
+  unsigned char key[crypto_secretstream_xchacha20poly1305_KEYBYTES];
+  if (memcmp(s->head, CRYPTO_MAGIC, CRYPTO_MAGIC_LEN) != 0 || material == 0 ||
+      head_len != CRYPTO_PREAMBLE_LEN + material +
+                      crypto_secretstream_xchacha20poly1305_HEADERBYTES ||
+      crypto_stream_derive_key(s, key, password) != 0) {
+    free(file);
+    return CRYPTO_ERROR_RESUME;
+  }
+  crypto_journal_key(j, key);
+  sodium_memzero(key, sizeof(key));
+
+  size_t body_len = file_len - ad_len - seal_len;
+  unsigned char *body = malloc(body_len);
+  const unsigned char *nonce = file + ad_len;
+  int status = CRYPTO_ERROR_RESUME;
+  if (body &&
+      crypto_aead_xchacha20poly1305_ietf_decrypt(
+          body, NULL, NULL,
+          nonce + crypto_aead_xchacha20poly1305_ietf_NPUBBYTES,
+          file_len - ad_len - crypto_aead_xchacha20poly1305_ietf_NPUBBYTES,
+          file, ad_len, nonce, j->key) == 0) {
+    long long fields[CRYPTO_JOURNAL_FIELDS];
+    for (int i = 0; i < CRYPTO_JOURNAL_FIELDS; i++) {
+      fields[i] = (long long)crypto_load_le(body + 8 * i, 8);
+    }
+    j->phase = (int)fields[0];
+    j->window = fields[1];
+    j->base = fields[2];
+    j->reader_offset = fields[3];
+    j->pos = fields[4];
+    j->writer_offset = fields[5];
+    j->records = fields[6];
+    j->shift_from = fields[7];
+    j->shift_end = fields[8];
+    j->shift_delta = fields[9];
+    j->final_size = fields[10];
+    j->saved_len = fields[11];
+    s->hash_plain = fields[12] != 0;
+    if (j->window >= CRYPTO_JOURNAL_WINDOW_MIN &&
+        j->window <= CRYPTO_JOURNAL_WINDOW_MAX && j->saved_len >= 0 &&
+        j->saved_len <= j->window &&
+        body_len == CRYPTO_JOURNAL_FIXED_LEN + (size_t)j->saved_len &&
+        (j->saved = malloc((size_t)j->window))) {
+      const unsigned char *p = body + CRYPTO_JOURNAL_FIELDS * 8;
+      memcpy(&j->state, p, sizeof(j->state));
+      p += sizeof(j->state);
+      memcpy(&j->plain_hash, p, sizeof(j->plain_hash));
+      p += sizeof(j->plain_hash);
+      memcpy(j->saved, p, (size_t)j->saved_len);
+      status = CRYPTO_SUCCESS;
+    }
+  }
+  if (body) {
+    sodium_memzero(body, body_len);
+  }
+  free(body);
+  free(file);
+  return status;
+}
+
+// sets the resume point to the stream as 'mark' has it
+static void crypto_journal_mark(CryptoStream *s, const CryptoMark *mark,
+                                long long reader_offset, long long pos) {
+  CryptoJournal *j = s->journal;
+  j->state = mark->state;
+  j->records = mark->records;
+  j->plain_hash = s->plain_hash;
+  j->reader_offset = reader_offset;
+  j->pos = pos;
+}
+
+// makes the output durable and saves the journal at its resume point.
+// 'end' is where the write that called for the commit ends: the window
+// reaches at least that far, and the input it covers is saved
+static int crypto_journal_commit(CryptoStream *s, int phase, long long end) {
+  CryptoJournal *j = s->journal;
+  if (s->writer.fd >= 0) {
+    if (crypto_writer_sync(&s->writer) != CRYPTO_SUCCESS) {
+      return s->op == CRYPTO_OP_ENCRYPT ? CRYPTO_ERROR_ENC : CRYPTO_ERROR_DEC;
+    }
+    j->writer_offset = crypto_writer_tell(&s->writer);
+  }
+  j->phase = phase;
+  j->limit = j->writer_offset + j->window;
+  if (end > j->limit) {
+    j->limit = end;
+  }
+  j->saved_len = 0;
+  struct stat st;
+  if (phase == CRYPTO_JOURNAL_STREAM && fstat(j->fd, &st) == 0) {
+    long long saved_end = j->limit < st.st_size ? j->limit : st.st_size;
+    if (saved_end > j->reader_offset) {
+      j->saved_len = saved_end - j->reader_offset;
+      if (!crypto_pread_all(j->fd, j->saved, j->saved_len,
+                            j->reader_offset)) {
+        return CRYPTO_ERROR_FILE;
+      }
+    }
+  }
+  return crypto_journal_save(s);
+}
+
+// moves [shift_from, shift_end) shift_delta bytes further into the file,
+// from the top down, in steps no longer than the delta. a step only writes
+// over bytes an earlier one moved already, so one cut short by a crash is
+// simply done again: the journal is saved after each
+static int crypto_journal_shift(CryptoStream *s) {
+  CryptoJournal *j = s->journal;
+  int error = s->op == CRYPTO_OP_ENCRYPT ? CRYPTO_ERROR_ENC : CRYPTO_ERROR_DEC;
+  unsigned char *buffer = malloc(CRYPTO_IO_BUFFER_SIZE);
+  if (!buffer) {
+    return CRYPTO_ERROR_MEM;
+  }
+  int status = CRYPTO_SUCCESS;
+  while (status == CRYPTO_SUCCESS && j->shift_end > j->shift_from) {
+    long long low = j->shift_end - j->shift_delta;
+    if (low < j->shift_from) {
+      low = j->shift_from;
+    }
+    for (long long high = j->shift_end; high > low;) {
+      if (crypto_cancelled(s->opts)) {
+        status = CRYPTO_ERROR_CANCELLED;
+        break;
+      }
+      long long n = high - low < CRYPTO_IO_BUFFER_SIZE ? high - low
+                                                       : CRYPTO_IO_BUFFER_SIZE;
+      high -= n;
+      if (!crypto_pread_all(j->fd, buffer, n, high) ||
+          !crypto_pwrite_all(j->fd, buffer, n, high + j->shift_delta)) {
+        status = error;
+        break;
+      }
+    }
+    if (status == CRYPTO_SUCCESS && fdatasync(j->fd) != 0) {
+      status = error;
+    }
+    if (status == CRYPTO_SUCCESS) {
+      j->shift_end = low;
+      status = crypto_journal_save(s);
+    }
+  }
+  sodium_memzero(buffer, CRYPTO_IO_BUFFER_SIZE);
+  free(buffer);
+  if (status == CRYPTO_SUCCESS) {
+    status = crypto_journal_commit(s, CRYPTO_JOURNAL_STREAM, j->limit);
+  }
+  return status;
+}
+
+// keeps the writes within the window: before one would end past it at
+// 'end', commits the stream as it was before the record being handled
+// ('mark', NULL for the current state; its plaintext starts at 'pos'). a
+// hole may need more room than the ciphertext read so far leaves; the
+// ciphertext from its record on is then moved out of the way first
+static int crypto_journal_reserve(CryptoStream *s, const CryptoMark *mark,
+                                  long long pos, long long end) {
+  CryptoJournal *j = s->journal;
+  if (end <= j->limit) {
+    return CRYPTO_SUCCESS;
+  }
+  long long unread = s->reader.base + crypto_reader_tell(&s->reader);
+  CryptoMark current;
+  if (!mark) {
+    crypto_stream_mark(s, &current, unread);
+    mark = &current;
+  }
+  int status;
+  struct stat st;
+  if (s->op == CRYPTO_OP_DECRYPT && end > unread) {
+    if (fstat(j->fd, &st) != 0) {
+      return CRYPTO_ERROR_DEC;
+    }
+    long long delta = end - unread + j->window;
+    crypto_journal_mark(s, mark, mark->record_offset + delta, pos);
+    j->shift_from = mark->record_offset;
+    j->shift_end = st.st_size;
+    j->shift_delta = delta;
+    status = crypto_journal_commit(s, CRYPTO_JOURNAL_SHIFT, end);
+    if (status == CRYPTO_SUCCESS) {
+      status = crypto_journal_shift(s);
+    }
+    if (status == CRYPTO_SUCCESS &&
+        crypto_reader_seek(&s->reader, unread + delta) != CRYPTO_SUCCESS) {
+      status = CRYPTO_ERROR_DEC;
+    }
+  } else {
+    crypto_journal_mark(s, mark, mark->record_offset, pos);
+    status = crypto_journal_commit(s, CRYPTO_JOURNAL_STREAM, end);
   }
+  sodium_memzero(&current, sizeof(current));
+  return status;
+}
+
+// in place, the next record has to fit in the journal's window
+static int crypto_encrypt_reserve(CryptoStream *s, long long pos) {
+  if (!s->journal) {
+    return CRYPTO_SUCCESS;
+  }
+  return crypto_journal_reserve(s, NULL, pos,
+                                crypto_writer_tell(&s->writer) + 4 +
+                                    CRYPTO_RECORD_CIPHER_MAX);
+}
+
+// walks the source extent by extent from 'pos': allocated ranges become
+// DATA records, holes a single HOLE record each, so a sparse file costs
+// what its data costs. data that runs to the end of the file is read until
+// EOF, the way a plain stream would be
+static int crypto_encrypt_records(CryptoStream *s, long long pos) {
+  unsigned char record[CRYPTO_RECORD_MAX];
+  unsigned int chunks = 0;
+  int status = CRYPTO_SUCCESS;
+  int eof = 0;
+  crypto_progress_update(s->opts, CRYPTO_PHASE_STREAM, pos);
+  while (!eof && status == CRYPTO_SUCCESS) {
+    long long data, hole;
+    crypto_reader_next_data(&s->reader, &data, &hole);
+    if (data > pos) {
+      status = crypto_encrypt_reserve(s, pos);
+      if (status == CRYPTO_SUCCESS) {
+        status = crypto_push_hole(s, data - pos);
+      }
+      if (status != CRYPTO_SUCCESS) {
+        break;
+      }
+      if (s->hash_plain) {
+        crypto_hash_zeros(&s->plain_hash, data - pos);
+      }
+      if (crypto_reader_seek(&s->reader, data) != CRYPTO_SUCCESS) {
+        status = CRYPTO_ERROR_ENC; // unable to skip the hole
+        break;
+      }
+      pos = data;
+      crypto_progress_update(s->opts, CRYPTO_PHASE_STREAM, pos);
+    }
+    if (data == hole) {
+      break; // the file ends in that hole
+    }
+    long long size = crypto_reader_size(&s->reader);
+    long long end = hole >= size ? LLONG_MAX : hole;
 
+    while (pos < end) {
+      if (crypto_cancelled(s->opts)) {
+        status = CRYPTO_ERROR_CANCELLED;
+        break;
+      }
+      if (s->checkpoint_every &&
+          pos - s->checkpoint_last >= s->checkpoint_every) {
+        status = crypto_push_checkpoint(s, pos);
+        if (status != CRYPTO_SUCCESS) {
+          break;
+        }
+      }
+      status = crypto_encrypt_reserve(s, pos);
+      if (status != CRYPTO_SUCCESS) {
+        break;
+      }
+      size_t want = CHUNK_SIZE;
+      if (end - pos < (long long)want) {
+        want = (size_t)(end - pos);
+      }
+      size_t bytes_read = crypto_reader_read(&s->reader, record + 1, want);
+      if (s->reader.error) {
+        status = CRYPTO_ERROR_ENC; // unable to read the source
+        break;
+      }
+      if (bytes_read > 0) {
+        record[0] = CRYPTO_RECORD_DATA;
+        status = crypto_push_record(s, record, 1 + bytes_read, 0);
+        if (status != CRYPTO_SUCCESS) {
+          break;
+        }
+        if (s->hash_plain) {
+          crypto_generichash_update(&s->plain_hash, record + 1, bytes_read);
+        }
+        if (s->stats) {
+          s->stats->bytes_read += bytes_read;
+        }
+        pos += bytes_read;
+      }
+      if (bytes_read < want) {
+        eof = 1; // the file ended early or was truncated while we read it
+        break;
+      }
+      if (++chunks % CRYPTO_PROGRESS_CHUNKS == 0) {
+        crypto_progress_update(s->opts, CRYPTO_PHASE_STREAM, pos);
+      }
+    }
+  }
+
+  if (status == CRYPTO_SUCCESS) {
+    status = crypto_encrypt_reserve(s, pos);
+  }
+  if (status == CRYPTO_SUCCESS) {
+    record[0] = CRYPTO_RECORD_END;
+    crypto_store_le(record + 1, (unsigned long long)pos, 8);
+    size_t len = 1 + 8;
+    if (s->hash_plain) {
+      crypto_finish_plain_digest(s);
+      memcpy(record + len, s->plain_digest, CRYPTO_DIGEST_BYTES);
+      len += CRYPTO_DIGEST_BYTES;
+    }
+    status = crypto_push_record(
+        s, record, len, crypto_secretstream_xchacha20poly1305_TAG_FINAL);
+  }
+  sodium_memzero(record, sizeof(record));
+  return status;
+}
+
+// picks the output up after its last checkpoint
+static int crypto_encrypt_resume(CryptoStream *s, const char *password,
+                                 long long *pos) {
+  CryptoReader enc;
+  if (!s->checkpoint_path[0] ||
+      crypto_reader_open(&enc, s->dest, CRYPTO_IO_CACHED) != CRYPTO_SUCCESS) {
+    return CRYPTO_ERROR_RESUME; // no partial output left
+  }
+  int status = crypto_stream_resume(s, &enc, password, pos);
+  long long resume_at = crypto_reader_tell(&enc);
+  crypto_reader_close(&enc);
+  if (status != CRYPTO_SUCCESS) {
+    return status;
+  }
+  status = crypto_stream_open_dest(s, resume_at);
+  if (status == CRYPTO_SUCCESS &&
+      crypto_reader_seek(&s->reader, *pos) != CRYPTO_SUCCESS) {
+    status = CRYPTO_ERROR_ENC;
+  }
+  return status;
+}
+
+// fills in a fresh head: password salt, master key salt and file nonce, or
+// a new file key sealed to each recipient
+static void crypto_stream_new_head(CryptoStream *s) {
+  const CryptoOptions *opts = s->opts;
+  unsigned char *salt = s->head + CRYPTO_PREAMBLE_LEN;
+  s->key_mode = opts && opts->recipient_count > 0 ? CRYPTO_KEY_RECIPIENT
+                : opts && opts->master_key        ? CRYPTO_KEY_MASTER
+                                                  : CRYPTO_KEY_PASSWORD;
+  memcpy(s->head, CRYPTO_MAGIC, CRYPTO_MAGIC_LEN);
+  s->head[CRYPTO_MAGIC_LEN] = CRYPTO_VERSION;
+  s->head[CRYPTO_MAGIC_LEN + 1] = (unsigned char)s->key_mode;
+  if (s->key_mode == CRYPTO_KEY_RECIPIENT) {
+    salt[0] = (unsigned char)opts->recipient_count;
+    randombytes_buf(s->file_key, sizeof(s->file_key));
+    s->file_key_set = 1;
+    for (int i = 0; i < opts->recipient_count; i++) {
+      crypto_box_seal(salt + 1 + i * CRYPTO_SEALED_KEY_BYTES, s->file_key,
+                      sizeof(s->file_key),
+                      opts->recipients + i * crypto_box_PUBLICKEYBYTES);
+    }
+  } else if (s->key_mode == CRYPTO_KEY_MASTER) {
+    memcpy(salt, opts->master_salt, crypto_pwhash_SALTBYTES);
+    randombytes_buf(salt + crypto_pwhash_SALTBYTES, CRYPTO_FILE_NONCE_BYTES);
+  } else {
+    randombytes_buf(salt, crypto_pwhash_SALTBYTES);
+  }
+  s->head_len = CRYPTO_PREAMBLE_LEN + crypto_key_material_len(s->head) +
+                crypto_secretstream_xchacha20poly1305_HEADERBYTES;
+}
+
+static int crypto_encrypt_stream(const CryptoFiles *files,
+                                 const char *password,
+                                 const CryptoOptions *opts,
+                                 StatsCrypto *stats) {
+  CryptoStream s;
+  int status = crypto_stream_open(&s, CRYPTO_OP_ENCRYPT, files, opts, stats);
+  if (status != CRYPTO_SUCCESS) {
+    return status;
+  }
+
+  long long pos = 0;
+  if (opts && opts->resume) {
+    status = crypto_encrypt_resume(&s, password, &pos);
+    if (status != CRYPTO_SUCCESS) {
+      return crypto_stream_close(&s, status, status, 0);
+    }
+  } else {
+    if (s.checkpoint_path[0]) {
+      unlink(s.checkpoint_path); // left over from an earlier attempt
+    }
+    status = crypto_stream_open_dest(&s, 0);
+    if (status != CRYPTO_SUCCESS) {
+      return crypto_stream_close(&s, status, status, 0);
+    }
+
+    crypto_stream_new_head(&s);
+    unsigned char key[crypto_secretstream_xchacha20poly1305_KEYBYTES];
+    if (crypto_stream_derive_key(&s, key, password) != 0) {
+      return crypto_stream_close(&s, CRYPTO_ERROR_ENC, CRYPTO_ERROR_ENC, 0);
+    }
+    crypto_secretstream_xchacha20poly1305_init_push(
+        &s.state, s.head + s.head_len -
+                      crypto_secretstream_xchacha20poly1305_HEADERBYTES,
+        key);
+    sodium_memzero(key, sizeof(key));
+    crypto_writer_write(&s.writer, s.head, s.head_len);
+    if (s.hash_cipher) {
+      crypto_generichash_update(&s.cipher_hash, s.head, s.head_len);
+    }
+    if (stats) {
+      stats->bytes_written = (long long)s.head_len;
+    }
+  }
+
+  status = crypto_encrypt_records(&s, pos);
+  return crypto_stream_close(&s, status, CRYPTO_ERROR_ENC,
+                             crypto_reader_tell(&s.reader));
+}
+
+int crypto_decrypt_file(const char *src, const char *dest,
+                        const char *password) {
+  return crypto_decrypt_file_ex(src, dest, password, NULL);
+}
+
+// decrypts records from the reader's position on, 'pos' being the plaintext
+// offset there. CHECKPOINT records, once checked, make the output durable
+// and record a checkpoint of the decryption
+static int crypto_decrypt_records(CryptoStream *s, long long pos) {
+  unsigned char record[CRYPTO_RECORD_MAX];
+  CryptoMark mark;
+  unsigned int chunks = 0;
+  int status = CRYPTO_SUCCESS;
+  crypto_progress_update(s->opts, CRYPTO_PHASE_STREAM,
+                         crypto_reader_tell(&s->reader));
+  for (;;) {
+    if (crypto_cancelled(s->opts)) {
+      status = CRYPTO_ERROR_CANCELLED;
+      break;
+    }
+    long long records = s->records;
+    if (s->checkpoint_every || s->journal) {
+      crypto_stream_mark(s, &mark, crypto_reader_tell(&s->reader));
+    }
+    size_t len;
+    unsigned char tag;
+    status = crypto_pull_record(s, &s->reader, record, &len, &tag);
+    if (status != CRYPTO_SUCCESS) {
+      break;
+    }
+    int final = tag == crypto_secretstream_xchacha20poly1305_TAG_FINAL;
+    if (final != (record[0] == CRYPTO_RECORD_END)) {
+      status = CRYPTO_ERROR_DEC; // stream ended early or not at all
+      break;
+    }
+    if (s->journal) {
+      long long end = crypto_writer_tell(&s->writer);
+      if (record[0] == CRYPTO_RECORD_DATA) {
+        end += (long long)len - 1;
+      } else if (record[0] == CRYPTO_RECORD_HOLE && len == 1 + 8 &&
+                 crypto_load_le(record + 1, 8) <=
+                     (unsigned long long)(LLONG_MAX - end)) {
+        end += (long long)crypto_load_le(record + 1, 8);
+      }
+      status = crypto_journal_reserve(s, &mark, pos, end);
+      if (status != CRYPTO_SUCCESS) {
+        break;
+      }
+    }
+
+    if (record[0] == CRYPTO_RECORD_DATA) {
+      if (crypto_writer_write(&s->writer, record + 1, len - 1) !=
+          CRYPTO_SUCCESS) {
+        status = CRYPTO_ERROR_DEC; // unable to write the output
+        break;
+      }
+      if (s->hash_plain) {
+        crypto_generichash_update(&s->plain_hash, record + 1, len - 1);
+      }
+      if (s->stats) {
+        s->stats->bytes_written += len - 1;
+      }
+      pos += len - 1;
+    } else if (record[0] == CRYPTO_RECORD_HOLE && len == 1 + 8) {
+      unsigned long long hole = crypto_load_le(record + 1, 8);
+      if (hole == 0 || hole > (unsigned long long)(LLONG_MAX - pos)) {
+        status = CRYPTO_ERROR_DEC;
+        break;
+      }
+      if (crypto_writer_skip(&s->writer, (long long)hole) != CRYPTO_SUCCESS) {
+        status = CRYPTO_ERROR_DEC; // unable to seek over the hole
+        break;
+      }
+      if (s->hash_plain) {
+        crypto_hash_zeros(&s->plain_hash, (long long)hole);
+      }
+      pos += (long long)hole;
+    } else if (record[0] == CRYPTO_RECORD_CHECKPOINT) {
+      if (!crypto_checkpoint_matches(record, len, pos, records)) {
+        status = CRYPTO_ERROR_DEC; // records were dropped or reordered
+        break;
+      }
+      if (s->checkpoint_every) {
+        if (crypto_writer_sync(&s->writer) != CRYPTO_SUCCESS) {
+          status = CRYPTO_ERROR_DEC;
+          break;
+        }
+        crypto_checkpoint_save(s, &mark, pos);
+      }
+    } else if (record[0] == CRYPTO_RECORD_END &&
+               (len == 1 + 8 || len == 1 + 8 + CRYPTO_DIGEST_BYTES)) {
+      unsigned char extra;
+      if (crypto_load_le(record + 1, 8) != (unsigned long long)pos ||
+          crypto_reader_read(&s->reader, &extra, 1) != 0) {
+        status = CRYPTO_ERROR_DEC; // size mismatch or trailing garbage
+        break;
+      }
+      crypto_finish_plain_digest(s);
+      if (s->hash_plain && len > 1 + 8 &&
+          sodium_memcmp(s->plain_digest, record + 1 + 8,
+                        CRYPTO_DIGEST_BYTES) != 0) {
+        status = CRYPTO_ERROR_DEC; // the plaintext is not what was encrypted
+      }
+      break;
+    } else {
+      status = CRYPTO_ERROR_DEC; // unknown record
+      break;
+    }
+
+    if (++chunks % CRYPTO_PROGRESS_CHUNKS == 0) {
+      crypto_progress_update(s->opts, CRYPTO_PHASE_STREAM,
+                             crypto_reader_tell(&s->reader));
+    }
+  }
+  sodium_memzero(&mark, sizeof(mark));
+  sodium_memzero(record, sizeof(record));
+  return status;
+}
+
+// the format before the preamble: fixed size chunks, the last one (short,
+// possibly empty) tagged FINAL
+static int crypto_decrypt_chunks(CryptoStream *s) {
   unsigned char
       input_buffer[CHUNK_SIZE + crypto_secretstream_xchacha20poly1305_ABYTES];
   unsigned char output_buffer[CHUNK_SIZE];
-
   unsigned long long decrypted_chunk_len;
   size_t bytes_read;
   int eof;
   unsigned char tag;
+  unsigned int chunks = 0;
+  int status = CRYPTO_SUCCESS;
+  crypto_progress_update(s->opts, CRYPTO_PHASE_STREAM,
+                         crypto_reader_tell(&s->reader));
 
   do {
-    bytes_read = fread(input_buffer, 1, sizeof(input_buffer), src_file);
-    eof = feof(src_file);
+    if (crypto_cancelled(s->opts)) {
+      status = CRYPTO_ERROR_CANCELLED;
+      break;
+    }
+    bytes_read =
+        crypto_reader_read(&s->reader, input_buffer, sizeof(input_buffer));
+    eof = bytes_read < sizeof(input_buffer);
+    if (s->reader.error) {
+      status = CRYPTO_ERROR_DEC; // unable to read the source
+      break;
+    }
 
     tag = eof ? crypto_secretstream_xchacha20poly1305_TAG_FINAL : 0;
-    if (crypto_secretstream_xchacha20poly1305_pull(
-            &state, output_buffer, &decrypted_chunk_len, &tag, input_buffer,
-            bytes_read, AAD_STRING, AAD_STRING_LEN) != 0) {
-      fclose(src_file);
-      fclose(dest_file);
-      return CRYPTO_ERROR_DEC; // corrupted chunk
+    long long aead_start = s->stats ? stats_now_ns() : 0;
+    int pull_status = crypto_secretstream_xchacha20poly1305_pull(
+        &s->state, output_buffer, &decrypted_chunk_len, &tag, input_buffer,
+        bytes_read, AAD_STRING, AAD_STRING_LEN);
+    if (s->stats) {
+      s->stats->aead_ns += stats_now_ns() - aead_start;
+    }
+    if (pull_status != 0) {
+      status = CRYPTO_ERROR_DEC; // corrupted chunk
+      break;
     }
 
     if (tag == crypto_secretstream_xchacha20poly1305_TAG_FINAL && !eof) {
-      fclose(src_file);
-      fclose(dest_file);
-      return CRYPTO_ERROR_DEC; // end of stream before the end of the file
+      status = CRYPTO_ERROR_DEC; // end of stream before the end of the file
+      break;
     } else if (tag != crypto_secretstream_xchacha20poly1305_TAG_FINAL && eof) {
-      fclose(src_file);
-      fclose(dest_file);
-      return CRYPTO_ERROR_DEC; // end of file before the end of the stream
+      status = CRYPTO_ERROR_DEC; // end of file before the end of the stream
+      break;
+    }
+
+    if (crypto_writer_write(&s->writer, output_buffer,
+                            (size_t)decrypted_chunk_len) != CRYPTO_SUCCESS) {
+      status = CRYPTO_ERROR_DEC; // unable to write the output
+      break;
+    }
+    if (s->hash_plain) {
+      crypto_generichash_update(&s->plain_hash, output_buffer,
+                                decrypted_chunk_len);
+    }
+    if (s->hash_cipher) {
+      crypto_generichash_update(&s->cipher_hash, input_buffer, bytes_read);
+    }
+    if (s->stats) {
+      s->stats->bytes_read += bytes_read;
+      s->stats->bytes_written += decrypted_chunk_len;
+      s->stats->chunks++;
     }
 
-    fwrite(output_buffer, 1, (size_t)decrypted_chunk_len, dest_file);
+    if (++chunks % CRYPTO_PROGRESS_CHUNKS == 0) {
+      crypto_progress_update(s->opts, CRYPTO_PHASE_STREAM,
+                             crypto_reader_tell(&s->reader));
+    }
   } while (!eof);
 
-  fclose(src_file);
-  fclose(dest_file);
+  sodium_memzero(output_buffer, sizeof(output_buffer));
+  return status;
+}
+
+// reads the head of an encrypted file of any version from the start of
+// s->reader. files without the preamble are version 1 and start with the
+// salt; their head is kept as if they had one, in the password key mode
+static int crypto_read_any_head(CryptoStream *s, int *version) {
+  *version = 1;
+  if (crypto_reader_read(&s->reader, s->head, CRYPTO_PREAMBLE_LEN) ==
+          CRYPTO_PREAMBLE_LEN &&
+      memcmp(s->head, CRYPTO_MAGIC, CRYPTO_MAGIC_LEN) == 0) {
+    *version = s->head[CRYPTO_MAGIC_LEN];
+    return crypto_read_head(s, &s->reader);
+  }
+  s->key_mode = CRYPTO_KEY_PASSWORD;
+  s->head_len = CRYPTO_PREAMBLE_LEN + crypto_pwhash_SALTBYTES +
+                crypto_secretstream_xchacha20poly1305_HEADERBYTES;
+  size_t rest = s->head_len - CRYPTO_PREAMBLE_LEN;
+  if (crypto_reader_seek(&s->reader, 0) != CRYPTO_SUCCESS ||
+      crypto_reader_read(&s->reader, s->head + CRYPTO_PREAMBLE_LEN, rest) !=
+          rest) {
+    return CRYPTO_ERROR_DEC; // incomplete salt or header
+  }
+  return CRYPTO_SUCCESS;
+}
+
+static int crypto_decrypt_stream(const CryptoFiles *files,
+                                 const char *password,
+                                 const CryptoOptions *opts,
+                                 StatsCrypto *stats) {
+  CryptoStream s;
+  int status = crypto_stream_open(&s, CRYPTO_OP_DECRYPT, files, opts, stats);
+  if (status != CRYPTO_SUCCESS) {
+    return status;
+  }
+
+  if (opts && opts->resume) {
+    long long pos;
+    status = crypto_stream_resume(&s, &s.reader, password, &pos);
+    if (status == CRYPTO_SUCCESS) {
+      status = crypto_stream_open_dest(&s, pos);
+    }
+    if (status != CRYPTO_SUCCESS) {
+      return crypto_stream_close(&s, status, status, 0);
+    }
+    status = crypto_decrypt_records(&s, pos);
+    return crypto_stream_close(&s, status, CRYPTO_ERROR_DEC,
+                               crypto_reader_tell(&s.reader));
+  }
+
+  if (s.checkpoint_path[0]) {
+    unlink(s.checkpoint_path); // left over from an earlier attempt
+  }
+  status = crypto_stream_open_dest(&s, 0);
+  if (status != CRYPTO_SUCCESS) {
+    return crypto_stream_close(&s, status, status, 0);
+  }
+
+  int version;
+  status = crypto_read_any_head(&s, &version);
+  const unsigned char *head =
+      version == 1 ? s.head + CRYPTO_PREAMBLE_LEN : s.head;
+  if (status != CRYPTO_SUCCESS) {
+    return crypto_stream_close(&s, status, status, 0);
+  }
+
+  unsigned char key[crypto_secretstream_xchacha20poly1305_KEYBYTES];
+  if (crypto_stream_derive_key(&s, key, password) != 0) {
+    // unable to derive key
+    return crypto_stream_close(&s, CRYPTO_ERROR_DEC, CRYPTO_ERROR_DEC, 0);
+  }
+  if (crypto_secretstream_xchacha20poly1305_init_pull(
+          &s.state,
+          s.head + s.head_len -
+              crypto_secretstream_xchacha20poly1305_HEADERBYTES,
+          key) != 0) {
+    sodium_memzero(key, sizeof(key));
+    // corrupted header
+    return crypto_stream_close(&s, CRYPTO_ERROR_DEC, CRYPTO_ERROR_DEC, 0);
+  }
+  sodium_memzero(key, sizeof(key));
+  if (stats) {
+    stats->bytes_read = crypto_reader_tell(&s.reader);
+  }
+  if (s.hash_cipher) {
+    crypto_generichash_update(&s.cipher_hash, head,
+                              s.head + s.head_len - head);
+  }
+
+  status = version == 1 ? crypto_decrypt_chunks(&s)
+                        : crypto_decrypt_records(&s, 0);
+  return crypto_stream_close(&s, status, CRYPTO_ERROR_DEC,
+                             crypto_reader_tell(&s.reader));
+}
+
+// a preview decrypts a window of the plaintext into memory the caller owns,
+// for a look inside a file without writing anything to disk. the stream
+// cannot be entered in the middle (every message depends on the ones
+// before it), so a window at 'offset' is reached by decrypting and dropping
+// what comes before it; nothing after the window is read, and a read costs
+// what lies before its end, never the size of the file. each record is
+// authenticated as it is pulled, and the plaintext is hashed from the start
+// as it goes by, but the END record and the digest in it are only checked
+// when the window reaches them
+#define CRYPTO_PREVIEW_WINDOW (64 << 10) // ciphertext read ahead per refill
+
+struct CryptoPreview {
+  CryptoStream s; // the head, and the reader positioned after it
+  unsigned char key[crypto_secretstream_xchacha20poly1305_KEYBYTES];
+  int version;
+  long long data_start; // where the first record or chunk begins
+};
+
+// derives the key of 'path' once, so later reads of any window cost no more
+// than decrypting up to it. '*preview' lives in guarded memory and is wiped
+// by crypto_preview_close. a wrong password shows on the first read
+int crypto_preview_open(const char *path, const char *password,
+                        const CryptoOptions *opts, CryptoPreview **preview) {
+  *preview = NULL;
+  CryptoPreview *p = (CryptoPreview *)sodium_malloc(sizeof(CryptoPreview));
+  if (!p) {
+    return CRYPTO_ERROR_MEM;
+  }
+  CryptoFiles files = {.src = path, .src_fd = -1, .dest_fd = -1};
+  crypto_stream_init(&p->s, CRYPTO_OP_DECRYPT, &files, opts, NULL);
+  p->s.hash_cipher = 0;
+  int status = crypto_reader_open(&p->s.reader, path, CRYPTO_IO_CACHED);
+  if (status != CRYPTO_SUCCESS) {
+    sodium_free(p);
+    return status;
+  }
+  p->s.reader.window = CRYPTO_PREVIEW_WINDOW;
+
+  status = crypto_read_any_head(&p->s, &p->version);
+  if (status == CRYPTO_SUCCESS &&
+      crypto_stream_derive_key(&p->s, p->key, password) != 0) {
+    status = CRYPTO_ERROR_DEC;
+  }
+  if (status != CRYPTO_SUCCESS) {
+    crypto_preview_close(p);
+    return status;
+  }
+  p->data_start = crypto_reader_tell(&p->s.reader);
+  *preview = p;
+  return CRYPTO_SUCCESS;
+}
+
+// copies the part of the plaintext [pos, pos + len) that falls into the
+// window, zeros where 'data' is NULL (a hole). returns the bytes of the
+// window filled so far
+static size_t crypto_preview_copy(const unsigned char *data, long long pos,
+                                  long long len, long long offset,
+                                  unsigned char *out, size_t out_len) {
+  long long start = pos > offset ? pos : offset;
+  long long end = pos + len;
+  if (end > offset + (long long)out_len) {
+    end = offset + (long long)out_len;
+  }
+  if (end <= start) {
+    return pos > offset ? (size_t)(pos - offset) : 0;
+  }
+  if (data) {
+    memcpy(out + (start - offset), data + (start - pos), end - start);
+  } else {
+    memset(out + (start - offset), 0, end - start);
+  }
+  return (size_t)(end - offset);
+}
+
+static int crypto_preview_records(CryptoStream *s, long long offset,
+                                  unsigned char *out, size_t len,
+                                  size_t *filled) {
+  unsigned char record[CRYPTO_RECORD_MAX];
+  long long pos = 0;
+  int status = CRYPTO_SUCCESS;
+  crypto_generichash_init(&s->plain_hash, NULL, 0, CRYPTO_DIGEST_BYTES);
+  s->plain_final = 0;
+  while (pos < offset + (long long)len) {
+    long long records = s->records;
+    size_t record_len;
+    unsigned char tag;
+    status = crypto_pull_record(s, &s->reader, record, &record_len, &tag);
+    if (status != CRYPTO_SUCCESS) {
+      break;
+    }
+    int final = tag == crypto_secretstream_xchacha20poly1305_TAG_FINAL;
+    if (final != (record[0] == CRYPTO_RECORD_END)) {
+      status = CRYPTO_ERROR_DEC; // stream ended early or not at all
+      break;
+    }
+    if (record[0] == CRYPTO_RECORD_DATA) {
+      *filled = crypto_preview_copy(record + 1, pos, record_len - 1, offset,
+                                    out, len);
+      pos += record_len - 1;
+      if (s->hash_plain) {
+        crypto_generichash_update(&s->plain_hash, record + 1, record_len - 1);
+      }
+    } else if (record[0] == CRYPTO_RECORD_HOLE && record_len == 1 + 8) {
+      unsigned long long hole = crypto_load_le(record + 1, 8);
+      if (hole == 0 || hole > (unsigned long long)(LLONG_MAX - pos)) {
+        status = CRYPTO_ERROR_DEC;
+        break;
+      }
+      *filled =
+          crypto_preview_copy(NULL, pos, (long long)hole, offset, out, len);
+      pos += (long long)hole;
+      if (s->hash_plain) {
+        crypto_hash_zeros(&s->plain_hash, (long long)hole);
+      }
+    } else if (record[0] == CRYPTO_RECORD_CHECKPOINT) {
+      if (!crypto_checkpoint_matches(record, record_len, pos, records)) {
+        status = CRYPTO_ERROR_DEC; // records were dropped or reordered
+        break;
+      }
+    } else if (record[0] == CRYPTO_RECORD_END &&
+               (record_len == 1 + 8 ||
+                record_len == 1 + 8 + CRYPTO_DIGEST_BYTES)) {
+      if (crypto_load_le(record + 1, 8) != (unsigned long long)pos) {
+        status = CRYPTO_ERROR_DEC; // size mismatch
+        break;
+      }
+      crypto_finish_plain_digest(s);
+      if (s->hash_plain && record_len > 1 + 8 &&
+          sodium_memcmp(s->plain_digest, record + 1 + 8,
+                        CRYPTO_DIGEST_BYTES) != 0) {
+        status = CRYPTO_ERROR_DEC; // the plaintext is not what was encrypted
+      }
+      break;
+    } else {
+      status = CRYPTO_ERROR_DEC; // unknown record
+      break;
+    }
+  }
+  sodium_memzero(record, sizeof(record));
+  return status;
+}
+
+static int crypto_preview_chunks(CryptoStream *s, long long offset,
+                                 unsigned char *out, size_t len,
+                                 size_t *filled) {
+  unsigned char
+      input_buffer[CHUNK_SIZE + crypto_secretstream_xchacha20poly1305_ABYTES];
+  unsigned char output_buffer[CHUNK_SIZE];
+  long long pos = 0;
+  int status = CRYPTO_SUCCESS;
+  while (pos < offset + (long long)len) {
+    size_t bytes_read =
+        crypto_reader_read(&s->reader, input_buffer, sizeof(input_buffer));
+    unsigned long long chunk_len;
+    unsigned char tag;
+    if (s->reader.error ||
+        crypto_secretstream_xchacha20poly1305_pull(
+            &s->state, output_buffer, &chunk_len, &tag, input_buffer,
+            bytes_read, AAD_STRING, AAD_STRING_LEN) != 0) {
+      status = CRYPTO_ERROR_DEC; // unreadable or corrupted chunk
+      break;
+    }
+    *filled = crypto_preview_copy(output_buffer, pos, (long long)chunk_len,
+                                  offset, out, len);
+    pos += (long long)chunk_len;
+    if (tag == crypto_secretstream_xchacha20poly1305_TAG_FINAL) {
+      break;
+    }
+    if (bytes_read < sizeof(input_buffer)) {
+      status = CRYPTO_ERROR_DEC; // end of file before the end of the stream
+      break;
+    }
+  }
+  sodium_memzero(output_buffer, sizeof(output_buffer));
+  return status;
+}
+
+// decrypts up to 'len' bytes of plaintext starting at 'offset' into 'out'.
+// '*out_len' receives how many there were: fewer than 'len' only at the end
+// of the file
+int crypto_preview_read(CryptoPreview *preview, long long offset,
+                        unsigned char *out, size_t len, size_t *out_len) {
+  CryptoStream *s = &preview->s;
+  *out_len = 0;
+  if (offset < 0) {
+    offset = 0;
+  }
+  // every read starts the stream over from its header
+  s->records = 0;
+  if (crypto_reader_seek(&s->reader, preview->data_start) != CRYPTO_SUCCESS ||
+      crypto_secretstream_xchacha20poly1305_init_pull(
+          &s->state,
+          s->head + s->head_len -
+              crypto_secretstream_xchacha20poly1305_HEADERBYTES,
+          preview->key) != 0) {
+    return CRYPTO_ERROR_DEC;
+  }
+  size_t filled = 0;
+  int status =
+      preview->version == 1
+          ? crypto_preview_chunks(s, offset, out, len, &filled)
+          : crypto_preview_records(s, offset, out, len, &filled);
+  sodium_memzero(&s->state, sizeof(s->state));
+  if (status != CRYPTO_SUCCESS) {
+    sodium_memzero(out, len); // never show plaintext that did not verify
+    return status;
+  }
+  *out_len = filled;
+  return CRYPTO_SUCCESS;
+}
+
+void crypto_preview_close(CryptoPreview *preview) {
+  if (!preview) {
+    return;
+  }
+  crypto_reader_close(&preview->s.reader);
+  sodium_free(preview); // sodium_free zeroes the key and state first
+}
+
+// the most a 'size' byte file grows by when encrypted as dense DATA records
+static long long crypto_max_growth(const CryptoStream *s, long long size) {
+  const long long frame = 4 + crypto_secretstream_xchacha20poly1305_ABYTES;
+  long long records = size / CHUNK_SIZE + 1;
+  return (long long)s->head_len + records * (frame + 1) + frame + 1 + 8 +
+         CRYPTO_DIGEST_BYTES;
+}
+
+// clones the file next to itself. filesystems without shared extents
+// leave no snapshot rather than a full copy
+static void crypto_in_place_snapshot(CryptoStream *s) {
+#ifdef FICLONE
+  char path[PATH_MAX];
+  if (!crypto_sidecar_path(s->src, CRYPTO_SNAPSHOT_SUFFIX, path,
+                           sizeof(path))) {
+    return;
+  }
+  int fd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+  if (fd < 0) {
+    return;
+  }
+  int cloned = ioctl(fd, FICLONE, s->journal->fd) == 0;
+  close(fd);
+  if (!cloned) {
+    unlink(path);
+  }
+#else
+  (void)s;
+#endif
+}
+
+// sets up a fresh conversion: key, head and the first journal. encryption
+// starts by moving the plaintext up by its growth and a window, decryption
+// straight away with the stream. only version 2 files decrypt in place
+static int crypto_in_place_start(CryptoStream *s, const char *password,
+                                 long long size) {
+  CryptoJournal *j = s->journal;
+  if (access(j->path, F_OK) == 0) {
+    return CRYPTO_ERROR_RESUME; // an interrupted conversion, to resume
+  }
+  j->window = size < CRYPTO_JOURNAL_WINDOW_MIN   ? CRYPTO_JOURNAL_WINDOW_MIN
+              : size > CRYPTO_JOURNAL_WINDOW_MAX ? CRYPTO_JOURNAL_WINDOW_MAX
+                                                 : size;
+  j->saved = malloc((size_t)j->window);
+  if (!j->saved) {
+    return CRYPTO_ERROR_MEM;
+  }
 
+  unsigned char key[crypto_secretstream_xchacha20poly1305_KEYBYTES];
+  if (s->op == CRYPTO_OP_ENCRYPT) {
+    crypto_stream_new_head(s);
+    if (crypto_stream_derive_key(s, key, password) != 0) {
+      return CRYPTO_ERROR_ENC;
+    }
+    crypto_secretstream_xchacha20poly1305_init_push(
+        &s->state,
+        s->head + s->head_len -
+            crypto_secretstream_xchacha20poly1305_HEADERBYTES,
+        key);
+  } else {
+    int status = crypto_reader_open_at(&s->reader, s->src, s->io_policy, 0);
+    if (status != CRYPTO_SUCCESS) {
+      return status;
+    }
+    if (crypto_reader_read(&s->reader, s->head, CRYPTO_PREAMBLE_LEN) !=
+            CRYPTO_PREAMBLE_LEN ||
+        memcmp(s->head, CRYPTO_MAGIC, CRYPTO_MAGIC_LEN) != 0 ||
+        crypto_read_head(s, &s->reader) != CRYPTO_SUCCESS ||
+        crypto_stream_derive_key(s, key, password) != 0) {
+      sodium_memzero(key, sizeof(key));
+      return CRYPTO_ERROR_DEC;
+    }
+    if (crypto_secretstream_xchacha20poly1305_init_pull(
+            &s->state,
+            s->head + s->head_len -
+                crypto_secretstream_xchacha20poly1305_HEADERBYTES,
+            key) != 0) {
+      sodium_memzero(key, sizeof(key));
+      return CRYPTO_ERROR_DEC; // corrupted header
+    }
+    // a wrong password shows on the first record: check it before the
+    // journal commits the file to the conversion
+    crypto_secretstream_xchacha20poly1305_state first_state = s->state;
+    long long first = crypto_reader_tell(&s->reader);
+    unsigned char record[CRYPTO_RECORD_MAX];
+    size_t len;
+    unsigned char tag;
+    int pulled = crypto_pull_record(s, &s->reader, record, &len, &tag);
+    s->state = first_state;
+    s->records = 0;
+    sodium_memzero(&first_state, sizeof(first_state));
+    sodium_memzero(record, sizeof(record));
+    if (pulled != CRYPTO_SUCCESS ||
+        crypto_reader_seek(&s->reader, first) != CRYPTO_SUCCESS) {
+      sodium_memzero(key, sizeof(key));
+      return CRYPTO_ERROR_DEC;
+    }
+  }
+  crypto_journal_key(j, key);
   sodium_memzero(key, sizeof(key));
+  if (s->opts && s->opts->snapshot) {
+    crypto_in_place_snapshot(s);
+  }
+
+  CryptoMark mark;
+  crypto_stream_mark(s, &mark, 0);
+  int status;
+  if (s->op == CRYPTO_OP_ENCRYPT) {
+    j->base = crypto_max_growth(s, size) + j->window;
+    crypto_journal_mark(s, &mark, j->base, 0);
+    j->shift_from = 0;
+    j->shift_end = size;
+    j->shift_delta = j->base;
+    status = crypto_journal_commit(s, CRYPTO_JOURNAL_SHIFT, 0);
+  } else {
+    crypto_journal_mark(s, &mark, crypto_reader_tell(&s->reader), 0);
+    status = crypto_journal_commit(s, CRYPTO_JOURNAL_STREAM, 0);
+  }
+  sodium_memzero(&mark, sizeof(mark));
+  return status;
+}
+
+// loads the journal and puts back the input the writes since its last
+// commit may have overwritten
+static int crypto_in_place_resume(CryptoStream *s, const char *password) {
+  CryptoJournal *j = s->journal;
+  int status = crypto_journal_load(s, password);
+  if (status != CRYPTO_SUCCESS) {
+    return status;
+  }
+  if (j->phase == CRYPTO_JOURNAL_FINISH) {
+    s->hash_plain = 0; // the digest went with the interrupted run
+    return CRYPTO_SUCCESS;
+  }
+  if (j->phase != CRYPTO_JOURNAL_STREAM) {
+    return CRYPTO_SUCCESS;
+  }
+  if (!crypto_pwrite_all(j->fd, j->saved, j->saved_len, j->reader_offset) ||
+      fdatasync(j->fd) != 0) {
+    return CRYPTO_ERROR_FILE;
+  }
+  return crypto_journal_commit(s, CRYPTO_JOURNAL_STREAM, 0);
+}
+
+// runs the stream from the journal's resume point to its end, then records
+// the size the file ends up with
+static int crypto_in_place_stream(CryptoStream *s) {
+  CryptoJournal *j = s->journal;
+  int error = s->op == CRYPTO_OP_ENCRYPT ? CRYPTO_ERROR_ENC : CRYPTO_ERROR_DEC;
+  int status = CRYPTO_SUCCESS;
+  if (s->reader.fd < 0) {
+    status = crypto_reader_open_at(&s->reader, s->src, s->io_policy, j->base);
+  }
+  if (status == CRYPTO_SUCCESS &&
+      crypto_reader_seek(&s->reader, j->reader_offset - j->base) !=
+          CRYPTO_SUCCESS) {
+    status = error;
+  }
+  if (status == CRYPTO_SUCCESS) {
+    status = crypto_writer_open_in_place(&s->writer, s->src, s->io_policy,
+                                         j->writer_offset);
+  }
+  if (status != CRYPTO_SUCCESS) {
+    return status;
+  }
+  if (s->stats) {
+    s->reader.calls = &s->stats->read_calls;
+    s->writer.calls = &s->stats->write_calls;
+  }
+  s->state = j->state;
+  s->records = j->records;
+  s->plain_hash = j->plain_hash;
+
+  if (s->op == CRYPTO_OP_ENCRYPT) {
+    if (j->writer_offset == 0) {
+      crypto_writer_write(&s->writer, s->head, s->head_len);
+    }
+    status = crypto_encrypt_records(s, j->pos);
+  } else {
+    status = crypto_decrypt_records(s, j->pos);
+  }
+  if (status == CRYPTO_SUCCESS &&
+      crypto_writer_sync(&s->writer) != CRYPTO_SUCCESS) {
+    status = error;
+  }
+  if (status == CRYPTO_SUCCESS) {
+    j->phase = CRYPTO_JOURNAL_FINISH;
+    j->final_size = crypto_writer_tell(&s->writer);
+    j->saved_len = 0;
+    status = crypto_journal_save(s);
+  }
+  return status;
+}
+
+// cuts the file at the end of the stream; the journal and snapshot go once
+// that is durable
+static int crypto_in_place_finish(CryptoStream *s) {
+  CryptoJournal *j = s->journal;
+  if (ftruncate(j->fd, j->final_size) != 0 || fsync(j->fd) != 0) {
+    return CRYPTO_ERROR_FILE;
+  }
+  unlink(j->path);
+  char path[PATH_MAX];
+  if (crypto_sidecar_path(s->src, CRYPTO_SNAPSHOT_SUFFIX, path,
+                          sizeof(path))) {
+    unlink(path);
+  }
   return CRYPTO_SUCCESS;
 }
+
+// converts files->src into itself, as the journal next to it says when
+// resuming. a failed or cancelled conversion leaves the file as the journal
+// describes it, to be resumed
+static int crypto_in_place_run(int op, const CryptoFiles *files,
+                               const char *password, const CryptoOptions *opts,
+                               StatsCrypto *stats) {
+  CryptoStream s;
+  CryptoJournal journal;
+  memset(&journal, 0, sizeof(journal));
+  crypto_stream_init(&s, op, files, opts, stats);
+  s.hash_cipher = 0; // both sides have the one name, nothing for a manifest
+  s.journal = &journal;
+  journal.fd = open(files->src, O_RDWR | O_CLOEXEC);
+  struct stat st;
+  int status = CRYPTO_SUCCESS;
+  if (journal.fd < 0 || fstat(journal.fd, &st) != 0 ||
+      !S_ISREG(st.st_mode) ||
+      !crypto_sidecar_path(files->src, CRYPTO_JOURNAL_SUFFIX, journal.path,
+                           sizeof(journal.path))) {
+    status = CRYPTO_ERROR_FILE;
+  }
+  if (status == CRYPTO_SUCCESS) {
+    s.src_size = st.st_size;
+    crypto_progress_begin(opts, st.st_size);
+    status = opts && opts->resume
+                 ? crypto_in_place_resume(&s, password)
+                 : crypto_in_place_start(&s, password, st.st_size);
+  }
+  if (status == CRYPTO_SUCCESS && journal.phase == CRYPTO_JOURNAL_SHIFT) {
+    status = crypto_journal_shift(&s);
+  }
+  if (status == CRYPTO_SUCCESS && journal.phase == CRYPTO_JOURNAL_STREAM) {
+    status = crypto_in_place_stream(&s);
+  }
+  if (status == CRYPTO_SUCCESS) {
+    status = crypto_in_place_finish(&s);
+  }
+  if (status != CRYPTO_SUCCESS) {
+    s.writer.in_place = 0; // keep the file whole for the resume
+  }
+  long long done = s.reader.fd >= 0 ? crypto_reader_tell(&s.reader) : 0;
+  status = crypto_stream_close(
+      &s, status, op == CRYPTO_OP_ENCRYPT ? CRYPTO_ERROR_ENC : CRYPTO_ERROR_DEC,
+      done);
+  if (journal.fd >= 0) {
+    close(journal.fd);
+  }
+  if (journal.saved) {
+    sodium_memzero(journal.saved, (size_t)journal.window);
+  }
+  free(journal.saved);
+  sodium_memzero(&journal, sizeof(journal));
+  return status;
+}
+
+static int crypto_encrypt_in_place_stream(const CryptoFiles *files,
+                                          const char *password,
+                                          const CryptoOptions *opts,
+                                          StatsCrypto *stats) {
+  return crypto_in_place_run(CRYPTO_OP_ENCRYPT, files, password, opts, stats);
+}
+
+static int crypto_decrypt_in_place_stream(const CryptoFiles *files,
+                                          const char *password,
+                                          const CryptoOptions *opts,
+                                          StatsCrypto *stats) {
+  return crypto_in_place_run(CRYPTO_OP_DECRYPT, files, password, opts, stats);
+}
+
+// runs one operation, timing it when stats are wanted
+static int crypto_run(int op, const CryptoFiles *files, const char *password,
+                      const CryptoOptions *opts) {
+  if (opts && (opts->recipient_count < 0 ||
+               opts->recipient_count > CRYPTO_MAX_RECIPIENTS)) {
+    return CRYPTO_ERROR_ENC;
+  }
+  int record = stats_enabled();
+  int (*stream)(const CryptoFiles *, const char *, const CryptoOptions *,
+                StatsCrypto *) =
+      op == CRYPTO_OP_ENCRYPT ? crypto_encrypt_stream : crypto_decrypt_stream;
+  if (files->in_place) {
+    stream = op == CRYPTO_OP_ENCRYPT ? crypto_encrypt_in_place_stream
+                                     : crypto_decrypt_in_place_stream;
+  }
+  if (!record && (!opts || !opts->stats)) {
+    return stream(files, password, opts, NULL);
+  }
+  StatsCrypto stats;
+  memset(&stats, 0, sizeof(stats));
+  long long start = stats_now_ns();
+  int result = stream(files, password, opts, &stats);
+  stats.total_ns = stats_now_ns() - start;
+  if (record) {
+    stats_record_crypto(op == CRYPTO_OP_ENCRYPT ? "encrypt" : "decrypt",
+                        files->src ? files->src : "-", result, &stats);
+  }
+  if (opts && opts->stats) {
+    *opts->stats = stats;
+  }
+  return result;
+}
+
+int crypto_encrypt_file_ex(const char *src, const char *dest,
+                           const char *password, const CryptoOptions *opts) {
+  CryptoFiles files = {src, dest, -1, -1, 0};
+  return crypto_run(CRYPTO_OP_ENCRYPT, &files, password, opts);
+}
+
+int crypto_decrypt_file_ex(const char *src, const char *dest,
+                           const char *password, const CryptoOptions *opts) {
+  CryptoFiles files = {src, dest, -1, -1, 0};
+  return crypto_run(CRYPTO_OP_DECRYPT, &files, password, opts);
+}
+
+// the same on descriptors the caller opened and keeps: 'src_fd' is read
+// from its offset, a regular 'dest_fd' is emptied first. the names are what
+// stats and the manifest call the two ends; a NULL name keeps that end out
+// of the manifest. no checkpoints are kept
+int crypto_encrypt_fd(int src_fd, int dest_fd, const char *src_name,
+                      const char *dest_name, const char *password,
+                      const CryptoOptions *opts) {
+  CryptoFiles files = {src_name, dest_name, src_fd, dest_fd, 0};
+  return crypto_run(CRYPTO_OP_ENCRYPT, &files, password, opts);
+}
+
+int crypto_decrypt_fd(int src_fd, int dest_fd, const char *src_name,
+                      const char *dest_name, const char *password,
+                      const CryptoOptions *opts) {
+  CryptoFiles files = {src_name, dest_name, src_fd, dest_fd, 0};
+  return crypto_run(CRYPTO_OP_DECRYPT, &files, password, opts);
+}
+
+// converts 'path' into its encrypted or decrypted self, in place, without
+// room for a second copy: the file grows by at most its encryption overhead
+// and a window of up to 16 MiB. progress is journaled next to it, so an
+// interrupted conversion resumes with opts->resume; until then the file is
+// neither plaintext nor ciphertext. the output is dense, holes encrypt as
+// zeros, and has no CHECKPOINT records
+int crypto_encrypt_in_place(const char *path, const char *password,
+                            const CryptoOptions *opts) {
+  CryptoFiles files = {path, path, -1, -1, 1};
+  return crypto_run(CRYPTO_OP_ENCRYPT, &files, password, opts);
+}
+
+int crypto_decrypt_in_place(const char *path, const char *password,
+                            const CryptoOptions *opts) {
+  CryptoFiles files = {path, path, -1, -1, 1};
+  return crypto_run(CRYPTO_OP_DECRYPT, &files, password, opts);
+}
+
+// CRYPTO_IN_PLACE_* when 'path' has the journal of an interrupted
+// conversion, 0 otherwise
+int crypto_in_place_pending(const char *path) {
+  char journal[PATH_MAX];
+  unsigned char prefix[CRYPTO_CHECKPOINT_PREFIX_LEN];
+  if (!crypto_sidecar_path(path, CRYPTO_JOURNAL_SUFFIX, journal,
+                           sizeof(journal))) {
+    return 0;
+  }
+  FILE *file = fopen(journal, "rb");
+  if (!file) {
+    return 0;
+  }
+  size_t got = fread(prefix, 1, sizeof(prefix), file);
+  fclose(file);
+  if (got != sizeof(prefix) ||
+      memcmp(prefix, CRYPTO_JOURNAL_MAGIC, CRYPTO_MAGIC_LEN) != 0 ||
+      prefix[CRYPTO_MAGIC_LEN] != CRYPTO_JOURNAL_VERSION) {
+    return 0;
+  }
+  int op = prefix[CRYPTO_MAGIC_LEN + 1];
+  return op == CRYPTO_OP_ENCRYPT   ? CRYPTO_IN_PLACE_ENCRYPT
+         : op == CRYPTO_OP_DECRYPT ? CRYPTO_IN_PLACE_DECRYPT
+                                   : 0;
+}
+
+// writes 'key' in hex after 'tag' to 'path', which must not exist yet. a
+// file this call created is removed again when writing it fails
+static int crypto_write_key_file(const char *path, const char *tag,
+                                 const unsigned char *key, size_t len,
+                                 mode_t mode) {
+  char hex[crypto_box_SECRETKEYBYTES * 2 + 1];
+  if (len * 2 + 1 > sizeof(hex)) {
+    return CRYPTO_ERROR_FILE;
+  }
+  int fd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, mode);
+  if (fd < 0) {
+    return CRYPTO_ERROR_FILE; // e.g. it exists: never touched
+  }
+  int status = CRYPTO_ERROR_FILE;
+  FILE *file = fdopen(fd, "w");
+  if (file) {
+    sodium_bin2hex(hex, sizeof(hex), key, len);
+    int ok = fprintf(file, "%s %s\n", tag, hex) > 0;
+    if (fclose(file) == 0 && ok) {
+      status = CRYPTO_SUCCESS;
+    }
+  } else {
+    close(fd);
+  }
+  sodium_memzero(hex, sizeof(hex));
+  if (status != CRYPTO_SUCCESS) {
+    unlink(path);
+  }
+  return status;
+}
+
+// writes a new X25519 key pair: the secret key to 'path', readable by its
+// owner only, and the public key to 'path' with ".pub" appended. neither may
+// exist yet
+int crypto_keygen(const char *path) {
+  unsigned char public_key[crypto_box_PUBLICKEYBYTES];
+  unsigned char secret_key[crypto_box_SECRETKEYBYTES];
+  char pub_path[PATH_MAX];
+  if (!crypto_sidecar_path(path, ".pub", pub_path, sizeof(pub_path))) {
+    return CRYPTO_ERROR_FILE;
+  }
+  crypto_box_keypair(public_key, secret_key);
+  int status = crypto_write_key_file(path, CRYPTO_SECRET_KEY_TAG, secret_key,
+                                     sizeof(secret_key), 0600);
+  sodium_memzero(secret_key, sizeof(secret_key));
+  if (status != CRYPTO_SUCCESS) {
+    return status;
+  }
+  status = crypto_write_key_file(pub_path, CRYPTO_PUBLIC_KEY_TAG, public_key,
+                                 sizeof(public_key), 0644);
+  if (status != CRYPTO_SUCCESS) {
+    unlink(path); // created above, useless without its public key
+  }
+  return status;
+}
+
+// reads the key after 'tag' in a key file into 'key' ('len' bytes)
+static int crypto_read_key_file(const char *path, const char *tag,
+                                unsigned char *key, size_t len) {
+  char line[128];
+  FILE *file = fopen(path, "r");
+  if (!file) {
+    return CRYPTO_ERROR_FILE;
+  }
+  int got = fgets(line, sizeof(line), file) != NULL;
+  fclose(file);
+  size_t tag_len = strlen(tag);
+  size_t key_len = 0;
+  int status = CRYPTO_ERROR_DEC;
+  if (got && strncmp(line, tag, tag_len) == 0 && line[tag_len] == ' ' &&
+      sodium_hex2bin(key, len, line + tag_len + 1,
+                     strcspn(line + tag_len + 1, "\r\n"), NULL, &key_len,
+                     NULL) == 0 &&
+      key_len == len) {
+    status = CRYPTO_SUCCESS;
+  }
+  sodium_memzero(line, sizeof(line));
+  return status;
+}
+
+int crypto_read_public_key(const char *path, unsigned char *public_key) {
+  return crypto_read_key_file(path, CRYPTO_PUBLIC_KEY_TAG, public_key,
+                              crypto_box_PUBLICKEYBYTES);
+}
+
+int crypto_read_secret_key(const char *path, unsigned char *secret_key) {
+  return crypto_read_key_file(path, CRYPTO_SECRET_KEY_TAG, secret_key,
+                              crypto_box_SECRETKEYBYTES);
+}
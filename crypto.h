@@ -1,19 +1,132 @@
 #ifndef CRYPTO_H
 #define CRYPTO_H
 
+#include <pthread.h>
 #include <sodium.h>
+#include <stdatomic.h>
 
 #define CRYPTO_SUCCESS 1
 #define CRYPTO_ERROR_FILE -1
 #define CRYPTO_ERROR_MEM -2
 #define CRYPTO_ERROR_ENC -3
 #define CRYPTO_ERROR_DEC -4
+#define CRYPTO_ERROR_CANCELLED -5
+// the checkpoint cannot be used: another password, or the source changed
+#define CRYPTO_ERROR_RESUME -6
+
+// BLAKE2b-512, the digest of the plaintext kept in the file
+#define CRYPTO_DIGEST_BYTES crypto_generichash_BYTES_MAX
+
+// size of a master key, see CryptoOptions.master_key
+#define CRYPTO_MASTER_KEY_BYTES 32
+
+// key pairs of recipients, see CryptoOptions.recipients
+#define CRYPTO_PUBLIC_KEY_BYTES crypto_box_PUBLICKEYBYTES
+#define CRYPTO_SECRET_KEY_BYTES crypto_box_SECRETKEYBYTES
+#define CRYPTO_MAX_RECIPIENTS 16
+
+// default spacing of checkpoints, in bytes of plaintext
+#define CRYPTO_CHECKPOINT_BYTES (256LL << 20)
+
+// values of CryptoProgress.phase
+#define CRYPTO_PHASE_IDLE 0
+#define CRYPTO_PHASE_KDF 1      // deriving the key from the password
+#define CRYPTO_PHASE_STREAM 2   // encrypting or decrypting chunks
+#define CRYPTO_PHASE_FINALIZE 3 // flushing and closing the output
+#define CRYPTO_PHASE_DONE 4
+
+// counters published by a running operation. the operation stores into them
+// once every few hundred KiB, so any thread may poll them at no cost to it
+typedef struct CryptoProgress {
+  atomic_int phase;
+  atomic_llong bytes_done;  // input bytes consumed so far
+  atomic_llong bytes_total; // size of the input file
+  atomic_llong started_ns;  // monotonic time the stream phase began
+  atomic_llong updated_ns;  // monotonic time of the last update
+} CryptoProgress;
+
+// optional knobs for the *_ex variants, a NULL pointer means defaults
+typedef struct CryptoOptions {
+  atomic_int *cancel; // checked between chunks, stops the operation if set
+  CryptoProgress *progress; // updated as the operation runs, may be NULL
+  struct StatsCrypto *stats; // receives this operation's counters, may be NULL
+  int io_policy; // CRYPTO_IO_* from crypto_io.h, 0 (cached) by default
+  // continue from the checkpoint kept next to 'dest' instead of starting
+  // over, or for conversions in place, from the journal next to the file
+  int resume;
+  // 0 for CRYPTO_CHECKPOINT_BYTES, < 0 to write no checkpoints. decryption
+  // checkpoints wherever the encrypted file has one, when this is >= 0
+  long long checkpoint_bytes;
+  // skip the BLAKE2b digest of the plaintext, which is stored in the file
+  // and checked on decryption. holes are hashed as zeros, so huge sparse
+  // files may want to
+  int no_digest;
+  // when set, files are encrypted under this key instead of one derived
+  // from the password per file, and files under it decrypt without the
+  // password. it is crypto_derive_key of the password and 'master_salt'
+  // (crypto_pwhash_SALTBYTES), which is stored in the file
+  const unsigned char *master_key;
+  const unsigned char *master_salt;
+  // receives the digest of the plaintext (CRYPTO_DIGEST_BYTES) when the
+  // operation succeeds and no_digest is not set, may be NULL
+  unsigned char *digest;
+  // for conversions in place: first clone the file to '<path>.snapshot'
+  // where the filesystem shares extents (FICLONE), removed on success
+  int snapshot;
+  // when set, files are encrypted to these X25519 public keys
+  // (CRYPTO_PUBLIC_KEY_BYTES each, see crypto_keygen) instead of a password,
+  // so encrypting takes neither. they decrypt with 'secret_key', that of any
+  // one recipient; so does resuming their encryption
+  const unsigned char *recipients;
+  int recipient_count; // up to CRYPTO_MAX_RECIPIENTS
+  const unsigned char *secret_key;
+  // when set, held around every argon2 run of the operation, so a caller
+  // running many at once can keep their 256 MiB each from adding up
+  pthread_mutex_t *kdf_lock;
+} CryptoOptions;
+
+// a window onto the plaintext of an encrypted file, see crypto_preview_open
+typedef struct CryptoPreview CryptoPreview;
+
+// what an interrupted conversion in place was doing, see
+// crypto_in_place_pending
+#define CRYPTO_IN_PLACE_ENCRYPT 1
+#define CRYPTO_IN_PLACE_DECRYPT 2
 
 int crypto_encrypt_file(const char *src, const char *dest,
                         const char *password);
 int crypto_decrypt_file(const char *src, const char *dest,
                         const char *password);
+int crypto_encrypt_file_ex(const char *src, const char *dest,
+                           const char *password, const CryptoOptions *opts);
+int crypto_decrypt_file_ex(const char *src, const char *dest,
+                           const char *password, const CryptoOptions *opts);
+int crypto_encrypt_fd(int src_fd, int dest_fd, const char *src_name,
+                      const char *dest_name, const char *password,
+                      const CryptoOptions *opts);
+int crypto_decrypt_fd(int src_fd, int dest_fd, const char *src_name,
+                      const char *dest_name, const char *password,
+                      const CryptoOptions *opts);
+int crypto_encrypt_in_place(const char *path, const char *password,
+                            const CryptoOptions *opts);
+int crypto_decrypt_in_place(const char *path, const char *password,
+                            const CryptoOptions *opts);
+int crypto_in_place_pending(const char *path);
+int crypto_master_salt(int fd, unsigned char *salt);
+void crypto_progress_estimate(CryptoProgress *progress, double *rate,
+                              long long *eta_ms, long long *idle_ms);
+int crypto_checkpoint_exists(const char *dest);
+void crypto_remove_output(const char *dest);
+int crypto_probe_file(const char *path);
 int crypto_derive_key(unsigned char *key, size_t key_len, const char *password,
                       const unsigned char *salt);
+int crypto_preview_open(const char *path, const char *password,
+                        const CryptoOptions *opts, CryptoPreview **preview);
+int crypto_preview_read(CryptoPreview *preview, long long offset,
+                        unsigned char *out, size_t len, size_t *out_len);
+void crypto_preview_close(CryptoPreview *preview);
+int crypto_keygen(const char *path);
+int crypto_read_public_key(const char *path, unsigned char *public_key);
+int crypto_read_secret_key(const char *path, unsigned char *secret_key);
 
 #endif
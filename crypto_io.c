@@ -0,0 +1,485 @@
+#define _GNU_SOURCE // O_DIRECT, sync_file_range and fallocate
+#include "crypto_io.h"
+#include "crypto.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// buffered file access for the stream loops in crypto.c, with a choice of
+// page cache behaviour. the cached policy behaves like stdio with a larger
+// buffer. the streaming policies are meant for bulk runs that would
+// otherwise push everything else out of the page cache: the source is read
+// ahead and released once consumed, and the output is written back and
+// released as it goes (or, with CRYPTO_IO_DIRECT, never cached at all)
+
+// O_DIRECT wants buffers, offsets and lengths aligned to the logical block
+// size; a page covers every common device
+#define CRYPTO_IO_ALIGN 4096
+// how far ahead of the cursor the kernel is asked to read
+#define CRYPTO_IO_READAHEAD (8 << 20)
+
+static unsigned char *crypto_io_alloc() {
+  void *buffer = NULL;
+  if (posix_memalign(&buffer, CRYPTO_IO_ALIGN, CRYPTO_IO_BUFFER_SIZE) != 0) {
+    return NULL;
+  }
+  return (unsigned char *)buffer;
+}
+
+static int crypto_reader_init(CryptoReader *reader, int fd, int policy) {
+  memset(reader, 0, sizeof(*reader));
+  reader->fd = fd;
+  if (reader->fd < 0) {
+    return CRYPTO_ERROR_FILE;
+  }
+  reader->buffer = crypto_io_alloc();
+  if (!reader->buffer) {
+    close(reader->fd);
+    return CRYPTO_ERROR_MEM;
+  }
+  reader->policy = policy;
+  if (policy != CRYPTO_IO_CACHED) {
+    posix_fadvise(reader->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    posix_fadvise(reader->fd, 0, CRYPTO_IO_READAHEAD, POSIX_FADV_WILLNEED);
+  }
+  return CRYPTO_SUCCESS;
+}
+
+int crypto_reader_open(CryptoReader *reader, const char *path, int policy) {
+  return crypto_reader_init(reader, open(path, O_RDONLY), policy);
+}
+
+// reads from a descriptor the caller keeps open, from its current offset,
+// which then reads as offset 0. the reader works on a duplicate, so closing
+// it leaves 'fd' alone
+int crypto_reader_open_fd(CryptoReader *reader, int fd, int policy) {
+  int status = crypto_reader_init(reader, fcntl(fd, F_DUPFD_CLOEXEC, 0),
+                                  policy);
+  if (status == CRYPTO_SUCCESS) {
+    off_t offset = lseek(reader->fd, 0, SEEK_CUR);
+    reader->offset = offset > 0 ? offset : 0; // pipes have no offset
+    reader->base = reader->offset;
+    reader->dropped = reader->offset & ~(long long)(CRYPTO_IO_ALIGN - 1);
+  }
+  return status;
+}
+
+// reads 'path' as if it started 'base' bytes in
+int crypto_reader_open_at(CryptoReader *reader, const char *path, int policy,
+                          long long base) {
+  int status = crypto_reader_open(reader, path, policy);
+  if (status == CRYPTO_SUCCESS) {
+    reader->base = base;
+    if (crypto_reader_seek(reader, 0) != CRYPTO_SUCCESS) {
+      crypto_reader_close(reader);
+      return CRYPTO_ERROR_FILE;
+    }
+  }
+  return status;
+}
+
+static void crypto_reader_fill(CryptoReader *reader) {
+  if (reader->policy != CRYPTO_IO_CACHED) {
+    // hand back what was consumed and keep the read-ahead window moving
+    long long drop_end = reader->offset & ~(long long)(CRYPTO_IO_ALIGN - 1);
+    if (drop_end > reader->dropped) {
+      posix_fadvise(reader->fd, reader->dropped, drop_end - reader->dropped,
+                    POSIX_FADV_DONTNEED);
+      reader->dropped = drop_end;
+    }
+    posix_fadvise(reader->fd, reader->offset + CRYPTO_IO_BUFFER_SIZE,
+                  CRYPTO_IO_BUFFER_SIZE, POSIX_FADV_WILLNEED);
+  }
+
+  size_t want = reader->window && reader->window < CRYPTO_IO_BUFFER_SIZE
+                    ? reader->window
+                    : CRYPTO_IO_BUFFER_SIZE;
+  reader->len = 0;
+  reader->pos = 0;
+  while (reader->len < want) {
+    ssize_t got =
+        read(reader->fd, reader->buffer + reader->len, want - reader->len);
+    if (reader->calls) {
+      (*reader->calls)++;
+    }
+    if (got < 0 && errno == EINTR) {
+      continue;
+    }
+    if (got <= 0) {
+      reader->eof = 1;
+      reader->error = got < 0;
+      break;
+    }
+    reader->len += got;
+    reader->offset += got;
+  }
+}
+
+// copies up to 'len' bytes into 'out'. a short count means the end of the
+// file (or an error, see reader->error), like fread
+size_t crypto_reader_read(CryptoReader *reader, void *out, size_t len) {
+  size_t copied = 0;
+  while (copied < len) {
+    if (reader->pos == reader->len) {
+      if (reader->eof) {
+        break;
+      }
+      crypto_reader_fill(reader);
+      if (reader->len == 0) {
+        break;
+      }
+    }
+    size_t n = reader->len - reader->pos;
+    if (n > len - copied) {
+      n = len - copied;
+    }
+    memcpy((unsigned char *)out + copied, reader->buffer + reader->pos, n);
+    reader->pos += n;
+    copied += n;
+  }
+  return copied;
+}
+
+// offset of the next byte crypto_reader_read returns
+long long crypto_reader_tell(CryptoReader *reader) {
+  return reader->offset - (long long)(reader->len - reader->pos) -
+         reader->base;
+}
+
+// moves the read cursor, dropping whatever is buffered
+int crypto_reader_seek(CryptoReader *reader, long long offset) {
+  offset += reader->base;
+  if (lseek(reader->fd, offset, SEEK_SET) != offset) {
+    reader->error = 1;
+    return CRYPTO_ERROR_FILE;
+  }
+  reader->len = 0;
+  reader->pos = 0;
+  reader->offset = offset;
+  reader->dropped = offset & ~(long long)(CRYPTO_IO_ALIGN - 1);
+  reader->eof = 0;
+  return CRYPTO_SUCCESS;
+}
+
+// finds the next allocated range at or after the read cursor. '*data' gets
+// its start and '*hole' the start of the hole after it; both are the file
+// size if only a hole is left. where holes cannot be queried (pipes, old
+// filesystems) the rest of the input is data and '*hole' is LLONG_MAX
+void crypto_reader_next_data(CryptoReader *reader, long long *data,
+                             long long *hole) {
+  long long from = crypto_reader_tell(reader);
+  *data = from;
+  *hole = LLONG_MAX;
+#if defined(SEEK_DATA) && defined(SEEK_HOLE)
+  off_t found = lseek(reader->fd, from + reader->base, SEEK_DATA);
+  if (found >= 0) {
+    *data = found - reader->base;
+    found = lseek(reader->fd, found, SEEK_HOLE);
+    if (found - reader->base >= *data) {
+      *hole = found - reader->base;
+    }
+  } else if (errno == ENXIO) {
+    // nothing but a hole up to the end of the file
+    long long size = crypto_reader_size(reader);
+    *data = *hole = size > from ? size : from;
+  }
+  // SEEK_DATA and SEEK_HOLE move the file offset that read() uses
+  lseek(reader->fd, reader->offset, SEEK_SET);
+#endif
+}
+
+long long crypto_reader_size(CryptoReader *reader) {
+  struct stat st;
+  return fstat(reader->fd, &st) == 0 && st.st_size > reader->base
+             ? st.st_size - reader->base
+             : 0;
+}
+
+void crypto_reader_close(CryptoReader *reader) {
+  if (reader->fd >= 0 && reader->policy != CRYPTO_IO_CACHED) {
+    posix_fadvise(reader->fd, 0, 0, POSIX_FADV_DONTNEED);
+  }
+  if (reader->fd >= 0) {
+    close(reader->fd);
+  }
+  if (reader->buffer) {
+    sodium_memzero(reader->buffer, CRYPTO_IO_BUFFER_SIZE);
+    free(reader->buffer);
+  }
+  memset(reader, 0, sizeof(*reader));
+  reader->fd = -1;
+}
+
+int crypto_writer_open(CryptoWriter *writer, const char *path, int policy) {
+  return crypto_writer_open_at(writer, path, policy, 0);
+}
+
+// like crypto_writer_open, but keeps the first 'offset' bytes of an existing
+// file and continues after them (the file is cut or extended to 'offset')
+int crypto_writer_open_at(CryptoWriter *writer, const char *path, int policy,
+                          long long offset) {
+  memset(writer, 0, sizeof(*writer));
+  writer->buffer = crypto_io_alloc();
+  if (!writer->buffer) {
+    writer->fd = -1;
+    return CRYPTO_ERROR_MEM;
+  }
+  writer->policy = policy;
+  int flags = O_WRONLY | O_CREAT | (offset > 0 ? 0 : O_TRUNC);
+  writer->fd = -1;
+  if (policy == CRYPTO_IO_DIRECT) {
+    writer->fd = open(path, flags | O_DIRECT, 0644);
+    writer->direct = writer->fd >= 0;
+    if (!writer->direct) {
+      writer->policy = CRYPTO_IO_STREAM; // e.g. tmpfs refuses O_DIRECT
+    }
+  }
+  if (writer->fd < 0) {
+    writer->fd = open(path, flags, 0644);
+  }
+  if (writer->fd >= 0 && offset > 0 &&
+      (ftruncate(writer->fd, offset) != 0 ||
+       lseek(writer->fd, offset, SEEK_SET) != offset)) {
+    close(writer->fd);
+    writer->fd = -1;
+  }
+  if (writer->fd < 0) {
+    free(writer->buffer);
+    writer->buffer = NULL;
+    return CRYPTO_ERROR_FILE;
+  }
+  writer->offset = offset;
+  writer->flushed = offset & ~(long long)(CRYPTO_IO_ALIGN - 1);
+  return CRYPTO_SUCCESS;
+}
+
+// writes to a descriptor the caller keeps open, through a duplicate. a
+// regular file is emptied first, like crypto_writer_open would; anything
+// else is written in sequence. O_DIRECT needs a fresh open, so the direct
+// policy streams instead
+int crypto_writer_open_fd(CryptoWriter *writer, int fd, int policy) {
+  memset(writer, 0, sizeof(*writer));
+  writer->fd = -1;
+  writer->buffer = crypto_io_alloc();
+  if (!writer->buffer) {
+    return CRYPTO_ERROR_MEM;
+  }
+  writer->policy = policy == CRYPTO_IO_DIRECT ? CRYPTO_IO_STREAM : policy;
+  writer->fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+  struct stat st;
+  if (writer->fd >= 0 && fstat(writer->fd, &st) == 0 &&
+      S_ISREG(st.st_mode) &&
+      (ftruncate(writer->fd, 0) != 0 || lseek(writer->fd, 0, SEEK_SET) != 0)) {
+    close(writer->fd);
+    writer->fd = -1;
+  }
+  if (writer->fd < 0) {
+    free(writer->buffer);
+    writer->buffer = NULL;
+    return CRYPTO_ERROR_FILE;
+  }
+  return CRYPTO_SUCCESS;
+}
+
+// overwrites 'path' from 'offset' on, for conversions in place: nothing is
+// truncated on open, and closing cuts the file where the writes ended.
+// O_DIRECT would bypass the pages the reader of the same file uses, so the
+// direct policy streams instead
+int crypto_writer_open_in_place(CryptoWriter *writer, const char *path,
+                                int policy, long long offset) {
+  memset(writer, 0, sizeof(*writer));
+  writer->buffer = crypto_io_alloc();
+  if (!writer->buffer) {
+    writer->fd = -1;
+    return CRYPTO_ERROR_MEM;
+  }
+  writer->policy = policy == CRYPTO_IO_DIRECT ? CRYPTO_IO_STREAM : policy;
+  writer->in_place = 1;
+  writer->fd = open(path, O_WRONLY | O_CLOEXEC);
+  if (writer->fd >= 0 && lseek(writer->fd, offset, SEEK_SET) != offset) {
+    close(writer->fd);
+    writer->fd = -1;
+  }
+  if (writer->fd < 0) {
+    free(writer->buffer);
+    writer->buffer = NULL;
+    return CRYPTO_ERROR_FILE;
+  }
+  writer->offset = offset;
+  writer->flushed = offset & ~(long long)(CRYPTO_IO_ALIGN - 1);
+  return CRYPTO_SUCCESS;
+}
+
+static int crypto_writer_write_all(CryptoWriter *writer,
+                                   const unsigned char *data, size_t len) {
+  while (len > 0) {
+    ssize_t put = write(writer->fd, data, len);
+    if (writer->calls) {
+      (*writer->calls)++;
+    }
+    if (put < 0 && errno == EINTR) {
+      continue;
+    }
+    if (put <= 0) {
+      writer->error = 1;
+      return 0;
+    }
+    data += put;
+    len -= put;
+    writer->offset += put;
+  }
+  return 1;
+}
+
+// with the stream policy, the range just written is queued for writeback and
+// the range before it, whose writeback was queued last time, is waited for
+// and dropped, so at most two buffers of dirty pages exist at any time
+static void crypto_writer_release(CryptoWriter *writer, long long start) {
+  if (writer->policy != CRYPTO_IO_STREAM) {
+    return;
+  }
+#ifdef SYNC_FILE_RANGE_WRITE
+  sync_file_range(writer->fd, start, writer->offset - start,
+                  SYNC_FILE_RANGE_WRITE);
+  if (start > writer->flushed) {
+    sync_file_range(writer->fd, writer->flushed, start - writer->flushed,
+                    SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+                        SYNC_FILE_RANGE_WAIT_AFTER);
+    posix_fadvise(writer->fd, writer->flushed, start - writer->flushed,
+                  POSIX_FADV_DONTNEED);
+    writer->flushed = start;
+  }
+#else
+  (void)start;
+#endif
+}
+
+static int crypto_writer_flush(CryptoWriter *writer) {
+  if (writer->len == 0) {
+    return 1;
+  }
+  long long start = writer->offset;
+  if (writer->direct && (writer->len % CRYPTO_IO_ALIGN != 0 ||
+                         writer->offset % CRYPTO_IO_ALIGN != 0)) {
+    // only the tail of the file (or data after an odd sized hole) can be
+    // unaligned; finish it through the cache
+    int flags = fcntl(writer->fd, F_GETFL);
+    if (flags == -1 || fcntl(writer->fd, F_SETFL, flags & ~O_DIRECT) == -1) {
+      writer->error = 1;
+      return 0;
+    }
+    writer->direct = 0;
+  }
+  if (!crypto_writer_write_all(writer, writer->buffer, writer->len)) {
+    return 0;
+  }
+  writer->len = 0;
+  crypto_writer_release(writer, start);
+  return 1;
+}
+
+int crypto_writer_write(CryptoWriter *writer, const void *data, size_t len) {
+  const unsigned char *bytes = (const unsigned char *)data;
+  while (len > 0) {
+    size_t n = CRYPTO_IO_BUFFER_SIZE - writer->len;
+    if (n > len) {
+      n = len;
+    }
+    memcpy(writer->buffer + writer->len, bytes, n);
+    writer->len += n;
+    bytes += n;
+    len -= n;
+    if (writer->len == CRYPTO_IO_BUFFER_SIZE && !crypto_writer_flush(writer)) {
+      return CRYPTO_ERROR_FILE;
+    }
+  }
+  return writer->error ? CRYPTO_ERROR_FILE : CRYPTO_SUCCESS;
+}
+
+// offset the next byte handed to crypto_writer_write lands at
+long long crypto_writer_tell(CryptoWriter *writer) {
+  return writer->offset + (long long)writer->len;
+}
+
+// flushes the buffer and waits until everything written so far is on disk
+int crypto_writer_sync(CryptoWriter *writer) {
+  if (!crypto_writer_flush(writer) || fdatasync(writer->fd) != 0) {
+    writer->error = 1;
+    return CRYPTO_ERROR_FILE;
+  }
+  return CRYPTO_SUCCESS;
+}
+
+// leaves 'len' bytes unwritten, which the filesystem keeps as a hole.
+// pipes and sockets cannot seek, so they get the zeros written out. in
+// place, the range holds old data: it is punched out, or else zeroed
+int crypto_writer_skip(CryptoWriter *writer, long long len) {
+  if (!crypto_writer_flush(writer)) {
+    return CRYPTO_ERROR_FILE;
+  }
+  int punched = 1;
+#ifdef FALLOC_FL_PUNCH_HOLE
+  if (writer->in_place) {
+    punched = fallocate(writer->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                        writer->offset, len) == 0;
+  }
+#else
+  punched = !writer->in_place;
+#endif
+  if (punched && lseek(writer->fd, len, SEEK_CUR) >= 0) {
+    writer->offset += len;
+    return CRYPTO_SUCCESS;
+  }
+  if (punched && errno != ESPIPE) {
+    writer->error = 1;
+    return CRYPTO_ERROR_FILE;
+  }
+  while (len > 0) {
+    size_t n = len < CRYPTO_IO_BUFFER_SIZE ? (size_t)len
+                                           : CRYPTO_IO_BUFFER_SIZE;
+    memset(writer->buffer, 0, n);
+    writer->len = n;
+    if (!crypto_writer_flush(writer)) {
+      return CRYPTO_ERROR_FILE;
+    }
+    len -= (long long)n;
+  }
+  return CRYPTO_SUCCESS;
+}
+
+// flushes what is buffered and closes the file. returns CRYPTO_ERROR_FILE if
+// any write failed along the way
+int crypto_writer_close(CryptoWriter *writer) {
+  if (writer->fd >= 0) {
+    crypto_writer_flush(writer);
+    struct stat st;
+    if (!writer->error && fstat(writer->fd, &st) == 0 &&
+        S_ISREG(st.st_mode) &&
+        (st.st_size < writer->offset ||
+         (writer->in_place && st.st_size > writer->offset)) &&
+        ftruncate(writer->fd, writer->offset) != 0) {
+      writer->error = 1; // could not extend the file over a trailing hole
+    }
+    if (writer->policy == CRYPTO_IO_STREAM && !writer->error) {
+      if (fdatasync(writer->fd) != 0 && errno != EINVAL) {
+        writer->error = 1; // EINVAL: a pipe or socket, nothing to sync
+      }
+      posix_fadvise(writer->fd, 0, 0, POSIX_FADV_DONTNEED);
+    }
+    if (close(writer->fd) != 0) {
+      writer->error = 1;
+    }
+  }
+  int status = writer->error ? CRYPTO_ERROR_FILE : CRYPTO_SUCCESS;
+  if (writer->buffer) {
+    sodium_memzero(writer->buffer, CRYPTO_IO_BUFFER_SIZE);
+    free(writer->buffer);
+  }
+  memset(writer, 0, sizeof(*writer));
+  writer->fd = -1;
+  return status;
+}
@@ -0,0 +1,69 @@
+#ifndef CRYPTO_IO_H
+#define CRYPTO_IO_H
+
+#include <stddef.h>
+
+// values of CryptoOptions.io_policy
+#define CRYPTO_IO_CACHED 0 // plain buffered reads and writes
+#define CRYPTO_IO_STREAM 1 // read-ahead, pages dropped behind the cursor
+#define CRYPTO_IO_DIRECT 2 // as STREAM, and the output bypasses the cache
+
+#define CRYPTO_IO_BUFFER_SIZE (1 << 20)
+
+typedef struct CryptoReader {
+  int fd;
+  int policy;
+  unsigned char *buffer;
+  size_t len; // bytes in 'buffer'
+  size_t pos; // bytes of 'buffer' already handed out
+  long long offset;  // file offset just past 'buffer'
+  long long dropped; // cached pages before this offset were released
+  long long base;    // file offset the reader's offsets count from
+  // bytes asked for per refill, 0 for the whole buffer. readers that stop
+  // early keep it small so they never read far past what they use
+  size_t window;
+  int eof;
+  int error;
+  long long *calls; // counts read syscalls when non-NULL
+} CryptoReader;
+
+typedef struct CryptoWriter {
+  int fd;
+  int policy;
+  int direct; // the descriptor is currently open with O_DIRECT
+  unsigned char *buffer;
+  size_t len;
+  long long offset;  // file offset just past what was handed to the kernel
+  long long flushed; // pages before this offset were written back
+  // writes land over data the file already holds: skipped ranges are zeroed
+  // and closing cuts the file where the writes ended
+  int in_place;
+  int error;
+  long long *calls; // counts write syscalls when non-NULL
+} CryptoWriter;
+
+int crypto_reader_open(CryptoReader *reader, const char *path, int policy);
+int crypto_reader_open_fd(CryptoReader *reader, int fd, int policy);
+int crypto_reader_open_at(CryptoReader *reader, const char *path, int policy,
+                          long long base);
+size_t crypto_reader_read(CryptoReader *reader, void *out, size_t len);
+long long crypto_reader_tell(CryptoReader *reader);
+int crypto_reader_seek(CryptoReader *reader, long long offset);
+void crypto_reader_next_data(CryptoReader *reader, long long *data,
+                             long long *hole);
+long long crypto_reader_size(CryptoReader *reader);
+void crypto_reader_close(CryptoReader *reader);
+
+int crypto_writer_open(CryptoWriter *writer, const char *path, int policy);
+int crypto_writer_open_at(CryptoWriter *writer, const char *path, int policy,
+                          long long offset);
+int crypto_writer_open_fd(CryptoWriter *writer, int fd, int policy);
+int crypto_writer_open_in_place(CryptoWriter *writer, const char *path,
+                                int policy, long long offset);
+int crypto_writer_write(CryptoWriter *writer, const void *data, size_t len);
+long long crypto_writer_tell(CryptoWriter *writer);
+int crypto_writer_sync(CryptoWriter *writer);
+int crypto_writer_skip(CryptoWriter *writer, long long len);
+int crypto_writer_close(CryptoWriter *writer);
+
+#endif
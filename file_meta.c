@@ -0,0 +1,197 @@
+#include "file_meta.h"
+#include "crypto.h"
+#include "file_type.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+// one background thread stats the rows the browser is currently showing,
+// classifies them and reads the header of .enc files, so that drawing never
+// waits on the disk.
+// requests and results are plain paths: the worker never sees a FileNode, so
+// the tree can be replaced or freed while a lookup is in flight
+
+#define FILE_META_MAX_WANTED 256
+#define FILE_META_MAX_RESULTS 256
+
+typedef struct FileMetaResult {
+  char path[MAX_PATH_LENGTH];
+  int found;
+  int is_dir;
+  long long size;
+  long long mtime;
+  int enc_status;
+  const char *type;
+} FileMetaResult;
+
+static pthread_t meta_thread;
+static pthread_mutex_t meta_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t meta_cond = PTHREAD_COND_INITIALIZER;
+static int meta_running;
+
+static char meta_wanted[FILE_META_MAX_WANTED][MAX_PATH_LENGTH];
+static int meta_num_wanted;
+static int meta_next_wanted;
+static char meta_in_flight[MAX_PATH_LENGTH];
+
+static FileMetaResult meta_results[FILE_META_MAX_RESULTS];
+static int meta_num_results;
+
+static int file_meta_has_suffix(const char *path, const char *suffix) {
+  size_t path_len = strlen(path);
+  size_t suffix_len = strlen(suffix);
+  return path_len >= suffix_len &&
+         strcmp(path + path_len - suffix_len, suffix) == 0;
+}
+
+static void file_meta_lookup(FileMetaResult *result) {
+  struct stat st;
+  result->found = stat(result->path, &st) == 0;
+  if (!result->found) {
+    return;
+  }
+  result->is_dir = S_ISDIR(st.st_mode);
+  result->size = st.st_size;
+  result->mtime = st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+  result->enc_status = FILE_META_ENC_NONE;
+  result->type = result->is_dir ? NULL : file_type_describe(result->path, &st);
+  if (!result->is_dir && file_meta_has_suffix(result->path, ".enc")) {
+    result->enc_status = crypto_probe_file(result->path) == CRYPTO_SUCCESS
+                             ? FILE_META_ENC_VALID
+                             : FILE_META_ENC_INVALID;
+  }
+}
+
+// must be called with meta_lock held
+static int file_meta_is_queued(const char *path) {
+  if (strcmp(meta_in_flight, path) == 0) {
+    return 1;
+  }
+  for (int i = 0; i < meta_num_results; i++) {
+    if (strcmp(meta_results[i].path, path) == 0) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static void *file_meta_thread(void *arg) {
+  (void)arg;
+  FileMetaResult result;
+
+  pthread_mutex_lock(&meta_lock);
+  while (meta_running) {
+    if (meta_next_wanted >= meta_num_wanted ||
+        meta_num_results == FILE_META_MAX_RESULTS) {
+      pthread_cond_wait(&meta_cond, &meta_lock);
+      continue;
+    }
+    const char *path = meta_wanted[meta_next_wanted++];
+    if (file_meta_is_queued(path)) {
+      continue;
+    }
+    memset(&result, 0, sizeof(result));
+    strcpy(result.path, path);
+    strcpy(meta_in_flight, path);
+    pthread_mutex_unlock(&meta_lock);
+
+    file_meta_lookup(&result);
+
+    pthread_mutex_lock(&meta_lock);
+    meta_in_flight[0] = '\0';
+    meta_results[meta_num_results++] = result;
+  }
+  pthread_mutex_unlock(&meta_lock);
+  return NULL;
+}
+
+int file_meta_start() {
+  pthread_mutex_lock(&meta_lock);
+  if (meta_running) {
+    pthread_mutex_unlock(&meta_lock);
+    return FILE_META_SUCCESS;
+  }
+  meta_running = 1;
+  meta_num_wanted = meta_next_wanted = meta_num_results = 0;
+  pthread_mutex_unlock(&meta_lock);
+
+  if (pthread_create(&meta_thread, NULL, file_meta_thread, NULL) != 0) {
+    meta_running = 0;
+    return FILE_META_ERROR;
+  }
+  return FILE_META_SUCCESS;
+}
+
+void file_meta_stop() {
+  pthread_mutex_lock(&meta_lock);
+  if (!meta_running) {
+    pthread_mutex_unlock(&meta_lock);
+    return;
+  }
+  meta_running = 0;
+  pthread_cond_signal(&meta_cond);
+  pthread_mutex_unlock(&meta_lock);
+  pthread_join(meta_thread, NULL);
+}
+
+// replaces the work list with the nodes that still lack metadata, in the
+// order given (the rows on screen), dropping anything that scrolled away
+void file_meta_want(FileNode **nodes, int count) {
+  pthread_mutex_lock(&meta_lock);
+  meta_num_wanted = 0;
+  meta_next_wanted = 0;
+  for (int i = 0; i < count && meta_num_wanted < FILE_META_MAX_WANTED; i++) {
+    if (!nodes[i]->meta_ready) {
+      strcpy(meta_wanted[meta_num_wanted++], nodes[i]->path);
+    }
+  }
+  if (meta_num_wanted > 0) {
+    pthread_cond_signal(&meta_cond);
+  }
+  pthread_mutex_unlock(&meta_lock);
+}
+
+// non-zero while requested metadata has not been applied to the tree yet
+int file_meta_pending() {
+  if (!meta_running) {
+    return 0;
+  }
+  pthread_mutex_lock(&meta_lock);
+  int pending = meta_next_wanted < meta_num_wanted || meta_num_results > 0 ||
+                meta_in_flight[0] != '\0';
+  pthread_mutex_unlock(&meta_lock);
+  return pending;
+}
+
+// copies finished lookups into the matching nodes of 'root', returning how
+// many nodes changed. must be called from the thread that owns the tree
+int file_meta_apply(FileNode *root) {
+  static FileMetaResult ready[FILE_META_MAX_RESULTS];
+
+  pthread_mutex_lock(&meta_lock);
+  int num_ready = meta_num_results;
+  memcpy(ready, meta_results, num_ready * sizeof(FileMetaResult));
+  meta_num_results = 0;
+  if (num_ready > 0) {
+    pthread_cond_signal(&meta_cond);
+  }
+  pthread_mutex_unlock(&meta_lock);
+
+  int updated = 0;
+  for (int i = 0; i < num_ready; i++) {
+    FileNode *node = file_tree_get_by_path(root, ready[i].path);
+    if (!node) {
+      continue; // the tree changed while the lookup was running
+    }
+    node->meta_ready = 1;
+    if (ready[i].found) {
+      node->size = ready[i].size;
+      node->mtime = ready[i].mtime;
+      node->enc_status = ready[i].enc_status;
+      node->type = ready[i].type;
+    }
+    updated++;
+  }
+  return updated;
+}
@@ -0,0 +1,20 @@
+#ifndef FILE_META_H
+#define FILE_META_H
+
+#include "file_tree.h"
+
+#define FILE_META_SUCCESS 1
+#define FILE_META_ERROR -1
+
+// values of FileNode.enc_status
+#define FILE_META_ENC_NONE 0    // not a .enc file
+#define FILE_META_ENC_VALID 1   // .enc with a well-formed header and stream
+#define FILE_META_ENC_INVALID 2 // .enc that is truncated or unreadable
+
+int file_meta_start();
+void file_meta_stop();
+void file_meta_want(FileNode **nodes, int count);
+int file_meta_pending();
+int file_meta_apply(FileNode *root);
+
+#endif
@@ -0,0 +1,276 @@
+#include "file_search.h"
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// how many candidates are tested between two looks at the clock
+#define SEARCH_CLOCK_INTERVAL 4096
+
+// maps a lower-cased character to one of 40 classes: letters, digits, a few
+// common punctuation characters and "anything else"
+static unsigned long long file_search_char_bit(unsigned char c) {
+  if (c >= 'a' && c <= 'z') {
+    return 1ULL << (c - 'a');
+  }
+  if (c >= '0' && c <= '9') {
+    return 1ULL << (26 + c - '0');
+  }
+  switch (c) {
+  case '.':
+    return 1ULL << 36;
+  case '_':
+    return 1ULL << 37;
+  case '-':
+    return 1ULL << 38;
+  default:
+    return 1ULL << 39;
+  }
+}
+
+static unsigned long long file_search_mask(const char *str) {
+  unsigned long long mask = 0;
+  for (const unsigned char *p = (const unsigned char *)str; *p; p++) {
+    mask |= file_search_char_bit(*p);
+  }
+  return mask;
+}
+
+static long file_search_now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+static int file_search_collect(FileSearchIndex *index, FileNode *node,
+                               size_t *names_len, size_t *names_capacity) {
+  size_t name_len = strlen(node->name);
+  if (*names_len + name_len + 1 > *names_capacity) {
+    size_t new_capacity = *names_capacity * 2;
+    while (*names_len + name_len + 1 > new_capacity) {
+      new_capacity *= 2;
+    }
+    char *new_names = (char *)realloc(index->names, new_capacity);
+    if (!new_names) {
+      return 0;
+    }
+    index->names = new_names;
+    *names_capacity = new_capacity;
+  }
+
+  char *name = index->names + *names_len;
+  for (size_t i = 0; i <= name_len; i++) {
+    name[i] = (char)tolower((unsigned char)node->name[i]);
+  }
+  index->nodes[index->count] = node;
+  index->masks[index->count] = file_search_mask(name);
+  index->name_offsets[index->count] = (unsigned int)*names_len;
+  index->count++;
+  *names_len += name_len + 1;
+
+  for (int i = 0; i < node->num_children; i++) {
+    if (!file_search_collect(index, node->children[i], names_len,
+                             names_capacity)) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+FileSearchIndex *file_search_index_create(FileNode *root) {
+  if (!root) {
+    return NULL;
+  }
+  FileSearchIndex *index =
+      (FileSearchIndex *)calloc(1, sizeof(FileSearchIndex));
+  if (!index) {
+    return NULL;
+  }
+
+  int total_nodes = file_tree_count_nodes(root);
+  size_t names_capacity = (size_t)total_nodes * 16 + 64;
+  index->root = root;
+  index->generation = file_tree_get_generation(root);
+  index->nodes = (FileNode **)malloc(total_nodes * sizeof(FileNode *));
+  index->masks =
+      (unsigned long long *)malloc(total_nodes * sizeof(unsigned long long));
+  index->name_offsets =
+      (unsigned int *)malloc(total_nodes * sizeof(unsigned int));
+  index->names = (char *)malloc(names_capacity);
+  if (!index->nodes || !index->masks || !index->name_offsets ||
+      !index->names) {
+    file_search_index_destroy(index);
+    return NULL;
+  }
+
+  size_t names_len = 0;
+  if (!file_search_collect(index, root, &names_len, &names_capacity)) {
+    file_search_index_destroy(index);
+    return NULL;
+  }
+  return index;
+}
+
+void file_search_index_destroy(FileSearchIndex *index) {
+  if (!index) {
+    return;
+  }
+  free(index->nodes);
+  free(index->masks);
+  free(index->name_offsets);
+  free(index->names);
+  free(index);
+}
+
+int file_search_index_is_stale(const FileSearchIndex *index, FileNode *root) {
+  return !index || index->root != root ||
+         index->generation != file_tree_get_generation(root);
+}
+
+FileSearch *file_search_create(const FileSearchIndex *index) {
+  FileSearch *search = (FileSearch *)calloc(1, sizeof(FileSearch));
+  if (!search) {
+    return NULL;
+  }
+  search->index = index;
+  search->complete[0] = 1; // the empty query matches everything
+  search->num_candidates = index ? index->count : 0;
+  search->cursor = search->num_candidates;
+  return search;
+}
+
+void file_search_destroy(FileSearch *search) {
+  if (!search) {
+    return;
+  }
+  for (int i = 0; i <= FILE_SEARCH_MAX_QUERY; i++) {
+    free(search->matches[i]);
+  }
+  free(search);
+}
+
+static void file_search_drop_level(FileSearch *search, int level) {
+  free(search->matches[level]);
+  search->matches[level] = NULL;
+  search->num_matches[level] = 0;
+  search->complete[level] = 0;
+}
+
+void file_search_set_query(FileSearch *search, const char *query) {
+  char lowered[FILE_SEARCH_MAX_QUERY + 1];
+  int len = 0;
+  for (; query[len] && len < FILE_SEARCH_MAX_QUERY; len++) {
+    lowered[len] = (char)tolower((unsigned char)query[len]);
+  }
+  lowered[len] = '\0';
+
+  // result sets stay valid for the prefix the old and new query share
+  int common = 0;
+  while (common < len && common < search->query_len &&
+         lowered[common] == search->query[common]) {
+    common++;
+  }
+  for (int level = common + 1; level <= FILE_SEARCH_MAX_QUERY; level++) {
+    if (search->matches[level] || search->complete[level]) {
+      file_search_drop_level(search, level);
+    }
+  }
+
+  memcpy(search->query, lowered, len + 1);
+  search->query_len = len;
+
+  // narrow the deepest finished result set that the new query extends
+  int base = common;
+  while (base > 0 && !search->complete[base]) {
+    base--;
+  }
+  if (base == len) {
+    search->num_candidates = 0;
+    search->cursor = 0;
+    return;
+  }
+  if (search->matches[len]) {
+    file_search_drop_level(search, len);
+  }
+
+  search->candidates = base > 0 ? search->matches[base] : NULL;
+  search->num_candidates =
+      base > 0 ? search->num_matches[base] : search->index->count;
+  search->cursor = 0;
+  search->matches[len] = (int *)malloc(
+      (search->num_candidates ? search->num_candidates : 1) * sizeof(int));
+  if (!search->matches[len]) {
+    search->num_candidates = 0;
+  }
+}
+
+// tests candidates for at most 'budget_ns' nanoseconds, returning 1 once the
+// current query has been fully evaluated
+int file_search_step(FileSearch *search, long budget_ns) {
+  if (file_search_is_complete(search)) {
+    return 1;
+  }
+
+  const FileSearchIndex *index = search->index;
+  const char *query = search->query;
+  unsigned long long query_mask = file_search_mask(query);
+  int len = search->query_len;
+  int *out = search->matches[len];
+  int count = search->num_matches[len];
+  long deadline = file_search_now_ns() + budget_ns;
+
+  while (search->cursor < search->num_candidates) {
+    int end = search->cursor + SEARCH_CLOCK_INTERVAL;
+    if (end > search->num_candidates) {
+      end = search->num_candidates;
+    }
+    for (; search->cursor < end; search->cursor++) {
+      int node_idx = search->candidates ? search->candidates[search->cursor]
+                                        : search->cursor;
+      if ((index->masks[node_idx] & query_mask) != query_mask) {
+        continue;
+      }
+      const char *name = index->names + index->name_offsets[node_idx];
+      const char *q = query;
+      for (; *name && *q; name++) {
+        if (*name == *q) {
+          q++;
+        }
+      }
+      if (*q == '\0') {
+        out[count++] = node_idx;
+      }
+    }
+    if (file_search_now_ns() >= deadline) {
+      break;
+    }
+  }
+
+  search->num_matches[len] = count;
+  if (search->cursor >= search->num_candidates) {
+    search->complete[len] = 1;
+    return 1;
+  }
+  return 0;
+}
+
+int file_search_is_complete(const FileSearch *search) {
+  return search->complete[search->query_len];
+}
+
+int file_search_result_count(const FileSearch *search) {
+  if (search->query_len == 0) {
+    return search->index ? search->index->count : 0;
+  }
+  return search->num_matches[search->query_len];
+}
+
+FileNode *file_search_result(const FileSearch *search, int result_idx) {
+  if (result_idx < 0 || result_idx >= file_search_result_count(search)) {
+    return NULL;
+  }
+  if (search->query_len == 0) {
+    return search->index->nodes[result_idx];
+  }
+  return search->index->nodes[search->matches[search->query_len][result_idx]];
+}
@@ -0,0 +1,46 @@
+#ifndef FILE_SEARCH_H
+#define FILE_SEARCH_H
+
+#include "file_tree.h"
+
+#define FILE_SEARCH_MAX_QUERY 64
+
+// flat, cache-friendly copy of every name in a tree, built once per tree
+typedef struct FileSearchIndex {
+  FileNode *root;
+  unsigned long generation;  // tree generation the index was built from
+  FileNode **nodes;          // every node, in pre-order
+  unsigned long long *masks; // set of character classes present in each name
+  unsigned int *name_offsets;
+  char *names; // lower-cased names, NUL separated
+  int count;
+} FileSearchIndex;
+
+// incremental fuzzy (subsequence) search over a FileSearchIndex. the result
+// set for every prefix of the query is kept, so typing another character only
+// rescans the previous matches and deleting one is free
+typedef struct FileSearch {
+  const FileSearchIndex *index;
+  char query[FILE_SEARCH_MAX_QUERY + 1];
+  int query_len;
+  int *matches[FILE_SEARCH_MAX_QUERY + 1]; // matches[n]: first n characters
+  int num_matches[FILE_SEARCH_MAX_QUERY + 1];
+  int complete[FILE_SEARCH_MAX_QUERY + 1];
+  const int *candidates; // NULL scans every node of the index
+  int num_candidates;
+  int cursor; // next candidate to test for the current query
+} FileSearch;
+
+FileSearchIndex *file_search_index_create(FileNode *root);
+void file_search_index_destroy(FileSearchIndex *index);
+int file_search_index_is_stale(const FileSearchIndex *index, FileNode *root);
+
+FileSearch *file_search_create(const FileSearchIndex *index);
+void file_search_destroy(FileSearch *search);
+void file_search_set_query(FileSearch *search, const char *query);
+int file_search_step(FileSearch *search, long budget_ns);
+int file_search_is_complete(const FileSearch *search);
+int file_search_result_count(const FileSearch *search);
+FileNode *file_search_result(const FileSearch *search, int result_idx);
+
+#endif
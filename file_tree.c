@@ -1,11 +1,195 @@
 #include "file_tree.h"
+#include "stats.h"
 #include <dirent.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
 
-FileNode *file_tree_create(const char *path, int show_hidden) {
+#define INDEX_INITIAL_BUCKETS 1024
+
+// source of tree generations. shared by all trees so that a generation
+// never repeats, even for a new tree allocated where an old one was freed
+static atomic_ulong file_tree_generations;
+
+// open hash table mapping a full path to its node, chained through
+// FileNode.hash_next so that the index costs no allocation per node
+typedef struct FileTreeIndex {
+  FileNode **buckets;
+  size_t num_buckets; // always a power of two
+  size_t count;
+  size_t num_marked; // nodes with 'marked' set
+  unsigned long generation; // bumped whenever a node is added or removed
+
+  // pre-order listing of the tree, i.e. the rows of the file browser,
+  // rebuilt lazily once the generation moves on
+  FileNode **rows;
+  size_t rows_capacity;
+  size_t num_rows;
+  unsigned long rows_generation;
+} FileTreeIndex;
+
+// 64-bit FNV-1a
+static unsigned long long file_tree_hash_path(const char *path) {
+  unsigned long long hash = 0xcbf29ce484222325ULL;
+  for (const unsigned char *p = (const unsigned char *)path; *p; p++) {
+    hash ^= *p;
+    hash *= 0x100000001b3ULL;
+  }
+  return hash;
+}
+
+static FileTreeIndex *file_tree_index_create() {
+  FileTreeIndex *index = (FileTreeIndex *)malloc(sizeof(FileTreeIndex));
+  if (!index) {
+    return NULL;
+  }
+  index->buckets =
+      (FileNode **)calloc(INDEX_INITIAL_BUCKETS, sizeof(FileNode *));
+  if (!index->buckets) {
+    free(index);
+    return NULL;
+  }
+  index->num_buckets = INDEX_INITIAL_BUCKETS;
+  index->count = 0;
+  index->num_marked = 0;
+  index->generation = 0;
+  index->rows = NULL;
+  index->rows_capacity = 0;
+  index->num_rows = 0;
+  index->rows_generation = 0;
+  return index;
+}
+
+static void file_tree_index_destroy(FileTreeIndex *index) {
+  if (!index) {
+    return;
+  }
+  free(index->buckets);
+  free(index->rows);
+  free(index);
+}
+
+// doubles the bucket array, rehashing from the cached path hashes
+static void file_tree_index_grow(FileTreeIndex *index) {
+  size_t new_num_buckets = index->num_buckets * 2;
+  FileNode **new_buckets =
+      (FileNode **)calloc(new_num_buckets, sizeof(FileNode *));
+  if (!new_buckets) {
+    return; // keep chaining in the old table, lookups stay correct
+  }
+  for (size_t i = 0; i < index->num_buckets; i++) {
+    FileNode *node = index->buckets[i];
+    while (node) {
+      FileNode *next = node->hash_next;
+      size_t bucket = node->path_hash & (new_num_buckets - 1);
+      node->hash_next = new_buckets[bucket];
+      new_buckets[bucket] = node;
+      node = next;
+    }
+  }
+  free(index->buckets);
+  index->buckets = new_buckets;
+  index->num_buckets = new_num_buckets;
+}
+
+static void file_tree_index_insert(FileTreeIndex *index, FileNode *node) {
+  if (!index) {
+    return;
+  }
+  if (index->count >= index->num_buckets) {
+    file_tree_index_grow(index);
+  }
+  size_t bucket = node->path_hash & (index->num_buckets - 1);
+  node->hash_next = index->buckets[bucket];
+  index->buckets[bucket] = node;
+  index->count++;
+  index->generation = atomic_fetch_add(&file_tree_generations, 1) + 1;
+}
+
+static void file_tree_index_remove(FileTreeIndex *index, FileNode *node) {
+  if (!index) {
+    return;
+  }
+  FileNode **link = &index->buckets[node->path_hash & (index->num_buckets - 1)];
+  while (*link) {
+    if (*link == node) {
+      *link = node->hash_next;
+      node->hash_next = NULL;
+      index->count--;
+      if (node->marked) {
+        index->num_marked--;
+      }
+      index->generation = atomic_fetch_add(&file_tree_generations, 1) + 1;
+      return;
+    }
+    link = &(*link)->hash_next;
+  }
+}
+
+static void file_tree_index_remove_subtree(FileTreeIndex *index,
+                                           FileNode *node) {
+  file_tree_index_remove(index, node);
+  for (int i = 0; i < node->num_children; i++) {
+    file_tree_index_remove_subtree(index, node->children[i]);
+  }
+}
+
+static FileNode *file_tree_index_lookup(const FileTreeIndex *index,
+                                        const char *path) {
+  unsigned long long hash = file_tree_hash_path(path);
+  FileNode *node = index->buckets[hash & (index->num_buckets - 1)];
+  for (; node; node = node->hash_next) {
+    if (node->path_hash == hash && strcmp(node->path, path) == 0) {
+      return node;
+    }
+  }
+  return NULL;
+}
+
+static int file_tree_add_child(FileNode *parent, FileNode *child) {
+  if (parent->num_children == parent->children_capacity) {
+    int new_capacity =
+        parent->children_capacity ? parent->children_capacity * 2 : 8;
+    FileNode **new_children = (FileNode **)realloc(
+        parent->children, new_capacity * sizeof(FileNode *));
+    if (!new_children) {
+      return 0;
+    }
+    parent->children = new_children;
+    parent->children_capacity = new_capacity;
+  }
+  child->parent = parent;
+  parent->children[parent->num_children++] = child;
+  return 1;
+}
+
+static void file_tree_free_subtree(FileNode *node) {
+  for (int i = 0; i < node->num_children; i++) {
+    file_tree_free_subtree(node->children[i]);
+  }
+  free(node->children);
+  free(node);
+}
+
+// builds "<dir>/<name>" the same way for every node in the tree
+void file_tree_join_path(char *out, const char *dir, const char *name) {
+  if (strcmp(dir, "/") == 0) {
+    snprintf(out, MAX_PATH_LENGTH, "/%s", name);
+  } else {
+    int dir_len = strlen(dir);
+    if (dir[dir_len - 1] == '/') { // prevents double addition of '/'
+      snprintf(out, MAX_PATH_LENGTH, "%s%s", dir, name);
+    } else {
+      snprintf(out, MAX_PATH_LENGTH, "%s/%s", dir, name);
+    }
+  }
+  out[MAX_PATH_LENGTH - 1] = '\0';
+}
+
+// allocates a node for 'path' and indexes it, without touching the disk
+static FileNode *file_tree_alloc_node(const char *path, FileTreeIndex *index) {
   FileNode *node = (FileNode *)malloc(sizeof(FileNode));
 
   if (!node) {
@@ -15,6 +199,7 @@ FileNode *file_tree_create(const char *path, int show_hidden) {
   memset(node, 0, sizeof(FileNode));
   strncpy(node->path, path, MAX_PATH_LENGTH - 1);
   node->path[MAX_PATH_LENGTH - 1] = '\0';
+  node->path_hash = file_tree_hash_path(node->path);
 
   // extract the name from the path (the part after the last '/')
   const char *basename = strrchr(path, '/');
@@ -30,9 +215,25 @@ FileNode *file_tree_create(const char *path, int show_hidden) {
     strcpy(node->name, "/");
   }
 
+  file_tree_index_insert(index, node);
+  return node;
+}
+
+static FileNode *file_tree_create_node(const char *path, int show_hidden,
+                                       FileTreeIndex *index) {
+  FileNode *node = file_tree_alloc_node(path, index);
+
+  if (!node) {
+    return NULL;
+  }
+
   struct stat st;
   // get file status to determine if it's a directory.
-  node->is_dir = stat(path, &st) == 0 ? S_ISDIR(st.st_mode) : 0;
+  if (stat(path, &st) == 0) {
+    node->is_dir = S_ISDIR(st.st_mode);
+    node->size = st.st_size;
+    node->mtime = st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+  }
 
   if (node->is_dir) {
     DIR *dir = opendir(path);
@@ -51,28 +252,13 @@ FileNode *file_tree_create(const char *path, int show_hidden) {
         }
 
         char child_path[MAX_PATH_LENGTH];
-        // construct the child path
-        if (strcmp(path, "/") == 0) {
-          snprintf(child_path, MAX_PATH_LENGTH, "/%s", entry->d_name);
-        } else {
-          int path_len = strlen(path);
-          if (path[path_len - 1] == '/') { // prevents double addition of '/'
-            snprintf(child_path, MAX_PATH_LENGTH, "%s%s", path, entry->d_name);
-          } else {
-            snprintf(child_path, MAX_PATH_LENGTH, "%s/%s", path, entry->d_name);
-          }
-        }
-        child_path[MAX_PATH_LENGTH - 1] = '\0';
-
-        FileNode *child = file_tree_create(child_path, show_hidden);
-        if (child != NULL) {
-          child->parent = node;
-          if (node->num_children < MAX_CHILDREN) {
-            node->children[node->num_children++] = child;
-          } else {
-            free(child);
-            break;
-          }
+        file_tree_join_path(child_path, path, entry->d_name);
+
+        FileNode *child = file_tree_create_node(child_path, show_hidden, index);
+        if (child != NULL && !file_tree_add_child(node, child)) {
+          file_tree_index_remove_subtree(index, child);
+          file_tree_free_subtree(child);
+          break;
         }
       }
       closedir(dir);
@@ -81,23 +267,41 @@ FileNode *file_tree_create(const char *path, int show_hidden) {
   return node;
 }
 
+FileNode *file_tree_create(const char *path, int show_hidden) {
+  FileTreeIndex *index = file_tree_index_create();
+  if (!index) {
+    return NULL;
+  }
+  long long scan_start = stats_enabled() ? stats_now_ns() : 0;
+  FileNode *root = file_tree_create_node(path, show_hidden, index);
+  if (!root) {
+    file_tree_index_destroy(index);
+    return NULL;
+  }
+  root->index = index;
+  if (scan_start) {
+    stats_record_tree_scan(path, (int)index->count,
+                           stats_now_ns() - scan_start);
+  }
+  return root;
+}
+
 void file_tree_destroy(FileNode *node_to_destroy) {
   if (!node_to_destroy) {
     return;
   }
-  // recursively destroy all child nodes
-  for (int i = 0; i < node_to_destroy->num_children; i++) {
-    file_tree_destroy(node_to_destroy->children[i]);
-    node_to_destroy->children[i] = NULL;
-  }
-  free(node_to_destroy);
-  node_to_destroy = NULL;
+  file_tree_index_destroy(node_to_destroy->index);
+  file_tree_free_subtree(node_to_destroy);
 }
 
 FileNode *file_tree_get_by_path(FileNode *root, const char *path) {
   if (!root) {
     return NULL;
   }
+  if (root->index) {
+    return file_tree_index_lookup(root->index, path);
+  }
+  // subtrees carry no index of their own, fall back to a walk
   if (strcmp(root->path, path) == 0) {
     return root;
   }
@@ -110,11 +314,65 @@ FileNode *file_tree_get_by_path(FileNode *root, const char *path) {
   return NULL;
 }
 
+static void file_tree_flatten(FileTreeIndex *index, FileNode *node,
+                              int depth) {
+  node->depth = depth;
+  index->rows[index->num_rows++] = node;
+  for (int i = 0; i < node->num_children; i++) {
+    file_tree_flatten(index, node->children[i], depth + 1);
+  }
+}
+
+static int file_tree_update_rows(FileTreeIndex *index, FileNode *root) {
+  if (index->rows && index->rows_generation == index->generation) {
+    return 1;
+  }
+  if (index->rows_capacity < index->count) {
+    FileNode **new_rows =
+        (FileNode **)realloc(index->rows, index->count * sizeof(FileNode *));
+    if (!new_rows) {
+      return 0;
+    }
+    index->rows = new_rows;
+    index->rows_capacity = index->count;
+  }
+  index->num_rows = 0;
+  file_tree_flatten(index, root, 0);
+  index->rows_generation = index->generation;
+  return 1;
+}
+
+// returns the node shown on browser row 'row' (pre-order position). with the
+// root's index this is a lookup into a cached flat listing whose nodes also
+// carry their depth; without it the tree is walked
+FileNode *file_tree_get_row(FileNode *root, int row) {
+  if (!root || row < 0) {
+    return NULL;
+  }
+  if (root->index && file_tree_update_rows(root->index, root)) {
+    if ((size_t)row >= root->index->num_rows) {
+      return NULL;
+    }
+    return root->index->rows[row];
+  }
+  int num_visited = 0;
+  return file_tree_get_by_index(root, row, &num_visited);
+}
+
 FileNode *file_tree_get_by_index(FileNode *root, int index, int *num_visited) {
   if (!root) {
     return NULL;
   }
 
+  if (*num_visited == 0 && root->index &&
+      file_tree_update_rows(root->index, root)) {
+    if (index < 0 || (size_t)index >= root->index->num_rows) {
+      return NULL;
+    }
+    *num_visited = index;
+    return root->index->rows[index];
+  }
+
   if (*num_visited == index) {
     return root;
   }
@@ -136,9 +394,229 @@ int file_tree_count_nodes(FileNode *root) {
   if (!root) {
     return 0;
   }
+  if (root->index) {
+    return (int)root->index->count; // every node of the tree is indexed
+  }
   int count = 1;
   for (int i = 0; i < root->num_children; i++) {
     count += file_tree_count_nodes(root->children[i]);
   }
   return count;
 }
+
+// adds 'path' (and its subtree, for directories) under its parent directory
+// node, returning the existing node if it is already indexed
+FileNode *file_tree_insert(FileNode *root, const char *path, int show_hidden) {
+  if (!root || !path) {
+    return NULL;
+  }
+  FileNode *existing = file_tree_get_by_path(root, path);
+  if (existing) {
+    return existing;
+  }
+
+  const char *slash = strrchr(path, '/');
+  if (!slash) {
+    return NULL; // every path below the root contains a '/'
+  }
+
+  char parent_path[MAX_PATH_LENGTH];
+  size_t parent_len = slash - path;
+  if (parent_len >= MAX_PATH_LENGTH) {
+    return NULL;
+  }
+  memcpy(parent_path, path, parent_len);
+  parent_path[parent_len] = '\0';
+
+  FileNode *parent =
+      file_tree_get_by_path(root, parent_len ? parent_path : "/");
+  if (!parent && parent_len + 1 < MAX_PATH_LENGTH) {
+    // the root may have been given with a trailing '/'
+    parent_path[parent_len] = '/';
+    parent_path[parent_len + 1] = '\0';
+    parent = file_tree_get_by_path(root, parent_path);
+  }
+  if (!parent || !parent->is_dir) {
+    return NULL;
+  }
+
+  struct stat st;
+  if (stat(path, &st) != 0) {
+    return NULL;
+  }
+
+  FileNode *node = file_tree_create_node(path, show_hidden, root->index);
+  if (!node) {
+    return NULL;
+  }
+  if (!file_tree_add_child(parent, node)) {
+    file_tree_index_remove_subtree(root->index, node);
+    file_tree_free_subtree(node);
+    return NULL;
+  }
+  return node;
+}
+
+// detaches 'node' from the tree rooted at 'root' and frees its subtree
+void file_tree_remove(FileNode *root, FileNode *node) {
+  if (!root || !node || node == root || !node->parent) {
+    return;
+  }
+  FileNode *parent = node->parent;
+  for (int i = 0; i < parent->num_children; i++) {
+    if (parent->children[i] == node) {
+      memmove(&parent->children[i], &parent->children[i + 1],
+              (parent->num_children - i - 1) * sizeof(FileNode *));
+      parent->num_children--;
+      break;
+    }
+  }
+  file_tree_index_remove_subtree(root->index, node);
+  file_tree_free_subtree(node);
+}
+
+// changes whenever nodes are inserted into or removed from the tree, so
+// derived structures (e.g. search indexes) know when to rebuild
+unsigned long file_tree_get_generation(FileNode *root) {
+  if (!root || !root->index) {
+    return 0;
+  }
+  return root->index->generation;
+}
+
+// marks are kept on the nodes themselves and counted by the root's index,
+// so toggling one is O(1) and the count is always at hand. they do not
+// change the generation: the rows stay the same
+void file_tree_set_marked(FileNode *root, FileNode *node, int marked) {
+  if (!root || !node || node->marked == (marked != 0)) {
+    return;
+  }
+  node->marked = marked != 0;
+  if (root->index) {
+    if (marked) {
+      root->index->num_marked++;
+    } else {
+      root->index->num_marked--;
+    }
+  }
+}
+
+int file_tree_count_marked(FileNode *root) {
+  if (!root || !root->index) {
+    return 0;
+  }
+  return (int)root->index->num_marked;
+}
+
+// copies up to 'max' marked nodes into 'out' in browser order
+int file_tree_get_marked(FileNode *root, FileNode **out, int max) {
+  if (file_tree_count_marked(root) == 0 ||
+      !file_tree_update_rows(root->index, root)) {
+    return 0;
+  }
+  int count = 0;
+  for (size_t i = 0; i < root->index->num_rows && count < max; i++) {
+    if (root->index->rows[i]->marked) {
+      out[count++] = root->index->rows[i];
+    }
+  }
+  return count;
+}
+
+void file_tree_clear_marks(FileNode *root) {
+  if (file_tree_count_marked(root) == 0 ||
+      !file_tree_update_rows(root->index, root)) {
+    return;
+  }
+  for (size_t i = 0; i < root->index->num_rows; i++) {
+    root->index->rows[i]->marked = 0;
+  }
+  root->index->num_marked = 0;
+}
+
+// creates a root node with an empty index, without scanning 'path'
+FileNode *file_tree_create_root(const char *path, int is_dir) {
+  FileTreeIndex *index = file_tree_index_create();
+  if (!index) {
+    return NULL;
+  }
+  FileNode *root = file_tree_alloc_node(path, index);
+  if (!root) {
+    file_tree_index_destroy(index);
+    return NULL;
+  }
+  root->is_dir = is_dir;
+  root->index = index;
+  return root;
+}
+
+// attaches a node for 'name' under 'parent' from already known metadata,
+// without touching the disk (used when restoring a tree from a snapshot)
+FileNode *file_tree_add_node(FileNode *root, FileNode *parent,
+                             const char *name, int is_dir, long long size,
+                             long long mtime) {
+  if (!root || !parent) {
+    return NULL;
+  }
+  char path[MAX_PATH_LENGTH];
+  file_tree_join_path(path, parent->path, name);
+
+  FileNode *node = file_tree_alloc_node(path, root->index);
+  if (!node) {
+    return NULL;
+  }
+  node->is_dir = is_dir;
+  node->size = size;
+  node->mtime = mtime;
+  if (!file_tree_add_child(parent, node)) {
+    file_tree_index_remove(root->index, node);
+    free(node);
+    return NULL;
+  }
+  return node;
+}
+
+static int file_tree_copy_children(FileNode *root, FileNode *to,
+                                   const FileNode *from) {
+  for (int i = 0; i < from->num_children; i++) {
+    const FileNode *child = from->children[i];
+    FileNode *node = file_tree_add_node(root, to, child->name, child->is_dir,
+                                        child->size, child->mtime);
+    if (!node || !file_tree_copy_children(root, node, child)) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+// duplicates the shape of the tree (names, kinds, sizes and times) into a new
+// tree with its own index and browser rows, without touching the disk. marks
+// and metadata are left behind
+FileNode *file_tree_copy(const FileNode *root) {
+  if (!root) {
+    return NULL;
+  }
+  FileNode *copy = file_tree_create_root(root->path, root->is_dir);
+  if (!copy) {
+    return NULL;
+  }
+  copy->size = root->size;
+  copy->mtime = root->mtime;
+  if (!file_tree_copy_children(copy, copy, root) ||
+      !file_tree_update_rows(copy->index, copy)) {
+    file_tree_destroy(copy);
+    return NULL;
+  }
+  return copy;
+}
+
+// the browser row 'node' is shown on, -1 if it is not part of the tree
+int file_tree_get_row_index(FileNode *root, const FileNode *node) {
+  FileNode *row_node;
+  for (int row = 0; (row_node = file_tree_get_row(root, row)); row++) {
+    if (row_node == node) {
+      return row;
+    }
+  }
+  return -1;
+}
@@ -1,17 +1,31 @@
 #ifndef FILE_TREE_H
 #define FILE_TREE_H
 
+#include <stddef.h>
+
 #define MAX_PATH_LENGTH 512
 #define MAX_NAME_LENGTH 256
-#define MAX_CHILDREN 100
+
+struct FileTreeIndex;
 
 typedef struct FileNode {
   char name[MAX_NAME_LENGTH];
   char path[MAX_PATH_LENGTH];
   unsigned int is_dir : 1;
+  unsigned int meta_ready : 1; // size/mtime/enc_status checked by file_meta
+  unsigned int enc_status : 2;
+  unsigned int marked : 1; // part of the browser's multi-selection
+  const char *type; // label from file_type_describe, NULL until known
+  long long size;
+  long long mtime; // nanoseconds since the epoch
+  int depth; // distance from the root, refreshed by file_tree_get_row
   struct FileNode *parent;
-  struct FileNode *children[MAX_CHILDREN];
+  struct FileNode **children;
   int num_children;
+  int children_capacity;
+  unsigned long long path_hash; // hash of 'path', used by the index
+  struct FileNode *hash_next;   // next node in the same index bucket
+  struct FileTreeIndex *index;  // path -> node index, only set on the root
 } FileNode;
 
 FileNode *file_tree_create(const char *path, int show_hidden);
@@ -19,5 +33,23 @@ void file_tree_destroy(FileNode *root);
 FileNode *file_tree_get_by_path(FileNode *root, const char *path);
 FileNode *file_tree_get_by_index(FileNode *root, int index, int *current_index);
 int file_tree_count_nodes(FileNode *root);
+FileNode *file_tree_get_row(FileNode *root, int row);
+
+FileNode *file_tree_insert(FileNode *root, const char *path, int show_hidden);
+void file_tree_remove(FileNode *root, FileNode *node);
+unsigned long file_tree_get_generation(FileNode *root);
+
+void file_tree_set_marked(FileNode *root, FileNode *node, int marked);
+int file_tree_count_marked(FileNode *root);
+int file_tree_get_marked(FileNode *root, FileNode **out, int max);
+void file_tree_clear_marks(FileNode *root);
+
+FileNode *file_tree_create_root(const char *path, int is_dir);
+FileNode *file_tree_add_node(FileNode *root, FileNode *parent,
+                             const char *name, int is_dir, long long size,
+                             long long mtime);
+void file_tree_join_path(char *out, const char *dir, const char *name);
+FileNode *file_tree_copy(const FileNode *root);
+int file_tree_get_row_index(FileNode *root, const FileNode *node);
 
 #endif
@@ -0,0 +1,342 @@
+#include "file_type.h"
+#include <fcntl.h>
+#include <magic.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+// labels come from, in order: the extension table, the magic-byte table and
+// finally libmagic. libmagic is opened once for the whole process, and every
+// answer is cached per (device, inode, mtime), so a file is classified at
+// most once while it stays unchanged. returned labels live until
+// file_type_cleanup and may be compared by pointer
+
+#define TYPE_CACHE_BUCKETS 4096
+#define TYPE_CACHE_MAX_ENTRIES 65536
+#define TYPE_SNIFF_BYTES 16
+
+typedef struct ExtensionType {
+  const char *extension;
+  const char *label;
+} ExtensionType;
+
+typedef struct SignatureType {
+  unsigned int offset;
+  unsigned int length;
+  const char *bytes;
+  const char *label;
+} SignatureType;
+
+typedef struct TypeCacheEntry {
+  dev_t dev;
+  ino_t ino;
+  long long mtime;
+  const char *label;
+  struct TypeCacheEntry *next;
+} TypeCacheEntry;
+
+typedef struct InternedLabel {
+  struct InternedLabel *next;
+  char label[];
+} InternedLabel;
+
+static const ExtensionType extension_types[] = {
+    {".enc", "Encrypted File"},
+    {".dec", "Decrypted File"},
+    {".txt", "Text File"},
+    {".c", "C Source"},
+    {".h", "C Source"},
+    {".zip", "Archive"},
+    {".tar", "Archive"},
+    {".gz", "Archive"},
+    {".bz2", "Archive"},
+    {".7z", "Archive"},
+    {".jpg", "JPEG Image"},
+    {".jpeg", "JPEG Image"},
+    {".jpe", "JPEG Image"},
+    {".jfif", "JPEG Image"},
+    {".png", "PNG Image"},
+    {".gif", "GIF Image"},
+    {".bmp", "BMP Image"},
+    {".pdf", "PDF Document"},
+    {".mp3", "MP3 Audio"},
+    {".wav", "WAV Audio"},
+    {".mp4", "MP4 Video"},
+    {".avi", "AVI Video"},
+    {".doc", "Word Document"},
+    {".docx", "Word Document"},
+    {".xls", "Excel Spreadsheet"},
+    {".xlsx", "Excel Spreadsheet"},
+    {".ppt", "PowerPoint Presentation"},
+    {".pptx", "PowerPoint Presentation"},
+    {".odt", "OpenDocument Text"},
+    {".ods", "OpenDocument Spreadsheet"},
+    {".odp", "OpenDocument Presentation"},
+    {".rtf", "Rich Text Format"},
+    {".csv", "CSV Data"},
+    {".html", "HTML Document"},
+    {".htm", "HTML Document"},
+    {".xml", "XML Data"},
+    {".json", "JSON Data"},
+};
+
+static const SignatureType signature_types[] = {
+    {0, 8, "\x89PNG\r\n\x1a\n", "PNG Image"},
+    {0, 3, "\xff\xd8\xff", "JPEG Image"},
+    {0, 4, "GIF8", "GIF Image"},
+    {0, 5, "%PDF-", "PDF Document"},
+    {0, 4, "PK\x03\x04", "Archive"},
+    {0, 2, "\x1f\x8b", "Archive"},
+    {0, 3, "BZh", "Archive"},
+    {0, 6, "\xfd" "7zXZ\x00", "Archive"},
+    {0, 6, "7z\xbc\xaf\x27\x1c", "Archive"},
+    {0, 4, "\x7f" "ELF", "ELF Executable"},
+    {0, 3, "ID3", "MP3 Audio"},
+    {8, 4, "WAVE", "WAV Audio"},
+    {8, 4, "AVI ", "AVI Video"},
+    {4, 4, "ftyp", "MP4 Video"},
+    {0, 16, "SQLite format 3\x00", "SQLite Database"},
+};
+
+static pthread_once_t magic_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t magic_lock = PTHREAD_MUTEX_INITIALIZER;
+static magic_t magic_cookie;
+static pthread_t preload_thread;
+static int preload_started;
+
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static TypeCacheEntry *cache_buckets[TYPE_CACHE_BUCKETS];
+static int cache_entries;
+static InternedLabel *interned_labels;
+
+static void file_type_load_magic() {
+  magic_t cookie = magic_open(MAGIC_SYMLINK);
+  if (cookie == NULL) {
+    return; // failed to initialize libmagic
+  }
+  if (magic_load(cookie, NULL) != 0) {
+    magic_close(cookie); // failed to load magic database
+    return;
+  }
+  magic_cookie = cookie;
+}
+
+static void *file_type_preload_thread(void *arg) {
+  (void)arg;
+  pthread_once(&magic_once, file_type_load_magic);
+  return NULL;
+}
+
+// starts parsing the magic database in the background, so that the first
+// lookup that needs it does not pay for it on the UI thread
+void file_type_preload() {
+  if (preload_started) {
+    return;
+  }
+  if (pthread_create(&preload_thread, NULL, file_type_preload_thread, NULL) ==
+      0) {
+    preload_started = 1;
+  }
+}
+
+void file_type_cleanup() {
+  if (preload_started) {
+    pthread_join(preload_thread, NULL);
+    preload_started = 0;
+  }
+  if (magic_cookie) {
+    magic_close(magic_cookie);
+    magic_cookie = NULL;
+  }
+
+  pthread_mutex_lock(&cache_lock);
+  for (int i = 0; i < TYPE_CACHE_BUCKETS; i++) {
+    while (cache_buckets[i]) {
+      TypeCacheEntry *next = cache_buckets[i]->next;
+      free(cache_buckets[i]);
+      cache_buckets[i] = next;
+    }
+  }
+  cache_entries = 0;
+  while (interned_labels) {
+    InternedLabel *next = interned_labels->next;
+    free(interned_labels);
+    interned_labels = next;
+  }
+  pthread_mutex_unlock(&cache_lock);
+}
+
+static size_t file_type_bucket(dev_t dev, ino_t ino) {
+  unsigned long long hash = (unsigned long long)ino * 0x9e3779b97f4a7c15ULL;
+  hash ^= (unsigned long long)dev;
+  return (size_t)(hash >> 32) % TYPE_CACHE_BUCKETS;
+}
+
+static const char *file_type_cache_get(const struct stat *st,
+                                       long long mtime) {
+  const char *label = NULL;
+  pthread_mutex_lock(&cache_lock);
+  TypeCacheEntry *entry =
+      cache_buckets[file_type_bucket(st->st_dev, st->st_ino)];
+  for (; entry; entry = entry->next) {
+    if (entry->dev == st->st_dev && entry->ino == st->st_ino &&
+        entry->mtime == mtime) {
+      label = entry->label;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&cache_lock);
+  return label;
+}
+
+static void file_type_cache_put(const struct stat *st, long long mtime,
+                                const char *label) {
+  pthread_mutex_lock(&cache_lock);
+  if (cache_entries >= TYPE_CACHE_MAX_ENTRIES) {
+    // forget everything rather than track recency; labels stay interned
+    for (int i = 0; i < TYPE_CACHE_BUCKETS; i++) {
+      while (cache_buckets[i]) {
+        TypeCacheEntry *next = cache_buckets[i]->next;
+        free(cache_buckets[i]);
+        cache_buckets[i] = next;
+      }
+    }
+    cache_entries = 0;
+  }
+  TypeCacheEntry *entry = (TypeCacheEntry *)malloc(sizeof(TypeCacheEntry));
+  if (entry) {
+    size_t bucket = file_type_bucket(st->st_dev, st->st_ino);
+    entry->dev = st->st_dev;
+    entry->ino = st->st_ino;
+    entry->mtime = mtime;
+    entry->label = label;
+    entry->next = cache_buckets[bucket];
+    cache_buckets[bucket] = entry;
+    cache_entries++;
+  }
+  pthread_mutex_unlock(&cache_lock);
+}
+
+// returns a copy of 'label' that lives until file_type_cleanup
+static const char *file_type_intern(const char *label) {
+  const char *interned = NULL;
+  pthread_mutex_lock(&cache_lock);
+  for (InternedLabel *it = interned_labels; it; it = it->next) {
+    if (strcmp(it->label, label) == 0) {
+      interned = it->label;
+      break;
+    }
+  }
+  if (!interned) {
+    size_t len = strlen(label);
+    InternedLabel *it =
+        (InternedLabel *)malloc(sizeof(InternedLabel) + len + 1);
+    if (it) {
+      memcpy(it->label, label, len + 1);
+      it->next = interned_labels;
+      interned_labels = it;
+      interned = it->label;
+    }
+  }
+  pthread_mutex_unlock(&cache_lock);
+  return interned ? interned : "File";
+}
+
+static const char *file_type_from_extension(const char *path) {
+  const char *slash = strrchr(path, '/');
+  const char *name = slash ? slash + 1 : path;
+  const char *dot = strrchr(name, '.');
+  if (!dot || dot == name) {
+    return NULL;
+  }
+  for (size_t i = 0; i < sizeof(extension_types) / sizeof(extension_types[0]);
+       i++) {
+    if (strcasecmp(dot, extension_types[i].extension) == 0) {
+      return extension_types[i].label;
+    }
+  }
+  return NULL;
+}
+
+static const char *file_type_from_signature(const char *path) {
+  unsigned char head[TYPE_SNIFF_BYTES];
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    return NULL;
+  }
+  ssize_t len = read(fd, head, sizeof(head));
+  close(fd);
+  if (len <= 0) {
+    return len == 0 ? "Empty File" : NULL;
+  }
+  for (size_t i = 0; i < sizeof(signature_types) / sizeof(signature_types[0]);
+       i++) {
+    const SignatureType *sig = &signature_types[i];
+    if (sig->offset + sig->length <= (size_t)len &&
+        memcmp(head + sig->offset, sig->bytes, sig->length) == 0) {
+      return sig->label;
+    }
+  }
+  return NULL;
+}
+
+static const char *file_type_from_magic(const char *path) {
+  pthread_once(&magic_once, file_type_load_magic);
+  if (!magic_cookie) {
+    return NULL;
+  }
+  char type_buffer[256];
+  int found = 0;
+  // a magic_t may only be used by one thread at a time
+  pthread_mutex_lock(&magic_lock);
+  const char *full_type = magic_file(magic_cookie, path);
+  if (full_type != NULL) {
+    strncpy(type_buffer, full_type, sizeof(type_buffer) - 1);
+    type_buffer[sizeof(type_buffer) - 1] = '\0'; // ensure null-termination
+    found = 1;
+  }
+  pthread_mutex_unlock(&magic_lock);
+  if (!found) {
+    return NULL;
+  }
+
+  char *comma = strchr(type_buffer, ',');
+  if (comma != NULL) {
+    *comma = '\0'; // truncate the string at the comma
+  }
+  return file_type_intern(type_buffer);
+}
+
+// short label for the regular file at 'path'. 'st' may be NULL, in which
+// case the file is stat'ed here. safe to call from any thread
+const char *file_type_describe(const char *path, const struct stat *st) {
+  const char *label = file_type_from_extension(path);
+  if (label) {
+    return label;
+  }
+
+  struct stat path_st;
+  if (!st) {
+    if (stat(path, &path_st) != 0) {
+      return "File";
+    }
+    st = &path_st;
+  }
+  long long mtime = st->st_mtim.tv_sec * 1000000000LL + st->st_mtim.tv_nsec;
+  label = file_type_cache_get(st, mtime);
+  if (label) {
+    return label;
+  }
+
+  label = file_type_from_signature(path);
+  if (!label) {
+    label = file_type_from_magic(path);
+  }
+  if (!label) {
+    label = "File";
+  }
+  file_type_cache_put(st, mtime, label);
+  return label;
+}
@@ -0,0 +1,10 @@
+#ifndef FILE_TYPE_H
+#define FILE_TYPE_H
+
+#include <sys/stat.h>
+
+void file_type_preload();
+void file_type_cleanup();
+const char *file_type_describe(const char *path, const struct stat *st);
+
+#endif
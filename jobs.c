@@ -0,0 +1,336 @@
+#include "jobs.h"
+#include "crypto.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <unistd.h>
+
+// encrypt and decrypt requests run on a small pool of worker threads so the
+// ui stays responsive while argon2 and the stream cipher are busy.
+// each job owns a copy of its password in guarded memory, wiped as soon as
+// the job can no longer need it. a job that fails or is cancelled removes
+// whatever it had written to its destination, except when it is stopped by
+// jobs_stop with a checkpoint on disk: that output can be resumed later
+
+// every worker may hold an argon2 instance (256 MiB at the moderate limits)
+#define JOBS_MAX_WORKERS 4
+
+typedef struct Job {
+  JobInfo info;
+  int in_use;
+  int collected; // the owner has seen the final state
+  char *password; // sodium_malloc'ed, NULL once wiped
+  atomic_int cancel;
+  CryptoProgress progress;
+} Job;
+
+static pthread_t job_threads[JOBS_MAX_WORKERS];
+static int num_job_threads;
+static pthread_mutex_t job_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t job_cond = PTHREAD_COND_INITIALIZER;
+static int jobs_running;
+static int next_job_id = 1;
+static Job jobs[JOBS_MAX];
+static atomic_ulong job_changes;
+static atomic_int job_io_policy;
+static atomic_int job_no_digest;
+
+// must be called with job_lock held
+static void jobs_wipe_password(Job *job) {
+  if (job->password) {
+    sodium_free(job->password); // sodium_free zeroes the buffer first
+    job->password = NULL;
+  }
+}
+
+static int jobs_is_finished(const Job *job) {
+  return job->info.state == JOB_DONE || job->info.state == JOB_FAILED ||
+         job->info.state == JOB_CANCELLED;
+}
+
+// must be called with job_lock held. picks the oldest queued job
+static Job *jobs_next_queued() {
+  Job *next = NULL;
+  for (int i = 0; i < JOBS_MAX; i++) {
+    if (jobs[i].in_use && jobs[i].info.state == JOB_QUEUED &&
+        (!next || jobs[i].info.id < next->info.id)) {
+      next = &jobs[i];
+    }
+  }
+  return next;
+}
+
+static void *jobs_worker_thread(void *arg) {
+  (void)arg;
+
+  pthread_mutex_lock(&job_lock);
+  while (jobs_running) {
+    Job *job = jobs_next_queued();
+    if (!job) {
+      pthread_cond_wait(&job_cond, &job_lock);
+      continue;
+    }
+    job->info.state = JOB_RUNNING;
+    atomic_fetch_add(&job_changes, 1);
+    CryptoOptions opts = {.cancel = &job->cancel,
+                          .progress = &job->progress,
+                          .io_policy = atomic_load(&job_io_policy),
+                          .resume = (job->info.flags & JOB_RESUME) != 0,
+                          .no_digest = atomic_load(&job_no_digest)};
+    pthread_mutex_unlock(&job_lock);
+
+    // the slot stays in use until collected, so 'job' cannot be reused here
+    int result =
+        job->info.type == JOB_ENCRYPT
+            ? crypto_encrypt_file_ex(job->info.src, job->info.dest,
+                                     job->password, &opts)
+            : crypto_decrypt_file_ex(job->info.src, job->info.dest,
+                                     job->password, &opts);
+    pthread_mutex_lock(&job_lock);
+    int stopping = !jobs_running;
+    pthread_mutex_unlock(&job_lock);
+    if (result != CRYPTO_SUCCESS && result != CRYPTO_ERROR_FILE &&
+        result != CRYPTO_ERROR_RESUME &&
+        !(stopping && result == CRYPTO_ERROR_CANCELLED &&
+          crypto_checkpoint_exists(job->info.dest))) {
+      crypto_remove_output(job->info.dest); // drop the partial output
+    }
+
+    pthread_mutex_lock(&job_lock);
+    jobs_wipe_password(job);
+    job->info.result = result;
+    job->info.state = result == CRYPTO_SUCCESS           ? JOB_DONE
+                      : result == CRYPTO_ERROR_CANCELLED ? JOB_CANCELLED
+                                                         : JOB_FAILED;
+    atomic_fetch_add(&job_changes, 1);
+  }
+  pthread_mutex_unlock(&job_lock);
+  return NULL;
+}
+
+// starts 'num_workers' threads, or one per online cpu when it is 0
+int jobs_start(int num_workers) {
+  if (num_workers < 1) {
+    num_workers = (int)sysconf(_SC_NPROCESSORS_ONLN);
+  }
+  if (num_workers < 1) {
+    num_workers = 1;
+  }
+  if (num_workers > JOBS_MAX_WORKERS) {
+    num_workers = JOBS_MAX_WORKERS;
+  }
+
+  pthread_mutex_lock(&job_lock);
+  if (jobs_running) {
+    pthread_mutex_unlock(&job_lock);
+    return JOBS_SUCCESS;
+  }
+  jobs_running = 1;
+  pthread_mutex_unlock(&job_lock);
+
+  for (int i = 0; i < num_workers; i++) {
+    if (pthread_create(&job_threads[num_job_threads], NULL,
+                       jobs_worker_thread, NULL) == 0) {
+      num_job_threads++;
+    }
+  }
+  if (num_job_threads == 0) {
+    jobs_running = 0;
+    return JOBS_ERROR;
+  }
+  return JOBS_SUCCESS;
+}
+
+// CRYPTO_IO_* policy for jobs that start from now on
+void jobs_set_io_policy(int policy) { atomic_store(&job_io_policy, policy); }
+
+// whether jobs that start from now on store and check a plaintext digest
+void jobs_set_digest(int enabled) { atomic_store(&job_no_digest, !enabled); }
+
+// cancels everything still queued or running and waits for the workers
+void jobs_stop() {
+  pthread_mutex_lock(&job_lock);
+  if (!jobs_running) {
+    pthread_mutex_unlock(&job_lock);
+    return;
+  }
+  jobs_running = 0;
+  for (int i = 0; i < JOBS_MAX; i++) {
+    atomic_store(&jobs[i].cancel, 1);
+  }
+  pthread_cond_broadcast(&job_cond);
+  pthread_mutex_unlock(&job_lock);
+
+  for (int i = 0; i < num_job_threads; i++) {
+    pthread_join(job_threads[i], NULL);
+  }
+  num_job_threads = 0;
+
+  pthread_mutex_lock(&job_lock);
+  for (int i = 0; i < JOBS_MAX; i++) {
+    jobs_wipe_password(&jobs[i]);
+    jobs[i].in_use = 0;
+  }
+  pthread_mutex_unlock(&job_lock);
+}
+
+// queues a job and returns its id (> 0), or a JOBS_ERROR_* code.
+// 'password' is copied, so the caller may wipe its buffer right away
+int jobs_submit(int type, const char *src, const char *dest,
+                const char *password, int flags) {
+  if (!src || !dest || !password || strlen(src) >= MAX_PATH_LENGTH ||
+      strlen(dest) >= MAX_PATH_LENGTH) {
+    return JOBS_ERROR;
+  }
+
+  pthread_mutex_lock(&job_lock);
+  if (!jobs_running) {
+    pthread_mutex_unlock(&job_lock);
+    return JOBS_ERROR;
+  }
+  Job *slot = NULL;
+  for (int i = 0; i < JOBS_MAX; i++) {
+    Job *job = &jobs[i];
+    if (!job->in_use) {
+      slot = slot && !slot->in_use ? slot : job;
+      continue;
+    }
+    if (!jobs_is_finished(job) && strcmp(job->info.dest, dest) == 0) {
+      pthread_mutex_unlock(&job_lock);
+      return JOBS_ERROR_BUSY;
+    }
+    // otherwise recycle the oldest job whose outcome was already seen
+    if (job->collected && (!slot || (slot->in_use &&
+                                     job->info.id < slot->info.id))) {
+      slot = job;
+    }
+  }
+  if (!slot) {
+    pthread_mutex_unlock(&job_lock);
+    return JOBS_ERROR_FULL;
+  }
+
+  size_t password_len = strlen(password);
+  char *password_copy = (char *)sodium_malloc(password_len + 1);
+  if (!password_copy) {
+    pthread_mutex_unlock(&job_lock);
+    return JOBS_ERROR;
+  }
+  memcpy(password_copy, password, password_len + 1);
+
+  memset(&slot->info, 0, sizeof(slot->info));
+  slot->info.id = next_job_id++;
+  slot->info.type = type;
+  slot->info.flags = flags;
+  slot->info.state = JOB_QUEUED;
+  strcpy(slot->info.src, src);
+  strcpy(slot->info.dest, dest);
+  slot->in_use = 1;
+  slot->collected = 0;
+  slot->password = password_copy;
+  atomic_store(&slot->cancel, 0);
+  atomic_store(&slot->progress.phase, CRYPTO_PHASE_IDLE);
+  atomic_store(&slot->progress.bytes_done, 0);
+  atomic_store(&slot->progress.bytes_total, 0);
+  int id = slot->info.id;
+
+  atomic_fetch_add(&job_changes, 1);
+  pthread_cond_signal(&job_cond);
+  pthread_mutex_unlock(&job_lock);
+  return id;
+}
+
+// a queued job is dropped at once, a running one stops at the next chunk
+int jobs_cancel(int id) {
+  int status = JOBS_ERROR;
+  pthread_mutex_lock(&job_lock);
+  for (int i = 0; i < JOBS_MAX; i++) {
+    Job *job = &jobs[i];
+    if (!job->in_use || job->info.id != id || jobs_is_finished(job)) {
+      continue;
+    }
+    atomic_store(&job->cancel, 1);
+    if (job->info.state == JOB_QUEUED) {
+      jobs_wipe_password(job);
+      job->info.state = JOB_CANCELLED;
+      job->info.result = CRYPTO_ERROR_CANCELLED;
+    }
+    atomic_fetch_add(&job_changes, 1);
+    status = JOBS_SUCCESS;
+    break;
+  }
+  pthread_mutex_unlock(&job_lock);
+  return status;
+}
+
+// fills in the progress fields of a running job's info
+static void jobs_read_progress(Job *job, JobInfo *info) {
+  CryptoProgress *progress = &job->progress;
+  info->phase = atomic_load(&progress->phase);
+  info->bytes_done = atomic_load(&progress->bytes_done);
+  info->bytes_total = atomic_load(&progress->bytes_total);
+  crypto_progress_estimate(progress, &info->rate, &info->eta_ms,
+                           &info->idle_ms);
+}
+
+// copies up to 'max' jobs into 'out', newest first
+int jobs_snapshot(JobInfo *out, int max) {
+  int count = 0;
+  pthread_mutex_lock(&job_lock);
+  for (int i = 0; i < JOBS_MAX; i++) {
+    if (!jobs[i].in_use) {
+      continue;
+    }
+    if (jobs[i].info.state == JOB_RUNNING) {
+      jobs_read_progress(&jobs[i], &jobs[i].info);
+    }
+    // insertion sort by descending id, the table is small
+    int pos = count < max ? count : max - 1;
+    if (count >= max && jobs[i].info.id < out[pos].id) {
+      continue;
+    }
+    while (pos > 0 && out[pos - 1].id < jobs[i].info.id) {
+      if (pos < max) {
+        out[pos] = out[pos - 1];
+      }
+      pos--;
+    }
+    out[pos] = jobs[i].info;
+    if (count < max) {
+      count++;
+    }
+  }
+  pthread_mutex_unlock(&job_lock);
+  return count;
+}
+
+// copies jobs that finished since the last call into 'out', so the owner
+// can react to each outcome exactly once
+int jobs_collect_finished(JobInfo *out, int max) {
+  int count = 0;
+  pthread_mutex_lock(&job_lock);
+  for (int i = 0; i < JOBS_MAX && count < max; i++) {
+    if (jobs[i].in_use && !jobs[i].collected && jobs_is_finished(&jobs[i])) {
+      jobs[i].collected = 1;
+      out[count++] = jobs[i].info;
+    }
+  }
+  pthread_mutex_unlock(&job_lock);
+  return count;
+}
+
+// number of jobs that are queued or running
+int jobs_active() {
+  int active = 0;
+  pthread_mutex_lock(&job_lock);
+  for (int i = 0; i < JOBS_MAX; i++) {
+    if (jobs[i].in_use && !jobs_is_finished(&jobs[i])) {
+      active++;
+    }
+  }
+  pthread_mutex_unlock(&job_lock);
+  return active;
+}
+
+// changes whenever a job is added or changes state
+unsigned long jobs_version() { return atomic_load(&job_changes); }
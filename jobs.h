@@ -0,0 +1,56 @@
+#ifndef JOBS_H
+#define JOBS_H
+
+#include "file_tree.h"
+
+#define JOBS_SUCCESS 1
+#define JOBS_ERROR -1
+#define JOBS_ERROR_BUSY -2 // another active job already writes that file
+#define JOBS_ERROR_FULL -3 // every slot holds an active or unseen job
+
+#define JOBS_MAX 1024        // queued, running and unseen finished jobs
+#define JOBS_DEFAULT_WORKERS 0 // one per online cpu
+
+// values of JobInfo.type
+#define JOB_ENCRYPT 1
+#define JOB_DECRYPT 2
+
+// bits of JobInfo.flags
+#define JOB_RESUME 1 // continue from the checkpoint next to the destination
+
+// values of JobInfo.state
+#define JOB_QUEUED 0
+#define JOB_RUNNING 1
+#define JOB_DONE 2
+#define JOB_FAILED 3
+#define JOB_CANCELLED 4
+
+typedef struct JobInfo {
+  int id;
+  int type;
+  int flags;
+  int state;
+  int result; // CRYPTO_* code of a finished job
+  int phase;  // CRYPTO_PHASE_* of a running job
+  long long bytes_done;
+  long long bytes_total;
+  double rate;      // stream throughput in bytes per second
+  long long eta_ms; // -1 while unknown
+  long long idle_ms; // time since the job last reported progress
+  char src[MAX_PATH_LENGTH];
+  char dest[MAX_PATH_LENGTH];
+} JobInfo;
+
+int jobs_start(int num_workers);
+void jobs_stop();
+void jobs_set_io_policy(int policy);
+void jobs_set_digest(int enabled);
+int jobs_submit(int type, const char *src, const char *dest,
+                const char *password, int flags);
+int jobs_cancel(int id);
+int jobs_snapshot(JobInfo *out, int max);
+int jobs_collect_finished(JobInfo *out, int max);
+int jobs_active();
+unsigned long jobs_version();
+
+#endif
@@ -1,18 +1,516 @@
+#include "agent.h"
 #include "crypto.h"
+#include "crypto_io.h"
+#include "file_meta.h"
 #include "file_tree.h"
+#include "file_type.h"
+#include "jobs.h"
+#include "manifest.h"
+#include "stats.h"
+#include "store.h"
+#include "sync.h"
+#include "tree_cache.h"
+#include "tree_snapshot.h"
 #include "tui.h"
+#include <errno.h>
+#include <fcntl.h>
 #include <getopt.h>
+#include <limits.h>
 #include <ncurses.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
+// the version of the tree the ui is on, see latest_tree
 FileNode *root_node = NULL;
 
 static char *current_tree_path = ".";
 static int current_show_hidden = 0;
+static char *current_cache_path = NULL;
+static TreeCache *tree_cache = NULL;
+static int tree_reader = -1; // the ui's slot, see tree_snapshot_register
 
 void cleanup();
 
+// the ui's tree handler: passes the tree revalidated from the cache on to
+// the tree writer once it is ready, then moves the ui to the newest version
+// the writer published
+static FileNode *latest_tree() {
+  FileNode *fresh = tree_cache_poll_revalidation(tree_cache);
+  if (fresh) {
+    tree_snapshot_replace(fresh);
+  }
+  root_node = tree_snapshot_adopt(tree_reader, root_node);
+  return root_node;
+}
+
+// asks the tree writer for a version of the tree that shows the output of
+// every job that finished since the last call. the ui picks it up in
+// latest_tree, so this never changes the tree on screen itself
+static int collect_finished_jobs() {
+  JobInfo finished[32];
+  int count;
+  while ((count = jobs_collect_finished(finished, 32)) > 0) {
+    for (int i = 0; i < count; i++) {
+      if (finished[i].state == JOB_DONE) {
+        tree_snapshot_insert(finished[i].dest);
+      }
+    }
+  }
+  return 0;
+}
+
+static void output_path_for(int type, const char *path, char *out) {
+  if (type == JOB_ENCRYPT) {
+    snprintf(out, MAX_PATH_LENGTH, "%s.enc", path);
+    out[MAX_PATH_LENGTH - 1] = '\0';
+    return;
+  }
+  const char *ext = strrchr(path, '.');
+  if (ext && strcmp(ext, ".enc") == 0) {
+    strncpy(out, path, ext - path);
+    out[ext - path] = '\0';
+  } else {
+    snprintf(out, MAX_PATH_LENGTH, "%s.dec", path);
+  }
+}
+
+// asks for the file(s) to encrypt or decrypt, then for one confirmation and
+// one password for all of them, and queues a job per file. the workers run
+// the jobs concurrently; collect_finished_jobs indexes their outputs
+static void run_crypto_action(int type) {
+  const char *verb = type == JOB_ENCRYPT ? "Encrypt" : "Decrypt";
+  FileNode **files = NULL;
+  int count = tui_get_file_browser_selection(root_node, &files);
+  if (count == 0) {
+    return; // esc
+  }
+  if (count == 1 && files[0]->is_dir) {
+    free(files);
+    tui_display_message("Please select a valid file", TUI_MSG_ERROR);
+    tui_draw_layout();
+    return;
+  }
+
+  char confirm_prompt[MAX_PATH_LENGTH + 50];
+  if (count == 1) {
+    snprintf(confirm_prompt, sizeof(confirm_prompt), "%s file \"%s\" (%s)?",
+             verb, files[0]->name, get_common_file_type(files[0]));
+  } else {
+    snprintf(confirm_prompt, sizeof(confirm_prompt), "%s %d marked files?",
+             verb, count);
+  }
+  if (tui_get_confirmation(confirm_prompt) != TUI_CONFIRM_YES) {
+    free(files);
+    tui_draw_layout(); // redraw UI after confirmation dialog
+    return;
+  }
+
+  // outputs left behind by an interrupted run can be continued instead
+  int resumable = 0;
+  for (int i = 0; i < count; i++) {
+    char output_file[MAX_PATH_LENGTH];
+    output_path_for(type, files[i]->path, output_file);
+    resumable += crypto_checkpoint_exists(output_file);
+  }
+  int flags = 0;
+  if (resumable > 0) {
+    if (count == 1) {
+      snprintf(confirm_prompt, sizeof(confirm_prompt),
+               "Resume the interrupted run from its checkpoint?");
+    } else {
+      snprintf(confirm_prompt, sizeof(confirm_prompt),
+               "Resume %d interrupted files from their checkpoints?",
+               resumable);
+    }
+    if (tui_get_confirmation(confirm_prompt) == TUI_CONFIRM_YES) {
+      flags = JOB_RESUME;
+    }
+  }
+
+  char *password =
+      tui_get_password(type == JOB_ENCRYPT
+                           ? "Enter the password to encrypt the file(s):"
+                           : "Enter the password to decrypt the file(s):");
+  if (!password || strlen(password) == 0) {
+    free(files);
+    tui_display_message("Password cannot be empty", TUI_MSG_WARNING);
+    tui_draw_layout();
+    return;
+  }
+
+  int queued = 0;
+  int busy = 0;
+  int full = 0;
+  for (int i = 0; i < count; i++) {
+    char output_file[MAX_PATH_LENGTH];
+    output_path_for(type, files[i]->path, output_file);
+    int id = jobs_submit(type, files[i]->path, output_file, password,
+                         crypto_checkpoint_exists(output_file) ? flags : 0);
+    if (id > 0) {
+      queued++;
+    } else if (id == JOBS_ERROR_BUSY) {
+      busy++;
+    } else if (id == JOBS_ERROR_FULL) {
+      full++;
+    }
+  }
+  sodium_memzero(password, strlen(password));
+  free(files);
+  file_tree_clear_marks(root_node);
+
+  if (queued < count) {
+    char message[128];
+    if (count == 1) {
+      snprintf(message, sizeof(message), "%s",
+               busy   ? "Another job is already writing that file"
+               : full ? "Too many jobs, wait for some to finish"
+                      : "Failed to start the job");
+    } else {
+      snprintf(message, sizeof(message),
+               "Queued %d of %d files (%d busy, %d over the job limit)",
+               queued, count, busy, full);
+    }
+    tui_display_message(message, queued ? TUI_MSG_WARNING : TUI_MSG_ERROR);
+  }
+  tui_draw_layout();
+}
+
+static const char *crypto_result_message(int result) {
+  switch (result) {
+  case CRYPTO_ERROR_FILE:
+    return "cannot open or write a file";
+  case CRYPTO_ERROR_MEM:
+    return "out of memory";
+  case CRYPTO_ERROR_ENC:
+    return "encryption failed";
+  case CRYPTO_ERROR_DEC:
+    return "wrong password or key, or the file is damaged";
+  case CRYPTO_ERROR_CANCELLED:
+    return "cancelled";
+  case CRYPTO_ERROR_RESUME:
+    return "nothing to resume, or another password";
+  default:
+    return "unknown error";
+  }
+}
+
+// --agent: asks for the password on the terminal (or reads it from stdin),
+// then serves requests without a ui until stopped or idle
+static int run_agent(const char *socket_path, int idle_seconds,
+                     int io_policy, int digest) {
+  char *password = agent_read_password("Password: ");
+  if (!password || strlen(password) == 0) {
+    agent_free_password(password);
+    fprintf(stderr, "Password cannot be empty\n");
+    return 1;
+  }
+  if (agent_start(socket_path, password, io_policy, !digest) !=
+      AGENT_SUCCESS) {
+    agent_free_password(password);
+    fprintf(stderr, "Failed to start the agent on '%s'\n", socket_path);
+    return 1;
+  }
+  fprintf(stderr, "Agent listening on %s\n", socket_path);
+  agent_serve(idle_seconds);
+  agent_free_password(password);
+  stats_close();
+  manifest_close();
+  return 0;
+}
+
+// --client: hands one operation to the agent. 'args' are the operation and
+// its files; the output name defaults to the one the ui would pick
+static int run_client(const char *socket_path, int num_args, char **args) {
+  static const char *op_names[] = {"encrypt", "decrypt", "verify", "stop"};
+  static const int ops[] = {AGENT_OP_ENCRYPT, AGENT_OP_DECRYPT,
+                            AGENT_OP_VERIFY, AGENT_OP_STOP};
+  int op = 0;
+  for (int i = 0; i < 4 && num_args > 0; i++) {
+    if (strcmp(args[0], op_names[i]) == 0) {
+      op = ops[i];
+    }
+  }
+  int num_files = op == AGENT_OP_STOP ? 0 : op == AGENT_OP_VERIFY ? 1 : 2;
+  if (op == 0 || num_args - 1 > num_files ||
+      (op != AGENT_OP_STOP && num_args < 2)) {
+    fprintf(stderr, "Usage: --client SOCKET encrypt|decrypt SRC [DEST], "
+                    "verify SRC or stop\n");
+    return 1;
+  }
+
+  const char *src = op == AGENT_OP_STOP ? NULL : args[1];
+  char dest[MAX_PATH_LENGTH] = "";
+  if (num_args > 2) {
+    snprintf(dest, sizeof(dest), "%s", args[2]);
+  } else if (num_files == 2) {
+    output_path_for(op == AGENT_OP_ENCRYPT ? JOB_ENCRYPT : JOB_DECRYPT, src,
+                    dest);
+  }
+  int result = CRYPTO_SUCCESS;
+  int status = agent_request(socket_path, op, src, dest, &result);
+  if (status == AGENT_ERROR_CONNECT) {
+    fprintf(stderr, "No agent is listening on '%s'\n", socket_path);
+  } else if (status == AGENT_ERROR_FILE) {
+    fprintf(stderr, "Failed to open the files\n");
+  } else if (status != AGENT_SUCCESS) {
+    fprintf(stderr, "The agent did not answer\n");
+  } else if (result != CRYPTO_SUCCESS) {
+    fprintf(stderr, "%s: %s\n", src, crypto_result_message(result));
+  }
+  return status == AGENT_SUCCESS && result == CRYPTO_SUCCESS ? 0 : 1;
+}
+
+static void report_sync_failure(const char *path, int result) {
+  fprintf(stderr, "%s: %s\n", path, crypto_result_message(result));
+}
+
+// --sync: encrypts what changed under 'src_dir' since the last run into
+// 'dest_dir' and removes the ciphertext of deleted files
+static int run_sync(const char *src_dir, const char *dest_dir, int hash_check,
+                    int io_policy) {
+  char *password = agent_read_password("Password: ");
+  if (!password || strlen(password) == 0) {
+    agent_free_password(password);
+    fprintf(stderr, "Password cannot be empty\n");
+    return 1;
+  }
+  SyncOptions opts = {.hash_check = hash_check,
+                      .io_policy = io_policy,
+                      .on_failure = report_sync_failure};
+  SyncReport report;
+  int status = sync_run(src_dir, dest_dir, password, &opts, &report);
+  agent_free_password(password);
+  stats_close();
+  manifest_close();
+  if (status == SYNC_ERROR_INDEX) {
+    fprintf(stderr, "Failed to open the sync index in '%s': wrong password "
+                    "or damaged\n",
+            dest_dir);
+    return 1;
+  }
+  if (status == SYNC_ERROR) {
+    fprintf(stderr, "Failed to sync '%s' into '%s'\n", src_dir, dest_dir);
+    return 1;
+  }
+  printf("%d new, %d changed, %d unchanged, %d removed, %d failed\n",
+         report.added, report.changed, report.unchanged, report.removed,
+         report.failed);
+  return status == SYNC_SUCCESS ? 0 : 1;
+}
+
+// --store: puts a file into the chunk store in 'store_dir', or gets one
+// back from its chunk list. 'args' are the operation and its files
+static int run_store(const char *store_dir, int num_args, char **args,
+                     int io_policy) {
+  int put = num_args > 0 && strcmp(args[0], "put") == 0;
+  int get = num_args > 0 && strcmp(args[0], "get") == 0;
+  if ((!put && !get) || num_args < 2 || num_args > 3) {
+    fprintf(stderr, "Usage: --store STORE put FILE [LIST] or get LIST "
+                    "[FILE]\n");
+    return 1;
+  }
+  const char *src = args[1];
+  char dest[MAX_PATH_LENGTH];
+  size_t ext_len = strlen(STORE_LIST_EXTENSION);
+  size_t src_len = strlen(src);
+  if (num_args > 2) {
+    snprintf(dest, sizeof(dest), "%s", args[2]);
+  } else if (put) {
+    snprintf(dest, sizeof(dest), "%s%s", src, STORE_LIST_EXTENSION);
+  } else if (src_len > ext_len &&
+             strcmp(src + src_len - ext_len, STORE_LIST_EXTENSION) == 0) {
+    snprintf(dest, sizeof(dest), "%.*s", (int)(src_len - ext_len), src);
+  } else {
+    fprintf(stderr, "%s does not end in %s, name the output FILE\n", src,
+            STORE_LIST_EXTENSION);
+    return 1;
+  }
+
+  char *password = agent_read_password("Password: ");
+  if (!password || strlen(password) == 0) {
+    agent_free_password(password);
+    fprintf(stderr, "Password cannot be empty\n");
+    return 1;
+  }
+  Store *store = NULL;
+  int status = store_open(store_dir, password, io_policy, &store);
+  agent_free_password(password);
+  if (status == STORE_ERROR_KEY) {
+    fprintf(stderr, "Failed to open the store in '%s': wrong password or "
+                    "damaged\n",
+            store_dir);
+    return 1;
+  }
+  if (status != STORE_SUCCESS) {
+    fprintf(stderr, "Failed to open the store in '%s'\n", store_dir);
+    return 1;
+  }
+
+  StoreReport report;
+  status = put ? store_put(store, src, dest, &report)
+               : store_get(store, src, dest);
+  store_close(store);
+  if (status == STORE_ERROR_DEC) {
+    fprintf(stderr, "%s: not of this store, or damaged\n", src);
+  } else if (status == STORE_ERROR_FILE) {
+    fprintf(stderr, "%s: failed to read or write the files\n", src);
+  } else if (status != STORE_SUCCESS) {
+    fprintf(stderr, "%s: failed\n", src);
+  } else if (put) {
+    printf("%s: %lld chunks, %lld new (%lld of %lld bytes stored)\n", dest,
+           report.chunks, report.new_chunks, report.new_bytes, report.bytes);
+  }
+  return status == STORE_SUCCESS ? 0 : 1;
+}
+
+// the password of an operation, unless the keys in 'opts' do without one:
+// recipients to encrypt to, or a secret key to decrypt with. sets *password
+// to NULL then; returns 0 when a password was wanted and none given
+static int read_password_unless_keyed(int encrypt, const CryptoOptions *opts,
+                                      char **password) {
+  *password = NULL;
+  if (encrypt ? opts->recipient_count > 0 : opts->secret_key != NULL) {
+    return 1;
+  }
+  *password = agent_read_password("Password: ");
+  if (!*password || strlen(*password) == 0) {
+    agent_free_password(*password);
+    *password = NULL;
+    fprintf(stderr, "Password cannot be empty\n");
+    return 0;
+  }
+  return 1;
+}
+
+// --encrypt and --decrypt: one file without a ui, into 'args[0]' when given
+// and otherwise next to it, named as the browser would
+static int run_file(int type, const char *src, int num_args, char **args,
+                    const CryptoOptions *opts) {
+  if (num_args > 1) {
+    fprintf(stderr, "Usage: --encrypt|--decrypt FILE [DEST]\n");
+    return 1;
+  }
+  char dest[MAX_PATH_LENGTH];
+  if (num_args == 1) {
+    snprintf(dest, sizeof(dest), "%s", args[0]);
+  } else {
+    output_path_for(type, src, dest);
+  }
+  struct stat src_st, dest_st;
+  if (stat(src, &src_st) == 0 && stat(dest, &dest_st) == 0 &&
+      src_st.st_dev == dest_st.st_dev && src_st.st_ino == dest_st.st_ino) {
+    fprintf(stderr, "%s: the output would overwrite the input, use "
+                    "--in-place to convert a file into itself\n",
+            src);
+    return 1;
+  }
+  // the output is written next to 'dest' and renamed over it once whole, so
+  // a failed run leaves an existing 'dest' as it was
+  char tmp[MAX_PATH_LENGTH + 16];
+  snprintf(tmp, sizeof(tmp), "%s.%d.tmp", dest, (int)getpid());
+
+  int encrypt = type == JOB_ENCRYPT;
+  char *password;
+  if (!read_password_unless_keyed(encrypt, opts, &password)) {
+    return 1;
+  }
+  // the manifest still records the output under 'dest'
+  int result = CRYPTO_ERROR_FILE;
+  int src_fd = open(src, O_RDONLY | O_CLOEXEC);
+  int tmp_fd = src_fd < 0 ? -1
+                          : open(tmp, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC,
+                                 0644);
+  if (tmp_fd >= 0) {
+    result = encrypt
+                 ? crypto_encrypt_fd(src_fd, tmp_fd, src, dest, password, opts)
+                 : crypto_decrypt_fd(src_fd, tmp_fd, src, dest, password, opts);
+    if (close(tmp_fd) != 0 && result == CRYPTO_SUCCESS) {
+      result = CRYPTO_ERROR_FILE;
+    }
+    if (result == CRYPTO_SUCCESS && rename(tmp, dest) != 0) {
+      result = CRYPTO_ERROR_FILE;
+    }
+    if (result != CRYPTO_SUCCESS) {
+      unlink(tmp); // only ever this run's own output
+    }
+  }
+  if (src_fd >= 0) {
+    close(src_fd);
+  }
+  agent_free_password(password);
+  stats_close();
+  manifest_close();
+  if (result != CRYPTO_SUCCESS) {
+    fprintf(stderr, "%s: %s\n", src, crypto_result_message(result));
+    return 1;
+  }
+  return 0;
+}
+
+// --keygen: writes a key pair to 'path' and 'path'.pub
+static int run_keygen(const char *path) {
+  if (crypto_keygen(path) != CRYPTO_SUCCESS) {
+    fprintf(stderr, "Failed to write a key pair to '%s' (neither it nor "
+                    "'%s.pub' may exist yet)\n",
+            path, path);
+    return 1;
+  }
+  printf("Secret key in %s, public key in %s.pub\n", path, path);
+  return 0;
+}
+
+// --in-place: converts 'args[0]' into its own ciphertext or plaintext, or
+// resumes the conversion an interruption left half done
+static int run_in_place(const char *op, int num_args, char **args,
+                        const CryptoOptions *base) {
+  int resume = strcmp(op, "resume") == 0;
+  if ((!resume && strcmp(op, "encrypt") != 0 && strcmp(op, "decrypt") != 0) ||
+      num_args != 1) {
+    fprintf(stderr, "Usage: --in-place encrypt|decrypt|resume FILE\n");
+    return 1;
+  }
+  const char *path = args[0];
+  int pending = crypto_in_place_pending(path);
+  if (resume && !pending) {
+    fprintf(stderr, "%s: no interrupted conversion to resume\n", path);
+    return 1;
+  }
+  if (!resume && pending) {
+    fprintf(stderr, "%s: an earlier conversion was interrupted, resume it "
+                    "with '--in-place resume'\n",
+            path);
+    return 1;
+  }
+
+  CryptoOptions opts = *base;
+  opts.resume = resume;
+  int encrypt = resume ? pending == CRYPTO_IN_PLACE_ENCRYPT
+                       : strcmp(op, "encrypt") == 0;
+  // resuming an encryption to recipients reopens the file key, which takes
+  // the secret key of one of them
+  char *password;
+  if (!read_password_unless_keyed(encrypt && !resume, &opts, &password)) {
+    return 1;
+  }
+  int result = encrypt ? crypto_encrypt_in_place(path, password, &opts)
+                       : crypto_decrypt_in_place(path, password, &opts);
+  agent_free_password(password);
+  stats_close();
+  manifest_close();
+  if (result != CRYPTO_SUCCESS) {
+    fprintf(stderr, "%s: %s\n", path, crypto_result_message(result));
+    if (crypto_in_place_pending(path)) {
+      fprintf(stderr, "%s: half converted, finish with '--in-place "
+                      "resume'\n",
+              path);
+    }
+  }
+  return result == CRYPTO_SUCCESS ? 0 : 1;
+}
+
 void print_help(const char *prog_name) {
   printf("Usage: %s [options] [directory]\n\n", prog_name);
   printf("FileCryption: A tool to encrypt and decrypt files.\n\n");
@@ -25,7 +523,86 @@ void print_help(const char *prog_name) {
   printf("                        If [directory] is also provided as a "
          "positional argument,\n");
   printf("                        the one from -d/--directory takes "
-         "precedence.\n\n");
+         "precedence.\n");
+  printf("  -c, --cache FILE      Keep a snapshot of the file tree in FILE. "
+         "On the next\n");
+  printf("                        start the browser opens from the snapshot "
+         "while it is\n");
+  printf("                        revalidated in the background.\n");
+  printf("  -s, --stats TARGET    Append per-operation timings and counters "
+         "as JSON lines\n");
+  printf("                        to TARGET, a file path or fd:N for an open "
+         "descriptor.\n");
+  printf("  -i, --io-policy MODE  Page cache use for file data: cached "
+         "(default), stream\n");
+  printf("                        (read ahead and drop pages once done) or "
+         "direct (as\n");
+  printf("                        stream, output written with O_DIRECT).\n");
+  printf("  -m, --manifest FILE   Append the BLAKE2b digests of every file "
+         "read and written\n");
+  printf("                        to FILE, in the format 'b2sum -c' "
+         "checks.\n");
+  printf("  -n, --no-digest       Do not store or check plaintext digests "
+         "(they hash the\n");
+  printf("                        holes of sparse files as zeros).\n");
+  printf("  -A, --agent SOCKET    Run as a key agent: ask for the password "
+         "once, then\n");
+  printf("                        serve --client requests on the unix "
+         "socket SOCKET.\n");
+  printf("  -t, --idle SECONDS    Stop the agent after SECONDS without a "
+         "request (default\n");
+  printf("                        %d, 0 for never). The keys are wiped when "
+         "it stops.\n",
+         AGENT_DEFAULT_IDLE_SECONDS);
+  printf("  -C, --client SOCKET OP FILE [DEST]\n");
+  printf("                        Have the agent on SOCKET run OP (encrypt, "
+         "decrypt or\n");
+  printf("                        verify) on FILE, or 'stop' it. '-' is "
+         "stdin or stdout.\n");
+  printf("  -S, --sync DEST       Encrypt the directory into DEST without a "
+         "ui, only the\n");
+  printf("                        files new or changed since the last sync, "
+         "and remove\n");
+  printf("                        the ciphertext of deleted files.\n");
+  printf("  -H, --hash-check      With --sync, compare the contents of "
+         "files of unchanged\n");
+  printf("                        size rather than trusting their "
+         "modification time.\n");
+  printf("  -T, --store STORE OP FILE [DEST]\n");
+  printf("                        Deduplicating chunk store in STORE: 'put "
+         "FILE [LIST]'\n");
+  printf("                        stores the chunks of FILE not stored "
+         "yet and writes its\n");
+  printf("                        chunk list (default FILE%s), 'get LIST "
+         "[FILE]' rebuilds\n",
+         STORE_LIST_EXTENSION);
+  printf("                        the file.\n");
+  printf("  -P, --in-place OP FILE\n");
+  printf("                        Encrypt or decrypt FILE into itself, "
+         "needing only its\n");
+  printf("                        overhead and up to 16 MiB of free space. "
+         "OP 'resume'\n");
+  printf("                        finishes a conversion that was "
+         "interrupted.\n");
+  printf("  -k, --snapshot        With --in-place, clone FILE first where "
+         "the filesystem\n");
+  printf("                        shares extents, kept as FILE.snapshot "
+         "until done.\n");
+  printf("  -E, --encrypt FILE [DEST]\n");
+  printf("  -D, --decrypt FILE [DEST]\n");
+  printf("                        Encrypt or decrypt one file without a ui, "
+         "by default to\n");
+  printf("                        FILE.enc or FILE without .enc.\n");
+  printf("  -G, --keygen FILE     Write a new key pair: the secret key to "
+         "FILE, the public\n");
+  printf("                        key to FILE.pub.\n");
+  printf("  -R, --recipient FILE  Encrypt to the public key in FILE rather "
+         "than a password\n");
+  printf("                        (up to %d times): no password is asked "
+         "for.\n",
+         CRYPTO_MAX_RECIPIENTS);
+  printf("  -I, --identity FILE   Decrypt with the secret key in FILE rather "
+         "than a password.\n\n");
   printf("If no directory is specified via -d or as a positional argument, '.' "
          "(current directory) is used.\n");
 }
@@ -38,18 +615,54 @@ int main(int argc, char **argv) {
 
   int show_hidden_arg = 0;
   char *path_arg = NULL;
+  int io_policy_arg = CRYPTO_IO_CACHED;
+  int digest_arg = 1;
+  const char *agent_socket_arg = NULL;
+  const char *client_socket_arg = NULL;
+  int idle_arg = AGENT_DEFAULT_IDLE_SECONDS;
+  const char *sync_dest_arg = NULL;
+  int hash_check_arg = 0;
+  const char *store_dir_arg = NULL;
+  const char *in_place_arg = NULL;
+  int snapshot_arg = 0;
+  const char *encrypt_arg = NULL;
+  const char *decrypt_arg = NULL;
+  const char *keygen_arg = NULL;
+  const char *identity_arg = NULL;
+  unsigned char recipients_arg[CRYPTO_MAX_RECIPIENTS *
+                               CRYPTO_PUBLIC_KEY_BYTES];
+  int recipient_count_arg = 0;
 
   struct option long_options[] = {
       {"help", no_argument, 0, 'h'},
       {"all", no_argument, 0, 'a'},
       {"directory", required_argument, 0, 'd'},
+      {"cache", required_argument, 0, 'c'},
+      {"stats", required_argument, 0, 's'},
+      {"io-policy", required_argument, 0, 'i'},
+      {"manifest", required_argument, 0, 'm'},
+      {"no-digest", no_argument, 0, 'n'},
+      {"agent", required_argument, 0, 'A'},
+      {"idle", required_argument, 0, 't'},
+      {"client", required_argument, 0, 'C'},
+      {"sync", required_argument, 0, 'S'},
+      {"hash-check", no_argument, 0, 'H'},
+      {"store", required_argument, 0, 'T'},
+      {"in-place", required_argument, 0, 'P'},
+      {"snapshot", no_argument, 0, 'k'},
+      {"encrypt", required_argument, 0, 'E'},
+      {"decrypt", required_argument, 0, 'D'},
+      {"keygen", required_argument, 0, 'G'},
+      {"recipient", required_argument, 0, 'R'},
+      {"identity", required_argument, 0, 'I'},
       {0, 0, 0, 0} // terminator for options
   };
 
   int opt_char;
   int long_index = 0;
-  while ((opt_char = getopt_long(argc, argv, "had:", long_options,
-                                 &long_index)) != -1) {
+  while ((opt_char =
+              getopt_long(argc, argv, "had:c:s:i:m:nA:t:C:S:HT:P:kE:D:G:R:I:",
+                          long_options, &long_index)) != -1) {
     switch (opt_char) {
     case 'h':
       print_help(argv[0]);
@@ -60,12 +673,144 @@ int main(int argc, char **argv) {
     case 'd':
       path_arg = optarg;
       break;
+    case 'c':
+      current_cache_path = optarg;
+      break;
+    case 's':
+      if (stats_open(optarg) != STATS_SUCCESS) {
+        fprintf(stderr, "Failed to open stats output '%s'\n", optarg);
+        return 1;
+      }
+      break;
+    case 'i':
+      if (strcmp(optarg, "cached") == 0) {
+        io_policy_arg = CRYPTO_IO_CACHED;
+      } else if (strcmp(optarg, "stream") == 0) {
+        io_policy_arg = CRYPTO_IO_STREAM;
+      } else if (strcmp(optarg, "direct") == 0) {
+        io_policy_arg = CRYPTO_IO_DIRECT;
+      } else {
+        fprintf(stderr, "Unknown I/O policy '%s'\n", optarg);
+        return 1;
+      }
+      break;
+    case 'm':
+      if (manifest_open(optarg) != MANIFEST_SUCCESS) {
+        fprintf(stderr, "Failed to open manifest '%s'\n", optarg);
+        return 1;
+      }
+      break;
+    case 'n':
+      digest_arg = 0;
+      break;
+    case 'A':
+      agent_socket_arg = optarg;
+      break;
+    case 't': {
+      // a typo must not read as 0, which keeps the keys for good
+      char *end;
+      errno = 0;
+      long idle = strtol(optarg, &end, 10);
+      if (errno != 0 || end == optarg || *end != '\0' || idle < 0 ||
+          idle > INT_MAX) {
+        fprintf(stderr, "Invalid idle time '%s'\n", optarg);
+        print_help(argv[0]);
+        return 1;
+      }
+      idle_arg = (int)idle;
+      break;
+    }
+    case 'C':
+      client_socket_arg = optarg;
+      break;
+    case 'S':
+      sync_dest_arg = optarg;
+      break;
+    case 'H':
+      hash_check_arg = 1;
+      break;
+    case 'T':
+      store_dir_arg = optarg;
+      break;
+    case 'P':
+      in_place_arg = optarg;
+      break;
+    case 'k':
+      snapshot_arg = 1;
+      break;
+    case 'E':
+      encrypt_arg = optarg;
+      break;
+    case 'D':
+      decrypt_arg = optarg;
+      break;
+    case 'G':
+      keygen_arg = optarg;
+      break;
+    case 'R':
+      if (recipient_count_arg == CRYPTO_MAX_RECIPIENTS) {
+        fprintf(stderr, "At most %d recipients\n", CRYPTO_MAX_RECIPIENTS);
+        return 1;
+      }
+      unsigned char *recipient =
+          recipients_arg + recipient_count_arg * CRYPTO_PUBLIC_KEY_BYTES;
+      if (crypto_read_public_key(optarg, recipient) != CRYPTO_SUCCESS) {
+        fprintf(stderr, "Failed to read a public key from '%s'\n", optarg);
+        return 1;
+      }
+      recipient_count_arg++;
+      break;
+    case 'I':
+      identity_arg = optarg;
+      break;
     default:
       print_help(argv[0]);
       return 1;
     }
   }
 
+  if (agent_socket_arg) {
+    return run_agent(agent_socket_arg, idle_arg, io_policy_arg, digest_arg);
+  }
+  if (client_socket_arg) {
+    return run_client(client_socket_arg, argc - optind, argv + optind);
+  }
+  if (store_dir_arg) {
+    return run_store(store_dir_arg, argc - optind, argv + optind,
+                     io_policy_arg);
+  }
+  if (keygen_arg) {
+    return run_keygen(keygen_arg);
+  }
+  if (in_place_arg || encrypt_arg || decrypt_arg) {
+    CryptoOptions opts = {.io_policy = io_policy_arg,
+                          .no_digest = !digest_arg,
+                          .snapshot = snapshot_arg,
+                          .recipients = recipients_arg,
+                          .recipient_count = recipient_count_arg};
+    unsigned char *secret_key = NULL;
+    if (identity_arg) {
+      secret_key = sodium_malloc(CRYPTO_SECRET_KEY_BYTES);
+      if (!secret_key ||
+          crypto_read_secret_key(identity_arg, secret_key) != CRYPTO_SUCCESS) {
+        fprintf(stderr, "Failed to read a secret key from '%s'\n",
+                identity_arg);
+        sodium_free(secret_key);
+        return 1;
+      }
+      opts.secret_key = secret_key;
+    }
+    int status =
+        in_place_arg
+            ? run_in_place(in_place_arg, argc - optind, argv + optind, &opts)
+        : encrypt_arg ? run_file(JOB_ENCRYPT, encrypt_arg, argc - optind,
+                                 argv + optind, &opts)
+                      : run_file(JOB_DECRYPT, decrypt_arg, argc - optind,
+                                 argv + optind, &opts);
+    sodium_free(secret_key);
+    return status;
+  }
+
   if (path_arg) {
     current_tree_path = path_arg;
   } else if (optind < argc) {
@@ -73,10 +818,45 @@ int main(int argc, char **argv) {
   } else {
     current_tree_path = ".";
   }
+  if (sync_dest_arg) {
+    return run_sync(current_tree_path, sync_dest_arg, hash_check_arg,
+                    io_policy_arg);
+  }
   current_show_hidden = show_hidden_arg;
 
   tui_init();
-  root_node = file_tree_create(current_tree_path, current_show_hidden);
+  file_type_preload();
+  file_meta_start();
+  jobs_set_io_policy(io_policy_arg);
+  jobs_set_digest(digest_arg);
+  jobs_start(JOBS_DEFAULT_WORKERS);
+  tui_set_idle_handler(collect_finished_jobs);
+  FileNode *scanned = NULL;
+  if (current_cache_path) {
+    tree_cache = tree_cache_open(current_cache_path);
+    scanned =
+        tree_cache_load(tree_cache, current_tree_path, current_show_hidden);
+    if (scanned) {
+      tree_cache_start_revalidation(tree_cache, current_tree_path,
+                                    current_show_hidden);
+    }
+  }
+  if (!scanned) {
+    scanned = file_tree_create(current_tree_path, current_show_hidden);
+  }
+  // from here on the tree is rebuilt in the background and published to the
+  // ui as new versions, see tree_snapshot.c
+  if (scanned && tree_snapshot_start(scanned, current_tree_path,
+                                     current_show_hidden) !=
+                     TREE_SNAPSHOT_SUCCESS) {
+    file_tree_destroy(scanned);
+    scanned = NULL;
+  }
+  if (scanned) {
+    tree_reader = tree_snapshot_register();
+    root_node = tree_snapshot_adopt(tree_reader, NULL);
+    tui_set_tree_handler(latest_tree);
+  }
 
   if (!root_node) {
     if (argc > 1) {
@@ -97,108 +877,32 @@ int main(int argc, char **argv) {
   int running = 1;
   while (running) {
     int selection = tui_get_menu_selection();
+    latest_tree();
     switch (selection) {
-    case MENU_ENCRYPT: {
-      FileNode *file = tui_get_file_browser_selection(root_node);
-      if (!file) {
-        break; // esc
-      }
-      if (file->is_dir) {
-        tui_display_message("Please select a valid file", TUI_MSG_ERROR);
-        tui_draw_layout();
-        break;
-      }
-
-      const char *file_type = get_common_file_type(file);
-      char confirm_prompt[MAX_PATH_LENGTH + 50];
-      snprintf(confirm_prompt, sizeof(confirm_prompt),
-               "Encrypt file \"%s\" (%s)?", file->name, file_type);
-
-      if (tui_get_confirmation(confirm_prompt) != TUI_CONFIRM_YES) {
-        tui_draw_layout(); // redraw UI after confirmation dialog
-        break;
-      }
-
-      char *password =
-          tui_get_password("Enter the password to encrypt the file:");
-      if (!password || strlen(password) == 0) {
-        tui_display_message("Password cannot be empty", TUI_MSG_WARNING);
-        break;
-      }
-      char output_file[MAX_PATH_LENGTH];
-      snprintf(output_file, MAX_PATH_LENGTH, "%s.enc", file->path);
-      output_file[MAX_PATH_LENGTH - 1] = '\0';
-      int result = crypto_encrypt_file(file->path, output_file, password);
-      if (result == CRYPTO_SUCCESS) {
-        char message[MAX_PATH_LENGTH + 30];
-        sprintf(message, "File encrypted and saved to %s", output_file);
-        tui_display_message(message, TUI_MSG_SUCCESS);
-      } else {
-        tui_display_message("Encryption failed", TUI_MSG_ERROR);
-      }
-      FileNode *old_root = root_node;
-      root_node = file_tree_create(current_tree_path, current_show_hidden);
-      if (root_node) {
-        file_tree_destroy(old_root);
+    case MENU_ENCRYPT:
+      run_crypto_action(JOB_ENCRYPT);
+      break;
+    case MENU_DECRYPT:
+      run_crypto_action(JOB_DECRYPT);
+      break;
+    case MENU_JOBS: {
+      int id = tui_get_job_selection();
+      if (id > 0 && tui_get_confirmation("Cancel this job?") ==
+                        TUI_CONFIRM_YES) {
+        if (jobs_cancel(id) != JOBS_SUCCESS) {
+          tui_display_message("The job has already finished", TUI_MSG_INFO);
+        }
       }
       tui_draw_layout();
-      tui_draw_file_browser(root_node, 0, 0);
       break;
     }
-    case MENU_DECRYPT: {
-      FileNode *file = tui_get_file_browser_selection(root_node);
-      if (!file) {
-        break; // esc
-      }
-      if (file->is_dir) {
-        tui_display_message("Please select a valid file", TUI_MSG_ERROR);
-        tui_draw_layout();
-        break;
-      }
-
-      const char *file_type = get_common_file_type(file);
-      char confirm_prompt[MAX_PATH_LENGTH + 50];
-      snprintf(confirm_prompt, sizeof(confirm_prompt),
-               "Decrypt file \"%s\" (%s)?", file->name, file_type);
-
-      if (tui_get_confirmation(confirm_prompt) != TUI_CONFIRM_YES) {
-        tui_draw_layout();
-        break;
-      }
-
-      char *password =
-          tui_get_password("Enter the password to decrypt the file:");
-      if (!password || strlen(password) == 0) {
-        tui_display_message("Password cannot be empty", TUI_MSG_WARNING);
+    case MENU_EXIT:
+      if (jobs_active() &&
+          tui_get_confirmation("Jobs are still running. Cancel them and "
+                               "exit?") != TUI_CONFIRM_YES) {
         tui_draw_layout();
         break;
       }
-      char output_file[MAX_PATH_LENGTH];
-      char *ext = strrchr(file->path, '.');
-      if (ext && strcmp(ext, ".enc") == 0) {
-        strncpy(output_file, file->path, ext - file->path);
-      } else {
-        snprintf(output_file, MAX_PATH_LENGTH, "%s.dec", file->path);
-      }
-      output_file[ext - file->path] = '\0';
-      int result = crypto_decrypt_file(file->path, output_file, password);
-      if (result == CRYPTO_SUCCESS) {
-        char message[MAX_PATH_LENGTH + 28];
-        sprintf(message, "File decrypted and saved to %s", output_file);
-        tui_display_message(message, TUI_MSG_SUCCESS);
-      } else {
-        tui_display_message("Decryption failed", TUI_MSG_ERROR);
-      }
-      tui_draw_layout();
-      FileNode *old_root = root_node;
-      root_node = file_tree_create(current_tree_path, current_show_hidden);
-      if (root_node) {
-        file_tree_destroy(old_root);
-      }
-      tui_draw_file_browser(root_node, 0, 0);
-      break;
-    }
-    case MENU_EXIT:
       running = 0;
       break;
     }
@@ -208,9 +912,19 @@ int main(int argc, char **argv) {
 }
 
 void cleanup() {
-  if (root_node) {
-    file_tree_destroy(root_node);
-    root_node = NULL;
+  jobs_stop(); // cancels unfinished jobs and removes their partial output
+  file_meta_stop();
+  tree_cache_close(tree_cache);
+  tree_cache = NULL;
+  if (current_cache_path && root_node) {
+    tree_cache_save(root_node, current_show_hidden, current_cache_path);
   }
+  tree_snapshot_unregister(tree_reader);
+  tree_reader = -1;
+  tree_snapshot_stop(); // frees root_node along with every other version
+  root_node = NULL;
+  file_type_cleanup(); // after the tree, whose nodes point at type labels
+  stats_close();       // after every job and scan has been recorded
+  manifest_close();
   tui_cleanup();
 }
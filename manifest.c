@@ -0,0 +1,77 @@
+#include "manifest.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+
+// digests of the files crypto.c reads and writes, one line per file in the
+// format of b2sum, so 'b2sum -c MANIFEST' checks both the plaintext and
+// the encrypted copy. while no manifest is open, callers see
+// manifest_enabled() == 0 and skip hashing the ciphertext
+
+static atomic_int manifest_on;
+static pthread_mutex_t manifest_lock = PTHREAD_MUTEX_INITIALIZER;
+static FILE *manifest_file;
+
+int manifest_open(const char *path) {
+  if (!path) {
+    return MANIFEST_ERROR;
+  }
+  FILE *file = fopen(path, "a");
+  if (!file) {
+    return MANIFEST_ERROR;
+  }
+  setvbuf(file, NULL, _IOLBF, 0); // one write per line
+
+  pthread_mutex_lock(&manifest_lock);
+  if (manifest_file) {
+    fclose(manifest_file);
+  }
+  manifest_file = file;
+  atomic_store(&manifest_on, 1);
+  pthread_mutex_unlock(&manifest_lock);
+  return MANIFEST_SUCCESS;
+}
+
+int manifest_enabled() {
+  return atomic_load_explicit(&manifest_on, memory_order_relaxed);
+}
+
+// like b2sum, a name holding a backslash or a newline is escaped and its
+// line starts with a backslash
+void manifest_record(const char *path, const unsigned char *digest,
+                     size_t digest_len) {
+  pthread_mutex_lock(&manifest_lock);
+  if (!manifest_file) {
+    pthread_mutex_unlock(&manifest_lock);
+    return;
+  }
+  if (strpbrk(path, "\\\n")) {
+    fputc('\\', manifest_file);
+  }
+  for (size_t i = 0; i < digest_len; i++) {
+    fprintf(manifest_file, "%02x", digest[i]);
+  }
+  fputs("  ", manifest_file);
+  for (const char *p = path; *p; p++) {
+    if (*p == '\\') {
+      fputs("\\\\", manifest_file);
+    } else if (*p == '\n') {
+      fputs("\\n", manifest_file);
+    } else {
+      fputc(*p, manifest_file);
+    }
+  }
+  fputc('\n', manifest_file);
+  pthread_mutex_unlock(&manifest_lock);
+}
+
+void manifest_close() {
+  pthread_mutex_lock(&manifest_lock);
+  atomic_store(&manifest_on, 0);
+  if (manifest_file) {
+    fclose(manifest_file);
+    manifest_file = NULL;
+  }
+  pthread_mutex_unlock(&manifest_lock);
+}
@@ -0,0 +1,15 @@
+#ifndef MANIFEST_H
+#define MANIFEST_H
+
+#include <stddef.h>
+
+#define MANIFEST_SUCCESS 1
+#define MANIFEST_ERROR -1
+
+int manifest_open(const char *path);
+void manifest_close();
+int manifest_enabled();
+void manifest_record(const char *path, const unsigned char *digest,
+                     size_t digest_len);
+
+#endif
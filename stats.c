@@ -0,0 +1,188 @@
+#include "stats.h"
+#include "crypto.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// optional instrumentation: each encrypt/decrypt and each tree scan appends
+// one json object per line to the stats target, and stats_close appends
+// the totals of the session. while no target is open, callers see
+// stats_enabled() == 0 and skip even reading the clock
+
+#define STATS_OP_ENCRYPT 0
+#define STATS_OP_DECRYPT 1
+#define STATS_NUM_OPS 2
+
+typedef struct StatsTotals {
+  long long operations;
+  long long failed;
+  StatsCrypto sum;
+} StatsTotals;
+
+static atomic_int stats_on;
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static FILE *stats_file;
+static StatsTotals stats_totals[STATS_NUM_OPS];
+static long long stats_tree_scans;
+static long long stats_tree_scan_ns;
+static long long stats_session_start_ns;
+
+long long stats_now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+int stats_enabled() {
+  return atomic_load_explicit(&stats_on, memory_order_relaxed);
+}
+
+// 'target' is a file path, appended to, or "fd:N" for an already open
+// descriptor (e.g. a pipe set up by the caller)
+int stats_open(const char *target) {
+  if (!target) {
+    return STATS_ERROR;
+  }
+  FILE *file;
+  if (strncmp(target, "fd:", 3) == 0) {
+    char *end;
+    long fd = strtol(target + 3, &end, 10);
+    if (end == target + 3 || *end != '\0' || fd < 0) {
+      return STATS_ERROR;
+    }
+    file = fdopen((int)fd, "a");
+  } else {
+    file = fopen(target, "a");
+  }
+  if (!file) {
+    return STATS_ERROR;
+  }
+  setvbuf(file, NULL, _IOLBF, 0); // one write per record
+
+  pthread_mutex_lock(&stats_lock);
+  if (stats_file) {
+    fclose(stats_file);
+  }
+  stats_file = file;
+  memset(stats_totals, 0, sizeof(stats_totals));
+  stats_tree_scans = 0;
+  stats_tree_scan_ns = 0;
+  stats_session_start_ns = stats_now_ns();
+  atomic_store(&stats_on, 1);
+  pthread_mutex_unlock(&stats_lock);
+  return STATS_SUCCESS;
+}
+
+// must be called with stats_lock held
+static void stats_write_string(const char *value) {
+  fputc('"', stats_file);
+  for (const unsigned char *p = (const unsigned char *)value; *p; p++) {
+    if (*p == '"' || *p == '\\') {
+      fprintf(stats_file, "\\%c", *p);
+    } else if (*p < 0x20) {
+      fprintf(stats_file, "\\u%04x", *p);
+    } else {
+      fputc(*p, stats_file);
+    }
+  }
+  fputc('"', stats_file);
+}
+
+// must be called with stats_lock held
+static void stats_write_counters(const StatsCrypto *stats) {
+  double seconds = stats->total_ns / 1e9;
+  long long payload =
+      stats->bytes_read > stats->bytes_written ? stats->bytes_read
+                                               : stats->bytes_written;
+  fprintf(stats_file,
+          "\"total_ms\":%.3f,\"kdf_ms\":%.3f,\"aead_ms\":%.3f,"
+          "\"bytes_read\":%lld,\"bytes_written\":%lld,\"read_calls\":%lld,"
+          "\"write_calls\":%lld,\"chunks\":%lld,\"aead_ns_per_byte\":%.3f,"
+          "\"mb_per_s\":%.3f",
+          stats->total_ns / 1e6, stats->kdf_ns / 1e6, stats->aead_ns / 1e6,
+          stats->bytes_read, stats->bytes_written, stats->read_calls,
+          stats->write_calls, stats->chunks,
+          payload > 0 ? (double)stats->aead_ns / payload : 0.0,
+          seconds > 0 ? payload / seconds / 1e6 : 0.0);
+}
+
+static void stats_add(StatsCrypto *sum, const StatsCrypto *stats) {
+  sum->total_ns += stats->total_ns;
+  sum->kdf_ns += stats->kdf_ns;
+  sum->aead_ns += stats->aead_ns;
+  sum->bytes_read += stats->bytes_read;
+  sum->bytes_written += stats->bytes_written;
+  sum->read_calls += stats->read_calls;
+  sum->write_calls += stats->write_calls;
+  sum->chunks += stats->chunks;
+}
+
+// 'op' is "encrypt" or "decrypt", 'result' a CRYPTO_* code
+void stats_record_crypto(const char *op, const char *path, int result,
+                         const StatsCrypto *stats) {
+  pthread_mutex_lock(&stats_lock);
+  if (!stats_file) {
+    pthread_mutex_unlock(&stats_lock);
+    return;
+  }
+  StatsTotals *totals =
+      &stats_totals[strcmp(op, "decrypt") == 0 ? STATS_OP_DECRYPT
+                                               : STATS_OP_ENCRYPT];
+  totals->operations++;
+  if (result != CRYPTO_SUCCESS) {
+    totals->failed++;
+  }
+  stats_add(&totals->sum, stats);
+
+  fprintf(stats_file, "{\"event\":\"%s\",\"path\":", op);
+  stats_write_string(path);
+  fprintf(stats_file, ",\"result\":%d,", result);
+  stats_write_counters(stats);
+  fputs("}\n", stats_file);
+  pthread_mutex_unlock(&stats_lock);
+}
+
+void stats_record_tree_scan(const char *path, int num_nodes, long long ns) {
+  pthread_mutex_lock(&stats_lock);
+  if (!stats_file) {
+    pthread_mutex_unlock(&stats_lock);
+    return;
+  }
+  stats_tree_scans++;
+  stats_tree_scan_ns += ns;
+  fputs("{\"event\":\"tree_scan\",\"path\":", stats_file);
+  stats_write_string(path);
+  fprintf(stats_file, ",\"nodes\":%d,\"scan_ms\":%.3f}\n", num_nodes,
+          ns / 1e6);
+  pthread_mutex_unlock(&stats_lock);
+}
+
+// writes the session totals and stops collecting
+void stats_close() {
+  pthread_mutex_lock(&stats_lock);
+  if (!stats_file) {
+    pthread_mutex_unlock(&stats_lock);
+    return;
+  }
+  atomic_store(&stats_on, 0);
+  static const char *op_names[STATS_NUM_OPS] = {"encrypt", "decrypt"};
+  fprintf(stats_file,
+          "{\"event\":\"session\",\"session_ms\":%.3f,\"tree_scans\":%lld,"
+          "\"tree_scan_ms\":%.3f",
+          (stats_now_ns() - stats_session_start_ns) / 1e6, stats_tree_scans,
+          stats_tree_scan_ns / 1e6);
+  for (int i = 0; i < STATS_NUM_OPS; i++) {
+    fprintf(stats_file, ",\"%s\":{\"operations\":%lld,\"failed\":%lld,",
+            op_names[i], stats_totals[i].operations, stats_totals[i].failed);
+    stats_write_counters(&stats_totals[i].sum);
+    fputc('}', stats_file);
+  }
+  fputs("}\n", stats_file);
+  fclose(stats_file);
+  stats_file = NULL;
+  pthread_mutex_unlock(&stats_lock);
+}
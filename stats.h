@@ -0,0 +1,27 @@
+#ifndef STATS_H
+#define STATS_H
+
+#define STATS_SUCCESS 1
+#define STATS_ERROR -1
+
+// per-operation counters filled in by crypto.c while stats are enabled
+typedef struct StatsCrypto {
+  long long total_ns;
+  long long kdf_ns;
+  long long aead_ns; // time spent in secretstream push/pull
+  long long bytes_read;
+  long long bytes_written;
+  long long read_calls;
+  long long write_calls;
+  long long chunks;
+} StatsCrypto;
+
+int stats_open(const char *target);
+void stats_close();
+int stats_enabled();
+long long stats_now_ns();
+void stats_record_crypto(const char *op, const char *path, int result,
+                         const StatsCrypto *stats);
+void stats_record_tree_scan(const char *path, int num_nodes, long long ns);
+
+#endif
@@ -0,0 +1,666 @@
+#define _GNU_SOURCE // memfd_create, mkostemp, syncfs
+#include "store.h"
+#include "crypto.h"
+#include "crypto_io.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// deduplicating chunk store. a file put into the store is cut into chunks
+// where a rolling (gear) hash of its content says so: an insertion or a
+// deletion only moves the boundaries around it, and the rest of a near
+// identical file cuts into the same chunks as before. chunks are named by a
+// hash keyed with the store key, and each one is encrypted and written once
+// under chunks/. the file becomes a list of chunk names and lengths,
+// encrypted like any file under the store's master key. the gear table is
+// derived from the key as well, so neither names nor boundaries can be
+// compared across stores.
+// put reads a batch while workers hash, encrypt and write the chunks of the
+// batch before it; get decrypts the chunks in parallel, each to its offset
+
+#define STORE_CONFIG_NAME ".filecryption-store"
+#define STORE_CONFIG_HEADER "filecryption-store 1"
+#define STORE_LIST_HEADER "filecryption-chunks 1"
+#define STORE_KEY_CONTEXT "FCRYPTST" // crypto_kdf context, 8 bytes
+#define STORE_MAX_WORKERS 8
+
+// boundaries are looked for past the minimum chunk size, where the top
+// STORE_CHUNK_BITS bits of the gear hash are zero: 64 KiB chunks on average
+#define STORE_CHUNK_MIN (16 * 1024)
+#define STORE_CHUNK_MAX (256 * 1024)
+#define STORE_CHUNK_BITS 16
+#define STORE_BATCH_BYTES (16 * 1024 * 1024)
+
+#define STORE_ID_BYTES 32
+#define STORE_NONCE_BYTES crypto_aead_xchacha20poly1305_ietf_NPUBBYTES
+// a chunk on disk: nonce, ciphertext, tag
+#define STORE_SEALED_BYTES(len)                                                \
+  (STORE_NONCE_BYTES + (len) + crypto_aead_xchacha20poly1305_ietf_ABYTES)
+
+// crypto_kdf ids of the subkeys of the master key
+#define STORE_SUBKEY_ID 1
+#define STORE_SUBKEY_CHUNK 2
+#define STORE_SUBKEY_GEAR 3 // and up, one per 32 bytes of gear table
+
+typedef struct StoreKeys {
+  unsigned char master[CRYPTO_MASTER_KEY_BYTES];
+  unsigned char id[crypto_generichash_KEYBYTES]; // names chunks
+  unsigned char chunk[crypto_aead_xchacha20poly1305_ietf_KEYBYTES];
+  uint64_t gear[256];
+} StoreKeys;
+
+struct Store {
+  char dir[PATH_MAX];
+  int io_policy;
+  StoreKeys *keys; // sodium_malloc'ed
+  unsigned char salt[crypto_pwhash_SALTBYTES];
+};
+
+typedef struct StoreChunk {
+  long long offset; // in the file
+  size_t len;
+  const unsigned char *data; // put only
+  unsigned char id[STORE_ID_BYTES];
+  int is_new; // put wrote it
+  int result;
+} StoreChunk;
+
+// the chunks of one put batch or one get, shared by the workers
+typedef struct StoreJob {
+  Store *store;
+  StoreChunk *chunks;
+  int num_chunks;
+  atomic_int next_chunk;
+  int fd; // get: the output file, -1 for put
+} StoreJob;
+
+static CryptoOptions store_file_options(const Store *store) {
+  CryptoOptions opts = {.checkpoint_bytes = -1,
+                        .master_key = store->keys->master,
+                        .master_salt = store->salt};
+  return opts;
+}
+
+static void store_derive_keys(StoreKeys *keys) {
+  crypto_kdf_derive_from_key(keys->id, sizeof(keys->id), STORE_SUBKEY_ID,
+                             STORE_KEY_CONTEXT, keys->master);
+  crypto_kdf_derive_from_key(keys->chunk, sizeof(keys->chunk),
+                             STORE_SUBKEY_CHUNK, STORE_KEY_CONTEXT,
+                             keys->master);
+  unsigned char *gear = (unsigned char *)keys->gear;
+  for (size_t i = 0; i < sizeof(keys->gear) / 32; i++) {
+    crypto_kdf_derive_from_key(gear + i * 32, 32, STORE_SUBKEY_GEAR + i,
+                               STORE_KEY_CONTEXT, keys->master);
+  }
+}
+
+// encrypts the contents of the memfd 'plain' to 'path', through a
+// temporary file renamed into place
+static int store_seal_file(Store *store, int plain, const char *path) {
+  char tmp_path[PATH_MAX + 8];
+  snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+  int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  if (fd < 0) {
+    return STORE_ERROR_FILE;
+  }
+  CryptoOptions opts = store_file_options(store);
+  int ok = lseek(plain, 0, SEEK_SET) == 0 &&
+           crypto_encrypt_fd(plain, fd, NULL, NULL, NULL, &opts) ==
+               CRYPTO_SUCCESS &&
+           fsync(fd) == 0;
+  ok = close(fd) == 0 && ok && rename(tmp_path, path) == 0;
+  if (!ok) {
+    unlink(tmp_path);
+  }
+  return ok ? STORE_SUCCESS : STORE_ERROR_FILE;
+}
+
+// decrypts the file open as 'fd' into a new memfd, returned at offset 0.
+// -1 if it is not a file of this store or does not authenticate
+static int store_open_sealed(Store *store, int fd) {
+  int plain = memfd_create("filecryption-store", MFD_CLOEXEC);
+  if (plain < 0) {
+    return -1;
+  }
+  CryptoOptions opts = store_file_options(store);
+  if (crypto_decrypt_fd(fd, plain, NULL, NULL, NULL, &opts) !=
+          CRYPTO_SUCCESS ||
+      lseek(plain, 0, SEEK_SET) != 0) {
+    close(plain);
+    return -1;
+  }
+  return plain;
+}
+
+// the config holds nothing but a header: it is there for its salt, and to
+// tell a wrong password from a damaged chunk
+static int store_read_config(Store *store, int fd, const char *password) {
+  if (crypto_master_salt(fd, store->salt) != CRYPTO_SUCCESS) {
+    return STORE_ERROR_KEY;
+  }
+  if (crypto_derive_key(store->keys->master, CRYPTO_MASTER_KEY_BYTES,
+                        password, store->salt) != 0) {
+    return STORE_ERROR;
+  }
+  int plain = store_open_sealed(store, fd);
+  if (plain < 0) {
+    return STORE_ERROR_KEY;
+  }
+  char header[sizeof(STORE_CONFIG_HEADER)];
+  int status = read(plain, header, sizeof(header)) == sizeof(header) &&
+                       memcmp(header, STORE_CONFIG_HEADER "\n",
+                              sizeof(header)) == 0
+                   ? STORE_SUCCESS
+                   : STORE_ERROR_KEY;
+  close(plain);
+  return status;
+}
+
+static int store_create_config(Store *store, const char *path,
+                               const char *password) {
+  randombytes_buf(store->salt, sizeof(store->salt));
+  if (crypto_derive_key(store->keys->master, CRYPTO_MASTER_KEY_BYTES,
+                        password, store->salt) != 0) {
+    return STORE_ERROR;
+  }
+  int plain = memfd_create("filecryption-store", MFD_CLOEXEC);
+  if (plain < 0) {
+    return STORE_ERROR;
+  }
+  int status = STORE_ERROR;
+  if (write(plain, STORE_CONFIG_HEADER "\n", sizeof(STORE_CONFIG_HEADER)) ==
+      sizeof(STORE_CONFIG_HEADER)) {
+    status = store_seal_file(store, plain, path);
+  }
+  close(plain);
+  return status;
+}
+
+// opens the store in 'dir', creating it if need be. on success '*out' is
+// the store, for store_close
+int store_open(const char *dir, const char *password, int io_policy,
+               Store **out) {
+  *out = NULL;
+  Store *store = calloc(1, sizeof(Store));
+  if (!store) {
+    return STORE_ERROR;
+  }
+  snprintf(store->dir, sizeof(store->dir), "%s", dir);
+  store->io_policy = io_policy;
+  store->keys = sodium_malloc(sizeof(StoreKeys));
+  if (!store->keys) {
+    free(store);
+    return STORE_ERROR;
+  }
+
+  char path[PATH_MAX + sizeof(STORE_CONFIG_NAME)];
+  mkdir(dir, 0700);
+  snprintf(path, sizeof(path), "%s/chunks", dir);
+  mkdir(path, 0700);
+  snprintf(path, sizeof(path), "%s/%s", dir, STORE_CONFIG_NAME);
+  int status;
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd >= 0) {
+    status = store_read_config(store, fd, password);
+    close(fd);
+  } else if (errno == ENOENT) {
+    status = store_create_config(store, path, password);
+  } else {
+    status = STORE_ERROR_FILE;
+  }
+  if (status != STORE_SUCCESS) {
+    store_close(store);
+    return status;
+  }
+  store_derive_keys(store->keys);
+  *out = store;
+  return STORE_SUCCESS;
+}
+
+void store_close(Store *store) {
+  if (!store) {
+    return;
+  }
+  sodium_free(store->keys);
+  free(store);
+}
+
+// chunks/ab/abcd...: the first byte of the name spreads them over 256
+// directories
+static void store_chunk_path(const Store *store, const unsigned char *id,
+                             char *path, size_t size) {
+  char hex[STORE_ID_BYTES * 2 + 1];
+  sodium_bin2hex(hex, sizeof(hex), id, STORE_ID_BYTES);
+  snprintf(path, size, "%s/chunks/%.2s/%s", store->dir, hex, hex);
+}
+
+static int store_write_all(int fd, const unsigned char *data, size_t len) {
+  while (len > 0) {
+    ssize_t written = write(fd, data, len);
+    if (written < 0 && errno == EINTR) {
+      continue;
+    }
+    if (written <= 0) {
+      return 0;
+    }
+    data += written;
+    len -= (size_t)written;
+  }
+  return 1;
+}
+
+static int store_pread_all(int fd, unsigned char *data, size_t len,
+                           off_t offset) {
+  while (len > 0) {
+    ssize_t got = pread(fd, data, len, offset);
+    if (got < 0 && errno == EINTR) {
+      continue;
+    }
+    if (got <= 0) {
+      return 0;
+    }
+    data += got;
+    len -= (size_t)got;
+    offset += got;
+  }
+  return 1;
+}
+
+static int store_pwrite_all(int fd, const unsigned char *data, size_t len,
+                            off_t offset) {
+  while (len > 0) {
+    ssize_t written = pwrite(fd, data, len, offset);
+    if (written < 0 && errno == EINTR) {
+      continue;
+    }
+    if (written <= 0) {
+      return 0;
+    }
+    data += written;
+    len -= (size_t)written;
+    offset += written;
+  }
+  return 1;
+}
+
+// names the chunk and, unless the store has it already, encrypts it into a
+// temporary file renamed into place. two workers storing the same chunk
+// both write it, and either copy is fine
+static void store_put_chunk(Store *store, StoreChunk *chunk) {
+  crypto_generichash(chunk->id, STORE_ID_BYTES, chunk->data, chunk->len,
+                     store->keys->id, sizeof(store->keys->id));
+  char path[PATH_MAX + STORE_ID_BYTES * 2 + 16];
+  store_chunk_path(store, chunk->id, path, sizeof(path));
+  chunk->result = STORE_SUCCESS;
+  if (access(path, F_OK) == 0) {
+    return;
+  }
+
+  size_t sealed_len = STORE_SEALED_BYTES(chunk->len);
+  unsigned char *sealed = malloc(sealed_len);
+  if (!sealed) {
+    chunk->result = STORE_ERROR;
+    return;
+  }
+  randombytes_buf(sealed, STORE_NONCE_BYTES);
+  crypto_aead_xchacha20poly1305_ietf_encrypt(
+      sealed + STORE_NONCE_BYTES, NULL, chunk->data, chunk->len, chunk->id,
+      STORE_ID_BYTES, NULL, sealed, store->keys->chunk);
+
+  char *slash = strrchr(path, '/');
+  *slash = '\0';
+  mkdir(path, 0700); // exists already, mostly
+  *slash = '/';
+  char tmp_path[sizeof(path) + 8];
+  snprintf(tmp_path, sizeof(tmp_path), "%s.XXXXXX", path);
+  int fd = mkostemp(tmp_path, O_CLOEXEC);
+  int ok = fd >= 0 && store_write_all(fd, sealed, sealed_len);
+  if (fd >= 0) {
+    ok = close(fd) == 0 && ok && rename(tmp_path, path) == 0;
+    if (!ok) {
+      unlink(tmp_path);
+    }
+  }
+  free(sealed);
+  chunk->is_new = ok;
+  chunk->result = ok ? STORE_SUCCESS : STORE_ERROR_FILE;
+}
+
+static void store_get_chunk(StoreJob *job, StoreChunk *chunk) {
+  char path[PATH_MAX + STORE_ID_BYTES * 2 + 16];
+  store_chunk_path(job->store, chunk->id, path, sizeof(path));
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    chunk->result = STORE_ERROR_FILE;
+    return;
+  }
+  size_t sealed_len = STORE_SEALED_BYTES(chunk->len);
+  unsigned char *sealed = malloc(sealed_len);
+  unsigned char *plain = malloc(chunk->len);
+  struct stat st;
+  chunk->result = STORE_ERROR;
+  if (sealed && plain) {
+    chunk->result = STORE_ERROR_DEC;
+    if (fstat(fd, &st) == 0 && st.st_size == (off_t)sealed_len &&
+        store_pread_all(fd, sealed, sealed_len, 0) &&
+        crypto_aead_xchacha20poly1305_ietf_decrypt(
+            plain, NULL, NULL, sealed + STORE_NONCE_BYTES,
+            sealed_len - STORE_NONCE_BYTES, chunk->id, STORE_ID_BYTES,
+            sealed, job->store->keys->chunk) == 0) {
+      chunk->result = store_pwrite_all(job->fd, plain, chunk->len,
+                                       chunk->offset)
+                          ? STORE_SUCCESS
+                          : STORE_ERROR_FILE;
+    }
+    sodium_memzero(plain, chunk->len);
+  }
+  close(fd);
+  free(sealed);
+  free(plain);
+}
+
+static void *store_worker_thread(void *arg) {
+  StoreJob *job = (StoreJob *)arg;
+  for (;;) {
+    int i = atomic_fetch_add(&job->next_chunk, 1);
+    if (i >= job->num_chunks) {
+      break;
+    }
+    if (job->fd < 0) {
+      store_put_chunk(job->store, &job->chunks[i]);
+    } else {
+      store_get_chunk(job, &job->chunks[i]);
+    }
+  }
+  return NULL;
+}
+
+static int store_start_workers(StoreJob *job, pthread_t *threads) {
+  int workers = (int)sysconf(_SC_NPROCESSORS_ONLN);
+  if (workers > STORE_MAX_WORKERS) {
+    workers = STORE_MAX_WORKERS;
+  }
+  if (workers > job->num_chunks) {
+    workers = job->num_chunks;
+  }
+  int started = 0;
+  while (started < workers &&
+         pthread_create(&threads[started], NULL, store_worker_thread, job) ==
+             0) {
+    started++;
+  }
+  return started;
+}
+
+// the caller helps with what is left, and copes alone if no thread started
+static int store_finish_job(StoreJob *job, pthread_t *threads, int started) {
+  store_worker_thread(job);
+  for (int i = 0; i < started; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  for (int i = 0; i < job->num_chunks; i++) {
+    if (job->chunks[i].result != STORE_SUCCESS) {
+      return job->chunks[i].result;
+    }
+  }
+  return STORE_SUCCESS;
+}
+
+// cuts 'data' into chunks. without 'eof' the bytes past the last boundary
+// are not a chunk yet, as where they end depends on data not read: returns
+// the length cut, the rest is for the next batch
+static size_t store_cut(const StoreKeys *keys, const unsigned char *data,
+                        size_t len, int eof, StoreJob *job) {
+  const uint64_t limit = 1ULL << (64 - STORE_CHUNK_BITS);
+  size_t start = 0;
+  while (start < len) {
+    size_t end = len - start > STORE_CHUNK_MAX ? start + STORE_CHUNK_MAX : len;
+    size_t cut = 0;
+    uint64_t hash = 0;
+    for (size_t i = start + STORE_CHUNK_MIN; i < end; i++) {
+      hash = (hash << 1) + keys->gear[data[i]];
+      if (hash < limit) {
+        cut = i + 1;
+        break;
+      }
+    }
+    if (!cut) {
+      if (end - start < STORE_CHUNK_MAX && !eof) {
+        break;
+      }
+      cut = end;
+    }
+    StoreChunk *chunk = &job->chunks[job->num_chunks++];
+    memset(chunk, 0, sizeof(*chunk));
+    chunk->data = data + start;
+    chunk->len = cut - start;
+    start = cut;
+  }
+  return start;
+}
+
+// reads into 'buffer' past 'len' until it is full or the file ends
+static size_t store_fill(CryptoReader *reader, unsigned char *buffer,
+                         size_t len, size_t capacity, int *eof) {
+  while (len < capacity) {
+    size_t got = crypto_reader_read(reader, buffer + len, capacity - len);
+    if (got == 0) {
+      *eof = 1;
+      break;
+    }
+    len += got;
+  }
+  return len;
+}
+
+// puts 'src' into the store and writes its chunk list to 'list'
+int store_put(Store *store, const char *src, const char *list,
+              StoreReport *report) {
+  memset(report, 0, sizeof(*report));
+  CryptoReader reader;
+  if (crypto_reader_open(&reader, src, store->io_policy) != CRYPTO_SUCCESS) {
+    return STORE_ERROR_FILE;
+  }
+  const size_t capacity = STORE_BATCH_BYTES + STORE_CHUNK_MAX;
+  const int max_chunks = capacity / STORE_CHUNK_MIN + 1;
+  unsigned char *buffers[2] = {malloc(capacity), malloc(capacity)};
+  StoreChunk *chunks[2] = {malloc(max_chunks * sizeof(StoreChunk)),
+                           malloc(max_chunks * sizeof(StoreChunk))};
+  int plain = memfd_create("filecryption-chunks", MFD_CLOEXEC);
+  FILE *out = plain >= 0 ? fdopen(dup(plain), "w") : NULL;
+  int status = STORE_ERROR;
+  if (buffers[0] && buffers[1] && chunks[0] && chunks[1] && out) {
+    status = STORE_SUCCESS;
+    fprintf(out, "%s\n", STORE_LIST_HEADER);
+  }
+
+  int eof = 0;
+  int current = 0;
+  size_t len = status == STORE_SUCCESS
+                   ? store_fill(&reader, buffers[0], 0, capacity, &eof)
+                   : 0;
+  while (status == STORE_SUCCESS && len > 0) {
+    StoreJob job = {.store = store, .chunks = chunks[current], .fd = -1};
+    atomic_init(&job.next_chunk, 0);
+    size_t cut = store_cut(store->keys, buffers[current], len, eof, &job);
+    for (int i = 0; i < job.num_chunks; i++) {
+      job.chunks[i].offset = report->bytes;
+      report->bytes += job.chunks[i].len;
+    }
+
+    // the uncut tail starts the next batch, read while this one is stored
+    unsigned char *next = buffers[1 - current];
+    size_t next_len = len - cut;
+    memcpy(next, buffers[current] + cut, next_len);
+    pthread_t threads[STORE_MAX_WORKERS];
+    int started = store_start_workers(&job, threads);
+    if (!eof) {
+      next_len = store_fill(&reader, next, next_len, capacity, &eof);
+    }
+    status = store_finish_job(&job, threads, started);
+
+    for (int i = 0; i < job.num_chunks; i++) {
+      StoreChunk *chunk = &job.chunks[i];
+      char hex[STORE_ID_BYTES * 2 + 1];
+      sodium_bin2hex(hex, sizeof(hex), chunk->id, STORE_ID_BYTES);
+      fprintf(out, "%s\t%zu\n", hex, chunk->len);
+      report->chunks++;
+      if (chunk->is_new) {
+        report->new_chunks++;
+        report->new_bytes += chunk->len;
+      }
+    }
+    len = next_len;
+    current = 1 - current;
+  }
+  if (status == STORE_SUCCESS && reader.error) {
+    status = STORE_ERROR_FILE;
+  }
+  crypto_reader_close(&reader);
+  if (out && fclose(out) != 0 && status == STORE_SUCCESS) {
+    status = STORE_ERROR_FILE;
+  }
+
+  // the chunks reach the disk before the list that names them
+  if (status == STORE_SUCCESS && report->new_chunks > 0) {
+    int dir_fd = open(store->dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd < 0 || syncfs(dir_fd) != 0) {
+      status = STORE_ERROR_FILE;
+    }
+    if (dir_fd >= 0) {
+      close(dir_fd);
+    }
+  }
+  if (status == STORE_SUCCESS) {
+    status = store_seal_file(store, plain, list);
+  }
+  if (plain >= 0) {
+    close(plain);
+  }
+  for (int i = 0; i < 2; i++) {
+    if (buffers[i]) {
+      sodium_memzero(buffers[i], capacity);
+    }
+    free(buffers[i]);
+    free(chunks[i]);
+  }
+  return status;
+}
+
+// reads the chunk list in the memfd 'plain', offsets included
+static int store_parse_list(int plain, StoreChunk **out, int *out_count) {
+  FILE *in = fdopen(plain, "r");
+  if (!in) {
+    close(plain);
+    return STORE_ERROR;
+  }
+  StoreChunk *chunks = NULL;
+  int count = 0;
+  int capacity = 0;
+  long long offset = 0;
+  char *line = NULL;
+  size_t line_capacity = 0;
+  int status = STORE_ERROR_DEC;
+  if (getline(&line, &line_capacity, in) > 0 &&
+      strcmp(line, STORE_LIST_HEADER "\n") == 0) {
+    status = STORE_SUCCESS;
+  }
+  while (status == STORE_SUCCESS && getline(&line, &line_capacity, in) > 0) {
+    if (count == capacity) {
+      capacity = capacity ? capacity * 2 : 256;
+      StoreChunk *grown = realloc(chunks, capacity * sizeof(StoreChunk));
+      if (!grown) {
+        status = STORE_ERROR;
+        break;
+      }
+      chunks = grown;
+    }
+    StoreChunk *chunk = &chunks[count];
+    memset(chunk, 0, sizeof(*chunk));
+    char *tab = strchr(line, '\t');
+    size_t id_len = 0;
+    if (!tab ||
+        sodium_hex2bin(chunk->id, sizeof(chunk->id), line, tab - line, NULL,
+                       &id_len, NULL) != 0 ||
+        id_len != STORE_ID_BYTES) {
+      status = STORE_ERROR_DEC;
+      break;
+    }
+    chunk->len = strtoul(tab + 1, NULL, 10);
+    if (chunk->len == 0 || chunk->len > STORE_CHUNK_MAX) {
+      status = STORE_ERROR_DEC;
+      break;
+    }
+    chunk->offset = offset;
+    offset += chunk->len;
+    count++;
+  }
+  free(line);
+  fclose(in);
+  if (status != STORE_SUCCESS) {
+    free(chunks);
+    return status;
+  }
+  *out = chunks;
+  *out_count = count;
+  return STORE_SUCCESS;
+}
+
+// rebuilds the file the chunk list 'list' describes as 'dest'
+int store_get(Store *store, const char *list, const char *dest) {
+  int list_fd = open(list, O_RDONLY | O_CLOEXEC);
+  if (list_fd < 0) {
+    return STORE_ERROR_FILE;
+  }
+  int plain = store_open_sealed(store, list_fd);
+  close(list_fd);
+  if (plain < 0) {
+    return STORE_ERROR_DEC;
+  }
+  StoreChunk *chunks = NULL;
+  int num_chunks = 0;
+  int status = store_parse_list(plain, &chunks, &num_chunks);
+  if (status != STORE_SUCCESS) {
+    return status;
+  }
+
+  int fd = open(dest, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    free(chunks);
+    return STORE_ERROR_FILE;
+  }
+  long long size = num_chunks > 0 ? chunks[num_chunks - 1].offset +
+                                        (long long)chunks[num_chunks - 1].len
+                                  : 0;
+  status = ftruncate(fd, size) == 0 ? STORE_SUCCESS : STORE_ERROR_FILE;
+  if (status == STORE_SUCCESS) {
+    StoreJob job = {.store = store,
+                    .chunks = chunks,
+                    .num_chunks = num_chunks,
+                    .fd = fd};
+    atomic_init(&job.next_chunk, 0);
+    pthread_t threads[STORE_MAX_WORKERS];
+    int started = store_start_workers(&job, threads);
+    status = store_finish_job(&job, threads, started);
+  }
+  if (status == STORE_SUCCESS && fdatasync(fd) != 0) {
+    status = STORE_ERROR_FILE;
+  }
+  if (close(fd) != 0 && status == STORE_SUCCESS) {
+    status = STORE_ERROR_FILE;
+  }
+  if (status != STORE_SUCCESS) {
+    unlink(dest);
+  }
+  free(chunks);
+  return status;
+}
@@ -0,0 +1,29 @@
+#ifndef STORE_H
+#define STORE_H
+
+#define STORE_SUCCESS 1
+#define STORE_ERROR -1
+#define STORE_ERROR_KEY -2  // the store does not open with this password
+#define STORE_ERROR_FILE -3 // a file cannot be read or written
+#define STORE_ERROR_DEC -4  // a chunk list or chunk fails authentication
+
+// appended to a file's name for its chunk list by default
+#define STORE_LIST_EXTENSION ".chunks"
+
+typedef struct Store Store;
+
+typedef struct StoreReport {
+  long long chunks;
+  long long new_chunks; // the others were in the store already
+  long long bytes;
+  long long new_bytes;
+} StoreReport;
+
+int store_open(const char *dir, const char *password, int io_policy,
+               Store **out);
+int store_put(Store *store, const char *src, const char *list,
+              StoreReport *report);
+int store_get(Store *store, const char *list, const char *dest);
+void store_close(Store *store);
+
+#endif
@@ -0,0 +1,615 @@
+#define _GNU_SOURCE // memfd_create
+#include "sync.h"
+#include "crypto.h"
+#include "crypto_io.h"
+#include "file_tree.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// incremental encryption of a directory tree into a mirror of .enc files.
+// the index in the destination records, for each source file, the size,
+// mtime, inode and plaintext digest it had when it was encrypted and the
+// ciphertext it went to. a run walks the source with file_tree_create,
+// encrypts only new files and files whose metadata changed, and removes the
+// ciphertext of files that are gone, so past the walk it costs what the
+// churn costs. with hash_check, a file whose size is unchanged is hashed
+// and its digest decides instead of its mtime and inode (restores, copies
+// that keep mtimes, coarse timestamps).
+// every file and the index itself are encrypted under one master key
+// (CRYPTO_KEY_MASTER), so a run hashes the password once, not once per file.
+// the index is encrypted as it names the files and holds their digests
+
+#define SYNC_INDEX_HEADER "filecryption-sync 1"
+#define SYNC_MAX_WORKERS 8
+
+// values of SyncTask.action
+#define SYNC_TASK_NONE 0
+#define SYNC_TASK_ENCRYPT 1 // new or changed
+#define SYNC_TASK_HASH 2    // the digest decides whether it changed
+
+typedef struct SyncEntry {
+  char *path;   // relative to the source directory
+  char *cipher; // relative to the destination directory
+  long long size;
+  long long mtime; // nanoseconds since the epoch
+  unsigned long long inode;
+  unsigned char digest[CRYPTO_DIGEST_BYTES];
+  int seen; // the walk found the file
+} SyncEntry;
+
+typedef struct SyncIndex {
+  SyncEntry *entries;
+  int count;
+  int capacity;
+} SyncIndex;
+
+typedef struct SyncTask {
+  char path[MAX_PATH_LENGTH]; // in the source tree
+  const char *rel;            // 'path' relative to the source directory
+  SyncEntry *entry;           // NULL for a new file
+  struct stat st;
+  int action;
+  int result; // CRYPTO_* code of the encryption
+  unsigned char digest[CRYPTO_DIGEST_BYTES];
+} SyncTask;
+
+typedef struct SyncRun {
+  const char *dest_dir;
+  const SyncOptions *opts;
+  unsigned char *master; // sodium_malloc'ed
+  unsigned char salt[crypto_pwhash_SALTBYTES];
+  SyncTask *tasks;
+  int num_tasks;
+  int tasks_capacity;
+  atomic_int next_task;
+} SyncRun;
+
+static int sync_compare_entries(const void *a, const void *b) {
+  return strcmp(((const SyncEntry *)a)->path, ((const SyncEntry *)b)->path);
+}
+
+static SyncEntry *sync_find(SyncIndex *index, const char *path) {
+  SyncEntry key = {.path = (char *)path};
+  return index->count > 0
+             ? bsearch(&key, index->entries, index->count, sizeof(SyncEntry),
+                       sync_compare_entries)
+             : NULL;
+}
+
+static SyncEntry *sync_add_entry(SyncIndex *index, const char *path,
+                                 const char *cipher) {
+  if (index->count == index->capacity) {
+    int capacity = index->capacity ? index->capacity * 2 : 256;
+    SyncEntry *entries =
+        realloc(index->entries, capacity * sizeof(SyncEntry));
+    if (!entries) {
+      return NULL;
+    }
+    index->entries = entries;
+    index->capacity = capacity;
+  }
+  SyncEntry *entry = &index->entries[index->count];
+  memset(entry, 0, sizeof(*entry));
+  entry->path = strdup(path);
+  entry->cipher = strdup(cipher);
+  if (!entry->path || !entry->cipher) {
+    free(entry->path);
+    free(entry->cipher);
+    return NULL;
+  }
+  index->count++;
+  return entry;
+}
+
+static void sync_free_index(SyncIndex *index) {
+  for (int i = 0; i < index->count; i++) {
+    free(index->entries[i].path);
+    free(index->entries[i].cipher);
+  }
+  free(index->entries);
+  memset(index, 0, sizeof(*index));
+}
+
+// paths are written with backslash, tab and newline escaped, so a line
+// holds one entry and a tab separates fields
+static void sync_write_escaped(FILE *out, const char *value) {
+  for (const char *p = value; *p; p++) {
+    if (*p == '\\') {
+      fputs("\\\\", out);
+    } else if (*p == '\t') {
+      fputs("\\t", out);
+    } else if (*p == '\n') {
+      fputs("\\n", out);
+    } else {
+      fputc(*p, out);
+    }
+  }
+}
+
+static void sync_unescape(char *value) {
+  char *out = value;
+  for (char *p = value; *p; p++) {
+    if (*p == '\\' && p[1]) {
+      p++;
+      *out++ = *p == 't' ? '\t' : *p == 'n' ? '\n' : *p;
+    } else {
+      *out++ = *p;
+    }
+  }
+  *out = '\0';
+}
+
+// one entry per line: size, mtime, inode, digest (hex), path, ciphertext
+static int sync_parse_entry(SyncIndex *index, char *line) {
+  char *fields[6];
+  int num_fields = 0;
+  char *save;
+  for (char *field = strtok_r(line, "\t\n", &save); field && num_fields < 6;
+       field = strtok_r(NULL, "\t\n", &save)) {
+    fields[num_fields++] = field;
+  }
+  if (num_fields != 6) {
+    return 0;
+  }
+  sync_unescape(fields[4]);
+  sync_unescape(fields[5]);
+  SyncEntry *entry = sync_add_entry(index, fields[4], fields[5]);
+  if (!entry) {
+    return 0;
+  }
+  entry->size = strtoll(fields[0], NULL, 10);
+  entry->mtime = strtoll(fields[1], NULL, 10);
+  entry->inode = strtoull(fields[2], NULL, 10);
+  size_t digest_len;
+  return sodium_hex2bin(entry->digest, sizeof(entry->digest), fields[3],
+                        strlen(fields[3]), NULL, &digest_len, NULL) == 0 &&
+         digest_len == sizeof(entry->digest);
+}
+
+// opens the index with the password: its salt is the master key salt of
+// the whole mirror. without an index, a new salt starts a new mirror
+static int sync_load_index(SyncRun *run, SyncIndex *index,
+                           const char *index_path, const char *password) {
+  int fd = open(index_path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    if (errno != ENOENT) {
+      return SYNC_ERROR;
+    }
+    randombytes_buf(run->salt, sizeof(run->salt));
+    return crypto_derive_key(run->master, CRYPTO_MASTER_KEY_BYTES, password,
+                             run->salt) == 0
+               ? SYNC_SUCCESS
+               : SYNC_ERROR;
+  }
+
+  int status = SYNC_ERROR_INDEX;
+  int plain = memfd_create("filecryption-sync", MFD_CLOEXEC);
+  if (plain >= 0 && crypto_master_salt(fd, run->salt) == CRYPTO_SUCCESS &&
+      crypto_derive_key(run->master, CRYPTO_MASTER_KEY_BYTES, password,
+                        run->salt) == 0) {
+    CryptoOptions opts = {.checkpoint_bytes = -1,
+                          .master_key = run->master,
+                          .master_salt = run->salt};
+    if (crypto_decrypt_fd(fd, plain, NULL, NULL, NULL, &opts) ==
+        CRYPTO_SUCCESS) {
+      status = SYNC_SUCCESS;
+    }
+  }
+  close(fd);
+  if (status != SYNC_SUCCESS) {
+    if (plain >= 0) {
+      close(plain);
+    }
+    return status;
+  }
+
+  lseek(plain, 0, SEEK_SET);
+  FILE *in = fdopen(plain, "r");
+  if (!in) {
+    close(plain);
+    return SYNC_ERROR;
+  }
+  char *line = NULL;
+  size_t line_capacity = 0;
+  if (getline(&line, &line_capacity, in) < 0 ||
+      strncmp(line, SYNC_INDEX_HEADER "\n", sizeof(SYNC_INDEX_HEADER)) != 0) {
+    status = SYNC_ERROR_INDEX;
+  }
+  while (status == SYNC_SUCCESS && getline(&line, &line_capacity, in) > 0) {
+    if (!sync_parse_entry(index, line)) {
+      status = SYNC_ERROR_INDEX;
+    }
+  }
+  free(line);
+  fclose(in);
+  qsort(index->entries, index->count, sizeof(SyncEntry),
+        sync_compare_entries);
+  return status;
+}
+
+// writes the index next to its final path and renames it into place
+static int sync_save_index(SyncRun *run, SyncIndex *index,
+                           const char *index_path) {
+  int plain = memfd_create("filecryption-sync", MFD_CLOEXEC);
+  FILE *out = plain >= 0 ? fdopen(dup(plain), "w") : NULL;
+  if (!out) {
+    if (plain >= 0) {
+      close(plain);
+    }
+    return SYNC_ERROR;
+  }
+  fprintf(out, "%s\n", SYNC_INDEX_HEADER);
+  for (int i = 0; i < index->count; i++) {
+    SyncEntry *entry = &index->entries[i];
+    char hex[CRYPTO_DIGEST_BYTES * 2 + 1];
+    sodium_bin2hex(hex, sizeof(hex), entry->digest, sizeof(entry->digest));
+    fprintf(out, "%lld\t%lld\t%llu\t%s\t", entry->size, entry->mtime,
+            entry->inode, hex);
+    sync_write_escaped(out, entry->path);
+    fputc('\t', out);
+    sync_write_escaped(out, entry->cipher);
+    fputc('\n', out);
+  }
+  int ok = fclose(out) == 0 && lseek(plain, 0, SEEK_SET) == 0;
+
+  char tmp_path[PATH_MAX + sizeof(SYNC_INDEX_NAME) + 8];
+  snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", index_path);
+  int fd = ok ? open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600)
+              : -1;
+  if (fd >= 0) {
+    CryptoOptions opts = {.checkpoint_bytes = -1,
+                          .master_key = run->master,
+                          .master_salt = run->salt};
+    ok = crypto_encrypt_fd(plain, fd, NULL, NULL, NULL, &opts) ==
+             CRYPTO_SUCCESS &&
+         fsync(fd) == 0;
+    ok = close(fd) == 0 && ok && rename(tmp_path, index_path) == 0;
+    if (!ok) {
+      unlink(tmp_path);
+    }
+  } else {
+    ok = 0;
+  }
+  close(plain);
+  return ok ? SYNC_SUCCESS : SYNC_ERROR;
+}
+
+// creates the directories leading to 'path', as mkdir -p would
+static void sync_make_parents(const char *path) {
+  char dir[PATH_MAX];
+  snprintf(dir, sizeof(dir), "%s", path);
+  for (char *slash = strchr(dir + 1, '/'); slash;
+       slash = strchr(slash + 1, '/')) {
+    *slash = '\0';
+    mkdir(dir, 0755); // exists already, mostly
+    *slash = '/';
+  }
+}
+
+// removes the directories above 'path' that are left empty, up to 'top'
+static void sync_remove_parents(const char *path, const char *top) {
+  char dir[PATH_MAX];
+  snprintf(dir, sizeof(dir), "%s", path);
+  size_t top_len = strlen(top);
+  for (char *slash = strrchr(dir, '/'); slash && slash > dir + top_len;
+       slash = strrchr(dir, '/')) {
+    *slash = '\0';
+    if (rmdir(dir) != 0) {
+      break; // not empty
+    }
+  }
+}
+
+// encrypts next to the ciphertext and renames over it once done, so the old
+// ciphertext, which the index still describes, survives a failure
+static void sync_encrypt_task(SyncRun *run, SyncTask *task) {
+  char cipher[PATH_MAX];
+  char tmp_path[PATH_MAX + 8];
+  snprintf(cipher, sizeof(cipher), "%s/%s.enc", run->dest_dir, task->rel);
+  snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", cipher);
+  sync_make_parents(cipher);
+  CryptoOptions opts = {.io_policy = run->opts->io_policy,
+                        .checkpoint_bytes = -1,
+                        .master_key = run->master,
+                        .master_salt = run->salt,
+                        .digest = task->digest};
+  task->result = crypto_encrypt_file_ex(task->path, tmp_path, NULL, &opts);
+  if (task->result == CRYPTO_SUCCESS && rename(tmp_path, cipher) != 0) {
+    task->result = CRYPTO_ERROR_FILE;
+  }
+  if (task->result != CRYPTO_SUCCESS) {
+    unlink(tmp_path);
+  }
+}
+
+static int sync_hash_file(const char *path, int io_policy,
+                          unsigned char *digest) {
+  CryptoReader reader;
+  int status = crypto_reader_open(&reader, path, io_policy);
+  if (status != CRYPTO_SUCCESS) {
+    return status;
+  }
+  crypto_generichash_state state;
+  crypto_generichash_init(&state, NULL, 0, CRYPTO_DIGEST_BYTES);
+  unsigned char buffer[1 << 16];
+  size_t got;
+  while ((got = crypto_reader_read(&reader, buffer, sizeof(buffer))) > 0) {
+    crypto_generichash_update(&state, buffer, got);
+  }
+  crypto_generichash_final(&state, digest, CRYPTO_DIGEST_BYTES);
+  status = reader.error ? CRYPTO_ERROR_FILE : CRYPTO_SUCCESS;
+  crypto_reader_close(&reader);
+  sodium_memzero(buffer, sizeof(buffer));
+  return status;
+}
+
+// a file whose digest matches the index is unchanged whatever its
+// metadata says; otherwise it is encrypted right away
+static void sync_hash_task(SyncRun *run, SyncTask *task) {
+  if (sync_hash_file(task->path, run->opts->io_policy, task->digest) ==
+          CRYPTO_SUCCESS &&
+      sodium_memcmp(task->digest, task->entry->digest,
+                    sizeof(task->digest)) == 0) {
+    task->action = SYNC_TASK_NONE;
+    task->result = CRYPTO_SUCCESS;
+    return;
+  }
+  task->action = SYNC_TASK_ENCRYPT;
+  sync_encrypt_task(run, task);
+}
+
+static void *sync_worker_thread(void *arg) {
+  SyncRun *run = (SyncRun *)arg;
+  for (;;) {
+    int i = atomic_fetch_add(&run->next_task, 1);
+    if (i >= run->num_tasks) {
+      break;
+    }
+    SyncTask *task = &run->tasks[i];
+    if (task->action == SYNC_TASK_HASH) {
+      sync_hash_task(run, task);
+    } else if (task->action == SYNC_TASK_ENCRYPT) {
+      sync_encrypt_task(run, task);
+    }
+  }
+  return NULL;
+}
+
+static void sync_run_tasks(SyncRun *run) {
+  int workers = run->opts->workers;
+  if (workers <= 0) {
+    workers = (int)sysconf(_SC_NPROCESSORS_ONLN);
+  }
+  if (workers > SYNC_MAX_WORKERS) {
+    workers = SYNC_MAX_WORKERS;
+  }
+  if (workers > run->num_tasks) {
+    workers = run->num_tasks;
+  }
+  pthread_t threads[SYNC_MAX_WORKERS];
+  int started = 0;
+  while (started < workers &&
+         pthread_create(&threads[started], NULL, sync_worker_thread, run) ==
+             0) {
+    started++;
+  }
+  sync_worker_thread(run); // this thread helps, and copes alone if need be
+  for (int i = 0; i < started; i++) {
+    pthread_join(threads[i], NULL);
+  }
+}
+
+static SyncTask *sync_add_task(SyncRun *run) {
+  if (run->num_tasks == run->tasks_capacity) {
+    int capacity = run->tasks_capacity ? run->tasks_capacity * 2 : 64;
+    SyncTask *tasks = realloc(run->tasks, capacity * sizeof(SyncTask));
+    if (!tasks) {
+      return NULL;
+    }
+    run->tasks = tasks;
+    run->tasks_capacity = capacity;
+  }
+  SyncTask *task = &run->tasks[run->num_tasks++];
+  memset(task, 0, sizeof(*task));
+  return task;
+}
+
+// decides what each regular file under 'node' needs. 'prefix_len' is the
+// length of the source directory in the node paths, separator included
+static int sync_plan(SyncRun *run, SyncIndex *index, const FileNode *node,
+                     size_t prefix_len, SyncReport *report) {
+  if (node->is_dir) {
+    for (int i = 0; i < node->num_children; i++) {
+      if (!sync_plan(run, index, node->children[i], prefix_len, report)) {
+        return 0;
+      }
+    }
+    return 1;
+  }
+  struct stat st;
+  if (lstat(node->path, &st) != 0 || !S_ISREG(st.st_mode) ||
+      strlen(node->path) <= prefix_len) {
+    return 1; // gone since the walk, or a link, device or pipe
+  }
+  const char *rel = node->path + prefix_len;
+  SyncEntry *entry = sync_find(index, rel);
+  long long mtime = st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+  int action = SYNC_TASK_ENCRYPT;
+  if (entry) {
+    entry->seen = 1;
+    char cipher[PATH_MAX];
+    snprintf(cipher, sizeof(cipher), "%s/%s", run->dest_dir, entry->cipher);
+    if (access(cipher, F_OK) != 0 || entry->size != st.st_size) {
+      action = SYNC_TASK_ENCRYPT;
+    } else if (run->opts->hash_check) {
+      action = SYNC_TASK_HASH;
+    } else if (entry->mtime == mtime &&
+               entry->inode == (unsigned long long)st.st_ino) {
+      report->unchanged++;
+      return 1;
+    }
+  }
+
+  SyncTask *task = sync_add_task(run);
+  if (!task) {
+    return 0;
+  }
+  snprintf(task->path, sizeof(task->path), "%s", node->path);
+  task->rel = task->path + prefix_len;
+  task->entry = entry;
+  task->st = st;
+  task->action = action;
+  return 1;
+}
+
+// folds the outcome of the tasks into the index. entries keep pointing into
+// the index array, so new entries are added only after every task is read
+static int sync_apply(SyncRun *run, SyncIndex *index, SyncReport *report) {
+  for (int i = 0; i < run->num_tasks; i++) {
+    SyncTask *task = &run->tasks[i];
+    SyncEntry *entry = task->entry;
+    if (task->result != CRYPTO_SUCCESS) {
+      report->failed++;
+      if (run->opts->on_failure) {
+        run->opts->on_failure(task->path, task->result);
+      }
+      continue;
+    }
+    if (!entry) {
+      continue;
+    }
+    if (task->action == SYNC_TASK_NONE) {
+      report->unchanged++;
+    } else {
+      report->changed++;
+    }
+    entry->size = task->st.st_size;
+    entry->mtime =
+        task->st.st_mtim.tv_sec * 1000000000LL + task->st.st_mtim.tv_nsec;
+    entry->inode = (unsigned long long)task->st.st_ino;
+    memcpy(entry->digest, task->digest, sizeof(entry->digest));
+  }
+
+  for (int i = 0; i < run->num_tasks; i++) {
+    SyncTask *task = &run->tasks[i];
+    if (task->entry || task->result != CRYPTO_SUCCESS) {
+      continue;
+    }
+    char cipher[PATH_MAX];
+    snprintf(cipher, sizeof(cipher), "%s.enc", task->rel);
+    SyncEntry *entry = sync_add_entry(index, task->rel, cipher);
+    if (!entry) {
+      return SYNC_ERROR;
+    }
+    entry->size = task->st.st_size;
+    entry->mtime =
+        task->st.st_mtim.tv_sec * 1000000000LL + task->st.st_mtim.tv_nsec;
+    entry->inode = (unsigned long long)task->st.st_ino;
+    entry->seen = 1;
+    memcpy(entry->digest, task->digest, sizeof(entry->digest));
+    report->added++;
+  }
+  return SYNC_SUCCESS;
+}
+
+// drops the ciphertext of files the walk did not find. a file is only taken
+// for deleted once lstat says so: a directory the walk could not read must
+// not cost its ciphertext
+static void sync_remove_deleted(SyncRun *run, SyncIndex *index,
+                                const char *src_dir, SyncReport *report) {
+  int kept = 0;
+  for (int i = 0; i < index->count; i++) {
+    SyncEntry *entry = &index->entries[i];
+    char path[PATH_MAX];
+    struct stat st;
+    snprintf(path, sizeof(path), "%s/%s", src_dir, entry->path);
+    if (entry->seen || lstat(path, &st) == 0 || errno != ENOENT) {
+      index->entries[kept++] = *entry;
+      continue;
+    }
+    snprintf(path, sizeof(path), "%s/%s", run->dest_dir, entry->cipher);
+    if (unlink(path) == 0 || errno == ENOENT) {
+      sync_remove_parents(path, run->dest_dir);
+      report->removed++;
+      free(entry->path);
+      free(entry->cipher);
+    } else {
+      index->entries[kept++] = *entry;
+    }
+  }
+  index->count = kept;
+}
+
+// brings 'dest_dir' in line with 'src_dir', see the top of the file
+int sync_run(const char *src_dir, const char *dest_dir, const char *password,
+             const SyncOptions *opts, SyncReport *report) {
+  memset(report, 0, sizeof(*report));
+  char src[PATH_MAX];
+  char dest[PATH_MAX];
+  mkdir(dest_dir, 0755);
+  if (!realpath(src_dir, src) || !realpath(dest_dir, dest)) {
+    return SYNC_ERROR;
+  }
+  size_t src_len = strlen(src);
+  if (strncmp(dest, src, src_len) == 0 &&
+      (dest[src_len] == '\0' || dest[src_len] == '/' ||
+       strcmp(src, "/") == 0)) {
+    return SYNC_ERROR; // the mirror would end up encrypting itself
+  }
+
+  SyncRun run;
+  memset(&run, 0, sizeof(run));
+  run.dest_dir = dest;
+  run.opts = opts;
+  run.master = sodium_malloc(CRYPTO_MASTER_KEY_BYTES);
+  if (!run.master) {
+    return SYNC_ERROR;
+  }
+  SyncIndex index;
+  memset(&index, 0, sizeof(index));
+  char index_path[PATH_MAX + sizeof(SYNC_INDEX_NAME)];
+  snprintf(index_path, sizeof(index_path), "%s/%s", dest, SYNC_INDEX_NAME);
+
+  int status = sync_load_index(&run, &index, index_path, password);
+  FileNode *root = NULL;
+  if (status == SYNC_SUCCESS) {
+    root = file_tree_create(src, 1);
+    if (!root || !root->is_dir) {
+      status = SYNC_ERROR;
+    }
+  }
+  if (status == SYNC_SUCCESS) {
+    size_t prefix_len = src_len + (src[src_len - 1] == '/' ? 0 : 1);
+    if (!sync_plan(&run, &index, root, prefix_len, report)) {
+      status = SYNC_ERROR;
+    }
+  }
+  if (status == SYNC_SUCCESS) {
+    sync_run_tasks(&run);
+    status = sync_apply(&run, &index, report);
+  }
+  if (status == SYNC_SUCCESS) {
+    sync_remove_deleted(&run, &index, src, report);
+    qsort(index.entries, index.count, sizeof(SyncEntry),
+          sync_compare_entries);
+    status = sync_save_index(&run, &index, index_path);
+  }
+  if (status == SYNC_SUCCESS && report->failed > 0) {
+    status = SYNC_ERROR_PARTIAL;
+  }
+
+  file_tree_destroy(root);
+  sync_free_index(&index);
+  free(run.tasks);
+  sodium_free(run.master);
+  return status;
+}
@@ -0,0 +1,33 @@
+#ifndef SYNC_H
+#define SYNC_H
+
+#define SYNC_SUCCESS 1
+#define SYNC_ERROR -1         // the source cannot be walked or the index kept
+#define SYNC_ERROR_INDEX -2   // the index does not open with this password
+#define SYNC_ERROR_PARTIAL -3 // some files failed, the others are in sync
+
+// kept in the destination directory, encrypted
+#define SYNC_INDEX_NAME ".filecryption-sync"
+
+typedef struct SyncOptions {
+  // confirm by digest whether files of unchanged size changed, rather than
+  // trusting their mtime and inode
+  int hash_check;
+  int io_policy; // CRYPTO_IO_* from crypto_io.h
+  int workers;   // 0 for one per online cpu
+  // told about each file that could not be encrypted, may be NULL
+  void (*on_failure)(const char *path, int result);
+} SyncOptions;
+
+typedef struct SyncReport {
+  int added;
+  int changed;
+  int unchanged;
+  int removed;
+  int failed;
+} SyncReport;
+
+int sync_run(const char *src_dir, const char *dest_dir, const char *password,
+             const SyncOptions *opts, SyncReport *report);
+
+#endif
@@ -0,0 +1,468 @@
+#include "tree_cache.h"
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define TREE_CACHE_MAGIC "FCTREE01"
+#define TREE_CACHE_BYTE_ORDER 0x01020304U
+#define TREE_CACHE_NO_PARENT 0xffffffffU
+#define TREE_CACHE_NO_RECORD 0xffffffffU
+
+// on-disk layout: header | root path (padded to 8 bytes) | records | names.
+// records are in pre-order, so a parent always precedes its children
+typedef struct TreeCacheHeader {
+  char magic[8];
+  unsigned int byte_order;
+  unsigned int show_hidden;
+  unsigned int num_records;
+  unsigned int root_path_len;
+  unsigned long long names_size;
+} TreeCacheHeader;
+
+typedef struct TreeCacheRecord {
+  unsigned int parent;
+  unsigned int name_offset; // into the names table, NUL terminated
+  unsigned short name_len;
+  unsigned char is_dir;
+  unsigned char reserved[5];
+  long long size;
+  long long mtime;
+} TreeCacheRecord;
+
+struct TreeCache {
+  char path[MAX_PATH_LENGTH];
+  void *map;
+  size_t map_size;
+  const TreeCacheHeader *header;
+  const char *root_path;
+  const TreeCacheRecord *records;
+  const char *names;
+
+  // child lists and a (parent, name) -> record table, built when opening
+  unsigned int *first_child;
+  unsigned int *next_sibling;
+  unsigned int *lookup;
+  size_t lookup_size; // power of two
+
+  pthread_t thread;
+  int thread_started;
+  atomic_int cancel;
+  atomic_int done;
+  FileNode *revalidated;
+  char revalidate_path[MAX_PATH_LENGTH];
+  int revalidate_show_hidden;
+};
+
+static size_t tree_cache_align(size_t len) { return (len + 7) & ~(size_t)7; }
+
+static unsigned long long tree_cache_hash(unsigned int parent,
+                                          const char *name) {
+  unsigned long long hash = 0xcbf29ce484222325ULL ^ parent;
+  for (const unsigned char *p = (const unsigned char *)name; *p; p++) {
+    hash ^= *p;
+    hash *= 0x100000001b3ULL;
+  }
+  return hash;
+}
+
+static const char *tree_cache_name(const TreeCache *cache, unsigned int rec) {
+  return cache->names + cache->records[rec].name_offset;
+}
+
+static int tree_cache_validate(TreeCache *cache) {
+  if (cache->map_size < sizeof(TreeCacheHeader)) {
+    return 0;
+  }
+  const TreeCacheHeader *header = (const TreeCacheHeader *)cache->map;
+  if (memcmp(header->magic, TREE_CACHE_MAGIC, sizeof(header->magic)) != 0 ||
+      header->byte_order != TREE_CACHE_BYTE_ORDER ||
+      header->root_path_len >= MAX_PATH_LENGTH || header->num_records == 0 ||
+      header->num_records == TREE_CACHE_NO_PARENT) {
+    return 0;
+  }
+
+  size_t records_offset =
+      sizeof(TreeCacheHeader) + tree_cache_align(header->root_path_len + 1);
+  size_t names_offset =
+      records_offset + (size_t)header->num_records * sizeof(TreeCacheRecord);
+  if (names_offset > cache->map_size ||
+      header->names_size != cache->map_size - names_offset) {
+    return 0;
+  }
+
+  cache->header = header;
+  cache->root_path = (const char *)cache->map + sizeof(TreeCacheHeader);
+  cache->records =
+      (const TreeCacheRecord *)((const char *)cache->map + records_offset);
+  cache->names = (const char *)cache->map + names_offset;
+  if (cache->root_path[header->root_path_len] != '\0') {
+    return 0;
+  }
+
+  for (unsigned int i = 0; i < header->num_records; i++) {
+    const TreeCacheRecord *rec = &cache->records[i];
+    if ((i == 0) != (rec->parent == TREE_CACHE_NO_PARENT)) {
+      return 0;
+    }
+    if (i > 0 && (rec->parent >= i || !cache->records[rec->parent].is_dir)) {
+      return 0;
+    }
+    if (rec->name_len >= MAX_NAME_LENGTH ||
+        (unsigned long long)rec->name_offset + rec->name_len >=
+            header->names_size ||
+        cache->names[rec->name_offset + rec->name_len] != '\0') {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+static int tree_cache_build_links(TreeCache *cache) {
+  unsigned int num_records = cache->header->num_records;
+  cache->first_child =
+      (unsigned int *)malloc(num_records * sizeof(unsigned int));
+  cache->next_sibling =
+      (unsigned int *)malloc(num_records * sizeof(unsigned int));
+  cache->lookup_size = 16;
+  while (cache->lookup_size < (size_t)num_records * 2) {
+    cache->lookup_size *= 2;
+  }
+  cache->lookup =
+      (unsigned int *)malloc(cache->lookup_size * sizeof(unsigned int));
+  if (!cache->first_child || !cache->next_sibling || !cache->lookup) {
+    return 0;
+  }
+  memset(cache->first_child, 0xff, num_records * sizeof(unsigned int));
+  memset(cache->next_sibling, 0xff, num_records * sizeof(unsigned int));
+  memset(cache->lookup, 0xff, cache->lookup_size * sizeof(unsigned int));
+
+  // walk backwards so that each child list keeps the on-disk order
+  for (unsigned int i = num_records - 1; i > 0; i--) {
+    unsigned int parent = cache->records[i].parent;
+    cache->next_sibling[i] = cache->first_child[parent];
+    cache->first_child[parent] = i;
+  }
+  for (unsigned int i = 1; i < num_records; i++) {
+    size_t slot = tree_cache_hash(cache->records[i].parent,
+                                  tree_cache_name(cache, i)) &
+                  (cache->lookup_size - 1);
+    while (cache->lookup[slot] != TREE_CACHE_NO_RECORD) {
+      slot = (slot + 1) & (cache->lookup_size - 1);
+    }
+    cache->lookup[slot] = i;
+  }
+  return 1;
+}
+
+static unsigned int tree_cache_find_child(const TreeCache *cache,
+                                          unsigned int parent,
+                                          const char *name) {
+  if (parent == TREE_CACHE_NO_RECORD) {
+    return TREE_CACHE_NO_RECORD;
+  }
+  size_t slot = tree_cache_hash(parent, name) & (cache->lookup_size - 1);
+  while (cache->lookup[slot] != TREE_CACHE_NO_RECORD) {
+    unsigned int rec = cache->lookup[slot];
+    if (cache->records[rec].parent == parent &&
+        strcmp(tree_cache_name(cache, rec), name) == 0) {
+      return rec;
+    }
+    slot = (slot + 1) & (cache->lookup_size - 1);
+  }
+  return TREE_CACHE_NO_RECORD;
+}
+
+// maps a snapshot written by tree_cache_save. returns NULL if there is none
+// or it cannot be trusted, in which case the caller scans the disk
+TreeCache *tree_cache_open(const char *cache_path) {
+  int fd = open(cache_path, O_RDONLY);
+  if (fd < 0) {
+    return NULL;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+    close(fd);
+    return NULL;
+  }
+
+  TreeCache *cache = (TreeCache *)calloc(1, sizeof(TreeCache));
+  if (!cache) {
+    close(fd);
+    return NULL;
+  }
+  strncpy(cache->path, cache_path, MAX_PATH_LENGTH - 1);
+  cache->map_size = (size_t)st.st_size;
+  cache->map = mmap(NULL, cache->map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (cache->map == MAP_FAILED) {
+    free(cache);
+    return NULL;
+  }
+
+  if (!tree_cache_validate(cache) || !tree_cache_build_links(cache)) {
+    tree_cache_close(cache);
+    return NULL;
+  }
+  return cache;
+}
+
+void tree_cache_close(TreeCache *cache) {
+  if (!cache) {
+    return;
+  }
+  if (cache->thread_started) {
+    atomic_store(&cache->cancel, 1);
+    pthread_join(cache->thread, NULL);
+  }
+  file_tree_destroy(cache->revalidated);
+  free(cache->first_child);
+  free(cache->next_sibling);
+  free(cache->lookup);
+  munmap(cache->map, cache->map_size);
+  free(cache);
+}
+
+// rebuilds the tree exactly as it was saved, without touching the disk
+FileNode *tree_cache_load(TreeCache *cache, const char *root_path,
+                          int show_hidden) {
+  if (!cache || strcmp(cache->root_path, root_path) != 0 ||
+      cache->header->show_hidden != (unsigned int)show_hidden) {
+    return NULL;
+  }
+
+  unsigned int num_records = cache->header->num_records;
+  FileNode **nodes = (FileNode **)malloc(num_records * sizeof(FileNode *));
+  if (!nodes) {
+    return NULL;
+  }
+  FileNode *root = file_tree_create_root(root_path, cache->records[0].is_dir);
+  if (!root) {
+    free(nodes);
+    return NULL;
+  }
+  root->size = cache->records[0].size;
+  root->mtime = cache->records[0].mtime;
+  nodes[0] = root;
+
+  for (unsigned int i = 1; i < num_records; i++) {
+    const TreeCacheRecord *rec = &cache->records[i];
+    nodes[i] = file_tree_add_node(root, nodes[rec->parent],
+                                  tree_cache_name(cache, i), rec->is_dir,
+                                  rec->size, rec->mtime);
+    if (!nodes[i]) {
+      file_tree_destroy(root);
+      free(nodes);
+      return NULL;
+    }
+  }
+  free(nodes);
+  return root;
+}
+
+// fills 'dir' in the tree being rebuilt. a directory whose mtime matches the
+// snapshot still has the same entries, so its listing is taken from the
+// cache; anything else is read from the disk again
+static void tree_cache_revalidate_dir(TreeCache *cache, FileNode *root,
+                                      FileNode *dir, unsigned int rec,
+                                      int show_hidden) {
+  if (atomic_load(&cache->cancel)) {
+    return;
+  }
+  struct stat st;
+  if (stat(dir->path, &st) != 0 || !S_ISDIR(st.st_mode)) {
+    return;
+  }
+  dir->mtime = st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+
+  if (rec != TREE_CACHE_NO_RECORD && cache->records[rec].is_dir &&
+      cache->records[rec].mtime == dir->mtime) {
+    for (unsigned int child = cache->first_child[rec];
+         child != TREE_CACHE_NO_RECORD; child = cache->next_sibling[child]) {
+      const TreeCacheRecord *child_rec = &cache->records[child];
+      FileNode *node = file_tree_add_node(
+          root, dir, tree_cache_name(cache, child), child_rec->is_dir,
+          child_rec->size, child_rec->mtime);
+      if (node && node->is_dir) {
+        tree_cache_revalidate_dir(cache, root, node, child, show_hidden);
+      }
+    }
+    return;
+  }
+
+  DIR *handle = opendir(dir->path);
+  if (!handle) {
+    return;
+  }
+  struct dirent *entry;
+  while ((entry = readdir(handle)) != NULL) {
+    if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+      continue;
+    }
+    if (!show_hidden && entry->d_name[0] == '.') {
+      continue;
+    }
+    char child_path[MAX_PATH_LENGTH];
+    file_tree_join_path(child_path, dir->path, entry->d_name);
+
+    struct stat child_st;
+    if (stat(child_path, &child_st) != 0) {
+      memset(&child_st, 0, sizeof(child_st));
+    }
+    int is_dir = S_ISDIR(child_st.st_mode);
+    FileNode *node = file_tree_add_node(
+        root, dir, entry->d_name, is_dir, child_st.st_size,
+        child_st.st_mtim.tv_sec * 1000000000LL + child_st.st_mtim.tv_nsec);
+    if (node && is_dir) {
+      tree_cache_revalidate_dir(cache, root, node,
+                                tree_cache_find_child(cache, rec,
+                                                      entry->d_name),
+                                show_hidden);
+    }
+  }
+  closedir(handle);
+}
+
+static void *tree_cache_revalidate_thread(void *arg) {
+  TreeCache *cache = (TreeCache *)arg;
+  FileNode *root =
+      file_tree_create_root(cache->revalidate_path, cache->records[0].is_dir);
+  if (root) {
+    tree_cache_revalidate_dir(cache, root, root, 0,
+                              cache->revalidate_show_hidden);
+  }
+  if (atomic_load(&cache->cancel)) {
+    file_tree_destroy(root); // incomplete, never published
+    root = NULL;
+  } else if (root) {
+    tree_cache_save(root, cache->revalidate_show_hidden, cache->path);
+  }
+  cache->revalidated = root;
+  atomic_store(&cache->done, 1);
+  return NULL;
+}
+
+// rebuilds the tree in the background, trusting unchanged directories
+int tree_cache_start_revalidation(TreeCache *cache, const char *root_path,
+                                  int show_hidden) {
+  if (!cache || cache->thread_started) {
+    return TREE_CACHE_ERROR_FILE;
+  }
+  strncpy(cache->revalidate_path, root_path, MAX_PATH_LENGTH - 1);
+  cache->revalidate_show_hidden = show_hidden;
+  if (pthread_create(&cache->thread, NULL, tree_cache_revalidate_thread,
+                     cache) != 0) {
+    return TREE_CACHE_ERROR_MEM;
+  }
+  cache->thread_started = 1;
+  return TREE_CACHE_SUCCESS;
+}
+
+// hands over the revalidated tree once it is ready, NULL until then (and
+// after it has been handed over)
+FileNode *tree_cache_poll_revalidation(TreeCache *cache) {
+  if (!cache || !cache->thread_started || !atomic_load(&cache->done)) {
+    return NULL;
+  }
+  FileNode *root = cache->revalidated;
+  cache->revalidated = NULL;
+  return root;
+}
+
+static void tree_cache_count(FileNode *node, unsigned int *num_records,
+                             unsigned long long *names_size) {
+  (*num_records)++;
+  *names_size += strlen(node->name) + 1;
+  for (int i = 0; i < node->num_children; i++) {
+    tree_cache_count(node->children[i], num_records, names_size);
+  }
+}
+
+static int tree_cache_write_records(FILE *file, FileNode *node,
+                                    unsigned int parent,
+                                    unsigned int *next_record,
+                                    unsigned int *name_offset) {
+  TreeCacheRecord rec;
+  memset(&rec, 0, sizeof(rec));
+  rec.parent = parent;
+  rec.name_offset = *name_offset;
+  rec.name_len = (unsigned short)strlen(node->name);
+  rec.is_dir = node->is_dir;
+  rec.size = node->size;
+  rec.mtime = node->mtime;
+  if (fwrite(&rec, sizeof(rec), 1, file) != 1) {
+    return 0;
+  }
+  unsigned int self = (*next_record)++;
+  *name_offset += rec.name_len + 1;
+  for (int i = 0; i < node->num_children; i++) {
+    if (!tree_cache_write_records(file, node->children[i], self, next_record,
+                                  name_offset)) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+static int tree_cache_write_names(FILE *file, FileNode *node) {
+  if (fwrite(node->name, 1, strlen(node->name) + 1, file) !=
+      strlen(node->name) + 1) {
+    return 0;
+  }
+  for (int i = 0; i < node->num_children; i++) {
+    if (!tree_cache_write_names(file, node->children[i])) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+// writes a snapshot of 'root' next to 'cache_path' and renames it into place,
+// so readers never see a partial file
+int tree_cache_save(FileNode *root, int show_hidden, const char *cache_path) {
+  if (!root) {
+    return TREE_CACHE_ERROR_FILE;
+  }
+  char tmp_path[MAX_PATH_LENGTH + 16];
+  snprintf(tmp_path, sizeof(tmp_path), "%s.%d.tmp", cache_path, (int)getpid());
+
+  FILE *file = fopen(tmp_path, "wb");
+  if (!file) {
+    return TREE_CACHE_ERROR_FILE;
+  }
+
+  TreeCacheHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, TREE_CACHE_MAGIC, sizeof(header.magic));
+  header.byte_order = TREE_CACHE_BYTE_ORDER;
+  header.show_hidden = show_hidden;
+  header.root_path_len = strlen(root->path);
+  tree_cache_count(root, &header.num_records, &header.names_size);
+
+  char root_path[MAX_PATH_LENGTH + 8];
+  size_t root_path_size = tree_cache_align(header.root_path_len + 1);
+  memset(root_path, 0, sizeof(root_path));
+  memcpy(root_path, root->path, header.root_path_len);
+
+  unsigned int next_record = 0;
+  unsigned int name_offset = 0;
+  int ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+           fwrite(root_path, 1, root_path_size, file) == root_path_size &&
+           tree_cache_write_records(file, root, TREE_CACHE_NO_PARENT,
+                                    &next_record, &name_offset) &&
+           tree_cache_write_names(file, root);
+  if (fclose(file) != 0) {
+    ok = 0;
+  }
+  if (!ok || rename(tmp_path, cache_path) != 0) {
+    unlink(tmp_path);
+    return TREE_CACHE_ERROR_FILE;
+  }
+  return TREE_CACHE_SUCCESS;
+}
@@ -0,0 +1,21 @@
+#ifndef TREE_CACHE_H
+#define TREE_CACHE_H
+
+#include "file_tree.h"
+
+#define TREE_CACHE_SUCCESS 1
+#define TREE_CACHE_ERROR_FILE -1
+#define TREE_CACHE_ERROR_MEM -2
+
+typedef struct TreeCache TreeCache;
+
+TreeCache *tree_cache_open(const char *cache_path);
+void tree_cache_close(TreeCache *cache);
+FileNode *tree_cache_load(TreeCache *cache, const char *root_path,
+                          int show_hidden);
+int tree_cache_start_revalidation(TreeCache *cache, const char *root_path,
+                                  int show_hidden);
+FileNode *tree_cache_poll_revalidation(TreeCache *cache);
+int tree_cache_save(FileNode *root, int show_hidden, const char *cache_path);
+
+#endif
@@ -0,0 +1,374 @@
+#include "tree_snapshot.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+
+// the browser's tree is shared with a background writer as a series of
+// versions. the writer keeps a private working tree, applies rescans and the
+// outputs of finished jobs to it, and publishes a copy of it with one atomic
+// store, so a rescan that takes seconds never holds up the ui.
+// readers take no locks. a published version never changes shape again;
+// only the presentation state of its nodes (marks, and what file_meta fills
+// in) is still written, and only by the reader that adopted it.
+// old versions are reclaimed the quiescent-state way (the flavour of rcu that
+// suits an event loop): in tree_snapshot_adopt a reader announces that it no
+// longer uses anything older, and a retired version is freed once every
+// registered reader has announced so since it was retired
+
+// paths queued for insertion. more than this between two versions turn into
+// a rescan
+#define TREE_SNAPSHOT_MAX_PENDING 256
+// job outputs remembered for replaying onto a replacement tree. with more, a
+// replacement turns into a rescan
+#define TREE_SNAPSHOT_MAX_LOG 1024
+// how often the writer retries freeing versions a reader still holds
+#define TREE_SNAPSHOT_RECLAIM_MS 100
+
+typedef struct TreeSnapshotRetired {
+  FileNode *root;
+  unsigned long epoch; // freed once every reader has announced this epoch
+  struct TreeSnapshotRetired *next;
+} TreeSnapshotRetired;
+
+static _Atomic(FileNode *) snapshot_current; // the newest published version
+static atomic_ulong snapshot_epoch = 1;
+// the epoch each registered reader announced last, 0 for a free slot
+static atomic_ulong snapshot_readers[TREE_SNAPSHOT_MAX_READERS];
+
+// owned by the writer thread
+static FileNode *snapshot_work;
+static TreeSnapshotRetired *snapshot_retired;
+static char snapshot_root_path[MAX_PATH_LENGTH];
+static int snapshot_show_hidden;
+// every path inserted since the writer started. a replacement was walked
+// from the disk at some earlier point, so it may lack any of them
+static char snapshot_log[TREE_SNAPSHOT_MAX_LOG][MAX_PATH_LENGTH];
+static int snapshot_log_len;
+static int snapshot_log_full;
+
+static pthread_t snapshot_thread;
+static pthread_mutex_t snapshot_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t snapshot_cond = PTHREAD_COND_INITIALIZER;
+static int snapshot_running;
+
+// requests for the writer, guarded by snapshot_lock
+static char snapshot_pending[TREE_SNAPSHOT_MAX_PENDING][MAX_PATH_LENGTH];
+static int snapshot_num_pending;
+static int snapshot_rescan_wanted;
+static int snapshot_pending_dropped; // inserts that became a rescan instead
+static FileNode *snapshot_replacement;
+
+// adds 'path' to the working tree, or refreshes its size and time when it is
+// already there: a job may have overwritten the file
+static void tree_snapshot_apply_insert(const char *path) {
+  FileNode *node = file_tree_get_by_path(snapshot_work, path);
+  if (!node) {
+    file_tree_insert(snapshot_work, path, snapshot_show_hidden);
+    return;
+  }
+  struct stat st;
+  if (stat(path, &st) == 0) {
+    node->size = st.st_size;
+    node->mtime = st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+  }
+}
+
+static void tree_snapshot_log_insert(const char *path) {
+  if (snapshot_log_len == TREE_SNAPSHOT_MAX_LOG) {
+    snapshot_log_full = 1;
+    return;
+  }
+  memcpy(snapshot_log[snapshot_log_len++], path, MAX_PATH_LENGTH);
+}
+
+static void tree_snapshot_publish() {
+  FileNode *next = file_tree_copy(snapshot_work);
+  TreeSnapshotRetired *retired =
+      (TreeSnapshotRetired *)malloc(sizeof(TreeSnapshotRetired));
+  if (!next || !retired) {
+    file_tree_destroy(next); // readers stay on the current version
+    free(retired);
+    return;
+  }
+  retired->root = atomic_exchange(&snapshot_current, next);
+  retired->epoch = atomic_fetch_add(&snapshot_epoch, 1) + 1;
+  retired->next = snapshot_retired;
+  snapshot_retired = retired;
+}
+
+// frees the retired versions no reader can still be using
+static void tree_snapshot_reclaim() {
+  unsigned long oldest = atomic_load(&snapshot_epoch);
+  for (int i = 0; i < TREE_SNAPSHOT_MAX_READERS; i++) {
+    unsigned long seen = atomic_load(&snapshot_readers[i]);
+    if (seen && seen < oldest) {
+      oldest = seen;
+    }
+  }
+  TreeSnapshotRetired **link = &snapshot_retired;
+  while (*link) {
+    TreeSnapshotRetired *retired = *link;
+    if (retired->epoch <= oldest) {
+      *link = retired->next;
+      file_tree_destroy(retired->root);
+      free(retired);
+    } else {
+      link = &retired->next;
+    }
+  }
+}
+
+static void *tree_snapshot_thread(void *arg) {
+  (void)arg;
+  static char paths[TREE_SNAPSHOT_MAX_PENDING][MAX_PATH_LENGTH];
+
+  pthread_mutex_lock(&snapshot_lock);
+  while (snapshot_running) {
+    if (snapshot_num_pending == 0 && !snapshot_rescan_wanted &&
+        !snapshot_replacement) {
+      if (snapshot_retired) {
+        struct timespec until;
+        clock_gettime(CLOCK_REALTIME, &until);
+        until.tv_nsec += TREE_SNAPSHOT_RECLAIM_MS * 1000000L;
+        if (until.tv_nsec >= 1000000000L) {
+          until.tv_sec++;
+          until.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(&snapshot_cond, &snapshot_lock, &until);
+        pthread_mutex_unlock(&snapshot_lock);
+        tree_snapshot_reclaim();
+        pthread_mutex_lock(&snapshot_lock);
+      } else {
+        pthread_cond_wait(&snapshot_cond, &snapshot_lock);
+      }
+      continue;
+    }
+    // everything asked for so far goes into one new version
+    int num_paths = snapshot_num_pending;
+    memcpy(paths, snapshot_pending, num_paths * sizeof(paths[0]));
+    snapshot_num_pending = 0;
+    int rescan = snapshot_rescan_wanted;
+    snapshot_rescan_wanted = 0;
+    if (snapshot_pending_dropped) {
+      snapshot_log_full = 1; // they were never logged
+      snapshot_pending_dropped = 0;
+    }
+    FileNode *replacement = snapshot_replacement;
+    snapshot_replacement = NULL;
+    pthread_mutex_unlock(&snapshot_lock);
+
+    if (replacement && snapshot_log_full) {
+      file_tree_destroy(replacement); // misses outputs no longer logged
+      rescan = 1;
+    } else if (replacement) {
+      file_tree_destroy(snapshot_work);
+      snapshot_work = replacement;
+      for (int i = 0; i < snapshot_log_len; i++) {
+        tree_snapshot_apply_insert(snapshot_log[i]);
+      }
+    }
+    if (rescan) {
+      FileNode *fresh =
+          file_tree_create(snapshot_root_path, snapshot_show_hidden);
+      if (fresh) {
+        file_tree_destroy(snapshot_work);
+        snapshot_work = fresh;
+      }
+    }
+    for (int i = 0; i < num_paths; i++) {
+      tree_snapshot_apply_insert(paths[i]);
+      tree_snapshot_log_insert(paths[i]);
+    }
+    tree_snapshot_publish();
+    tree_snapshot_reclaim();
+
+    pthread_mutex_lock(&snapshot_lock);
+  }
+  pthread_mutex_unlock(&snapshot_lock);
+  return NULL;
+}
+
+// takes 'root' over as the working tree and publishes a copy of it as the
+// first version. rescans build from 'root_path' with 'show_hidden'. on
+// failure 'root' stays with the caller
+int tree_snapshot_start(FileNode *root, const char *root_path,
+                        int show_hidden) {
+  if (!root || snapshot_running) {
+    return TREE_SNAPSHOT_ERROR;
+  }
+  FileNode *first = file_tree_copy(root);
+  if (!first) {
+    return TREE_SNAPSHOT_ERROR_MEM;
+  }
+  snapshot_work = root;
+  strncpy(snapshot_root_path, root_path, MAX_PATH_LENGTH - 1);
+  snapshot_root_path[MAX_PATH_LENGTH - 1] = '\0';
+  snapshot_show_hidden = show_hidden;
+  snapshot_log_len = 0;
+  snapshot_log_full = 0;
+  atomic_store(&snapshot_current, first);
+
+  snapshot_running = 1;
+  if (pthread_create(&snapshot_thread, NULL, tree_snapshot_thread, NULL) !=
+      0) {
+    snapshot_running = 0;
+    snapshot_work = NULL;
+    atomic_store(&snapshot_current, NULL);
+    file_tree_destroy(first);
+    return TREE_SNAPSHOT_ERROR;
+  }
+  return TREE_SNAPSHOT_SUCCESS;
+}
+
+// stops the writer and frees every version, so no reader may use a node of
+// any of them afterwards
+void tree_snapshot_stop() {
+  pthread_mutex_lock(&snapshot_lock);
+  if (!snapshot_running) {
+    pthread_mutex_unlock(&snapshot_lock);
+    return;
+  }
+  snapshot_running = 0;
+  pthread_cond_signal(&snapshot_cond);
+  pthread_mutex_unlock(&snapshot_lock);
+  pthread_join(snapshot_thread, NULL);
+
+  file_tree_destroy(snapshot_replacement);
+  snapshot_replacement = NULL;
+  snapshot_num_pending = 0;
+  snapshot_rescan_wanted = 0;
+  snapshot_pending_dropped = 0;
+  while (snapshot_retired) {
+    TreeSnapshotRetired *retired = snapshot_retired;
+    snapshot_retired = retired->next;
+    file_tree_destroy(retired->root);
+    free(retired);
+  }
+  file_tree_destroy(atomic_exchange(&snapshot_current, NULL));
+  file_tree_destroy(snapshot_work);
+  snapshot_work = NULL;
+  for (int i = 0; i < TREE_SNAPSHOT_MAX_READERS; i++) {
+    atomic_store(&snapshot_readers[i], 0);
+  }
+}
+
+// claims a reader slot for the calling thread, which from then on holds back
+// the reclamation of every version it may be using until it next calls
+// tree_snapshot_adopt
+int tree_snapshot_register() {
+  for (int i = 0; i < TREE_SNAPSHOT_MAX_READERS; i++) {
+    unsigned long free_slot = 0;
+    if (atomic_compare_exchange_strong(&snapshot_readers[i], &free_slot,
+                                       atomic_load(&snapshot_epoch))) {
+      return i;
+    }
+  }
+  return TREE_SNAPSHOT_ERROR_MEM;
+}
+
+void tree_snapshot_unregister(int reader) {
+  if (reader >= 0 && reader < TREE_SNAPSHOT_MAX_READERS) {
+    atomic_store(&snapshot_readers[reader], 0);
+  }
+}
+
+// keeps what the reader had attached to the nodes of 'from' where 'to' has
+// the same path: marks, and the metadata of files whose size and time have
+// not changed
+static void tree_snapshot_carry_over(FileNode *from, FileNode *to) {
+  FileNode *old;
+  for (int row = 0; (old = file_tree_get_row(from, row)); row++) {
+    if (!old->marked && !old->meta_ready) {
+      continue;
+    }
+    FileNode *node = file_tree_get_by_path(to, old->path);
+    if (!node) {
+      continue;
+    }
+    if (old->marked) {
+      file_tree_set_marked(to, node, 1);
+    }
+    if (old->meta_ready && node->is_dir == old->is_dir &&
+        node->size == old->size && node->mtime == old->mtime) {
+      node->meta_ready = 1;
+      node->enc_status = old->enc_status;
+      node->type = old->type;
+    }
+  }
+}
+
+// moves 'reader' to the newest version, carrying marks and metadata over
+// from 'held', the version it was on (NULL for none). returns the version
+// to use from now on, which may be 'held' itself. this is the reader's
+// quiescent point: no node of 'held' or of anything older may be touched
+// after it, unless it is returned again
+FileNode *tree_snapshot_adopt(int reader, FileNode *held) {
+  if (reader < 0 || reader >= TREE_SNAPSHOT_MAX_READERS) {
+    return held;
+  }
+  unsigned long epoch = atomic_load(&snapshot_epoch);
+  FileNode *latest = atomic_load(&snapshot_current);
+  if (!latest) {
+    return held;
+  }
+  if (held && latest != held) {
+    tree_snapshot_carry_over(held, latest);
+  }
+  atomic_store(&snapshot_readers[reader], epoch);
+  return latest;
+}
+
+// asks the writer for a version that shows 'path', e.g. a job's output
+int tree_snapshot_insert(const char *path) {
+  pthread_mutex_lock(&snapshot_lock);
+  if (!snapshot_running) {
+    pthread_mutex_unlock(&snapshot_lock);
+    return TREE_SNAPSHOT_ERROR;
+  }
+  if (snapshot_num_pending < TREE_SNAPSHOT_MAX_PENDING) {
+    strncpy(snapshot_pending[snapshot_num_pending], path,
+            MAX_PATH_LENGTH - 1);
+    snapshot_pending[snapshot_num_pending][MAX_PATH_LENGTH - 1] = '\0';
+    snapshot_num_pending++;
+  } else {
+    snapshot_rescan_wanted = 1; // finds them all, and anything else new
+    snapshot_pending_dropped = 1;
+  }
+  pthread_cond_signal(&snapshot_cond);
+  pthread_mutex_unlock(&snapshot_lock);
+  return TREE_SNAPSHOT_SUCCESS;
+}
+
+// hands the writer a tree built elsewhere (e.g. revalidated from the tree
+// cache) to continue from. the paths inserted since the writer started are
+// added to it again, as the walk that built it may have missed them. the
+// writer owns 'root' either way
+int tree_snapshot_replace(FileNode *root) {
+  pthread_mutex_lock(&snapshot_lock);
+  if (!snapshot_running) {
+    pthread_mutex_unlock(&snapshot_lock);
+    file_tree_destroy(root);
+    return TREE_SNAPSHOT_ERROR;
+  }
+  file_tree_destroy(snapshot_replacement); // never published, superseded
+  snapshot_replacement = root;
+  pthread_cond_signal(&snapshot_cond);
+  pthread_mutex_unlock(&snapshot_lock);
+  return TREE_SNAPSHOT_SUCCESS;
+}
+
+// asks the writer to walk the disk again and publish what it finds
+int tree_snapshot_rescan() {
+  pthread_mutex_lock(&snapshot_lock);
+  if (!snapshot_running) {
+    pthread_mutex_unlock(&snapshot_lock);
+    return TREE_SNAPSHOT_ERROR;
+  }
+  snapshot_rescan_wanted = 1;
+  pthread_cond_signal(&snapshot_cond);
+  pthread_mutex_unlock(&snapshot_lock);
+  return TREE_SNAPSHOT_SUCCESS;
+}
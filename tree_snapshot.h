@@ -0,0 +1,22 @@
+#ifndef TREE_SNAPSHOT_H
+#define TREE_SNAPSHOT_H
+
+#include "file_tree.h"
+
+#define TREE_SNAPSHOT_SUCCESS 1
+#define TREE_SNAPSHOT_ERROR -1     // the writer is not running
+#define TREE_SNAPSHOT_ERROR_MEM -2 // no memory, or no free reader slot
+
+#define TREE_SNAPSHOT_MAX_READERS 8
+
+int tree_snapshot_start(FileNode *root, const char *root_path,
+                        int show_hidden);
+void tree_snapshot_stop();
+int tree_snapshot_register();
+void tree_snapshot_unregister(int reader);
+FileNode *tree_snapshot_adopt(int reader, FileNode *held);
+int tree_snapshot_insert(const char *path);
+int tree_snapshot_replace(FileNode *root);
+int tree_snapshot_rescan();
+
+#endif
@@ -1,13 +1,103 @@
 
 #include "tui.h"
+#include "crypto.h"
+#include "file_meta.h"
+#include "file_search.h"
 #include "file_tree.h"
-#include <magic.h>
+#include "file_type.h"
+#include "jobs.h"
+#include "tree_snapshot.h"
+#include <ctype.h>
+#include <fnmatch.h>
 #include <ncurses.h>
+#include <stdlib.h>
 #include <string.h>
-
-static WINDOW *header_win, *footer_win, *menu_win, *browser_win, *message_win,
-    *input_win;
+#include <time.h>
+
+// upper bound on search work done between two looks at the keyboard
+#define SEARCH_SLICE_NS 8000000L
+// how often the browser checks for metadata while rows are still missing it
+#define META_POLL_MS 50
+// the screen is updated at most this often (60 frames a second); keys that
+// arrive in between are applied together and drawn in the next frame
+#define TUI_FRAME_NS (1000000000LL / 60)
+// how often the jobs panel is refreshed while jobs are queued or running
+#define JOBS_POLL_MS 200
+// how often an idle screen looks for a newer version of the tree
+#define TREE_POLL_MS 250
+// a running job that reports nothing for this long is shown as stalled
+#define JOBS_STALL_MS 5000
+// plaintext the preview decrypts for one page, at most
+#define PREVIEW_MAX_BYTES (64 << 10)
+// pages the preview remembers, so that going back lands where a page began
+#define PREVIEW_HISTORY 256
+// the jobs panel never shows more than this many jobs
+#define JOBS_PANEL_MAX 64
+// the size, mtime, status and type columns need this much room on the right
+#define META_COLUMNS_WIDTH 47
+// rows narrower than this leave the metadata columns out
+#define META_MIN_NAME_WIDTH 24
+#define MAX_VISIBLE_ROWS 512
+// border, blank line, one line per item, blank line, border
+#define MENU_HEIGHT (MENU_EXIT + 4)
+
+static WINDOW *header_win, *footer_win, *menu_win, *jobs_win, *browser_win,
+    *message_win, *input_win;
 static int term_rows, term_cols;
+static FileSearchIndex *search_index; // rebuilt when the tree changes
+static FileNode *visible_nodes[MAX_VISIBLE_ROWS]; // rows of the last draw
+static int num_visible_nodes;
+static const char *menu_labels[] = {"", "Encrypt File", "Decrypt File", "Jobs",
+                                    "Exit"};
+static int (*idle_handler)(); // see tui_set_idle_handler
+static FileNode *(*tree_handler)(); // see tui_set_tree_handler
+static unsigned long jobs_seen_version; // last job change handled
+static long long last_frame_ns;         // when tui_update last ran
+
+// what each browser line currently shows, so unchanged lines are skipped
+typedef struct BrowserLine {
+  FileNode *node;
+  int selected;
+  int marked;
+  int meta_ready;
+  int enc_status;
+  long long size;
+  long long mtime;
+  const char *type;
+} BrowserLine;
+
+static BrowserLine browser_lines[MAX_VISIBLE_ROWS];
+static int browser_lines_valid; // cleared whenever the window is rebuilt
+static FileNode *browser_lines_root;
+static unsigned long browser_lines_generation;
+
+static long long tui_now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// the draw functions only stage their windows (wnoutrefresh); this sends
+// everything staged to the terminal in one write
+static void tui_update() {
+  doupdate();
+  last_frame_ns = tui_now_ns();
+}
+
+static int tui_frame_due() {
+  return tui_now_ns() - last_frame_ns >= TUI_FRAME_NS;
+}
+
+// the next key already typed, or ERR. until the next frame is due it waits
+// for one, so a held key is read as fast as it repeats but drawn at most
+// once a frame
+static int tui_pending_key() {
+  long long wait_ns = last_frame_ns + TUI_FRAME_NS - tui_now_ns();
+  timeout(wait_ns > 0 ? (int)((wait_ns + 999999) / 1000000) : 0);
+  int ch = getch();
+  timeout(-1);
+  return ch;
+}
 
 void tui_init() {
   initscr();
@@ -38,6 +128,9 @@ void tui_cleanup() {
   if (menu_win) {
     delwin(menu_win);
   }
+  if (jobs_win) {
+    delwin(jobs_win);
+  }
   if (browser_win) {
     delwin(browser_win);
   }
@@ -47,6 +140,8 @@ void tui_cleanup() {
   if (input_win) {
     delwin(input_win);
   }
+  file_search_index_destroy(search_index);
+  search_index = NULL;
 
   endwin();
 }
@@ -64,6 +159,10 @@ void tui_draw_layout() {
     delwin(menu_win);
     menu_win = NULL;
   }
+  if (jobs_win) {
+    delwin(jobs_win);
+    jobs_win = NULL;
+  }
   if (browser_win) {
     delwin(browser_win);
     browser_win = NULL;
@@ -78,6 +177,7 @@ void tui_draw_layout() {
   }
 
   clear();
+  browser_lines_valid = 0;
 
   // create header window (top 3 rows)
   header_win = newwin(3, term_cols, 0, 0);
@@ -88,10 +188,16 @@ void tui_draw_layout() {
   wbkgd(footer_win, COLOR_PAIR(1));
 
   // create menu window (left panel, quarter screen width)
-  menu_win = newwin(term_rows - 5, term_cols / 4, 3, 0);
+  menu_win = newwin(MENU_HEIGHT, term_cols / 4, 3, 0);
   box(menu_win, 0, 0);
   mvwprintw(menu_win, 0, 2, " MENU ");
 
+  // create jobs window (left panel, below the menu) if there is room for it
+  if (term_rows - 5 - MENU_HEIGHT >= 3) {
+    jobs_win = newwin(term_rows - 5 - MENU_HEIGHT, term_cols / 4,
+                      3 + MENU_HEIGHT, 0);
+  }
+
   // create file browser window (right panel, three-quarters width)
   browser_win = newwin(term_rows - 5, (3 * term_cols) / 4, 3, term_cols / 4);
   box(browser_win, 0, 0);
@@ -100,10 +206,12 @@ void tui_draw_layout() {
   refresh();
 
   tui_draw_menu();
+  tui_draw_jobs(-1);
   tui_draw_header("FileCryption");
   tui_draw_footer("Arrow Keys: Navigate | Enter: Select Option | Esc: Exit");
 
-  wrefresh(browser_win);
+  wnoutrefresh(browser_win);
+  tui_update();
 }
 
 // handles resize events and redraws
@@ -113,101 +221,375 @@ void tui_resize_handler() {
 }
 
 void tui_draw_header(const char *title) {
-  wclear(header_win);
+  werase(header_win);
   mvwprintw(header_win, 1, (term_cols - strlen(title)) / 2, "%s", title);
-  wrefresh(header_win);
+  wnoutrefresh(header_win);
 }
 
 void tui_draw_footer(const char *footer) {
-  wclear(footer_win);
+  werase(footer_win);
   mvwprintw(footer_win, 0, 2, "%s", footer);
-  wrefresh(footer_win);
+  wnoutrefresh(footer_win);
 }
 
 void tui_draw_menu() {
-  wclear(menu_win);
+  werase(menu_win);
   box(menu_win, 0, 0);
-  mvwprintw(menu_win, 2, 2, "1. Encrypt File");
-  mvwprintw(menu_win, 3, 2, "2. Decrypt File");
-  mvwprintw(menu_win, 4, 2, "3. Exit");
-  wrefresh(menu_win);
+  mvwprintw(menu_win, 0, 2, " MENU ");
+  for (int i = MENU_ENCRYPT; i <= MENU_EXIT; i++) {
+    mvwprintw(menu_win, i + 1, 2, "%d. %s", i, menu_labels[i]);
+  }
+  wnoutrefresh(menu_win);
 }
 
 void tui_highlight_menu_item(int idx) {
   tui_draw_menu();
   wattron(menu_win, COLOR_PAIR(2));
-  mvwprintw(menu_win, idx + 1, 2, "%d. %s", idx,
-            idx == MENU_ENCRYPT   ? "Encrypt File"
-            : idx == MENU_DECRYPT ? "Decrypt File"
-                                  : "Exit");
+  mvwprintw(menu_win, idx + 1, 2, "%d. %s", idx, menu_labels[idx]);
   wattroff(menu_win, COLOR_PAIR(2));
-  wrefresh(menu_win);
+  wnoutrefresh(menu_win);
+}
+
+static void tui_format_size(char *out, size_t out_len, long long size) {
+  const char *units = "BKMGTP";
+  double value = (double)size;
+  int unit = 0;
+  while (value >= 1024 && units[unit + 1]) {
+    value /= 1024;
+    unit++;
+  }
+  if (unit == 0) {
+    snprintf(out, out_len, "%lldB", size);
+  } else {
+    snprintf(out, out_len, "%.1f%c", value, units[unit]);
+  }
+}
+
+static const char *tui_job_state_label(int state) {
+  switch (state) {
+  case JOB_QUEUED:
+    return "wait";
+  case JOB_RUNNING:
+    return "run";
+  case JOB_DONE:
+    return "done";
+  case JOB_FAILED:
+    return "fail";
+  default:
+    return "stop";
+  }
 }
 
-void tui_draw_file_tree_recursive(FileNode *node, int selected_idx,
-                                  int scroll_offset, int *current_idx, int *y,
-                                  int max_y, WINDOW *win) {
-  if (!node || *y >= max_y)
+// second line of a running job: a progress bar with the throughput and the
+// time left, or what the job is busy with when there is nothing to measure
+static void tui_draw_job_progress(int y, const JobInfo *job) {
+  int width = getmaxx(jobs_win) - 4;
+  if (job->phase <= CRYPTO_PHASE_KDF) {
+    mvwprintw(jobs_win, y, 2, "%.*s", width, "  deriving key");
     return;
+  }
+  if (job->phase >= CRYPTO_PHASE_FINALIZE) {
+    mvwprintw(jobs_win, y, 2, "%.*s", width, "  finalizing");
+    return;
+  }
 
-  if (*current_idx >= scroll_offset) {
-    int depth = 0;
-    for (FileNode *parent = node->parent; parent; parent = parent->parent)
-      depth++;
+  int percent = job->bytes_total > 0
+                    ? (int)(job->bytes_done * 100 / job->bytes_total)
+                    : 0;
+  char info[48];
+  if (job->idle_ms >= JOBS_STALL_MS) {
+    snprintf(info, sizeof(info), " %3d%% stalled %llds", percent,
+             job->idle_ms / 1000);
+  } else {
+    char rate[16];
+    tui_format_size(rate, sizeof(rate), (long long)job->rate);
+    if (job->eta_ms >= 0) {
+      long long seconds = (job->eta_ms + 999) / 1000;
+      snprintf(info, sizeof(info), " %3d%% %s/s %lld:%02lld", percent, rate,
+               seconds / 60, seconds % 60);
+    } else {
+      snprintf(info, sizeof(info), " %3d%% %s/s --:--", percent, rate);
+    }
+  }
 
-    char display[MAX_NAME_LENGTH + 4];
-    snprintf(display, sizeof(display), "%s %s", node->is_dir ? "->" : "  ",
-             node->name);
-    display[sizeof(display) - 1] = '\0';
+  int bar_width = width - (int)strlen(info) - 2;
+  if (bar_width < 4) {
+    mvwprintw(jobs_win, y, 2, "%.*s", width, info);
+    return;
+  }
+  int filled = bar_width * percent / 100;
+  wmove(jobs_win, y, 2);
+  waddch(jobs_win, '[');
+  for (int i = 0; i < bar_width; i++) {
+    waddch(jobs_win, i < filled ? '#' : '.');
+  }
+  waddch(jobs_win, ']');
+  waddstr(jobs_win, info);
+}
 
-    int display_attributes = 0;
-    if (node->is_dir) {
-      display_attributes = COLOR_PAIR(3);
+// lists the newest jobs in the panel below the menu, highlighting the
+// 'sel_idx'-th one (-1 for none). running jobs take a second line for their
+// progress. returns how many jobs fit in the panel
+int tui_draw_jobs(int sel_idx) {
+  if (!jobs_win) {
+    return 0;
+  }
+  werase(jobs_win);
+  box(jobs_win, 0, 0);
+  mvwprintw(jobs_win, 0, 2, " JOBS ");
+
+  JobInfo jobs[JOBS_PANEL_MAX];
+  int max_y = getmaxy(jobs_win);
+  int max_x = getmaxx(jobs_win);
+  int count = jobs_snapshot(jobs, max_y - 2 < JOBS_PANEL_MAX ? max_y - 2
+                                                             : JOBS_PANEL_MAX);
+  if (count == 0) {
+    mvwprintw(jobs_win, 1, 2, "No jobs");
+  }
+  int y = 1;
+  int drawn = 0;
+  for (int i = 0; i < count; i++) {
+    int lines = jobs[i].state == JOB_RUNNING ? 2 : 1;
+    if (y + lines > max_y - 1) {
+      break;
     }
-    if (*current_idx == selected_idx) {
-      display_attributes |= A_REVERSE;
+    const char *slash = strrchr(jobs[i].src, '/');
+    const char *name = slash ? slash + 1 : jobs[i].src;
+    int attributes = jobs[i].state == JOB_DONE     ? COLOR_PAIR(4)
+                     : jobs[i].state == JOB_FAILED ? COLOR_PAIR(5)
+                     : jobs[i].state == JOB_RUNNING ? COLOR_PAIR(3)
+                                                    : 0;
+    if (i == sel_idx) {
+      attributes |= A_REVERSE;
+    }
+    if (attributes != 0) {
+      wattron(jobs_win, attributes);
+    }
+    mvwprintw(jobs_win, y, 2, "%-4s %s %.*s",
+              tui_job_state_label(jobs[i].state),
+              jobs[i].type == JOB_ENCRYPT ? "enc" : "dec",
+              max_x - 12 > 0 ? max_x - 12 : 0, name);
+    wattroff(jobs_win, A_REVERSE | COLOR_PAIR(3) | COLOR_PAIR(4) |
+                           COLOR_PAIR(5));
+    if (lines == 2) {
+      tui_draw_job_progress(y + 1, &jobs[i]);
     }
+    y += lines;
+    drawn++;
+  }
+  wnoutrefresh(jobs_win);
+  return drawn;
+}
 
-    if (display_attributes != 0) {
-      wattron(win, display_attributes);
+// 'handler' runs on the ui thread whenever a job changed state and returns
+// non-zero if it changed the tree that is on screen
+void tui_set_idle_handler(int (*handler)()) { idle_handler = handler; }
+
+// 'handler' runs on the ui thread while it waits for keys and returns the
+// version of the tree to show from then on. nodes of the version shown
+// before must not be touched once it returned another one
+void tui_set_tree_handler(FileNode *(*handler)()) { tree_handler = handler; }
+
+// shows what was drawn, then waits for the next key while keeping the jobs
+// panel and, when 'root' is given, the tree in '*root' and the metadata of
+// its visible rows up to date. returns ERR instead of a key when the browser
+// needs to be redrawn
+static int tui_poll_key(FileNode **root, int job_sel_idx) {
+  while (1) {
+    tui_update();
+    int active = jobs_active();
+    int busy = active || jobs_version() != jobs_seen_version;
+    int poll_ms = root && file_meta_pending() ? META_POLL_MS
+                  : busy                      ? JOBS_POLL_MS
+                  : tree_handler              ? TREE_POLL_MS
+                                              : -1;
+    timeout(poll_ms);
+    int ch = getch();
+    timeout(-1);
+    if (ch != ERR) {
+      return ch;
     }
 
-    mvwprintw(win, *y, depth * 2 + 1, "%s", display);
-    wattroff(win, A_REVERSE | COLOR_PAIR(3));
+    // the panel is redrawn at most once per poll, which is what limits the
+    // rate of progress updates on screen
+    int changed = 0;
+    if (active || jobs_version() != jobs_seen_version) {
+      tui_draw_jobs(job_sel_idx);
+    }
+    if (jobs_version() != jobs_seen_version) {
+      jobs_seen_version = jobs_version();
+      if (idle_handler && idle_handler()) {
+        changed = 1;
+      }
+    }
+    if (tree_handler) {
+      FileNode *latest = tree_handler();
+      if (root && latest && latest != *root) {
+        *root = latest;
+        changed = 1;
+      }
+    }
+    if (root && file_meta_apply(*root) > 0) {
+      changed = 1;
+    }
+    if (changed && root) {
+      return ERR;
+    }
+  }
+}
 
-    (*y)++;
+// size, modification time, encryption status and file type, right-aligned
+// in the row.
+// left blank until the metadata worker has looked at the node
+static void tui_draw_meta_columns(WINDOW *win, int y, FileNode *node) {
+  int max_x = getmaxx(win);
+  if (max_x < META_COLUMNS_WIDTH + META_MIN_NAME_WIDTH) {
+    return;
+  }
+  int x = max_x - META_COLUMNS_WIDTH - 1;
+  if (!node->meta_ready) {
+    mvwprintw(win, y, x, "%*s", META_COLUMNS_WIDTH, "...");
+    return;
   }
 
-  (*current_idx)++;
+  char size[16] = "";
+  if (!node->is_dir) {
+    tui_format_size(size, sizeof(size), node->size);
+  }
+  char mtime[20] = "";
+  time_t seconds = (time_t)(node->mtime / 1000000000LL);
+  struct tm tm;
+  if (node->mtime > 0 && localtime_r(&seconds, &tm)) {
+    strftime(mtime, sizeof(mtime), "%Y-%m-%d %H:%M", &tm);
+  }
+  const char *status = node->enc_status == FILE_META_ENC_VALID     ? "enc"
+                       : node->enc_status == FILE_META_ENC_INVALID ? "enc!"
+                                                                   : "";
+  const char *type = node->is_dir ? "Directory" : node->type ? node->type : "";
+  mvwprintw(win, y, x, " %7s %16s %-5s %-14.14s", size, mtime, status, type);
+}
 
-  for (int i = 0; i < node->num_children; i++) {
-    tui_draw_file_tree_recursive(node->children[i], selected_idx, scroll_offset,
-                                 current_idx, y, max_y, win);
-    if (*y > max_y) {
-      break;
-    }
+// draws one browser row over whatever was on that line before
+static void tui_draw_file_row(WINDOW *win, int y, FileNode *node,
+                              int selected) {
+  int max_x = getmaxx(win);
+  wmove(win, y, 1);
+  wclrtoeol(win);
+  mvwaddch(win, y, max_x - 1, ACS_VLINE);
+  if (!node) {
+    return;
   }
+
+  char display[MAX_NAME_LENGTH + 4];
+  snprintf(display, sizeof(display), "%s %s",
+           node->is_dir ? "->" : node->marked ? " *" : "  ", node->name);
+  display[sizeof(display) - 1] = '\0';
+
+  int display_attributes = 0;
+  if (node->is_dir) {
+    display_attributes = COLOR_PAIR(3);
+  }
+  if (selected) {
+    display_attributes |= A_REVERSE;
+  }
+
+  if (display_attributes != 0) {
+    wattron(win, display_attributes);
+  }
+
+  int x = node->depth * 2 + 1;
+  if (x < max_x - 1) {
+    mvwprintw(win, y, x, "%.*s", max_x - 1 - x, display);
+  }
+  tui_draw_meta_columns(win, y, node);
+  wattroff(win, A_REVERSE | COLOR_PAIR(3));
 }
 
-void tui_draw_file_browser(FileNode *root, int sel_idx, int scr_offset) {
-  werase(browser_win); // clear previous browser
-  box(browser_win, 0, 0);
-  mvwprintw(browser_win, 0, 2, " FILES ");
+static int tui_browser_line_matches(const BrowserLine *line, FileNode *node,
+                                    int selected) {
+  if (line->node != node || line->selected != selected) {
+    return 0;
+  }
+  return !node || (line->marked == node->marked &&
+                   line->meta_ready == node->meta_ready &&
+                   line->enc_status == node->enc_status &&
+                   line->size == node->size && line->mtime == node->mtime &&
+                   line->type == node->type);
+}
 
+// draws the rows from 'scr_offset' on by indexing the tree's flat row list,
+// so the cost depends on the window height only. lines that show the same
+// node, highlight and metadata as last time are left alone
+void tui_draw_file_browser(FileNode *root, int sel_idx, int scr_offset) {
   if (!root) {
+    werase(browser_win); // clear previous browser
+    box(browser_win, 0, 0);
+    mvwprintw(browser_win, 0, 2, " FILES ");
     mvwprintw(browser_win, 1, 2, "No files or directory loaded");
-    wrefresh(browser_win);
+    wnoutrefresh(browser_win);
+    browser_lines_valid = 0;
     return;
   }
 
   int max_y = getmaxy(browser_win);
+  int num_lines = max_y - 2;
+  if (num_lines > MAX_VISIBLE_ROWS) {
+    num_lines = MAX_VISIBLE_ROWS;
+  }
+
+  unsigned long generation = file_tree_get_generation(root);
+  if (!browser_lines_valid || browser_lines_root != root ||
+      browser_lines_generation != generation) {
+    werase(browser_win);
+    box(browser_win, 0, 0);
+    mvwprintw(browser_win, 0, 2, " FILES ");
+    memset(browser_lines, 0, sizeof(browser_lines));
+    for (int i = 0; i < MAX_VISIBLE_ROWS; i++) {
+      browser_lines[i].selected = -1; // force every line to be drawn
+    }
+    browser_lines_root = root;
+    browser_lines_generation = generation;
+    browser_lines_valid = 1;
+  }
 
-  int current_idx = 0;
-  int y_pos = 1;
-  tui_draw_file_tree_recursive(root, sel_idx, scr_offset, &current_idx, &y_pos,
-                               max_y - 1, browser_win);
+  // the title carries the number of marked files, which may change without
+  // touching the rows
+  int num_marked = file_tree_count_marked(root);
+  mvwhline(browser_win, 0, 1, ACS_HLINE, getmaxx(browser_win) - 2);
+  if (num_marked > 0) {
+    mvwprintw(browser_win, 0, 2, " FILES (%d marked) ", num_marked);
+  } else {
+    mvwprintw(browser_win, 0, 2, " FILES ");
+  }
 
-  wrefresh(browser_win);
+  num_visible_nodes = 0;
+  for (int i = 0; i < num_lines; i++) {
+    int row = scr_offset + i;
+    FileNode *node = file_tree_get_row(root, row);
+    int selected = node && row == sel_idx;
+    if (node) {
+      visible_nodes[num_visible_nodes++] = node;
+    }
+
+    BrowserLine *line = &browser_lines[i];
+    if (tui_browser_line_matches(line, node, selected)) {
+      continue;
+    }
+    tui_draw_file_row(browser_win, i + 1, node, selected);
+    line->node = node;
+    line->selected = selected;
+    if (node) {
+      line->marked = node->marked;
+      line->meta_ready = node->meta_ready;
+      line->enc_status = node->enc_status;
+      line->size = node->size;
+      line->mtime = node->mtime;
+      line->type = node->type;
+    }
+  }
+  file_meta_want(visible_nodes, num_visible_nodes);
+
+  wnoutrefresh(browser_win);
 }
 
 void tui_display_message(const char *message, int message_type) {
@@ -267,8 +649,8 @@ int tui_get_menu_selection() {
 
   tui_highlight_menu_item(current_selection);
 
+  int ch = tui_poll_key(NULL, -1);
   while (1) {
-    int ch = getch();
     switch (ch) {
     case KEY_RESIZE:
       tui_resize_handler();
@@ -277,6 +659,7 @@ int tui_get_menu_selection() {
     case '1':
     case '2':
     case '3':
+    case '4':
       current_selection = ch - '0';
       break;
     case KEY_UP:
@@ -299,13 +682,20 @@ int tui_get_menu_selection() {
     case 27: // esc key
       return MENU_EXIT;
     }
-    tui_highlight_menu_item(current_selection);
+    // keys typed meanwhile move the highlight before it is drawn
+    ch = tui_pending_key();
+    if (ch == ERR) {
+      tui_highlight_menu_item(current_selection);
+      ch = tui_poll_key(NULL, -1);
+    }
   }
 }
 
-char *tui_get_password(const char *prompt) {
-  static char password[128];
-  memset(password, 0, sizeof(password));
+// one-line input box. the password box keeps echo off, other prompts show
+// what is typed
+static void tui_read_line(const char *title, const char *prompt, char *buffer,
+                          int buffer_len, int visible) {
+  memset(buffer, 0, buffer_len);
 
   int width = term_cols / 2;
   if (width < (int)strlen(prompt) + 5) {
@@ -325,7 +715,7 @@ char *tui_get_password(const char *prompt) {
   input_win = newwin(height, width, starty, startx);
   box(input_win, 0, 0);
 
-  mvwprintw(input_win, 0, 2, " Password Entry ");
+  mvwprintw(input_win, 0, 2, " %s ", title);
   mvwprintw(input_win, 2, 2, "%s", prompt);
   wrefresh(input_win);
 
@@ -335,9 +725,13 @@ char *tui_get_password(const char *prompt) {
 
   curs_set(1);
   wmove(field_win, 0, 0);
-  // echo();
-  wgetnstr(field_win, password, sizeof(password) - 1);
-  // noecho();
+  if (visible) {
+    echo();
+  }
+  wgetnstr(field_win, buffer, buffer_len - 1);
+  if (visible) {
+    noecho();
+  }
   curs_set(0);
 
   delwin(field_win);
@@ -346,7 +740,11 @@ char *tui_get_password(const char *prompt) {
 
   touchwin(stdscr);
   wrefresh(stdscr);
+}
 
+char *tui_get_password(const char *prompt) {
+  static char password[128];
+  tui_read_line("Password Entry", prompt, password, sizeof(password), 0);
   return password;
 }
 
@@ -357,125 +755,10 @@ const char *get_common_file_type(FileNode *node) {
   if (node->is_dir) {
     return "Directory";
   }
-  if (strcmp(strrchr(node->name, '.'), ".enc") == 0) {
-    return "Encrypted File";
-  }
-  if (strcmp(strrchr(node->name, '.'), ".dec") == 0) {
-    return "Decrypted File";
-  }
-#if defined(__unix__) || defined(__APPLE__)
-  static char type_buffer[256];
-  const char *default_type_on_error = "File";
-
-  magic_t magic_cookie = magic_open(MAGIC_SYMLINK);
-  if (magic_cookie == NULL) {
-    // failed to initialize libmagic
-    return default_type_on_error;
-  }
-
-  if (magic_load(magic_cookie, NULL) != 0) {
-    // failed to load magic database
-    magic_close(magic_cookie);
-    return default_type_on_error;
-  }
-
-  const char *full_type = magic_file(magic_cookie, node->path);
-
-  if (full_type != NULL) {
-    strncpy(type_buffer, full_type, sizeof(type_buffer) - 1);
-    type_buffer[sizeof(type_buffer) - 1] = '\0'; // ensure null-termination
-
-    char *comma = strchr(type_buffer, ',');
-    if (comma != NULL) {
-      *comma = '\0'; // truncate the string at the comma
-    }
-    magic_close(magic_cookie);
-    return type_buffer;
-  } else {
-    magic_close(magic_cookie);
-    return default_type_on_error;
-  }
-#endif
-  const char *dot = strrchr(node->name, '.');
-
-  if (!dot || dot == node->name) {
-    return "File";
-  }
-
-  if (strcmp(dot, ".txt") == 0) {
-    return "Text File";
-  }
-  if (strcmp(dot, ".c") == 0 || strcmp(dot, ".h") == 0) {
-    return "C Source";
-  }
-  if (strcmp(dot, ".zip") == 0 || strcmp(dot, ".tar") == 0 ||
-      strcmp(dot, ".gz") == 0 || strcmp(dot, ".bz2") == 0 ||
-      strcmp(dot, ".7z") == 0) {
-    return "Archive";
-  }
-  if (strcmp(dot, ".jpg") == 0 || strcmp(dot, ".jpeg") == 0 ||
-      strcmp(dot, ".jpe") == 0 || strcmp(dot, ".jfif") == 0) {
-    return "JPEG Image";
-  }
-  if (strcmp(dot, ".png") == 0) {
-    return "PNG Image";
-  }
-  if (strcmp(dot, ".gif") == 0) {
-    return "GIF Image";
-  }
-  if (strcmp(dot, ".bmp") == 0) {
-    return "BMP Image";
-  }
-  if (strcmp(dot, ".pdf") == 0) {
-    return "PDF Document";
-  }
-  if (strcmp(dot, ".mp3") == 0) {
-    return "MP3 Audio";
-  }
-  if (strcmp(dot, ".wav") == 0) {
-    return "WAV Audio";
-  }
-  if (strcmp(dot, ".mp4") == 0) {
-    return "MP4 Video";
-  }
-  if (strcmp(dot, ".avi") == 0) {
-    return "AVI Video";
-  }
-  if (strcmp(dot, ".doc") == 0 || strcmp(dot, ".docx") == 0) {
-    return "Word Document";
-  }
-  if (strcmp(dot, ".xls") == 0 || strcmp(dot, ".xlsx") == 0) {
-    return "Excel Spreadsheet";
+  if (node->type) {
+    return node->type; // already classified by the metadata worker
   }
-  if (strcmp(dot, ".ppt") == 0 || strcmp(dot, ".pptx") == 0) {
-    return "PowerPoint Presentation";
-  }
-  if (strcmp(dot, ".odt") == 0) {
-    return "OpenDocument Text";
-  }
-  if (strcmp(dot, ".ods") == 0) {
-    return "OpenDocument Spreadsheet";
-  }
-  if (strcmp(dot, ".odp") == 0) {
-    return "OpenDocument Presentation";
-  }
-  if (strcmp(dot, ".rtf") == 0) {
-    return "Rich Text Format";
-  }
-  if (strcmp(dot, ".csv") == 0) {
-    return "CSV Data";
-  }
-  if (strcmp(dot, ".html") == 0 || strcmp(dot, ".htm") == 0) {
-    return "HTML Document";
-  }
-  if (strcmp(dot, ".xml") == 0) {
-    return "XML Data";
-  }
-  if (strcmp(dot, ".json") == 0) {
-    return "JSON Data";
-  }
-
-  return "File";
+  return file_type_describe(node->path, NULL);
 }
 
 int tui_get_confirmation(const char *prompt) {
@@ -571,22 +854,468 @@ int tui_get_confirmation(const char *prompt) {
   wrefresh(stdscr);
   return TUI_CONFIRM_NO;
 }
-FileNode *tui_get_file_browser_selection(FileNode *root) {
-  tui_draw_footer("Arrow Keys: Navigate | Enter: Select File | Esc: Exit Menu");
+static void tui_draw_search_results(FileSearch *search, int sel_idx,
+                                    int scr_offset) {
+  browser_lines_valid = 0; // the tree view has to repaint every line
+  werase(browser_win);
+  box(browser_win, 0, 0);
+  mvwprintw(browser_win, 0, 2, " SEARCH ");
+
+  int max_y = getmaxy(browser_win);
+  int max_x = getmaxx(browser_win);
+  int result_count = file_search_result_count(search);
+
+  mvwprintw(browser_win, 1, 2, "/%s", search->query);
+  mvwprintw(browser_win, 1, max_x - 22, "%s%d matches",
+            file_search_is_complete(search) ? " " : ">", result_count);
+
+  int y = 2;
+  for (int i = scr_offset; i < result_count && y < max_y - 1; i++, y++) {
+    FileNode *node = file_search_result(search, i);
+    int display_attributes = node->is_dir ? COLOR_PAIR(3) : 0;
+    if (i == sel_idx) {
+      display_attributes |= A_REVERSE;
+    }
+    if (display_attributes != 0) {
+      wattron(browser_win, display_attributes);
+    }
+    mvwprintw(browser_win, y, 1, "%s %.*s", node->is_dir ? "->" : "  ",
+              max_x - 6, node->path);
+    wattroff(browser_win, A_REVERSE | COLOR_PAIR(3));
+  }
+
+  wnoutrefresh(browser_win);
+}
+
+// '/' prompt in the file browser: filters the tree by fuzzy name match as the
+// user types. returns the chosen node, or NULL to go back to the tree view
+static FileNode *tui_search_file_browser(FileNode *root) {
+  if (file_search_index_is_stale(search_index, root)) {
+    file_search_index_destroy(search_index);
+    search_index = file_search_index_create(root);
+  }
+  FileSearch *search =
+      search_index ? file_search_create(search_index) : NULL;
+  if (!search) {
+    return NULL;
+  }
+
+  tui_draw_footer(
+      "Type to filter | Arrow Keys: Navigate | Enter: Select File | Esc: Back");
+
+  char query[FILE_SEARCH_MAX_QUERY + 1] = "";
+  int query_len = 0;
+  int selected_idx = 0;
+  int scroll_offset = 0;
+  int visible_rows = getmaxy(browser_win) - 3;
+  FileNode *selected = NULL;
+  int searching = 1;
+  int dirty = 1; // the results on screen are out of date
+
+  while (searching) {
+    int result_count = file_search_result_count(search);
+    if (selected_idx >= result_count) {
+      selected_idx = result_count > 0 ? result_count - 1 : 0;
+    }
+    if (selected_idx < scroll_offset) {
+      scroll_offset = selected_idx;
+    } else if (selected_idx >= scroll_offset + visible_rows) {
+      scroll_offset = selected_idx - visible_rows + 1;
+    }
+
+    // a search still running redraws its growing results once a frame
+    int complete = file_search_is_complete(search);
+    if (dirty && (complete || tui_frame_due())) {
+      tui_draw_search_results(search, selected_idx, scroll_offset);
+      tui_update();
+      dirty = 0;
+    }
+
+    int ch;
+    if (!complete) {
+      // keep refining the result set until the next key arrives
+      nodelay(stdscr, TRUE);
+      ch = getch();
+      nodelay(stdscr, FALSE);
+      if (ch == ERR) {
+        file_search_step(search, SEARCH_SLICE_NS);
+        dirty = 1;
+        continue;
+      }
+    } else {
+      ch = getch();
+    }
+    dirty = 1;
+
+    switch (ch) {
+    case KEY_UP:
+      selected_idx = (selected_idx > 0) ? selected_idx - 1 : 0;
+      break;
+    case KEY_DOWN:
+      if (selected_idx < result_count - 1) {
+        selected_idx++;
+      }
+      break;
+    case KEY_PPAGE:
+      selected_idx =
+          (selected_idx - visible_rows > 0) ? selected_idx - visible_rows : 0;
+      break;
+    case KEY_NPAGE:
+      selected_idx += visible_rows;
+      break;
+    case 10:
+    case KEY_ENTER:
+      selected = file_search_result(search, selected_idx);
+      if (selected) {
+        searching = 0;
+      }
+      break;
+    case 27:
+      searching = 0;
+      break;
+    case KEY_RESIZE:
+      tui_resize_handler();
+      visible_rows = getmaxy(browser_win) - 3;
+      break;
+    case KEY_BACKSPACE:
+    case 127:
+    case 8:
+      if (query_len > 0) {
+        query[--query_len] = '\0';
+        file_search_set_query(search, query);
+        file_search_step(search, SEARCH_SLICE_NS);
+        selected_idx = 0;
+      }
+      break;
+    default:
+      if (ch > 0 && ch < 256 && isprint(ch) &&
+          query_len < FILE_SEARCH_MAX_QUERY) {
+        query[query_len++] = (char)ch;
+        query[query_len] = '\0';
+        file_search_set_query(search, query);
+        file_search_step(search, SEARCH_SLICE_NS);
+        selected_idx = 0;
+      }
+      break;
+    }
+  }
+
+  file_search_destroy(search);
+  return selected;
+}
+
+// text, unless there are NUL bytes or more than one control character in
+// eight
+static int tui_looks_binary(const unsigned char *data, size_t len) {
+  size_t control = 0;
+  for (size_t i = 0; i < len; i++) {
+    if (data[i] == 0) {
+      return 1;
+    }
+    if ((data[i] < 0x20 && !isspace(data[i])) || data[i] == 0x7f) {
+      control++;
+    }
+  }
+  return control * 8 > len;
+}
+
+// lays 'data' out as text inside the borders of 'win'. returns how many
+// bytes fit, i.e. where the next page starts
+static size_t tui_preview_text(WINDOW *win, const unsigned char *data,
+                               size_t len) {
+  int rows = getmaxy(win) - 2;
+  int cols = getmaxx(win) - 4;
+  int y = 0;
+  int x = 0;
+  size_t i;
+  for (i = 0; i < len && y < rows; i++) {
+    unsigned char c = data[i];
+    if (c == '\n') {
+      y++;
+      x = 0;
+      continue;
+    }
+    if (c == '\r') {
+      continue;
+    }
+    int width = c == '\t' ? 8 - x % 8 : 1;
+    if (x + width > cols) { // wrap
+      y++;
+      x = 0;
+      if (y == rows) {
+        break;
+      }
+    }
+    if (c != '\t') {
+      mvwaddch(win, y + 1, x + 2, isprint(c) ? c : '.');
+    }
+    x += width;
+  }
+  return i;
+}
+
+// lays 'data' out as a hex dump, 16 bytes a line
+static size_t tui_preview_hex(WINDOW *win, long long offset,
+                              const unsigned char *data, size_t len) {
+  int rows = getmaxy(win) - 2;
+  int cols = getmaxx(win) - 4;
+  size_t i = 0;
+  for (int y = 0; y < rows && i < len; y++, i += 16) {
+    char line[96];
+    int n = snprintf(line, sizeof(line), "%08llx ", offset + (long long)i);
+    for (size_t j = i; j < i + 16; j++) {
+      n += j < len ? snprintf(line + n, sizeof(line) - n, " %02x", data[j])
+                   : snprintf(line + n, sizeof(line) - n, "   ");
+    }
+    n += snprintf(line + n, sizeof(line) - n, "  ");
+    for (size_t j = i; j < i + 16 && j < len; j++) {
+      line[n++] = isprint(data[j]) ? data[j] : '.';
+    }
+    line[n] = '\0';
+    mvwprintw(win, y + 1, 2, "%.*s", cols, line);
+  }
+  return i < len ? i : len;
+}
+
+#define PREVIEW_FOOTER "PgDn/PgUp: Page | Home: Start | t: Text/Hex | Esc: Back"
+
+// shows the plaintext of an encrypted file a page at a time, over the
+// browser. each page is decrypted into guarded memory that is wiped when
+// the preview closes, and only as far into the file as the page reaches:
+// nothing is written to disk
+static void tui_preview_file(FileNode *node) {
+  if (!node || node->is_dir ||
+      crypto_probe_file(node->path) != CRYPTO_SUCCESS) {
+    tui_display_message("Only encrypted files can be previewed",
+                        TUI_MSG_WARNING);
+    return;
+  }
+  char *password = tui_get_password("Enter the password to preview the file:");
+  if (!password || strlen(password) == 0) {
+    tui_display_message("Password cannot be empty", TUI_MSG_WARNING);
+    return;
+  }
+  CryptoPreview *preview = NULL;
+  int status = crypto_preview_open(node->path, password, NULL, &preview);
+  sodium_memzero(password, strlen(password));
+  unsigned char *plain = (unsigned char *)sodium_malloc(PREVIEW_MAX_BYTES);
+  if (status == CRYPTO_SUCCESS && !plain) {
+    status = CRYPTO_ERROR_MEM;
+  }
+
+  WINDOW *win = NULL;
+  long long history[PREVIEW_HISTORY];
+  int depth = 0;
+  long long offset = 0;
+  int hex = -1; // decided from the first page
+  int open = status == CRYPTO_SUCCESS;
+  tui_draw_footer(PREVIEW_FOOTER);
+  while (open) {
+    if (!win) {
+      win = newwin(term_rows - 5, (3 * term_cols) / 4, 3, term_cols / 4);
+    }
+    int rows = getmaxy(win) - 2;
+    int cols = getmaxx(win) - 4;
+    long long want = hex == 1 ? rows * 16LL : (long long)rows * cols;
+    if (want > PREVIEW_MAX_BYTES) {
+      want = PREVIEW_MAX_BYTES;
+    }
+    size_t got;
+    status = crypto_preview_read(preview, offset, plain, (size_t)want, &got);
+    if (status != CRYPTO_SUCCESS) {
+      break;
+    }
+    if (hex < 0) {
+      hex = tui_looks_binary(plain, got);
+      continue; // the page size depends on the mode
+    }
+
+    werase(win);
+    box(win, 0, 0);
+    size_t shown = hex ? tui_preview_hex(win, offset, plain, got)
+                       : tui_preview_text(win, plain, got);
+    int at_end = got < (size_t)want && shown == got;
+    mvwprintw(win, 0, 2, " %.*s: bytes %lld-%lld%s ", cols / 2, node->name,
+              offset, offset + (long long)shown,
+              at_end ? ", end of file" : "");
+    sodium_memzero(plain, got);
+    wnoutrefresh(win);
+    tui_update();
+
+    switch (getch()) {
+    case KEY_NPAGE:
+    case KEY_DOWN:
+    case ' ':
+      if (!at_end && shown > 0) {
+        if (depth == PREVIEW_HISTORY) {
+          memmove(history, history + 1, sizeof(history) - sizeof(history[0]));
+          depth--;
+        }
+        history[depth++] = offset;
+        offset += (long long)shown;
+      }
+      break;
+    case KEY_PPAGE:
+    case KEY_UP:
+      if (depth > 0) {
+        offset = history[--depth];
+      }
+      break;
+    case KEY_HOME:
+      offset = 0;
+      depth = 0;
+      break;
+    case 't':
+      hex = !hex;
+      break;
+    case KEY_RESIZE:
+      tui_resize_handler();
+      delwin(win);
+      win = NULL;
+      tui_draw_footer(PREVIEW_FOOTER);
+      break;
+    case 27:
+    case 'q':
+      open = 0;
+      break;
+    }
+  }
+  if (win) {
+    delwin(win);
+  }
+  crypto_preview_close(preview);
+  sodium_free(plain); // sodium_free zeroes the buffer first
+  tui_draw_layout();
+  if (status != CRYPTO_SUCCESS) {
+    tui_display_message(status == CRYPTO_ERROR_DEC
+                            ? "Cannot preview: wrong password, or the file "
+                              "is damaged"
+                            : "Cannot preview: unable to read the file",
+                        TUI_MSG_ERROR);
+    tui_draw_layout();
+  }
+}
+
+#define BROWSER_FOOTER                                                         \
+  "Enter: Select | Space: Mark | v: Mark Range | *: Mark Pattern | "           \
+  "u: Unmark All | /: Search | p: Preview | r: Rescan | Esc: Exit Menu"
+
+// marks (or unmarks) the files on rows 'first' to 'last'. directories are
+// never marked themselves
+static void tui_mark_rows(FileNode *root, int first, int last, int marked) {
+  for (int row = first; row <= last; row++) {
+    FileNode *node = file_tree_get_row(root, row);
+    if (node && !node->is_dir) {
+      file_tree_set_marked(root, node, marked);
+    }
+  }
+}
+
+// space: toggles the file on 'row', or every file below the directory on
+// 'row'. the subtree of a node is the run of rows after it that sit deeper
+static void tui_toggle_mark(FileNode *root, int row) {
+  FileNode *node = file_tree_get_row(root, row);
+  if (!node) {
+    return;
+  }
+  if (!node->is_dir) {
+    file_tree_set_marked(root, node, !node->marked);
+    return;
+  }
+  int last = row;
+  int any_unmarked = 0;
+  FileNode *next;
+  while ((next = file_tree_get_row(root, last + 1)) &&
+         next->depth > node->depth) {
+    last++;
+    if (!next->is_dir && !next->marked) {
+      any_unmarked = 1;
+    }
+  }
+  tui_mark_rows(root, row + 1, last, any_unmarked);
+}
+
+// '*': marks every file whose name matches a shell pattern
+static void tui_mark_pattern(FileNode *root) {
+  char pattern[MAX_NAME_LENGTH];
+  tui_read_line("Mark Files", "Mark files matching (e.g. *.txt):", pattern,
+                sizeof(pattern), 1);
+  if (pattern[0] == '\0') {
+    return;
+  }
+  FileNode *node;
+  for (int row = 0; (node = file_tree_get_row(root, row)); row++) {
+    if (!node->is_dir && fnmatch(pattern, node->name, 0) == 0) {
+      file_tree_set_marked(root, node, 1);
+    }
+  }
+}
+
+// applies a movement key to the browser selection, 0 for any other key
+static int tui_move_selection(int ch, int *selected_idx, int total_nodes,
+                              int visible_rows) {
+  int idx = *selected_idx;
+  switch (ch) {
+  case KEY_UP:
+    idx = (idx > 0) ? idx - 1 : 0;
+    break;
+  case KEY_DOWN:
+    idx = (idx < total_nodes - 1) ? idx + 1 : total_nodes - 1;
+    break;
+  case KEY_PPAGE:
+    idx = (idx - visible_rows > 0) ? idx - visible_rows - 1 : 0;
+    break;
+  case KEY_NPAGE:
+    idx = (idx + visible_rows < total_nodes - 1) ? idx + visible_rows + 1
+                                                 : total_nodes - 1;
+    break;
+  case KEY_HOME:
+    idx = 0;
+    break;
+  case KEY_END:
+    idx = total_nodes - 1;
+    break;
+  default:
+    return 0;
+  }
+  *selected_idx = idx;
+  return 1;
+}
+
+// the row of 'path' in a version of the tree that replaced the one on
+// screen, or 'row' (kept within the tree) when the file is gone
+static int tui_follow_row(FileNode *root, const char *path, int row) {
+  FileNode *node = file_tree_get_by_path(root, path);
+  int found = node ? file_tree_get_row_index(root, node) : -1;
+  if (found >= 0) {
+    return found;
+  }
+  int total_nodes = file_tree_count_nodes(root);
+  return row < total_nodes ? row : total_nodes - 1;
+}
+
+// lets the user pick files in the browser. '*selected' receives a malloc'ed
+// array, freed by the caller, holding the marked files or, when nothing is
+// marked, the node that was picked. returns its length, 0 when cancelled
+int tui_get_file_browser_selection(FileNode *root, FileNode ***selected) {
+  *selected = NULL;
+  tui_draw_footer(BROWSER_FOOTER);
   if (!root) {
     tui_display_message("File tree is not loaded or is empty.", TUI_MSG_ERROR);
     tui_draw_layout();
-    return NULL;
+    return 0;
   }
 
-  int total_nodes = file_tree_count_nodes(root);
   int selected_idx = 0;
   int scroll_offset = 0;
+  int anchor_idx = 0; // where 'v' starts its range: the last marked row
 
   int max_y = getmaxy(browser_win);
 
   const int visible_rows = max_y - 2;
   while (1) {
+    // finished jobs may have added files since the last pass
+    int total_nodes = file_tree_count_nodes(root);
     if (selected_idx < scroll_offset) {
       scroll_offset = selected_idx;
     } else if (selected_idx >= scroll_offset + visible_rows) {
@@ -595,47 +1324,149 @@ FileNode *tui_get_file_browser_selection(FileNode *root) {
 
     tui_draw_file_browser(root, selected_idx, scroll_offset);
 
-    switch (getch()) {
-    case KEY_UP:
-      selected_idx = (selected_idx > 0) ? selected_idx - 1 : 0;
+    // wait for a key, redrawing as metadata for the visible rows comes in.
+    // movement keys typed while a frame was drawn are all applied before the
+    // next one, so a held arrow key never leaves a backlog behind it
+    FileNode *shown = root;
+    char selected_path[MAX_PATH_LENGTH] = "";
+    char anchor_path[MAX_PATH_LENGTH] = "";
+    FileNode *node = file_tree_get_row(root, selected_idx);
+    if (node) {
+      strcpy(selected_path, node->path);
+    }
+    if ((node = file_tree_get_row(root, anchor_idx))) {
+      strcpy(anchor_path, node->path);
+    }
+    int ch = tui_poll_key(&root, -1);
+    if (root != shown) {
+      // a newer version of the tree was swapped in: stay on the same files
+      int row = tui_follow_row(root, selected_path, selected_idx);
+      scroll_offset += row - selected_idx;
+      if (scroll_offset < 0) {
+        scroll_offset = 0;
+      }
+      selected_idx = row;
+      anchor_idx = tui_follow_row(root, anchor_path, anchor_idx);
+      total_nodes = file_tree_count_nodes(root);
+    }
+    while (tui_move_selection(ch, &selected_idx, total_nodes, visible_rows)) {
+      ch = tui_pending_key();
+    }
+
+    FileNode *picked = NULL;
+    switch (ch) {
+    case ' ':
+      tui_toggle_mark(root, selected_idx);
+      anchor_idx = selected_idx;
+      if (selected_idx < total_nodes - 1) {
+        selected_idx++;
+      }
       break;
-    case KEY_DOWN:
-      selected_idx =
-          (selected_idx < total_nodes - 1) ? selected_idx + 1 : total_nodes - 1;
+    case 'v':
+      if (anchor_idx <= selected_idx) {
+        tui_mark_rows(root, anchor_idx, selected_idx, 1);
+      } else {
+        tui_mark_rows(root, selected_idx, anchor_idx, 1);
+      }
+      anchor_idx = selected_idx;
       break;
-    case KEY_PPAGE:
-      selected_idx = (selected_idx - visible_rows > 0)
-                         ? selected_idx - visible_rows - 1
-                         : 0;
+    case '*':
+      tui_mark_pattern(root);
+      tui_draw_layout();
+      tui_draw_footer(BROWSER_FOOTER);
       break;
-    case KEY_NPAGE:
-      selected_idx = (selected_idx + visible_rows < total_nodes - 1)
-                         ? selected_idx + visible_rows + 1
-                         : total_nodes - 1;
+    case 'u':
+      file_tree_clear_marks(root);
       break;
-    case KEY_HOME:
-      selected_idx = 0;
+    case 'r':
+      tree_snapshot_rescan(); // shows up once the new version is published
       break;
-    case KEY_END:
-      selected_idx = total_nodes - 1;
+    case 'p':
+      tui_preview_file(file_tree_get_row(root, selected_idx));
+      tui_draw_footer(BROWSER_FOOTER);
       break;
     case 10:
     case KEY_ENTER: {
-      int current = 0;
-      FileNode *selected = file_tree_get_by_index(root, selected_idx, &current);
-      tui_draw_layout();
-      if (selected) {
-        return selected;
+      int num_marked = file_tree_count_marked(root);
+      if (num_marked > 0) {
+        *selected = (FileNode **)malloc(num_marked * sizeof(FileNode *));
+        if (!*selected) {
+          break;
+        }
+        tui_draw_layout();
+        return file_tree_get_marked(root, *selected, num_marked);
       }
+      int current = 0;
+      picked = file_tree_get_by_index(root, selected_idx, &current);
       break;
     }
+    case '/':
+      picked = tui_search_file_browser(root);
+      if (!picked) {
+        tui_draw_footer(BROWSER_FOOTER);
+      }
+      break;
     case 27:
       tui_draw_layout();
-      return NULL;
+      return 0;
     case KEY_RESIZE: // terminal resized
       tui_resize_handler();
       max_y = getmaxy(browser_win);
       break;
     }
+
+    if (picked) {
+      *selected = (FileNode **)malloc(sizeof(FileNode *));
+      if (*selected) {
+        (*selected)[0] = picked;
+        tui_draw_layout();
+        return 1;
+      }
+    }
+  }
+}
+
+// lets the user pick a job from the jobs panel. returns its id, or 0 when
+// the user backs out
+int tui_get_job_selection() {
+  tui_draw_footer("Arrow Keys: Navigate | Enter: Cancel Job | Esc: Back");
+  int selected_idx = 0;
+  int selected_id = 0;
+
+  while (1) {
+    JobInfo jobs[JOBS_PANEL_MAX];
+    int count = jobs_snapshot(jobs, JOBS_PANEL_MAX);
+    int shown = tui_draw_jobs(selected_idx);
+    count = count < shown ? count : shown; // only what the panel can show
+    if (count == 0) {
+      tui_display_message("There are no jobs", TUI_MSG_INFO);
+      tui_draw_layout();
+      return 0;
+    }
+    if (selected_idx >= count) {
+      selected_idx = count - 1;
+      tui_draw_jobs(selected_idx);
+    }
+
+    int ch = tui_poll_key(NULL, selected_idx);
+    switch (ch) {
+    case KEY_UP:
+      selected_idx = selected_idx > 0 ? selected_idx - 1 : 0;
+      break;
+    case KEY_DOWN:
+      selected_idx++;
+      break;
+    case 10:
+    case KEY_ENTER:
+      selected_id = jobs[selected_idx].id;
+      tui_draw_layout();
+      return selected_id;
+    case 27:
+      tui_draw_layout();
+      return 0;
+    case KEY_RESIZE:
+      tui_resize_handler();
+      break;
+    }
   }
 }
@@ -13,12 +13,16 @@ void tui_draw_header(const char *title);
 void tui_draw_footer(const char *footer);
 void tui_draw_menu();
 void tui_highlight_menu_item(int idx);
+int tui_draw_jobs(int sel_idx);
 void tui_draw_file_browser(FileNode *root, int sel_idx, int scr_offset);
 void tui_display_message(const char *message, int message_type);
 
 int tui_get_menu_selection();
 char *tui_get_password(const char *prompt);
-FileNode *tui_get_file_browser_selection(FileNode *root);
+int tui_get_file_browser_selection(FileNode *root, FileNode ***selected);
+int tui_get_job_selection();
+void tui_set_idle_handler(int (*handler)());
+void tui_set_tree_handler(FileNode *(*handler)());
 
 int tui_get_confirmation(const char *prompt);
 const char *get_common_file_type(FileNode *node);
@@ -30,7 +34,8 @@ const char *get_common_file_type(FileNode *node);
 
 #define MENU_ENCRYPT 1
 #define MENU_DECRYPT 2
-#define MENU_EXIT 3
+#define MENU_JOBS 3
+#define MENU_EXIT 4
 
 #define TUI_CONFIRM_YES 1
 #define TUI_CONFIRM_NO 0